@@ -0,0 +1,3200 @@
+#define CLOSURE_STRUCT_0_0(_rettype, _name)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *);\
+  struct _closure_common __c;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_0_0(_rettype, _name)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *);\
+static _rettype _name(struct _closure_##_name *);
+
+#define CLOSURE_DEFINE_0_0(_rettype, _name)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  }\
+  return (_rettype (**)(void *))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self)
+
+
+#define CLOSURE_STRUCT_0_1(_rettype, _name, _rt0, _rn0)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0);\
+  struct _closure_common __c;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_0_1(_rettype, _name, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0);\
+static _rettype _name(struct _closure_##_name *, _rt0);
+
+#define CLOSURE_DEFINE_0_1(_rettype, _name, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  }\
+  return (_rettype (**)(void *, _rt0))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0)
+
+
+#define CLOSURE_STRUCT_0_2(_rettype, _name, _rt0, _rn0, _rt1, _rn1)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1);\
+  struct _closure_common __c;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_0_2(_rettype, _name, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1);
+
+#define CLOSURE_DEFINE_0_2(_rettype, _name, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1)
+
+
+#define CLOSURE_STRUCT_0_3(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2);\
+  struct _closure_common __c;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_0_3(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2);
+
+#define CLOSURE_DEFINE_0_3(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2)
+
+
+#define CLOSURE_STRUCT_0_4(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);\
+  struct _closure_common __c;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_0_4(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2, _rt3);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);
+
+#define CLOSURE_DEFINE_0_4(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2, _rt3) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3)
+
+
+#define CLOSURE_STRUCT_0_5(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+  struct _closure_common __c;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_0_5(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);
+
+#define CLOSURE_DEFINE_0_5(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2, _rt3, _rt4) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4)
+
+
+#define CLOSURE_STRUCT_0_6(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+  struct _closure_common __c;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_0_6(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);
+
+#define CLOSURE_DEFINE_0_6(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5)
+
+
+#define CLOSURE_STRUCT_0_7(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+  struct _closure_common __c;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_0_7(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);
+
+#define CLOSURE_DEFINE_0_7(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6)
+
+
+#define CLOSURE_STRUCT_0_8(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+  struct _closure_common __c;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_0_8(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);
+
+#define CLOSURE_DEFINE_0_8(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7)
+
+
+#define CLOSURE_STRUCT_0_9(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+  struct _closure_common __c;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_0_9(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);
+
+#define CLOSURE_DEFINE_0_9(_rettype, _name, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7, _rt8 _rn8)
+
+
+#define CLOSURE_STRUCT_1_0(_rettype, _name, _lt0, _ln0)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_1_0(_rettype, _name, _lt0, _ln0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *);\
+static _rettype _name(struct _closure_##_name *);
+
+#define CLOSURE_DEFINE_1_0(_rettype, _name, _lt0, _ln0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  }\
+  return (_rettype (**)(void *))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self)
+
+
+#define CLOSURE_STRUCT_1_1(_rettype, _name, _lt0, _ln0, _rt0, _rn0)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_1_1(_rettype, _name, _lt0, _ln0, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0);\
+static _rettype _name(struct _closure_##_name *, _rt0);
+
+#define CLOSURE_DEFINE_1_1(_rettype, _name, _lt0, _ln0, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  }\
+  return (_rettype (**)(void *, _rt0))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0)
+
+
+#define CLOSURE_STRUCT_1_2(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_1_2(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1);
+
+#define CLOSURE_DEFINE_1_2(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1)
+
+
+#define CLOSURE_STRUCT_1_3(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_1_3(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2);
+
+#define CLOSURE_DEFINE_1_3(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2)
+
+
+#define CLOSURE_STRUCT_1_4(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_1_4(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2, _rt3);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);
+
+#define CLOSURE_DEFINE_1_4(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2, _rt3) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3)
+
+
+#define CLOSURE_STRUCT_1_5(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_1_5(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);
+
+#define CLOSURE_DEFINE_1_5(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2, _rt3, _rt4) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4)
+
+
+#define CLOSURE_STRUCT_1_6(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_1_6(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);
+
+#define CLOSURE_DEFINE_1_6(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5)
+
+
+#define CLOSURE_STRUCT_1_7(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_1_7(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);
+
+#define CLOSURE_DEFINE_1_7(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6)
+
+
+#define CLOSURE_STRUCT_1_8(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_1_8(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);
+
+#define CLOSURE_DEFINE_1_8(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7)
+
+
+#define CLOSURE_STRUCT_1_9(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_1_9(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);
+
+#define CLOSURE_DEFINE_1_9(_rettype, _name, _lt0, _ln0, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7, _rt8 _rn8)
+
+
+#define CLOSURE_STRUCT_2_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_2_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *);\
+static _rettype _name(struct _closure_##_name *);
+
+#define CLOSURE_DEFINE_2_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  }\
+  return (_rettype (**)(void *))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self)
+
+
+#define CLOSURE_STRUCT_2_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_2_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0);\
+static _rettype _name(struct _closure_##_name *, _rt0);
+
+#define CLOSURE_DEFINE_2_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  }\
+  return (_rettype (**)(void *, _rt0))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0)
+
+
+#define CLOSURE_STRUCT_2_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_2_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1);
+
+#define CLOSURE_DEFINE_2_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1)
+
+
+#define CLOSURE_STRUCT_2_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_2_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2);
+
+#define CLOSURE_DEFINE_2_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2)
+
+
+#define CLOSURE_STRUCT_2_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_2_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2, _rt3);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);
+
+#define CLOSURE_DEFINE_2_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2, _rt3) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3)
+
+
+#define CLOSURE_STRUCT_2_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_2_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);
+
+#define CLOSURE_DEFINE_2_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2, _rt3, _rt4) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4)
+
+
+#define CLOSURE_STRUCT_2_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_2_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);
+
+#define CLOSURE_DEFINE_2_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5)
+
+
+#define CLOSURE_STRUCT_2_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_2_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);
+
+#define CLOSURE_DEFINE_2_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6)
+
+
+#define CLOSURE_STRUCT_2_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_2_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);
+
+#define CLOSURE_DEFINE_2_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7)
+
+
+#define CLOSURE_STRUCT_2_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_2_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);
+
+#define CLOSURE_DEFINE_2_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7, _rt8 _rn8)
+
+
+#define CLOSURE_STRUCT_3_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_3_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *);\
+static _rettype _name(struct _closure_##_name *);
+
+#define CLOSURE_DEFINE_3_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  }\
+  return (_rettype (**)(void *))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self)
+
+
+#define CLOSURE_STRUCT_3_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_3_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0);\
+static _rettype _name(struct _closure_##_name *, _rt0);
+
+#define CLOSURE_DEFINE_3_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  }\
+  return (_rettype (**)(void *, _rt0))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0)
+
+
+#define CLOSURE_STRUCT_3_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_3_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1);
+
+#define CLOSURE_DEFINE_3_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1)
+
+
+#define CLOSURE_STRUCT_3_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_3_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2);
+
+#define CLOSURE_DEFINE_3_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2)
+
+
+#define CLOSURE_STRUCT_3_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_3_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2, _rt3);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);
+
+#define CLOSURE_DEFINE_3_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2, _rt3) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3)
+
+
+#define CLOSURE_STRUCT_3_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_3_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);
+
+#define CLOSURE_DEFINE_3_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2, _rt3, _rt4) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4)
+
+
+#define CLOSURE_STRUCT_3_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_3_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);
+
+#define CLOSURE_DEFINE_3_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5)
+
+
+#define CLOSURE_STRUCT_3_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_3_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);
+
+#define CLOSURE_DEFINE_3_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6)
+
+
+#define CLOSURE_STRUCT_3_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_3_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);
+
+#define CLOSURE_DEFINE_3_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7)
+
+
+#define CLOSURE_STRUCT_3_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_3_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);
+
+#define CLOSURE_DEFINE_3_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7, _rt8 _rn8)
+
+
+#define CLOSURE_STRUCT_4_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_4_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *);\
+static _rettype _name(struct _closure_##_name *);
+
+#define CLOSURE_DEFINE_4_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  }\
+  return (_rettype (**)(void *))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self)
+
+
+#define CLOSURE_STRUCT_4_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_4_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0);\
+static _rettype _name(struct _closure_##_name *, _rt0);
+
+#define CLOSURE_DEFINE_4_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  }\
+  return (_rettype (**)(void *, _rt0))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0)
+
+
+#define CLOSURE_STRUCT_4_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_4_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1);
+
+#define CLOSURE_DEFINE_4_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1)
+
+
+#define CLOSURE_STRUCT_4_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_4_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2);
+
+#define CLOSURE_DEFINE_4_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2)
+
+
+#define CLOSURE_STRUCT_4_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_4_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2, _rt3);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);
+
+#define CLOSURE_DEFINE_4_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2, _rt3) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3)
+
+
+#define CLOSURE_STRUCT_4_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_4_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);
+
+#define CLOSURE_DEFINE_4_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2, _rt3, _rt4) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4)
+
+
+#define CLOSURE_STRUCT_4_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_4_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);
+
+#define CLOSURE_DEFINE_4_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5)
+
+
+#define CLOSURE_STRUCT_4_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_4_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);
+
+#define CLOSURE_DEFINE_4_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6)
+
+
+#define CLOSURE_STRUCT_4_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_4_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);
+
+#define CLOSURE_DEFINE_4_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7)
+
+
+#define CLOSURE_STRUCT_4_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_4_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);
+
+#define CLOSURE_DEFINE_4_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7, _rt8 _rn8)
+
+
+#define CLOSURE_STRUCT_5_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_5_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *);\
+static _rettype _name(struct _closure_##_name *);
+
+#define CLOSURE_DEFINE_5_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  }\
+  return (_rettype (**)(void *))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self)
+
+
+#define CLOSURE_STRUCT_5_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_5_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0);\
+static _rettype _name(struct _closure_##_name *, _rt0);
+
+#define CLOSURE_DEFINE_5_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  }\
+  return (_rettype (**)(void *, _rt0))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0)
+
+
+#define CLOSURE_STRUCT_5_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_5_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1);
+
+#define CLOSURE_DEFINE_5_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1)
+
+
+#define CLOSURE_STRUCT_5_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_5_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2);
+
+#define CLOSURE_DEFINE_5_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2)
+
+
+#define CLOSURE_STRUCT_5_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_5_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2, _rt3);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);
+
+#define CLOSURE_DEFINE_5_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2, _rt3) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3)
+
+
+#define CLOSURE_STRUCT_5_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_5_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);
+
+#define CLOSURE_DEFINE_5_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2, _rt3, _rt4) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4)
+
+
+#define CLOSURE_STRUCT_5_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_5_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);
+
+#define CLOSURE_DEFINE_5_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5)
+
+
+#define CLOSURE_STRUCT_5_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_5_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);
+
+#define CLOSURE_DEFINE_5_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6)
+
+
+#define CLOSURE_STRUCT_5_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_5_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);
+
+#define CLOSURE_DEFINE_5_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7)
+
+
+#define CLOSURE_STRUCT_5_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_5_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);
+
+#define CLOSURE_DEFINE_5_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7, _rt8 _rn8)
+
+
+#define CLOSURE_STRUCT_6_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_6_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *);\
+static _rettype _name(struct _closure_##_name *);
+
+#define CLOSURE_DEFINE_6_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  }\
+  return (_rettype (**)(void *))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self)
+
+
+#define CLOSURE_STRUCT_6_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_6_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0);\
+static _rettype _name(struct _closure_##_name *, _rt0);
+
+#define CLOSURE_DEFINE_6_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  }\
+  return (_rettype (**)(void *, _rt0))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0)
+
+
+#define CLOSURE_STRUCT_6_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_6_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1);
+
+#define CLOSURE_DEFINE_6_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1)
+
+
+#define CLOSURE_STRUCT_6_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_6_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2);
+
+#define CLOSURE_DEFINE_6_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2)
+
+
+#define CLOSURE_STRUCT_6_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_6_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2, _rt3);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);
+
+#define CLOSURE_DEFINE_6_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2, _rt3) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3)
+
+
+#define CLOSURE_STRUCT_6_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_6_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);
+
+#define CLOSURE_DEFINE_6_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2, _rt3, _rt4) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4)
+
+
+#define CLOSURE_STRUCT_6_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_6_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);
+
+#define CLOSURE_DEFINE_6_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5)
+
+
+#define CLOSURE_STRUCT_6_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_6_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);
+
+#define CLOSURE_DEFINE_6_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6)
+
+
+#define CLOSURE_STRUCT_6_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_6_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);
+
+#define CLOSURE_DEFINE_6_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7)
+
+
+#define CLOSURE_STRUCT_6_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_6_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);
+
+#define CLOSURE_DEFINE_6_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7, _rt8 _rn8)
+
+
+#define CLOSURE_STRUCT_7_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_7_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *);\
+static _rettype _name(struct _closure_##_name *);
+
+#define CLOSURE_DEFINE_7_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  }\
+  return (_rettype (**)(void *))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self)
+
+
+#define CLOSURE_STRUCT_7_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_7_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0);\
+static _rettype _name(struct _closure_##_name *, _rt0);
+
+#define CLOSURE_DEFINE_7_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  }\
+  return (_rettype (**)(void *, _rt0))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0)
+
+
+#define CLOSURE_STRUCT_7_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_7_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1);
+
+#define CLOSURE_DEFINE_7_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1)
+
+
+#define CLOSURE_STRUCT_7_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_7_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2);
+
+#define CLOSURE_DEFINE_7_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2)
+
+
+#define CLOSURE_STRUCT_7_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_7_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2, _rt3);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);
+
+#define CLOSURE_DEFINE_7_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2, _rt3) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3)
+
+
+#define CLOSURE_STRUCT_7_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_7_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);
+
+#define CLOSURE_DEFINE_7_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2, _rt3, _rt4) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4)
+
+
+#define CLOSURE_STRUCT_7_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_7_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);
+
+#define CLOSURE_DEFINE_7_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5)
+
+
+#define CLOSURE_STRUCT_7_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_7_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);
+
+#define CLOSURE_DEFINE_7_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6)
+
+
+#define CLOSURE_STRUCT_7_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_7_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);
+
+#define CLOSURE_DEFINE_7_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7)
+
+
+#define CLOSURE_STRUCT_7_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_7_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);
+
+#define CLOSURE_DEFINE_7_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7, _rt8 _rn8)
+
+
+#define CLOSURE_STRUCT_8_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_8_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *);\
+static _rettype _name(struct _closure_##_name *);
+
+#define CLOSURE_DEFINE_8_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  }\
+  return (_rettype (**)(void *))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self)
+
+
+#define CLOSURE_STRUCT_8_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_8_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0);\
+static _rettype _name(struct _closure_##_name *, _rt0);
+
+#define CLOSURE_DEFINE_8_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  }\
+  return (_rettype (**)(void *, _rt0))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0)
+
+
+#define CLOSURE_STRUCT_8_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_8_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1);
+
+#define CLOSURE_DEFINE_8_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1)
+
+
+#define CLOSURE_STRUCT_8_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_8_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2);
+
+#define CLOSURE_DEFINE_8_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2)
+
+
+#define CLOSURE_STRUCT_8_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_8_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2, _rt3);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);
+
+#define CLOSURE_DEFINE_8_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2, _rt3) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3)
+
+
+#define CLOSURE_STRUCT_8_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_8_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);
+
+#define CLOSURE_DEFINE_8_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2, _rt3, _rt4) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4)
+
+
+#define CLOSURE_STRUCT_8_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_8_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);
+
+#define CLOSURE_DEFINE_8_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5)
+
+
+#define CLOSURE_STRUCT_8_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_8_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);
+
+#define CLOSURE_DEFINE_8_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6)
+
+
+#define CLOSURE_STRUCT_8_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_8_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);
+
+#define CLOSURE_DEFINE_8_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7)
+
+
+#define CLOSURE_STRUCT_8_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_8_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);
+
+#define CLOSURE_DEFINE_8_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7, _rt8 _rn8)
+
+
+#define CLOSURE_STRUCT_9_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+  _lt8 _ln8;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_9_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *);\
+static _rettype _name(struct _closure_##_name *);
+
+#define CLOSURE_DEFINE_9_0(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  n->_ln8 = l8;\
+  }\
+  return (_rettype (**)(void *))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self)
+
+
+#define CLOSURE_STRUCT_9_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+  _lt8 _ln8;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_9_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0);\
+static _rettype _name(struct _closure_##_name *, _rt0);
+
+#define CLOSURE_DEFINE_9_1(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  n->_ln8 = l8;\
+  }\
+  return (_rettype (**)(void *, _rt0))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0)
+
+
+#define CLOSURE_STRUCT_9_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+  _lt8 _ln8;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_9_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1);
+
+#define CLOSURE_DEFINE_9_2(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  n->_ln8 = l8;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1)
+
+
+#define CLOSURE_STRUCT_9_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+  _lt8 _ln8;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_9_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2);
+
+#define CLOSURE_DEFINE_9_3(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  n->_ln8 = l8;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2)
+
+
+#define CLOSURE_STRUCT_9_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+  _lt8 _ln8;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_9_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2, _rt3);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3);
+
+#define CLOSURE_DEFINE_9_4(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2, _rt3) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  n->_ln8 = l8;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3)
+
+
+#define CLOSURE_STRUCT_9_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+  _lt8 _ln8;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_9_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2, _rt3, _rt4);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4);
+
+#define CLOSURE_DEFINE_9_5(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2, _rt3, _rt4) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  n->_ln8 = l8;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4)
+
+
+#define CLOSURE_STRUCT_9_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+  _lt8 _ln8;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_9_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5);
+
+#define CLOSURE_DEFINE_9_6(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  n->_ln8 = l8;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5)
+
+
+#define CLOSURE_STRUCT_9_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+  _lt8 _ln8;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_9_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6);
+
+#define CLOSURE_DEFINE_9_7(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  n->_ln8 = l8;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6)
+
+
+#define CLOSURE_STRUCT_9_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+  _lt8 _ln8;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_9_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7);
+
+#define CLOSURE_DEFINE_9_8(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  n->_ln8 = l8;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7)
+
+
+#define CLOSURE_STRUCT_9_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+struct _closure_##_name {\
+  _rettype (*__apply)(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+  struct _closure_common __c;\
+  _lt0 _ln0;\
+  _lt1 _ln1;\
+  _lt2 _ln2;\
+  _lt3 _ln3;\
+  _lt4 _ln4;\
+  _lt5 _ln5;\
+  _lt6 _ln6;\
+  _lt7 _ln7;\
+  _lt8 _ln8;\
+};
+
+#define CLOSURE_DECLARE_FUNCS_9_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);\
+static _rettype _name(struct _closure_##_name *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8);
+
+#define CLOSURE_DEFINE_9_9(_rettype, _name, _lt0, _ln0, _lt1, _ln1, _lt2, _ln2, _lt3, _ln3, _lt4, _ln4, _lt5, _ln5, _lt6, _ln6, _lt7, _ln7, _lt8, _ln8, _rt0, _rn0, _rt1, _rn1, _rt2, _rn2, _rt3, _rn3, _rt4, _rn4, _rt5, _rn5, _rt6, _rn6, _rt7, _rn7, _rt8, _rn8)\
+static _rettype (**_fill_##_name(heap h, struct _closure_##_name* n, bytes s, _lt0 l0, _lt1 l1, _lt2 l2, _lt3 l3, _lt4 l4, _lt5 l5, _lt6 l6, _lt7 l7, _lt8 l8))(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8) {\
+  if (n != INVALID_ADDRESS) {\
+    n->__apply = _name;\
+    n->__c.name = #_name;\
+    n->__c.h = h;\
+    n->__c.size = s;\
+  n->_ln0 = l0;\
+  n->_ln1 = l1;\
+  n->_ln2 = l2;\
+  n->_ln3 = l3;\
+  n->_ln4 = l4;\
+  n->_ln5 = l5;\
+  n->_ln6 = l6;\
+  n->_ln7 = l7;\
+  n->_ln8 = l8;\
+  }\
+  return (_rettype (**)(void *, _rt0, _rt1, _rt2, _rt3, _rt4, _rt5, _rt6, _rt7, _rt8))n;\
+}\
+static _rettype _name(struct _closure_##_name *__self, _rt0 _rn0, _rt1 _rn1, _rt2 _rn2, _rt3 _rn3, _rt4 _rn4, _rt5 _rn5, _rt6 _rn6, _rt7 _rn7, _rt8 _rn8)
+
+
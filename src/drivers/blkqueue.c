@@ -0,0 +1,259 @@
+#include <runtime.h>
+#include <drivers/blkqueue.h>
+
+//#define BLKQUEUE_DEBUG
+#ifdef BLKQUEUE_DEBUG
+#define blkqueue_debug(x, ...) do {rprintf("BLKQ: " x, ##__VA_ARGS__);} while(0)
+#else
+#define blkqueue_debug(x, ...)
+#endif
+
+struct blkqueue {
+    heap h;
+    block_sg_io io;
+    struct blkqueue_limits l;
+    u64 split_blocks;           /* largest request within all limits */
+    int inflight;
+    boolean dispatching;        /* guards against inline completions */
+    struct list pending;        /* blkio, in arrival order */
+    struct list issued;         /* blkio, at the driver */
+    block_io r, w;
+};
+
+/* a single block_io call */
+typedef struct blkreq {
+    struct list l;
+    void *buf;
+    range blocks;
+    status_handler sh;
+} *blkreq;
+
+/* a request to the driver, covering one or more adjacent blkreqs */
+typedef struct blkio {
+    struct list l;
+    boolean write;
+    range blocks;
+    int nsegs;
+    struct list reqs;           /* blkreq, in block order */
+} *blkio;
+
+static inline int blkqueue_req_segs(blkqueue bq, u64 length)
+{
+    return bq->l.max_seg_size ? (length + bq->l.max_seg_size - 1) / bq->l.max_seg_size : 1;
+}
+
+/* requests must stay in order if they overlap and either one writes */
+static inline boolean blkio_conflict(blkio io, boolean write, range blocks)
+{
+    return (write || io->write) && ranges_intersect(io->blocks, blocks);
+}
+
+static boolean blkqueue_issued_conflict(blkqueue bq, blkio io)
+{
+    list_foreach(&bq->issued, l) {
+        if (blkio_conflict(struct_from_list(l, blkio, l), io->write, io->blocks))
+            return true;
+    }
+    return false;
+}
+
+static void blkqueue_issue(blkqueue bq, blkio io);
+
+/* The driver may complete requests in any order, so one overlapping
+   a request already issued waits for it, holding up those behind. A
+   driver may also complete a request before returning from it; the
+   loop already running then picks up whatever that released. */
+static void blkqueue_dispatch(blkqueue bq)
+{
+    if (bq->dispatching)
+        return;
+    bq->dispatching = true;
+    list l;
+    while (bq->inflight < bq->l.max_inflight && (l = list_get_next(&bq->pending))) {
+        blkio io = struct_from_list(l, blkio, l);
+        if (blkqueue_issued_conflict(bq, io))
+            break;
+        list_delete(l);
+        blkqueue_issue(bq, io);
+    }
+    bq->dispatching = false;
+}
+
+closure_function(2, 1, void, blkio_complete,
+                 blkqueue, bq, blkio, io,
+                 status, s)
+{
+    blkqueue bq = bound(bq);
+    blkio io = bound(io);
+    blkqueue_debug("%s: %s %R, status %v\n", __func__, io->write ? "write" : "read", io->blocks, s);
+    list l;
+    while ((l = list_get_next(&io->reqs))) {
+        blkreq r = struct_from_list(l, blkreq, l);
+        list_delete(l);
+        apply(r->sh, s);
+        deallocate(bq->h, r, sizeof(struct blkreq));
+    }
+    list_delete(&io->l);
+    deallocate(bq->h, io, sizeof(struct blkio));
+    bq->inflight--;
+    closure_finish();
+    blkqueue_dispatch(bq);
+}
+
+/* io may be freed by the time the driver returns */
+static void blkqueue_issue(blkqueue bq, blkio io)
+{
+    int nsegs = io->nsegs;
+    struct blkqueue_seg *segs = allocate(bq->h, nsegs * sizeof(struct blkqueue_seg));
+    assert(segs != INVALID_ADDRESS);
+    int n = 0;
+    list_foreach(&io->reqs, l) {
+        blkreq r = struct_from_list(l, blkreq, l);
+        void *buf = r->buf;
+        u64 remain = range_span(r->blocks) * bq->l.block_size;
+        while (remain > 0) {
+            u64 len = bq->l.max_seg_size ? MIN(remain, bq->l.max_seg_size) : remain;
+            assert(n < nsegs);
+            segs[n].buf = buf;
+            segs[n].length = len;
+            n++;
+            buf += len;
+            remain -= len;
+        }
+    }
+    blkqueue_debug("%s: %s %R, %d segs, inflight %d\n", __func__,
+                   io->write ? "write" : "read", io->blocks, n, bq->inflight);
+    bq->inflight++;
+    list_insert_before(&bq->issued, &io->l);
+    apply(bq->io, io->write, segs, n, io->blocks, closure(bq->h, blkio_complete, bq, io));
+    deallocate(bq->h, segs, nsegs * sizeof(struct blkqueue_seg));
+}
+
+/* Fold the request into a queued one if they are adjacent and the
+   result stays within the device limits. Merging moves the request
+   ahead of everything queued after that one, so stop at the latest
+   which it conflicts with. */
+static boolean blkqueue_merge(blkqueue bq, boolean write, blkreq r, int nsegs)
+{
+    for (list l = bq->pending.prev; l != &bq->pending; l = l->prev) {
+        blkio io = struct_from_list(l, blkio, l);
+        if (blkio_conflict(io, write, r->blocks))
+            return false;
+        if (io->write != write || io->nsegs + nsegs > bq->l.max_segs ||
+            range_span(io->blocks) + range_span(r->blocks) > bq->split_blocks)
+            continue;
+        if (io->blocks.end == r->blocks.start) {
+            list_insert_before(&io->reqs, &r->l);
+            io->blocks.end = r->blocks.end;
+        } else if (r->blocks.end == io->blocks.start) {
+            list_insert_after(&io->reqs, &r->l);
+            io->blocks.start = r->blocks.start;
+        } else {
+            continue;
+        }
+        io->nsegs += nsegs;
+        blkqueue_debug("%s: merged %R into %R\n", __func__, r->blocks, io->blocks);
+        return true;
+    }
+    return false;
+}
+
+static void blkqueue_add(blkqueue bq, boolean write, void *buf, range blocks, status_handler sh)
+{
+    blkreq r = allocate(bq->h, sizeof(struct blkreq));
+    assert(r != INVALID_ADDRESS);
+    r->buf = buf;
+    r->blocks = blocks;
+    r->sh = sh;
+    int nsegs = blkqueue_req_segs(bq, range_span(blocks) * bq->l.block_size);
+
+    if ((bq->inflight >= bq->l.max_inflight || !list_empty(&bq->pending)) &&
+        blkqueue_merge(bq, write, r, nsegs))
+        return;
+
+    blkio io = allocate(bq->h, sizeof(struct blkio));
+    assert(io != INVALID_ADDRESS);
+    io->write = write;
+    io->blocks = blocks;
+    io->nsegs = nsegs;
+    list_init(&io->reqs);
+    list_insert_before(&io->reqs, &r->l);
+    list_insert_before(&bq->pending, &io->l);
+    blkqueue_dispatch(bq);
+}
+
+static void blkqueue_submit(blkqueue bq, boolean write, void *buf, range blocks, status_handler sh)
+{
+    if (range_span(blocks) == 0) {
+        apply(sh, timm("result", "length must be > 0"));
+        return;
+    }
+    if (range_span(blocks) <= bq->split_blocks) {
+        blkqueue_add(bq, write, buf, blocks, sh);
+        return;
+    }
+
+    merge m = allocate_merge(bq->h, sh);
+    status_handler k = apply_merge(m);
+    while (blocks.start < blocks.end) {
+        u64 span = MIN(range_span(blocks), bq->split_blocks);
+        blkqueue_add(bq, write, buf, irange(blocks.start, blocks.start + span), apply_merge(m));
+        blocks.start += span;
+        buf += span * bq->l.block_size;
+    }
+    apply(k, STATUS_OK);
+}
+
+closure_function(1, 3, void, blkqueue_read,
+                 blkqueue, bq,
+                 void *, dest, range, blocks, status_handler, sh)
+{
+    blkqueue_submit(bound(bq), false, dest, blocks, sh);
+}
+
+closure_function(1, 3, void, blkqueue_write,
+                 blkqueue, bq,
+                 void *, source, range, blocks, status_handler, sh)
+{
+    blkqueue_submit(bound(bq), true, source, blocks, sh);
+}
+
+block_io blkqueue_reader(blkqueue bq)
+{
+    return bq->r;
+}
+
+block_io blkqueue_writer(blkqueue bq)
+{
+    return bq->w;
+}
+
+blkqueue allocate_blkqueue(heap h, block_sg_io io, blkqueue_limits l)
+{
+    blkqueue bq = allocate(h, sizeof(struct blkqueue));
+    if (bq == INVALID_ADDRESS)
+        return bq;
+    bq->h = h;
+    bq->io = io;
+    runtime_memcpy(&bq->l, l, sizeof(struct blkqueue_limits));
+    assert(bq->l.block_size > 0 && bq->l.max_segs > 0 && bq->l.max_inflight > 0);
+
+    /* a request must fit in max_segs segments of max_seg_size */
+    bq->split_blocks = bq->l.max_blocks ? bq->l.max_blocks : infinity;
+    if (bq->l.max_seg_size) {
+        assert(bq->l.max_seg_size >= bq->l.block_size);
+        bq->l.max_seg_size -= bq->l.max_seg_size % bq->l.block_size;
+        bq->split_blocks = MIN(bq->split_blocks,
+                               bq->l.max_segs * (bq->l.max_seg_size / bq->l.block_size));
+    }
+    bq->inflight = 0;
+    bq->dispatching = false;
+    list_init(&bq->pending);
+    list_init(&bq->issued);
+    bq->r = closure(h, blkqueue_read, bq);
+    bq->w = closure(h, blkqueue_write, bq);
+    blkqueue_debug("%s: block size %ld, split at %ld blocks, max segs %d, max seg size %ld, inflight %d\n",
+                   __func__, bq->l.block_size, bq->split_blocks, bq->l.max_segs,
+                   bq->l.max_seg_size, bq->l.max_inflight);
+    return bq;
+}
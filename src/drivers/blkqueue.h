@@ -0,0 +1,33 @@
+#pragma once
+
+#include <runtime/runtime.h>
+
+/* A request queue between the filesystem and a storage driver. Calls
+   to the block_io closures it hands out are passed straight to the
+   driver while fewer than max_inflight requests are outstanding;
+   beyond that they are queued, and requests for adjacent block ranges
+   in the same direction are merged into a single scatter-gather
+   request. Requests larger than the device limits are split. */
+
+typedef struct blkqueue_seg {
+    void *buf;
+    u64 length;
+} *blkqueue_seg;
+
+/* write, data segments, segment count, blocks, completion; the driver
+   must be done with the segment array on return */
+typedef closure_type(block_sg_io, void, boolean, blkqueue_seg, int, range, status_handler);
+
+typedef struct blkqueue_limits {
+    u64 block_size;             /* bytes */
+    u64 max_blocks;             /* per request, 0 for no limit */
+    u64 max_seg_size;           /* bytes, 0 for no limit */
+    int max_segs;               /* data segments per request */
+    int max_inflight;           /* requests issued to the driver */
+} *blkqueue_limits;
+
+typedef struct blkqueue *blkqueue;
+
+blkqueue allocate_blkqueue(heap h, block_sg_io io, blkqueue_limits l);
+block_io blkqueue_reader(blkqueue bq);
+block_io blkqueue_writer(blkqueue bq);
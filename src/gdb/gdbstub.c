@@ -96,7 +96,7 @@ static void start_slave(gdb g, boolean stepping)
     }
 
     rprintf ("slave run %p %p %p %p %d\n", g, g->t, g->t->frame, g->t->frame[FRAME_RIP], stepping);
-    enqueue(runqueue, g->t->run);    
+    thread_schedule(g->t, cpuinfo_from_id(g->t->cpu));
 }
 
 
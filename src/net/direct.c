@@ -99,7 +99,7 @@ closure_function(1, 0, void, direct_conn_send_bh,
         closure_finish();
     } else {
         direct_debug("re-enqueue\n");
-        enqueue(deferqueue, closure_self());
+        enqueue_grow(&deferqueue, closure_self());
     }
 }
 
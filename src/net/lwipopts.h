@@ -48,9 +48,19 @@
 #define LWIP_NO_LIMITS_H 1
 #define LWIP_NO_CTYPE_H 1
 
+#define TCP_MSS 1460
+/* TCP_WND is the largest receive window a connection may grow to; the
+   window a connection starts with is set per socket */
 #define LWIP_WND_SCALE 1
-#define TCP_RCV_SCALE 0         /* XXX check */
+#define TCP_RCV_SCALE 7
+#define TCP_WND (4 * 1024 * 1024)
+/* initial send buffer; grown per connection as cwnd opens */
+#define TCP_SND_BUF (32 * TCP_MSS)
 #define TCP_LISTEN_BACKLOG 1
+#define SO_REUSE 1
+#define LWIP_TCP_KEEPALIVE 1
+/* enough segments to fill the largest send buffer */
+#define TCP_SND_QUEUELEN 8192
 #define LWIP_DHCP 1
 // would prefer to set this dynamically...also,
 // seems better to allow some progress to be made
@@ -61,6 +71,8 @@
 #define MEMP_MEM_MALLOC 1
 typedef unsigned long size_t;
 #define LWIP_NETIF_STATUS_CALLBACK 1
+/* drivers disable checksums their device offloads */
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
 #define LWIP_TIMERS 1
 #define LWIP_TIMERS_CUSTOM 1
 #define LWIP_DHCP_BOOTP_FILE 1
@@ -112,6 +112,36 @@ int lwip_strncmp(const char *x, const char *y, unsigned long len)
     return 0;
 }
 
+/* All lwIP processing happens under the kernel lock, so the batch
+   depth needs no further protection. */
+static int tx_batch_depth;
+static vector tx_flush_handlers;
+
+boolean net_tx_batching(void)
+{
+    return tx_batch_depth > 0;
+}
+
+void net_tx_batch_begin(void)
+{
+    tx_batch_depth++;
+}
+
+void net_tx_batch_end(void)
+{
+    assert(tx_batch_depth > 0);
+    if (--tx_batch_depth > 0)
+        return;
+    thunk flush;
+    vector_foreach(tx_flush_handlers, flush)
+        apply(flush);
+}
+
+void net_register_tx_flush(thunk flush)
+{
+    vector_push(tx_flush_handlers, flush);
+}
+
 extern void lwip_init();
 
 void init_net(kernel_heaps kh)
@@ -119,5 +149,7 @@ void init_net(kernel_heaps kh)
     heap h = heap_general(kh);
     heap backed = heap_backed(kh);
     lwip_heap = allocate_mcache(h, backed, 5, 11, PAGESIZE);
+    tx_flush_handlers = allocate_vector(h, 1);
+    assert(tx_flush_handlers != INVALID_ADDRESS);
     lwip_init();
 }
@@ -2,5 +2,14 @@
 #define NET 1
 #define NET_SYSCALLS 1
 
-boolean netsyscall_init(unix_heaps uh);
+boolean netsyscall_init(unix_heaps uh, tuple root);
 status listen_port(heap h, u16 port, connection_handler c);
+
+/* Frames output between net_tx_batch_begin() and net_tx_batch_end()
+   may be held by the driver and handed to the device together when the
+   outermost batch ends. Drivers which hold frames register a thunk to
+   release them. */
+boolean net_tx_batching(void);
+void net_tx_batch_begin(void);
+void net_tx_batch_end(void);
+void net_register_tx_flush(thunk flush);
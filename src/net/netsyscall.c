@@ -8,6 +8,7 @@
 #include <unix_internal.h>
 #include <lwip.h>
 #include <lwip/udp.h>
+#include <lwip/priv/tcp_priv.h>
 #include <net_system_structs.h>
 
 //#define NETSYSCALL_DEBUG
@@ -22,6 +23,54 @@
 
 #define IFNAMSIZ    16
 
+#define MSG_OOB         0x00000001
+#define MSG_DONTROUTE   0x00000004
+#define MSG_PROBE       0x00000010
+#define MSG_CTRUNC      0x00000008
+#define MSG_TRUNC       0x00000020
+#define MSG_DONTWAIT    0x00000040
+#define MSG_EOR         0x00000080
+#define MSG_CONFIRM     0x00000800
+#define MSG_ERRQUEUE    0x00002000
+#define MSG_NOSIGNAL    0x00004000
+#define MSG_MORE        0x00008000
+#define MSG_WAITFORONE  0x00010000
+#define MSG_ZEROCOPY    0x04000000
+
+/* internal: a MSG_ZEROCOPY send the kernel had to copy */
+#define MSG_ZEROCOPY_COPIED 0x80000000
+
+#define SOCK_QUEUE_LEN 128
+/* datagrams waiting to be received, before further ones are dropped */
+#define UDP_QUEUE_LEN   1024
+
+/* the most a UDP datagram over IPv4 can carry */
+#define UDP_MAX_PAYLOAD (0xffff - 20 - 8)
+
+/* SO_SNDBUF and SO_RCVBUF limits; the receive window can't exceed TCP_WND */
+#define SOCK_BUF_MIN        2048
+#define SOCK_SNDBUF_MAX     (4 * MB)
+#define SOCK_RCVBUF_MAX     TCP_WND
+
+/* Buffer sizes a connection starts with. Unless fixed with SO_SNDBUF
+   or SO_RCVBUF, they grow with the bandwidth-delay product of the path
+   up to tcp_sndbuf_max and tcp_rcvbuf_max, which the manifest options
+   of the same names may lower. */
+#define SOCK_SNDBUF_INIT    TCP_SND_BUF
+#define SOCK_RCVBUF_INIT    (64 * KB)
+
+static u32 tcp_sndbuf_max = SOCK_SNDBUF_MAX;
+static u32 tcp_rcvbuf_max = SOCK_RCVBUF_MAX;
+
+/* TCP_KEEPIDLE, TCP_KEEPINTVL and TCP_KEEPCNT limits, as in Linux */
+#define TCP_KEEPALIVE_MAX   32767
+#define TCP_KEEPCNT_MAX     127
+
+/* keepalive defaults, in ms, as for a new lwIP pcb */
+#define TCP_KEEPIDLE_INIT   (7200 * THOUSAND)
+#define TCP_KEEPINTVL_INIT  (75 * THOUSAND)
+#define TCP_KEEPCNT_INIT    9
+
 #define resolve_socket(__p, __fd) ({fdesc f = resolve_fd(__p, __fd); \
     if (f->type != FDESC_TYPE_SOCKET) \
         return set_syscall_error(current, ENOTSOCK); \
@@ -55,6 +104,28 @@ struct mmsghdr {
     unsigned int msg_len;
 };
 
+struct cmsghdr {
+    size_t cmsg_len;
+    int cmsg_level;
+    int cmsg_type;
+};
+
+#define SOL_IP      0
+#define IP_RECVERR  11
+
+struct sock_extended_err {
+    u32 ee_errno;
+    u8 ee_origin;
+    u8 ee_type;
+    u8 ee_code;
+    u8 ee_pad;
+    u32 ee_info;
+    u32 ee_data;
+};
+
+#define SO_EE_ORIGIN_ZEROCOPY       5
+#define SO_EE_CODE_ZEROCOPY_COPIED  1
+
 struct ifmap {
     unsigned long mem_start;
     unsigned long mem_end;
@@ -110,6 +181,41 @@ enum udp_socket_state {
     UDP_SOCK_CREATED = 1,
 };
 
+/* MSG_ZEROCOPY sends complete once the peer acknowledges the stream
+   position where they end. Positions count all bytes written to the
+   connection. */
+typedef struct tcp_zc {
+    heap h;
+    struct sock *s;             /* for MSG_ZEROCOPY completions; 0 once closed */
+    u64 written;
+    u64 acked;
+    struct list pending;
+} *tcp_zc;
+
+typedef struct tcp_zc_buf {
+    struct list l;
+    u64 end;
+    u32 id;                     /* MSG_ZEROCOPY send number, if notify */
+    boolean notify;
+    boolean copied;
+} *tcp_zc_buf;
+
+/* Memory passed to tcp_write() by reference is held by custom pbufs,
+   put in place of the ones lwIP makes to refer to it, and released
+   when the last of these is freed. That is not before lwIP and any
+   driver still transmitting from them are done with them, which an
+   acknowledgement alone doesn't tell. */
+typedef struct tcp_zc_hold {
+    heap h;
+    thunk release;
+    u64 refs;
+} *tcp_zc_hold;
+
+typedef struct tcp_zc_pbuf {
+    struct pbuf_custom p;       /* must be first */
+    tcp_zc_hold zh;
+} *tcp_zc_pbuf;
+
 typedef struct sock {
     struct fdesc f;              /* must be first */
     int type;
@@ -121,10 +227,46 @@ typedef struct sock {
     int fd;
     err_t lwip_error;           /* lwIP error code; ERR_OK if normal */
     unsigned int msg_count;
+    boolean reuseaddr;
+    u32 sndbuf;                 /* SO_SNDBUF and SO_RCVBUF, in bytes */
+    u32 rcvbuf;
+    boolean sndbuf_lock;        /* set by the application; not autotuned */
+    boolean rcvbuf_lock;
+    /* MSG_ZEROCOPY sends are numbered in turn; those completed since
+       the error queue was last read are reported there as a range */
+    boolean zerocopy;           /* SO_ZEROCOPY */
+    u32 zerocopy_next;
+    boolean zerocopy_done;
+    boolean zerocopy_copied;
+    u32 zerocopy_lo;
+    u32 zerocopy_hi;
     union {
 	struct {
 	    struct tcp_pcb *lw;
 	    enum tcp_socket_state state; // half open?
+	    struct tcp_zc zc;
+	    boolean nodelay;
+	    boolean cork;
+	    boolean keepalive;
+	    u32 keep_idle;      /* ms */
+	    u32 keep_intvl;     /* ms */
+	    u32 keep_cnt;
+	    /* Buffer sizes in effect on lw. A shrink by more than is
+	       free is owed and taken as space is released. */
+	    u32 pcb_sndbuf;
+	    u32 snd_debt;
+	    u32 pcb_rcvbuf;
+	    u32 rcv_debt;
+	    u32 rcv_pending;    /* consumed but not yet returned to the window */
+	    /* receive autotuning: the time for a window's worth of data
+	       to arrive estimates the round trip, and what the
+	       application consumes in one gives the rate to keep up with */
+	    u32 rcv_rtt_seq;
+	    timestamp rcv_rtt_start;
+	    timestamp rcv_rtt;
+	    timestamp rcv_space_start;
+	    u64 rcv_space_copied;
+	    u64 rcv_space;
 	} tcp;
 	struct {
 	    struct udp_pcb *lw;
@@ -133,12 +275,223 @@ typedef struct sock {
     } info;
 } *sock;
 
+/* Free send buffer space, after taking any outstanding shrink. Unlike
+   tcp_sndbuf(), this isn't truncated to 16 bits. */
+static u64 tcp_sock_sndbuf(sock s)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    u32 take = MIN(s->info.tcp.snd_debt, lw->snd_buf);
+    lw->snd_buf -= take;
+    s->info.tcp.snd_debt -= take;
+    return lw->snd_buf;
+}
+
+/* Return consumed data to the receive window, less any outstanding shrink */
+static void tcp_sock_recved(sock s, u64 len)
+{
+    u32 take = MIN(len, s->info.tcp.rcv_debt);
+    s->info.tcp.rcv_debt -= take;
+    len -= take;
+    while (len > 0) {
+        u16 n = MIN(len, 0xffff);   /* tcp_recved takes a u16 */
+        tcp_recved(s->info.tcp.lw, n);
+        len -= n;
+    }
+}
+
+/* Return what a read consumed in one go, and only once the window
+   the peer has left is down to half the buffer, as Linux does; each
+   update then opens the window by a useful amount rather than costing
+   a window update ACK per segment read. */
+static void tcp_sock_recved_batch(sock s, u64 len)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    s->info.tcp.rcv_pending += len;
+    u32 avail = lw->rcv_ann_right_edge - lw->rcv_nxt;
+    if (2 * (u64)avail > s->info.tcp.pcb_rcvbuf)
+        return;
+    len = s->info.tcp.rcv_pending;
+    s->info.tcp.rcv_pending = 0;
+    tcp_sock_recved(s, len);
+}
+
+static void tcp_sock_resize_sndbuf(sock s)
+{
+    u32 want = s->sndbuf;
+    u32 have = s->info.tcp.pcb_sndbuf;
+    s->info.tcp.pcb_sndbuf = want;
+    if (want > have) {
+        u32 grow = want - have;
+        u32 paid = MIN(grow, s->info.tcp.snd_debt);
+        s->info.tcp.snd_debt -= paid;
+        s->info.tcp.lw->snd_buf += grow - paid;
+    } else {
+        s->info.tcp.snd_debt += have - want;
+        tcp_sock_sndbuf(s);
+    }
+}
+
+/* Received segments wait in the incoming queue, which must hold a
+   full window of them. It starts small and grows, keeping its
+   contents in order, as the window is opened. */
+static void tcp_sock_incoming_grow(sock s, u32 window)
+{
+    u64 qlen = window / TCP_MSS + 1;
+    if (qlen <= s->incoming->size)
+        return;
+    queue q = allocate_queue(s->h, qlen);
+    if (q == INVALID_ADDRESS)
+        return;
+    void *p;
+    while ((p = dequeue(s->incoming)))
+        assert(enqueue(q, p));
+    deallocate_queue(s->incoming);
+    s->incoming = q;
+}
+
+static void tcp_sock_resize_rcvbuf(sock s)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    /* without window scaling the peer can't be offered more than 64KB */
+    u32 want = MIN(s->rcvbuf, TCP_WND_MAX(lw));
+    u32 have = s->info.tcp.pcb_rcvbuf;
+    tcp_sock_incoming_grow(s, want);
+    s->info.tcp.pcb_rcvbuf = want;
+    if (want > have) {
+        tcp_sock_recved(s, want - have);
+    } else {
+        /* the announced edge stays put; the window closes as data arrives */
+        u32 shrink = have - want;
+        u32 take = MIN(shrink, lw->rcv_wnd);
+        lw->rcv_wnd -= take;
+        s->info.tcp.rcv_debt += shrink - take;
+    }
+}
+
+/* Push socket options down to the lwIP pcb. A listen pcb only carries
+   the option flags, which lwIP copies to new connections; the rest is
+   applied to those as they are accepted. */
+static void sock_apply_opts(sock s)
+{
+    if (s->type == SOCK_DGRAM) {
+        if (s->reuseaddr)
+            ip_set_option(s->info.udp.lw, SOF_REUSEADDR);
+        else
+            ip_reset_option(s->info.udp.lw, SOF_REUSEADDR);
+        return;
+    }
+
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    if (!lw)
+        return;
+    if (s->reuseaddr)
+        ip_set_option(lw, SOF_REUSEADDR);
+    else
+        ip_reset_option(lw, SOF_REUSEADDR);
+    if (s->info.tcp.keepalive)
+        ip_set_option(lw, SOF_KEEPALIVE);
+    else
+        ip_reset_option(lw, SOF_KEEPALIVE);
+    if (s->info.tcp.state == TCP_SOCK_LISTENING)
+        return;
+
+    /* corking holds back partial segments, as Nagle does */
+    if (s->info.tcp.nodelay && !s->info.tcp.cork)
+        tcp_nagle_disable(lw);
+    else
+        tcp_nagle_enable(lw);
+    lw->keep_idle = s->info.tcp.keep_idle;
+    lw->keep_intvl = s->info.tcp.keep_intvl;
+    lw->keep_cnt = s->info.tcp.keep_cnt;
+    tcp_sock_resize_sndbuf(s);
+    tcp_sock_resize_rcvbuf(s);
+}
+
+/* Sample the time for the window offered at the last sample to be
+   filled. This overstates the round trip when the sender isn't window
+   limited, so smaller samples are taken as they come. */
+static void tcp_sock_rcv_rtt_measure(sock s)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    timestamp t = now(CLOCK_ID_MONOTONIC);
+    if (s->info.tcp.rcv_rtt_start) {
+        if ((s32)(lw->rcv_nxt - s->info.tcp.rcv_rtt_seq) < 0)
+            return;
+        timestamp sample = t - s->info.tcp.rcv_rtt_start;
+        timestamp rtt = s->info.tcp.rcv_rtt;
+        if (!rtt) {
+            s->info.tcp.rcv_space_start = t;
+            s->info.tcp.rcv_space_copied = 0;
+        }
+        s->info.tcp.rcv_rtt = (!rtt || sample < rtt) ? sample : rtt - rtt / 8 + sample / 8;
+    }
+    s->info.tcp.rcv_rtt_start = t;
+    s->info.tcp.rcv_rtt_seq = lw->rcv_nxt + lw->rcv_wnd;
+}
+
+/* Once per round trip, size the receive buffer at twice what the
+   application consumed over the last one, so that the window keeps
+   ahead of a sender whose cwnd is still opening. */
+static void tcp_sock_rcvbuf_adjust(sock s, u64 copied)
+{
+    if (s->rcvbuf_lock || !s->info.tcp.rcv_rtt)
+        return;
+    s->info.tcp.rcv_space_copied += copied;
+    timestamp t = now(CLOCK_ID_MONOTONIC);
+    if (t - s->info.tcp.rcv_space_start < s->info.tcp.rcv_rtt)
+        return;
+    copied = s->info.tcp.rcv_space_copied;
+    if (copied > s->info.tcp.rcv_space) {
+        u64 want = MIN(2 * copied, tcp_rcvbuf_max);
+        if (want > s->rcvbuf) {
+            net_debug("sock %d, rtt %T, rcvbuf %d -> %ld\n", s->fd, s->info.tcp.rcv_rtt, s->rcvbuf, want);
+            s->rcvbuf = want;
+            tcp_sock_resize_rcvbuf(s);
+        }
+        s->info.tcp.rcv_space = copied;
+    }
+    s->info.tcp.rcv_space_start = t;
+    s->info.tcp.rcv_space_copied = 0;
+}
+
+/* Keep room for two congestion windows, so that the buffer doesn't
+   hold back a cwnd which has grown past it. */
+static void tcp_sock_sndbuf_expand(sock s)
+{
+    if (s->sndbuf_lock)
+        return;
+    u64 want = MIN(2 * (u64)s->info.tcp.lw->cwnd, tcp_sndbuf_max);
+    if (want > s->sndbuf) {
+        net_debug("sock %d, cwnd %d, sndbuf %d -> %ld\n", s->fd, s->info.tcp.lw->cwnd, s->sndbuf, want);
+        s->sndbuf = want;
+        tcp_sock_resize_sndbuf(s);
+    }
+}
+
+/* Take the window and send buffer the connection came up with as the
+   baseline for sizing; with scaling negotiated, the receive window can
+   now be opened past 64KB. */
+static void tcp_sock_established(sock s)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    s->info.tcp.pcb_sndbuf = lw->snd_buf;
+    s->info.tcp.snd_debt = 0;
+    s->info.tcp.pcb_rcvbuf = lw->rcv_wnd;
+    s->info.tcp.rcv_debt = 0;
+    s->info.tcp.rcv_pending = 0;
+    s->info.tcp.rcv_rtt_start = 0;
+    s->info.tcp.rcv_rtt = 0;
+    s->info.tcp.rcv_space = 0;
+    sock_apply_opts(s);
+}
+
 closure_function(1, 1, u32, socket_events,
                  sock, s,
                  thread, t /* ignore */)
 {
     sock s = bound(s);
     boolean in = queue_length(s->incoming) > 0;
+    u32 events = s->zerocopy_done ? EPOLLERR : 0;
 
     /* XXX socket state isn't giving a complete picture; needs to specify
        which transport ends are shut down */
@@ -146,16 +499,16 @@ closure_function(1, 1, u32, socket_events,
         if (s->info.tcp.state == TCP_SOCK_LISTENING) {
             return in ? EPOLLIN : 0;
         } else if (s->info.tcp.state == TCP_SOCK_OPEN) {
-            return (in ? EPOLLIN | EPOLLRDNORM : 0) |
+            return events | (in ? EPOLLIN | EPOLLRDNORM : 0) |
                 (s->info.tcp.lw->state == ESTABLISHED ?
-                (tcp_sndbuf(s->info.tcp.lw) ? EPOLLOUT | EPOLLWRNORM : 0) :
+                (tcp_sock_sndbuf(s) ? EPOLLOUT | EPOLLWRNORM : 0) :
                 EPOLLIN | EPOLLHUP);
         } else {
-            return 0;
+            return events;
         }
     }
     assert(s->type == SOCK_DGRAM);
-    return (in ? EPOLLIN | EPOLLRDNORM : 0) | EPOLLOUT | EPOLLWRNORM;
+    return events | (in ? EPOLLIN | EPOLLRDNORM : 0) | EPOLLOUT | EPOLLWRNORM;
 }
 
 static inline void notify_sock(sock s)
@@ -165,6 +518,21 @@ static inline void notify_sock(sock s)
     notify_dispatch(s->f.ns, events);
 }
 
+/* Post the completion of a MSG_ZEROCOPY send on the error queue.
+   Sends complete in the order they were numbered, so those not yet
+   read are always the range up to this one. */
+static void sock_zerocopy_complete(sock s, u32 id, boolean copied)
+{
+    if (!s->zerocopy_done) {
+        s->zerocopy_done = true;
+        s->zerocopy_copied = false;
+        s->zerocopy_lo = id;
+    }
+    s->zerocopy_hi = id;
+    s->zerocopy_copied |= copied;
+    notify_sock(s);
+}
+
 /* May be called from irq/softirq */
 static void set_lwip_error(sock s, err_t err)
 {
@@ -250,12 +618,82 @@ static inline void pbuf_consume(struct pbuf *p, u64 length)
     p->payload += length;
 }
 
+/* pooled in the udp_entry cache */
 struct udp_entry {
     struct pbuf * pbuf;
     u32 raddr;
     u16 rport;
 };
 
+static void sock_src_addr(sock s, void *p, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    struct sockaddr sa;
+    zero(&sa, sizeof(sa));
+    struct sockaddr_in * sin = (struct sockaddr_in *)&sa;
+    sin->family = AF_INET;
+    if (s->type == SOCK_STREAM) {
+        sin->address = ip4_addr_get_u32(&s->info.tcp.lw->remote_ip);
+        sin->port = htons(s->info.tcp.lw->remote_port);
+    } else {
+        struct udp_entry * e = p;
+        sin->address = e->raddr;
+        sin->port = htons(e->rport);
+    }
+    u32 len = MIN(sizeof(struct sockaddr), *addrlen);
+    *addrlen = sizeof(struct sockaddr);
+    runtime_memcpy(src_addr, sin, len);
+}
+
+/* Copy queued data out to iov: for a stream, as much as is available
+   and fits; for datagrams, the next one, with any part that doesn't
+   fit discarded and its full length left in *dgram_len. */
+static u64 sock_copy_to_iov(sock s, struct iovec *iov, int iovlen, u64 *dgram_len)
+{
+    u64 xfer_total = 0;
+    u64 iov_offset = 0;
+    int iv = 0;
+    void *p;
+
+    /* a datagram is consumed even if there is no room for any of it */
+    while ((iv < iovlen || s->type == SOCK_DGRAM) && (p = queue_peek(s->incoming))) {
+        struct pbuf * pbuf = s->type == SOCK_STREAM ? (struct pbuf *)p :
+            ((struct udp_entry *)p)->pbuf;
+        struct pbuf *cur_buf = pbuf;
+        if (dgram_len)
+            *dgram_len = pbuf->tot_len;
+
+        while (iv < iovlen && cur_buf) {
+            u64 xfer = MIN(iov[iv].iov_len - iov_offset, cur_buf->len);
+            if (xfer > 0) {
+                runtime_memcpy(iov[iv].iov_base + iov_offset, cur_buf->payload, xfer);
+                pbuf_consume(cur_buf, xfer);
+                iov_offset += xfer;
+                xfer_total += xfer;
+            }
+            if (iov_offset == iov[iv].iov_len) {
+                iv++;
+                iov_offset = 0;
+            }
+            if (cur_buf->len == 0)
+                cur_buf = cur_buf->next;
+        }
+
+        if (cur_buf && s->type == SOCK_STREAM)
+            break;
+        assert(dequeue(s->incoming) == p);
+        if (s->type == SOCK_DGRAM)
+            unix_cache_free(s->p->uh, udp_entry, p);
+        pbuf_free(pbuf);
+        if (!queue_peek(s->incoming))
+            notify_sock(s); /* reset a triggered EPOLLIN condition */
+        if (s->type == SOCK_DGRAM)
+            break;
+    }
+    if (s->type == SOCK_STREAM && xfer_total > 0)
+        tcp_sock_recved_batch(s, xfer_total);
+    return xfer_total;
+}
+
 static sysreturn sock_read_bh_internal(sock s, thread t, void * dest, u64 length, struct sockaddr * src_addr,
                                        socklen_t * addrlen, io_completion completion, u64 flags)
 {
@@ -296,58 +734,14 @@ static sysreturn sock_read_bh_internal(sock s, thread t, void * dest, u64 length
         return BLOCKQ_BLOCK_REQUIRED;               /* back to chewing more cud */
     }
 
-    if (src_addr) {
-        struct sockaddr sa;
-        zero(&sa, sizeof(sa));
-        struct sockaddr_in * sin = (struct sockaddr_in *)&sa;
-        sin->family = AF_INET;
-        if (s->type == SOCK_STREAM) {
-	    sin->address = ip4_addr_get_u32(&s->info.tcp.lw->remote_ip);
-	    sin->port = htons(s->info.tcp.lw->remote_port);
-        } else {
-            struct udp_entry * e = p;
-            sin->address = e->raddr;
-            sin->port = htons(e->rport);
-        }
-        u32 len = MIN(sizeof(struct sockaddr), *addrlen);
-        *addrlen = sizeof(struct sockaddr);
-        runtime_memcpy(src_addr, sin, len);
-    }
-
-    u64 xfer_total = 0;
-
-    /* TCP: consume multiple buffers to fill request, if available. */
-    do {
-        struct pbuf * pbuf = s->type == SOCK_STREAM ? (struct pbuf *)p :
-            ((struct udp_entry *)p)->pbuf;
-        struct pbuf *cur_buf = pbuf;
+    if (src_addr)
+        sock_src_addr(s, p, src_addr, addrlen);
 
-        do {
-            if (cur_buf->len > 0) {
-                u64 xfer = MIN(length, cur_buf->len);
-                runtime_memcpy(dest, cur_buf->payload, xfer);
-                pbuf_consume(cur_buf, xfer);
-                length -= xfer;
-                xfer_total += xfer;
-                dest = (char *) dest + xfer;
-                if (s->type == SOCK_STREAM)
-                    tcp_recved(s->info.tcp.lw, xfer);
-            }
-            if (cur_buf->len == 0)
-                cur_buf = cur_buf->next;
-        } while ((length > 0) && cur_buf);
-
-        if (!cur_buf || (s->type == SOCK_DGRAM)) {
-            assert(dequeue(s->incoming) == p);
-            if (s->type == SOCK_DGRAM)
-                deallocate(s->h, p, sizeof(struct udp_entry));
-            pbuf_free(pbuf);
-            p = queue_peek(s->incoming);
-            if (!p)
-                notify_sock(s); /* reset a triggered EPOLLIN condition */
-        }
-    } while(s->type == SOCK_STREAM && length > 0 && p); /* XXX simplify expression */
+    struct iovec iov = { dest, length };
+    u64 xfer_total = sock_copy_to_iov(s, &iov, 1, 0);
 
+    if (s->type == SOCK_STREAM)
+        tcp_sock_rcvbuf_adjust(s, xfer_total);
     rv = xfer_total;
   out:
     net_debug("   completion %p, rv %ld\n", completion, rv);
@@ -365,48 +759,6 @@ closure_function(7, 1, sysreturn, sock_read_bh,
     return rv;
 }
 
-static void recvmsg_complete_internal(sock s, struct msghdr * msg, void * dest, u64 length, boolean blocked,
-                                      thread t, sysreturn rv)
-{
-    s64 offset = 0;
-    int iv = 0;
-    while (offset < rv) {
-        struct iovec *iov = &msg->msg_iov[iv];
-
-        runtime_memcpy(iov->iov_base, dest + offset,
-                MIN(iov->iov_len, rv - offset));
-        offset += iov->iov_len;
-        iv++;
-    }
-    deallocate(s->h, dest, length);
-    msg->msg_controllen = 0;
-    msg->msg_flags = 0;
-    set_syscall_return(t, rv);
-    if (blocked)
-        thread_wakeup(t);
-}
-
-closure_function(5, 2, void, recvmsg_complete,
-                 sock, s, struct msghdr *, msg, void *, dest, u64, length, boolean, blocked,
-                 thread, t, sysreturn, rv)
-{
-    recvmsg_complete_internal(bound(s), bound(msg), bound(dest), bound(length), bound(blocked), t, rv);
-    closure_finish();
-}
-
-closure_function(5, 1, sysreturn, recvmsg_bh,
-                 sock, s, thread, t, void *, dest, u64, length, struct msghdr *, msg,
-                 u64, flags)
-{
-    io_completion completion = closure(bound(s)->h, recvmsg_complete, bound(s), bound(msg), bound(dest),
-                                       bound(length), true);
-    sysreturn rv = sock_read_bh_internal(bound(s), bound(t), bound(dest), bound(length), bound(msg)->msg_name,
-                                         &bound(msg)->msg_namelen, completion, flags);
-    if (rv != BLOCKQ_BLOCK_REQUIRED)
-        closure_finish();
-    return rv;
-}
-
 closure_function(1, 6, sysreturn, socket_read,
                  sock, s,
                  void *, dest, u64, length, u64, offset, thread, t, boolean, bh, io_completion, completion)
@@ -422,9 +774,97 @@ closure_function(1, 6, sysreturn, socket_read,
     return blockq_check(s->rxbq, t, ba, bh);
 }
 
-static sysreturn socket_write_tcp_bh_internal(sock s, thread t, void * buf, u64 remain, io_completion completion, u64 flags)
+static void tcp_zc_init(tcp_zc zc, heap h)
+{
+    zc->h = h;
+    zc->s = 0;
+    zc->written = 0;
+    zc->acked = 0;
+    list_init(&zc->pending);
+}
+
+static void tcp_zc_buf_done(tcp_zc zc, tcp_zc_buf b)
+{
+    list_delete(&b->l);
+    if (b->notify && zc->s)
+        sock_zerocopy_complete(zc->s, b->id, b->copied);
+    deallocate(zc->h, b, sizeof(struct tcp_zc_buf));
+}
+
+static void tcp_zc_ack(tcp_zc zc, u64 len)
+{
+    zc->acked += len;
+    list_foreach(&zc->pending, l) {
+        tcp_zc_buf b = struct_from_list(l, tcp_zc_buf, l);
+        if (b->end > zc->acked)
+            break;
+        tcp_zc_buf_done(zc, b);
+    }
+}
+
+/* the connection is gone; nothing more will be acknowledged */
+static void tcp_zc_release_all(tcp_zc zc)
+{
+    list_foreach(&zc->pending, l)
+        tcp_zc_buf_done(zc, struct_from_list(l, tcp_zc_buf, l));
+}
+
+static void tcp_zc_hold_put(tcp_zc_hold zh)
+{
+    if (--zh->refs > 0)
+        return;
+    apply(zh->release);
+    deallocate(zh->h, zh, sizeof(struct tcp_zc_hold));
+}
+
+static void tcp_zc_pbuf_free(struct pbuf *p)
+{
+    tcp_zc_pbuf zp = (tcp_zc_pbuf)p;
+    tcp_zc_hold zh = zp->zh;
+    deallocate(zh->h, zp, sizeof(struct tcp_zc_pbuf));
+    tcp_zc_hold_put(zh);
+}
+
+/* Replace the pbufs that tcp_write() has queued referring to
+   [buf, buf + len) with custom ones holding zh. These are never at the
+   head of a segment, which is its header. */
+static boolean tcp_zc_hold_pbufs(struct tcp_pcb *lw, tcp_zc_hold zh, void *buf, u64 len)
+{
+    for (struct tcp_seg *seg = lw->unsent; seg; seg = seg->next) {
+        for (struct pbuf *prev = seg->p, *q = prev->next; q; prev = q, q = q->next) {
+            if ((q->flags & PBUF_FLAG_IS_CUSTOM) || q->payload < buf || q->payload >= buf + len)
+                continue;
+            tcp_zc_pbuf zp = allocate(zh->h, sizeof(struct tcp_zc_pbuf));
+            if (zp == INVALID_ADDRESS)
+                return false;
+            zp->zh = zh;
+            zp->p.custom_free_function = tcp_zc_pbuf_free;
+            struct pbuf *c = pbuf_alloced_custom(PBUF_RAW, q->len, PBUF_REF, &zp->p,
+                                                 q->payload, q->len);
+            c->tot_len = q->tot_len;
+            c->next = q->next;
+            prev->next = c;
+            q->next = 0;
+            pbuf_free(q);
+            q = c;
+            zh->refs++;
+        }
+    }
+    return true;
+}
+
+/* A non-zero zc_release writes buf by reference; it is applied once
+   no pbuf refers to the data, or right away if none was queued.
+   MSG_ZEROCOPY sends have their acknowledgement reported on the error
+   queue. With MSG_MORE or TCP_CORK the data is queued without pushing
+   it out. */
+static sysreturn socket_write_tcp_bh_internal(sock s, thread t, void * buf, u64 remain, io_completion completion, u64 flags,
+                                              thunk zc_release, int msgflags)
 {
     sysreturn rv = 0;
+    tcp_zc_buf zb = 0;
+    tcp_zc_hold zh = 0;
+    boolean queued = false;
     err_t err = get_lwip_error(s);
     net_debug("fd %d, thread %ld, buf %p, remain %ld, flags 0x%lx, lwip err %d\n",
               s->fd, t->tid, buf, remain, flags, err);
@@ -445,11 +885,7 @@ static sysreturn socket_write_tcp_bh_internal(sock s, thread t, void * buf, u64
         goto out;
     }
 
-    /* Note that the actual transmit window size is truncated to 16
-       bits here (and tcp_write() doesn't accept more than 2^16
-       anyway), so even if we have a large transmit window due to
-       LWIP_WND_SCALE, we still can't write more than 2^16. Sigh... */
-    u64 avail = tcp_sndbuf(s->info.tcp.lw);
+    u64 avail = tcp_sock_sndbuf(s);
     if (avail == 0) {
       full:
         if ((flags & BLOCKQ_ACTION_BLOCKED) == 0 && (s->f.flags & SOCK_NONBLOCK)) {
@@ -464,7 +900,12 @@ static sysreturn socket_write_tcp_bh_internal(sock s, thread t, void * buf, u64
 
     /* Figure actual length and flags */
     u64 n;
-    u8 apiflags = TCP_WRITE_FLAG_COPY;
+    boolean byref = zc_release != 0;
+    boolean notify = (msgflags & (MSG_ZEROCOPY | MSG_ZEROCOPY_COPIED)) != 0;
+    u8 apiflags = byref ? 0 : TCP_WRITE_FLAG_COPY;
+    boolean more = (msgflags & MSG_MORE) || s->info.tcp.cork;
+    if (more)
+        apiflags |= TCP_WRITE_FLAG_MORE;
     if (avail < remain) {
         n = avail;
         apiflags |= TCP_WRITE_FLAG_MORE;
@@ -472,12 +913,60 @@ static sysreturn socket_write_tcp_bh_internal(sock s, thread t, void * buf, u64
         n = remain;
     }
 
-    /* XXX need to pore over lwIP error conditions here */
-    err = tcp_write(s->info.tcp.lw, buf, n, apiflags);
+    if (notify) {
+        zb = allocate(s->h, sizeof(struct tcp_zc_buf));
+        if (zb == INVALID_ADDRESS) {
+            rv = -ENOMEM;
+            goto out;
+        }
+    }
+    if (byref) {
+        zh = allocate(s->h, sizeof(struct tcp_zc_hold));
+        if (zh == INVALID_ADDRESS) {
+            zh = 0;
+            rv = -ENOMEM;
+            goto out;
+        }
+        zh->h = s->h;
+        zh->release = zc_release;
+        zh->refs = 1;
+    }
+
+    /* tcp_write() takes at most 64KB at a time; if lwIP runs out of
+       memory partway, what was queued so far is the result */
+    u64 written = 0;
+    do {
+        u16 len = MIN(n - written, 0xffff);
+        u8 f = written + len < n ? apiflags | TCP_WRITE_FLAG_MORE : apiflags;
+        /* XXX need to pore over lwIP error conditions here */
+        err = tcp_write(s->info.tcp.lw, buf + written, len, f);
+        if (err != ERR_OK)
+            break;
+        written += len;
+    } while (written < n);
+    if (written > 0) {
+        n = written;
+        err = ERR_OK;
+    }
     if (err == ERR_OK) {
-        /* XXX prob add a flag to determine whether to continuously
-           post data, e.g. if used by send/sendto... */
-        err = tcp_output(s->info.tcp.lw);
+        s->info.tcp.zc.written += n;
+        /* lwIP may transmit from it already; don't let go of it */
+        if (zh && !tcp_zc_hold_pbufs(s->info.tcp.lw, zh, buf, n)) {
+            msg_err("out of memory; leaking zero-copy buffer\n");
+            zh->refs++;
+        }
+        if (zb) {
+            zb->end = s->info.tcp.zc.written;
+            zb->notify = notify;
+            zb->copied = !byref;
+            zb->id = s->zerocopy_next++;
+            list_push_back(&s->info.tcp.zc.pending, &zb->l);
+            queued = true;
+        }
+        /* Held data goes out with a later write, on uncork or as
+           acks arrive; a full buffer must be sent to make progress. */
+        if (!more || n == avail)
+            err = tcp_output(s->info.tcp.lw);
         if (err == ERR_OK) {
             net_debug(" tcp_write and tcp_output successful for %ld bytes\n", n);
             rv = n;
@@ -492,49 +981,90 @@ static sysreturn socket_write_tcp_bh_internal(sock s, thread t, void * buf, u64
     } else if (err == ERR_MEM) {
         /* XXX some ambiguity in lwIP - investigate */
         net_debug(" tcp_write() returned ERR_MEM\n");
+        if (zb) {
+            deallocate(s->h, zb, sizeof(struct tcp_zc_buf));
+            zb = 0;
+        }
+        if (zh) {
+            deallocate(s->h, zh, sizeof(struct tcp_zc_hold));
+            zh = 0;
+        }
         goto full;
     } else {
         net_debug(" tcp_write() lwip error: %d\n", err);
         rv = lwip_to_errno(err);
     }
   out:
+    if (zb && zb != INVALID_ADDRESS && !queued)
+        deallocate(s->h, zb, sizeof(struct tcp_zc_buf));
+    if (zh)
+        tcp_zc_hold_put(zh);
+    else if (zc_release)
+        apply(zc_release);
     net_debug("   completion %p, rv %ld\n", completion, rv);
     blockq_handle_completion(s->txbq, flags, completion, t, rv);
     return rv;
 }
 
-closure_function(5, 1, sysreturn, socket_write_tcp_bh,
-                 sock, s, thread, t, void *, buf, u64, remain, io_completion, completion,
+closure_function(7, 1, sysreturn, socket_write_tcp_bh,
+                 sock, s, thread, t, void *, buf, u64, remain, io_completion, completion, thunk, zc_release, int, msgflags,
                  u64, flags)
 {
-    sysreturn rv = socket_write_tcp_bh_internal(bound(s), bound(t), bound(buf), bound(remain), bound(completion), flags);
+    sysreturn rv = socket_write_tcp_bh_internal(bound(s), bound(t), bound(buf), bound(remain), bound(completion), flags,
+                                                bound(zc_release), bound(msgflags));
     if (rv != BLOCKQ_BLOCK_REQUIRED)
         closure_finish();
     return rv;
 }
 
-static sysreturn socket_write_udp(sock s, void *source, u64 length)
+/* Gather a datagram from iov and send it to dest_addr, if given, or
+   else to the connected peer. A destination given here doesn't
+   connect the socket, which would filter what it receives. */
+static sysreturn socket_write_udp(sock s, struct iovec *iov, int iovlen,
+                                  struct sockaddr *dest_addr, socklen_t addrlen, int flags)
 {
     err_t err = ERR_OK;
+    u64 length = 0;
+
+    if (dest_addr && addrlen < sizeof(struct sockaddr_in))
+        return -EINVAL;
+    for (int i = 0; i < iovlen; i++)
+        length += iov[i].iov_len;
+    if (length > UDP_MAX_PAYLOAD)
+        return -EMSGSIZE;
 
     /* XXX check how much we can queue, maybe make udp bh */
-    /* XXX check if remote endpoint set? let LWIP check? */
     struct pbuf * pbuf = pbuf_alloc(PBUF_TRANSPORT, length, PBUF_RAM);
 
     if (!pbuf) {
         msg_err("failed to allocate pbuf for udp_send()\n");
         return -ENOBUFS;
     }
-    runtime_memcpy(pbuf->payload, source, length);
-    err = udp_send(s->info.udp.lw, pbuf);
+    u64 offset = 0;
+    for (int i = 0; i < iovlen; i++) {
+        runtime_memcpy(pbuf->payload + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    if (dest_addr) {
+        struct sockaddr_in * sin = (struct sockaddr_in *)dest_addr;
+        ip_addr_t ipaddr = IPADDR4_INIT(sin->address);
+        err = udp_sendto(s->info.udp.lw, pbuf, &ipaddr, ntohs(sin->port));
+    } else {
+        err = udp_send(s->info.udp.lw, pbuf);
+    }
+    /* the driver holds its own reference until transmitted */
+    pbuf_free(pbuf);
     if (err != ERR_OK) {
         net_debug("lwip error %d\n", err);
         return lwip_to_errno(err);
     }
+    /* datagrams are always copied, so this completes right away */
+    if (flags & MSG_ZEROCOPY)
+        sock_zerocopy_complete(s, s->zerocopy_next++, true);
     return length;
 }
 
-static sysreturn socket_write_internal(sock s, void *source, u64 length,
+static sysreturn socket_write_internal(sock s, void *source, u64 length, int flags,
                                        thread t, boolean bh, io_completion completion)
 {
     sysreturn rv;
@@ -546,11 +1076,21 @@ static sysreturn socket_write_internal(sock s, void *source, u64 length,
             rv = 0;
             goto out;
         }
+        /* the caller's pages go by reference if they can be pinned */
+        thunk release = 0;
+        if (flags & MSG_ZEROCOPY) {
+            void *pinned = pin_user_buffer(source, length, &release);
+            if (pinned)
+                source = pinned;
+            else
+                flags ^= MSG_ZEROCOPY | MSG_ZEROCOPY_COPIED;
+        }
         blockq_action ba = closure(s->h, socket_write_tcp_bh, s, t,
-                                   source, length, completion);
+                                   source, length, completion, release, flags);
         rv = blockq_check(s->txbq, t, ba, bh);
     } else if (s->type == SOCK_DGRAM) {
-        rv = socket_write_udp(s, source, length);
+        struct iovec iov = { source, length };
+        rv = socket_write_udp(s, &iov, 1, 0, 0, flags);
     } else {
 	msg_err("socket type %d unsupported\n", s->type);
 	rv = -EINVAL;
@@ -567,7 +1107,25 @@ closure_function(1, 6, sysreturn, socket_write,
     sock s = bound(s);
     net_debug("sock %d, type %d, thread %ld, source %p, length %ld, offset %ld\n",
 	      s->fd, s->type, t->tid, source, length, offset);
-    return socket_write_internal(s, source, length, t, bh, completion);
+    return socket_write_internal(s, source, length, 0, t, bh, completion);
+}
+
+sysreturn socket_write_zerocopy(fdesc f, void *buf, u64 length, thunk release,
+                                thread t, io_completion completion)
+{
+    sock s = (sock)f;
+    net_debug("sock %d, type %d, thread %ld, buf %p, length %ld\n",
+              s->fd, s->type, t->tid, buf, length);
+    sysreturn rv;
+    if (s->type == SOCK_STREAM && s->info.tcp.state == TCP_SOCK_OPEN && length > 0)
+        return blockq_check(s->txbq, t, closure(s->h, socket_write_tcp_bh, s, t,
+                                                buf, length, completion, release, 0), true);
+
+    /* nothing to hold on to: datagrams are copied */
+    rv = socket_write_internal(s, buf, length, 0, t, true, 0);
+    apply(release);
+    apply(completion, t, rv);
+    return rv;
 }
 
 closure_function(1, 2, sysreturn, socket_ioctl,
@@ -643,8 +1201,6 @@ closure_function(1, 2, sysreturn, socket_ioctl,
     }
 }
 
-#define SOCK_QUEUE_LEN 128
-
 closure_function(1, 0, sysreturn, socket_close,
                  sock, s)
 {
@@ -656,15 +1212,23 @@ closure_function(1, 0, sysreturn, socket_close,
          * prevent any lwIP callback that might be called after tcp_close() from
          * using a stale reference to the socket structure, set the callback
          * argument to NULL. */
+        s->info.tcp.zc.s = 0;
         if (s->info.tcp.lw) {
             tcp_close(s->info.tcp.lw);
             tcp_arg(s->info.tcp.lw, 0);
         }
+        tcp_zc_release_all(&s->info.tcp.zc);
         break;
-    case SOCK_DGRAM:
+    case SOCK_DGRAM: {
         udp_remove(s->info.udp.lw);
+        struct udp_entry *e;
+        while ((e = dequeue(s->incoming))) {
+            pbuf_free(e->pbuf);
+            unix_cache_free(s->p->uh, udp_entry, e);
+        }
         break;
     }
+    }
     deallocate_blockq(s->txbq);
     deallocate_blockq(s->rxbq);
     deallocate_queue(s->incoming);
@@ -725,14 +1289,21 @@ static void udp_input_lower(void *z, struct udp_pcb *pcb, struct pbuf *p,
 	      s->fd, pcb, p, n[0], n[1], n[2], n[3], port);
     assert(pcb == s->info.udp.lw);
     if (p) {
-	/* could make a cache if we care to */
-	struct udp_entry * e = allocate(s->h, sizeof(*e));
-	assert(e != INVALID_ADDRESS);
+	struct udp_entry * e = unix_cache_alloc(s->p->uh, udp_entry);
+	if (e == INVALID_ADDRESS) {
+	    pbuf_free(p);
+	    return;
+	}
 	e->pbuf = p;
 	e->raddr = ip4_addr_get_u32(addr);
 	e->rport = port;
-	if (!enqueue(s->incoming, e))
-	    msg_err("incoming queue full\n");
+	/* like a full receive buffer, drop */
+	if (!enqueue(s->incoming, e)) {
+	    net_debug("incoming queue full\n");
+	    unix_cache_free(s->p->uh, udp_entry, e);
+	    pbuf_free(p);
+	    return;
+	}
     } else {
 	msg_err("null pbuf\n");
     }
@@ -768,8 +1339,16 @@ static int allocate_sock(process p, int type, u32 flags, sock * rs)
     s->p = p;
     s->h = h;
     s->fd = fd;
-
-    s->incoming = allocate_queue(h, SOCK_QUEUE_LEN);
+    s->reuseaddr = false;
+    s->sndbuf = SOCK_SNDBUF_INIT;
+    s->rcvbuf = SOCK_RCVBUF_INIT;
+    s->sndbuf_lock = false;
+    s->rcvbuf_lock = false;
+    s->zerocopy = false;
+    s->zerocopy_next = 0;
+    s->zerocopy_done = false;
+
+    s->incoming = allocate_queue(h, type == SOCK_DGRAM ? UDP_QUEUE_LEN : SOCK_QUEUE_LEN);
     if (s->incoming == INVALID_ADDRESS) {
         msg_err("failed to allocate queue\n");
         goto err_queue;
@@ -809,6 +1388,22 @@ static int allocate_tcp_sock(process p, struct tcp_pcb *pcb, u32 flags)
     if (fd >= 0) {
 	s->info.tcp.lw = pcb;
 	s->info.tcp.state = TCP_SOCK_CREATED;
+	tcp_zc_init(&s->info.tcp.zc, s->h);
+	s->info.tcp.zc.s = s;
+	s->info.tcp.nodelay = false;
+	s->info.tcp.cork = false;
+	s->info.tcp.keepalive = false;
+	s->info.tcp.keep_idle = TCP_KEEPIDLE_INIT;
+	s->info.tcp.keep_intvl = TCP_KEEPINTVL_INIT;
+	s->info.tcp.keep_cnt = TCP_KEEPCNT_INIT;
+	s->info.tcp.pcb_sndbuf = pcb->snd_buf;
+	s->info.tcp.snd_debt = 0;
+	s->info.tcp.pcb_rcvbuf = pcb->rcv_wnd;
+	s->info.tcp.rcv_debt = 0;
+	s->info.tcp.rcv_pending = 0;
+	s->info.tcp.rcv_rtt_start = 0;
+	s->info.tcp.rcv_rtt = 0;
+	s->info.tcp.rcv_space = 0;
     }
     return fd;
 }
@@ -885,6 +1480,7 @@ static err_t tcp_input_lower(void *z, struct tcp_pcb *pcb, struct pbuf *p, err_t
 	    msg_err("incoming queue full\n");
             return ERR_BUF;     /* XXX verify */
         }
+        tcp_sock_rcv_rtt_measure(s);
         wakeup_sock(s, WAKEUP_SOCK_RX);
     } else {
         wakeup_sock(s, WAKEUP_SOCK_EXCEPT);
@@ -932,6 +1528,7 @@ static void lwip_tcp_conn_err(void * z, err_t err) {
 
     /* Don't try to use the pcb, it may have been deallocated already. */
     s->info.tcp.lw = 0;
+    tcp_zc_release_all(&s->info.tcp.zc);
 
     wakeup_sock(s, WAKEUP_SOCK_EXCEPT);
 }
@@ -943,6 +1540,8 @@ static err_t lwip_tcp_sent(void * arg, struct tcp_pcb * pcb, u16 len)
     }
     sock s = (sock)arg;
     net_debug("fd %d, pcb %p, len %d\n", s->fd, pcb, len);
+    tcp_zc_ack(&s->info.tcp.zc, len);
+    tcp_sock_sndbuf_expand(s);
     wakeup_sock(s, WAKEUP_SOCK_TX);
     return ERR_OK;
 }
@@ -989,6 +1588,8 @@ static err_t connect_tcp_complete(void* arg, struct tcp_pcb* tpcb, err_t err)
    }
    assert(s->info.tcp.state == TCP_SOCK_IN_CONNECTION);
    s->info.tcp.state = TCP_SOCK_OPEN; /* XXX state handling needs fixing; this could indicate an error as well */
+   if (err == ERR_OK)
+       tcp_sock_established(s);
    set_lwip_error(s, err);
    blockq_wake_one(s->rxbq);
    return ERR_OK;
@@ -1056,21 +1657,8 @@ sysreturn connect(int sockfd, struct sockaddr * addr, socklen_t addrlen)
     return lwip_to_errno(err);
 }
 
-#define MSG_OOB         0x00000001
-#define MSG_DONTROUTE   0x00000004
-#define MSG_PROBE       0x00000010
-#define MSG_TRUNC       0x00000020
-#define MSG_DONTWAIT    0x00000040
-#define MSG_EOR         0x00000080
-#define MSG_CONFIRM     0x00000800
-#define MSG_NOSIGNAL    0x00004000
-#define MSG_MORE        0x00008000
-
-static sysreturn sendto_prepare(sock s, int flags, struct sockaddr *dest_addr,
-        socklen_t addrlen)
+static sysreturn sendto_prepare(sock s, int flags)
 {
-    int err = ERR_OK;
-
     /* Process flags */
     if (flags & MSG_CONFIRM)
 	msg_warn("MSG_CONFIRM unimplemented; ignored\n");
@@ -1086,8 +1674,8 @@ static sysreturn sendto_prepare(sock s, int flags, struct sockaddr *dest_addr,
 	return -EOPNOTSUPP;
     }
 
-    if (flags & MSG_MORE)
-	msg_warn("MSG_MORE unimplemented; ignored\n");
+    if ((flags & MSG_MORE) && s->type != SOCK_STREAM)
+	msg_warn("MSG_MORE unimplemented for datagrams; ignored\n");
 
     if (flags & MSG_NOSIGNAL)
 	msg_warn("MSG_NOSIGNAL unimplemented; ignored\n");
@@ -1095,19 +1683,6 @@ static sysreturn sendto_prepare(sock s, int flags, struct sockaddr *dest_addr,
     if (flags & MSG_OOB)
 	msg_warn("MSG_OOB unimplemented; ignored\n");
 
-    /* Ignore dest if TCP */
-    if (s->type == SOCK_DGRAM && dest_addr) {
-	struct sockaddr_in * sin = (struct sockaddr_in *)dest_addr;
-	ip_addr_t ipaddr = IPADDR4_INIT(sin->address);
-	if (addrlen < sizeof(*sin))
-	    return -EINVAL;
-	err = udp_connect(s->info.udp.lw, &ipaddr, ntohs(sin->port));
-        if (err != ERR_OK) {
-            msg_err("udp_connect failed: %d\n", err);
-            return lwip_to_errno(err);
-        }
-    }
-
     return 0;
 }
 
@@ -1118,11 +1693,18 @@ sysreturn sendto(int sockfd, void * buf, u64 len, int flags,
     net_debug("sendto %d, buf %p, len %ld, flags %x, dest_addr %p, addrlen %d\n",
               sockfd, buf, len, flags, dest_addr, addrlen);
 
-    sysreturn rv = sendto_prepare(s, flags, dest_addr, addrlen);
+    if (!s->zerocopy)
+        flags &= ~MSG_ZEROCOPY;
+    sysreturn rv = sendto_prepare(s, flags);
     if (rv < 0) {
         return set_syscall_return(current, rv);
     }
-    return socket_write_internal(s, buf, len, current, false, syscall_io_complete);
+    /* Ignore dest if TCP */
+    if (s->type == SOCK_DGRAM) {
+        struct iovec iov = { buf, len };
+        return socket_write_udp(s, &iov, 1, dest_addr, addrlen, flags);
+    }
+    return socket_write_internal(s, buf, len, flags, current, false, syscall_io_complete);
 }
 
 static sysreturn sendmsg_prepare(sock s, const struct msghdr *msg, int flags,
@@ -1131,7 +1713,7 @@ static sysreturn sendmsg_prepare(sock s, const struct msghdr *msg, int flags,
     sysreturn rv;
     size_t i;
 
-    rv = sendto_prepare(s, flags, msg->msg_name, msg->msg_namelen);
+    rv = sendto_prepare(s, flags);
     if (rv < 0) {
         return rv;
     }
@@ -1181,13 +1763,33 @@ sysreturn sendmsg(int sockfd, const struct msghdr *msg, int flags)
     sysreturn rv;
 
     net_debug("sock %d, type %d, flags 0x%x\n", s->fd, s->type, flags);
+    if (!s->zerocopy)
+        flags &= ~MSG_ZEROCOPY;
+    if (s->type == SOCK_DGRAM) {
+        rv = sendto_prepare(s, flags);
+        if (rv == 0)
+            rv = socket_write_udp(s, msg->msg_iov, msg->msg_iovlen, msg->msg_name, msg->msg_namelen, flags);
+        return set_syscall_return(current, rv);
+    }
+    /* a single buffer can go by reference; several are gathered into
+       one, so the send is then reported as copied */
+    if (flags & MSG_ZEROCOPY) {
+        if (msg->msg_iovlen == 1) {
+            rv = sendto_prepare(s, flags);
+            if (rv < 0)
+                return set_syscall_return(current, rv);
+            return socket_write_internal(s, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len,
+                                         flags, current, false, syscall_io_complete);
+        }
+        flags ^= MSG_ZEROCOPY | MSG_ZEROCOPY_COPIED;
+    }
     rv = sendmsg_prepare(s, msg, flags, &buf, &len);
     if (rv <= 0) {
         return set_syscall_return(current, rv);
     }
     io_completion completion = closure(s->h, sendmsg_complete, s, buf, len,
             true);
-    rv = socket_write_internal(s, buf, len, current, false, completion);
+    rv = socket_write_internal(s, buf, len, flags, current, false, completion);
     sendmsg_complete_internal(s, buf, len, false, current, rv);
     return rv;
 }
@@ -1211,7 +1813,8 @@ closure_function(7, 1, sysreturn, sendmmsg_tcp_bh,
     struct mmsghdr * msgvec = bound(msgvec);
 
     io_completion completion = closure(s->h, sendmmsg_buf_complete, s, buf, len);
-    sysreturn rv = socket_write_tcp_bh_internal(s, t, buf, len, completion, bqflags | BLOCKQ_ACTION_BLOCKED);
+    sysreturn rv = socket_write_tcp_bh_internal(s, t, buf, len, completion, bqflags | BLOCKQ_ACTION_BLOCKED, 0,
+                                                bound(flags));
 
     while (true) {
         if (rv == BLOCKQ_BLOCK_REQUIRED) {
@@ -1230,7 +1833,8 @@ closure_function(7, 1, sysreturn, sendmmsg_tcp_bh,
         rv = sendmsg_prepare(s, &msgvec[s->msg_count].msg_hdr, bound(flags), &buf, &len);
         if (rv > 0) {
             completion = closure(s->h, sendmmsg_buf_complete, s, buf, len);
-            rv = socket_write_tcp_bh_internal(s, t, buf, len, completion, bqflags | BLOCKQ_ACTION_BLOCKED);
+            rv = socket_write_tcp_bh_internal(s, t, buf, len, completion, bqflags | BLOCKQ_ACTION_BLOCKED, 0,
+                                              bound(flags));
         }
     }
 
@@ -1241,6 +1845,26 @@ closure_function(7, 1, sysreturn, sendmmsg_tcp_bh,
     return set_syscall_return(t, rv);
 }
 
+/* The datagrams go to the driver as one transmit batch, so that the
+   device is notified once for the lot. */
+static sysreturn sendmmsg_udp(sock s, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    sysreturn rv = sendto_prepare(s, flags);
+    if (rv < 0)
+        return rv;
+    unsigned int i;
+    net_tx_batch_begin();
+    for (i = 0; i < vlen; i++) {
+        struct msghdr *msg = &msgvec[i].msg_hdr;
+        rv = socket_write_udp(s, msg->msg_iov, msg->msg_iovlen, msg->msg_name, msg->msg_namelen, flags);
+        if (rv < 0)
+            break;
+        msgvec[i].msg_len = rv;
+    }
+    net_tx_batch_end();
+    return i > 0 ? i : rv;
+}
+
 sysreturn sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
         int flags)
 {
@@ -1251,6 +1875,13 @@ sysreturn sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
 
     net_debug("sock %d, type %d, flags 0x%x, vlen %d\n", s->fd, s->type, flags,
             vlen);
+    if (!s->zerocopy)
+        flags &= ~MSG_ZEROCOPY;
+    if (s->type == SOCK_DGRAM)
+        return set_syscall_return(current, sendmmsg_udp(s, msgvec, vlen, flags));
+    /* each message is gathered into a buffer of its own */
+    if (flags & MSG_ZEROCOPY)
+        flags ^= MSG_ZEROCOPY | MSG_ZEROCOPY_COPIED;
     for (s->msg_count = 0; s->msg_count < vlen; s->msg_count++) {
         struct msghdr *msg_hdr = &msgvec[s->msg_count].msg_hdr;
 
@@ -1262,19 +1893,12 @@ sysreturn sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
             msgvec[s->msg_count].msg_len = 0;
             continue;
         }
-        switch (s->type) {
-        case SOCK_STREAM:
-            if (s->info.tcp.state != TCP_SOCK_OPEN) {
-                rv = -EPIPE;
-                break;
-            }
+        if (s->info.tcp.state != TCP_SOCK_OPEN) {
+            rv = -EPIPE;
+        } else {
             blockq_action ba = closure(s->h, sendmmsg_tcp_bh, s, current,
                     buf, len, flags, msgvec, vlen);
             rv = blockq_check(s->txbq, current, ba, false);
-            break;
-        case SOCK_DGRAM:
-            rv = socket_write_udp(s, buf, len);
-            break;
         }
         deallocate(s->h, buf, len);
         if (rv < 0) {
@@ -1305,32 +1929,181 @@ sysreturn recvfrom(int sockfd, void * buf, u64 len, int flags,
     return blockq_check(s->rxbq, current, ba, false);
 }
 
+/* Only MSG_ZEROCOPY completions are queued; reading the error queue
+   never blocks. */
+static sysreturn sock_recv_errqueue(sock s, struct msghdr *msg)
+{
+    if (!s->zerocopy_done)
+        return -EAGAIN;
+    struct {
+        struct cmsghdr h;
+        struct sock_extended_err ee;
+        struct sockaddr offender;
+    } c;
+    zero(&c, sizeof(c));
+    c.h.cmsg_len = sizeof(c);
+    c.h.cmsg_level = SOL_IP;
+    c.h.cmsg_type = IP_RECVERR;
+    c.ee.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+    c.ee.ee_code = s->zerocopy_copied ? SO_EE_CODE_ZEROCOPY_COPIED : 0;
+    c.ee.ee_info = s->zerocopy_lo;
+    c.ee.ee_data = s->zerocopy_hi;
+    s->zerocopy_done = false;
+    notify_sock(s);
+
+    msg->msg_flags = MSG_ERRQUEUE;
+    if (msg->msg_controllen < sizeof(c))
+        msg->msg_flags |= MSG_CTRUNC;
+    msg->msg_controllen = MIN(msg->msg_controllen, sizeof(c));
+    if (msg->msg_controllen)
+        runtime_memcpy(msg->msg_control, &c, msg->msg_controllen);
+    msg->msg_namelen = 0;
+    return 0;
+}
+
+/* receive one message straight into its iovecs */
+static u64 sock_recv_msg(sock s, struct msghdr *msg)
+{
+    void *p = queue_peek(s->incoming);
+    assert(p);
+    if (msg->msg_name)
+        sock_src_addr(s, p, msg->msg_name, &msg->msg_namelen);
+    u64 dgram_len = 0;
+    u64 len = sock_copy_to_iov(s, msg->msg_iov, msg->msg_iovlen, &dgram_len);
+    msg->msg_controllen = 0;
+    msg->msg_flags = (s->type == SOCK_DGRAM && dgram_len > len) ? MSG_TRUNC : 0;
+    if (s->type == SOCK_STREAM)
+        tcp_sock_rcvbuf_adjust(s, len);
+    return len;
+}
+
+closure_function(4, 1, sysreturn, recvmsg_bh,
+                 sock, s, thread, t, struct msghdr *, msg, int, flags,
+                 u64, bqflags)
+{
+    sock s = bound(s);
+    thread t = bound(t);
+    sysreturn rv;
+
+    if (bqflags & BLOCKQ_ACTION_NULLIFY) {
+        rv = -EINTR;
+        goto out;
+    }
+    err_t err = get_lwip_error(s);
+    if (err != ERR_OK) {
+        rv = lwip_to_errno(err);
+        goto out;
+    }
+    if (s->type == SOCK_STREAM && s->info.tcp.state != TCP_SOCK_OPEN) {
+        rv = -ENOTCONN;
+        goto out;
+    }
+    if (!queue_peek(s->incoming)) {
+        if (s->type == SOCK_STREAM && s->info.tcp.lw->state != ESTABLISHED) {
+            rv = 0;
+            goto out;
+        }
+        if ((s->f.flags & SOCK_NONBLOCK) || (bound(flags) & MSG_DONTWAIT)) {
+            rv = -EAGAIN;
+            goto out;
+        }
+        return BLOCKQ_BLOCK_REQUIRED;
+    }
+    rv = sock_recv_msg(s, bound(msg));
+  out:
+    net_debug("sock %d, rv %ld\n", s->fd, rv);
+    if (bqflags & BLOCKQ_ACTION_BLOCKED)
+        thread_wakeup(t);
+    closure_finish();
+    return set_syscall_return(t, rv);
+}
+
 sysreturn recvmsg(int sockfd, struct msghdr *msg, int flags)
 {
-    u64 total_len;
-    u8 *buf;
     sock s = resolve_socket(current->p, sockfd);
 
     net_debug("sock %d, type %d, thread %ld\n", s->fd, s->type, current->tid);
+    if (flags & MSG_ERRQUEUE)
+        return set_syscall_return(current, sock_recv_errqueue(s, msg));
     if ((s->type == SOCK_STREAM) && (s->info.tcp.state != TCP_SOCK_OPEN)) {
         return set_syscall_error(current, ENOTCONN);
     }
-    total_len = 0;
-    for (int i = 0; i < msg->msg_iovlen; i++) {
-        total_len += msg->msg_iov[i].iov_len;
+    if (s->type == SOCK_STREAM) {
+        u64 total_len = 0;
+        for (int i = 0; i < msg->msg_iovlen; i++)
+            total_len += msg->msg_iov[i].iov_len;
+        if (total_len == 0)
+            return 0;
     }
-    if (total_len == 0) {
-        return 0;
+    blockq_action ba = closure(s->h, recvmsg_bh, s, current, msg, flags);
+    return blockq_check(s->rxbq, current, ba, false);
+}
+
+/* Messages are taken as long as they are queued; once there are none,
+   block until vlen are received, unless MSG_WAITFORONE is given and
+   one was, or the timeout expires. */
+closure_function(6, 1, sysreturn, recvmmsg_bh,
+                 sock, s, thread, t, struct mmsghdr *, msgvec, unsigned int, vlen, int, flags, unsigned int, count,
+                 u64, bqflags)
+{
+    sock s = bound(s);
+    thread t = bound(t);
+    sysreturn rv = 0;
+
+    if (bqflags & BLOCKQ_ACTION_NULLIFY) {
+        rv = bound(count) > 0 ? bound(count) : -EINTR;
+        goto out;
     }
-    buf = allocate(s->h, total_len);
-    if (buf == INVALID_ADDRESS) {
-        return set_syscall_error(current, ENOMEM);
+
+    while (bound(count) < bound(vlen)) {
+        err_t err = get_lwip_error(s);
+        if (err != ERR_OK) {
+            rv = bound(count) > 0 ? bound(count) : lwip_to_errno(err);
+            goto out;
+        }
+        if (s->type == SOCK_STREAM && s->info.tcp.state != TCP_SOCK_OPEN) {
+            rv = bound(count) > 0 ? bound(count) : -ENOTCONN;
+            goto out;
+        }
+        if (!queue_peek(s->incoming)) {
+            if ((bound(count) > 0 && (bound(flags) & MSG_WAITFORONE)) ||
+                (bqflags & BLOCKQ_ACTION_TIMEDOUT) ||
+                (s->type == SOCK_STREAM && s->info.tcp.lw->state != ESTABLISHED))
+                break;
+            if ((s->f.flags & SOCK_NONBLOCK) || (bound(flags) & MSG_DONTWAIT)) {
+                rv = bound(count) > 0 ? bound(count) : -EAGAIN;
+                goto out;
+            }
+            return BLOCKQ_BLOCK_REQUIRED;
+        }
+        struct mmsghdr *m = &bound(msgvec)[bound(count)];
+        m->msg_len = sock_recv_msg(s, &m->msg_hdr);
+        bound(count)++;
     }
-    blockq_action ba = closure(s->h, recvmsg_bh, s, current, buf, total_len,
-            msg);
-    sysreturn rv = blockq_check(s->rxbq, current, ba, false);
-    recvmsg_complete_internal(s, msg, buf, total_len, false, current, rv);
-    return rv;
+    rv = bound(count);
+  out:
+    net_debug("sock %d, rv %ld\n", s->fd, rv);
+    if (bqflags & BLOCKQ_ACTION_BLOCKED)
+        thread_wakeup(t);
+    closure_finish();
+    return set_syscall_return(t, rv);
+}
+
+sysreturn recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+                   struct timespec *timeout)
+{
+    sock s = resolve_socket(current->p, sockfd);
+    net_debug("sock %d, type %d, thread %ld, vlen %d, flags 0x%x\n",
+              s->fd, s->type, current->tid, vlen, flags);
+    if (s->type == SOCK_STREAM && s->info.tcp.state != TCP_SOCK_OPEN)
+        return set_syscall_error(current, ENOTCONN);
+    if (vlen == 0)
+        return 0;
+    timestamp tmo = timeout ? time_from_timespec(timeout) : 0;
+    if (timeout && tmo == 0)
+        flags |= MSG_DONTWAIT;  /* an expired timeout; take what is queued */
+    blockq_action ba = closure(s->h, recvmmsg_bh, s, current, msgvec, vlen, flags, 0);
+    return blockq_check_timeout(s->rxbq, current, ba, false, CLOCK_ID_MONOTONIC, tmo, false);
 }
 
 static err_t accept_tcp_from_lwip(void * z, struct tcp_pcb * lw, err_t err)
@@ -1358,6 +2131,20 @@ static err_t accept_tcp_from_lwip(void * z, struct tcp_pcb * lw, err_t err)
     sock sn = vector_get(s->p->files, fd);
     sn->info.tcp.state = TCP_SOCK_OPEN;
     sn->fd = fd;
+
+    /* options are inherited from the listening socket */
+    sn->reuseaddr = s->reuseaddr;
+    sn->sndbuf = s->sndbuf;
+    sn->rcvbuf = s->rcvbuf;
+    sn->sndbuf_lock = s->sndbuf_lock;
+    sn->rcvbuf_lock = s->rcvbuf_lock;
+    sn->info.tcp.nodelay = s->info.tcp.nodelay;
+    sn->info.tcp.cork = s->info.tcp.cork;
+    sn->info.tcp.keepalive = s->info.tcp.keepalive;
+    sn->info.tcp.keep_idle = s->info.tcp.keep_idle;
+    sn->info.tcp.keep_intvl = s->info.tcp.keep_intvl;
+    sn->info.tcp.keep_cnt = s->info.tcp.keep_cnt;
+    tcp_sock_established(sn);
     set_lwip_error(s, ERR_OK);
     tcp_arg(lw, sn);
     tcp_recv(lw, tcp_input_lower);
@@ -1380,9 +2167,21 @@ sysreturn listen(int sockfd, int backlog)
     sock s = resolve_fd(current->p, sockfd);
     if (s->type != SOCK_STREAM)
 	return -EOPNOTSUPP;
-    backlog = MAX(backlog, SOCK_QUEUE_LEN);
+    /* lwIP keeps the backlog in a u8 */
+    backlog = MIN(MAX(backlog, 1), TCP_DEFAULT_LISTEN_BACKLOG);
     net_debug("sock %d, backlog %d\n", sockfd, backlog);
+
+    /* accepted connections wait in the incoming queue */
+    if (s->info.tcp.state != TCP_SOCK_LISTENING && backlog > SOCK_QUEUE_LEN) {
+        queue q = allocate_queue(s->h, backlog);
+        if (q == INVALID_ADDRESS)
+            return -ENOMEM;
+        deallocate_queue(s->incoming);
+        s->incoming = q;
+    }
     struct tcp_pcb * lw = tcp_listen_with_backlog(s->info.tcp.lw, backlog);
+    if (!lw)
+        return -ENOMEM;
     s->info.tcp.lw = lw;
     s->info.tcp.state = TCP_SOCK_LISTENING;
     set_lwip_error(s, ERR_OK);
@@ -1501,12 +2300,97 @@ sysreturn getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
     return 0;    
 }
 
+/* all supported options take an int */
+#define sockopt_int(__optval, __optlen) ({                      \
+    if (!(__optval) || (__optlen) < sizeof(int))                \
+        return -EINVAL;                                         \
+    *(int *)(__optval);})
+
 sysreturn setsockopt(int sockfd,
                      int level,
                      int optname,
                      void *optval,
                      socklen_t optlen)
 {
+    sock s = resolve_socket(current->p, sockfd);
+    net_debug("sock %d, type %d, level %d, optname %d, optlen %d\n",
+              s->fd, s->type, level, optname, optlen);
+    boolean flush = false;
+    int val;
+
+    switch (level) {
+    case SOL_SOCKET:
+        switch (optname) {
+        case SO_REUSEADDR:
+            s->reuseaddr = sockopt_int(optval, optlen) != 0;
+            break;
+        case SO_KEEPALIVE:
+            val = sockopt_int(optval, optlen);
+            if (s->type == SOCK_STREAM)
+                s->info.tcp.keepalive = val != 0;
+            break;
+        case SO_SNDBUF:
+            val = sockopt_int(optval, optlen);
+            s->sndbuf = MIN(MAX(val, SOCK_BUF_MIN), SOCK_SNDBUF_MAX);
+            s->sndbuf_lock = true;
+            break;
+        case SO_RCVBUF:
+            val = sockopt_int(optval, optlen);
+            s->rcvbuf = MIN(MAX(val, SOCK_BUF_MIN), SOCK_RCVBUF_MAX);
+            s->rcvbuf_lock = true;
+            break;
+        case SO_ZEROCOPY:
+            s->zerocopy = sockopt_int(optval, optlen) != 0;
+            break;
+        default:
+            goto unimplemented;
+        }
+        break;
+    case IPPROTO_TCP:
+        if (s->type != SOCK_STREAM)
+            return -ENOPROTOOPT;
+        switch (optname) {
+        case TCP_NODELAY:
+            /* pending data goes out right away, as on Linux */
+            s->info.tcp.nodelay = sockopt_int(optval, optlen) != 0;
+            flush = s->info.tcp.nodelay;
+            break;
+        case TCP_CORK:
+            val = sockopt_int(optval, optlen);
+            flush = s->info.tcp.cork && !val;
+            s->info.tcp.cork = val != 0;
+            break;
+        case TCP_KEEPIDLE:
+            val = sockopt_int(optval, optlen);
+            if (val < 1 || val > TCP_KEEPALIVE_MAX)
+                return -EINVAL;
+            s->info.tcp.keep_idle = val * THOUSAND;
+            break;
+        case TCP_KEEPINTVL:
+            val = sockopt_int(optval, optlen);
+            if (val < 1 || val > TCP_KEEPALIVE_MAX)
+                return -EINVAL;
+            s->info.tcp.keep_intvl = val * THOUSAND;
+            break;
+        case TCP_KEEPCNT:
+            val = sockopt_int(optval, optlen);
+            if (val < 1 || val > TCP_KEEPCNT_MAX)
+                return -EINVAL;
+            s->info.tcp.keep_cnt = val;
+            break;
+        default:
+            goto unimplemented;
+        }
+        break;
+    default:
+        goto unimplemented;
+    }
+
+    sock_apply_opts(s);
+    if (flush && s->info.tcp.state == TCP_SOCK_OPEN && s->info.tcp.lw)
+        tcp_output(s->info.tcp.lw);
+    return 0;
+  unimplemented:
     msg_warn("setsockopt unimplemented: fd %d, level %d, optname %d\n",
 	    sockfd, level, optname);
     return 0;
@@ -1522,24 +2406,59 @@ sysreturn getsockopt(int sockfd, int level, int optname, void *optval, socklen_t
         int val;
     } ret_optval;
 
-    /* Only socket options supported at the moment... */
-    if (level != 1)
-        return -EOPNOTSUPP;
-
-    switch (optname) {
-    case SO_TYPE:
-        ret_optval.val = s->type;
-        break;
-    case SO_ERROR:
-        ret_optval.val = -lwip_to_errno(get_and_clear_lwip_error(s));
+    switch (level) {
+    case SOL_SOCKET:
+        switch (optname) {
+        case SO_TYPE:
+            ret_optval.val = s->type;
+            break;
+        case SO_ERROR:
+            ret_optval.val = -lwip_to_errno(get_and_clear_lwip_error(s));
+            break;
+        case SO_REUSEADDR:
+            ret_optval.val = s->reuseaddr;
+            break;
+        case SO_KEEPALIVE:
+            ret_optval.val = s->type == SOCK_STREAM && s->info.tcp.keepalive;
+            break;
+        case SO_SNDBUF:
+            ret_optval.val = s->sndbuf;
+            break;
+        case SO_RCVBUF:
+            ret_optval.val = s->rcvbuf;
+            break;
+        case SO_ZEROCOPY:
+            ret_optval.val = s->zerocopy;
+            break;
+        default:
+            goto unimplemented;
+        }
         break;
-    case SO_SNDBUF:
-        ret_optval.val = 2048;  /* minimum value for this option in Linux */
+    case IPPROTO_TCP:
+        if (s->type != SOCK_STREAM)
+            return -ENOPROTOOPT;
+        switch (optname) {
+        case TCP_NODELAY:
+            ret_optval.val = s->info.tcp.nodelay;
+            break;
+        case TCP_CORK:
+            ret_optval.val = s->info.tcp.cork;
+            break;
+        case TCP_KEEPIDLE:
+            ret_optval.val = s->info.tcp.keep_idle / THOUSAND;
+            break;
+        case TCP_KEEPINTVL:
+            ret_optval.val = s->info.tcp.keep_intvl / THOUSAND;
+            break;
+        case TCP_KEEPCNT:
+            ret_optval.val = s->info.tcp.keep_cnt;
+            break;
+        default:
+            goto unimplemented;
+        }
         break;
     default:
-        msg_err("getsockopt unimplemented optname: fd %d, level %d, optname %d\n",
-            sockfd, level, optname);
-        return -ENOPROTOOPT;
+        return -EOPNOTSUPP;
     }
 
     if (optval && optlen) {
@@ -1549,6 +2468,10 @@ sysreturn getsockopt(int sockfd, int level, int optname, void *optval, socklen_t
     }
 
     return 0;
+  unimplemented:
+    msg_err("getsockopt unimplemented optname: fd %d, level %d, optname %d\n",
+            sockfd, level, optname);
+    return -ENOPROTOOPT;
 }
 
 void register_net_syscalls(struct syscall *map)
@@ -1564,6 +2487,7 @@ void register_net_syscalls(struct syscall *map)
     register_syscall(map, sendmmsg, sendmmsg);
     register_syscall(map, recvfrom, recvfrom);
     register_syscall(map, recvmsg, recvmsg);
+    register_syscall(map, recvmmsg, recvmmsg);
     register_syscall(map, setsockopt, setsockopt);
     register_syscall(map, getsockname, getsockname);
     register_syscall(map, getpeername, getpeername);
@@ -1571,13 +2495,33 @@ void register_net_syscalls(struct syscall *map)
     register_syscall(map, shutdown, shutdown);
 }
 
-boolean netsyscall_init(unix_heaps uh)
+static u32 tcp_buf_max_option(tuple root, symbol name, u32 max)
+{
+    u64 v;
+    value o = table_find(root, name);
+    if (!o)
+        return max;
+    if (!u64_from_value(o, &v) || v < SOCK_BUF_MIN) {
+        msg_err("invalid %b; using %d\n", symbol_string(name), max);
+        return max;
+    }
+    return MIN(v, max);
+}
+
+boolean netsyscall_init(unix_heaps uh, tuple root)
 {
     kernel_heaps kh = (kernel_heaps)uh;
+    tcp_sndbuf_max = tcp_buf_max_option(root, sym(tcp_sndbuf_max), SOCK_SNDBUF_MAX);
+    tcp_rcvbuf_max = tcp_buf_max_option(root, sym(tcp_rcvbuf_max), SOCK_RCVBUF_MAX);
     heap socket_cache = allocate_objcache(heap_general(kh), heap_backed(kh),
 					  sizeof(struct sock), PAGESIZE);
     if (socket_cache == INVALID_ADDRESS)
 	return false;
     uh->socket_cache = socket_cache;
+    heap udp_entry_cache = allocate_objcache(heap_general(kh), heap_backed(kh),
+                                             sizeof(struct udp_entry), PAGESIZE);
+    if (udp_entry_cache == INVALID_ADDRESS)
+        return false;
+    uh->udp_entry_cache = udp_entry_cache;
     return true;
 }
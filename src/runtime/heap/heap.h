@@ -29,6 +29,11 @@ boolean objcache_validate(heap h);
 heap objcache_from_object(u64 obj, bytes parent_pagesize);
 heap allocate_mcache(heap meta, heap parent, int min_order, int max_order, bytes pagesize);
 
+/* mcache heaps keep per-cpu magazines of free objects, indexed by the
+   value returned from cpu_id; until it is set, all use those of cpu 0 */
+#define MCACHE_MAX_CPUS 16
+void mcache_set_cpu_id(u32 (*cpu_id)(void));
+
 // really internals
 
 static inline void *page_of(void *x, bytes pagesize)
@@ -4,24 +4,102 @@
    object sizes. Object sizes are specified on heap creation. Allocations
    are made from the cache of the smallest object size equal to or greater
    than the alloc size.
+
+   Each cpu keeps a magazine of recently freed objects per size class,
+   from which allocations are served first. Empty magazines are
+   refilled, and full ones spilled, half a magazine at a time to or
+   from the underlying objcache.
 */
 
 //#define MCACHE_DEBUG
 
 #include <runtime.h>
 
+/* magazines are sized to hold up to MAGAZINE_BYTES of objects, up to
+   MAGAZINE_MAX_OBJS; classes too large for even one go straight to
+   the objcache */
+#define MAGAZINE_BYTES          (64 * KB)
+#define MAGAZINE_MAX_OBJS       64
+
+typedef struct magazine {
+    u32 count;
+    u32 capacity;
+    u64 *objs;
+} *magazine;
+
 typedef struct mcache {
     struct heap h;
     heap parent;
     heap meta;
     vector caches;
     u64 pagesize;
+    int min_order;
+    int max_order;
+    magazine cpus[MCACHE_MAX_CPUS]; /* per-cpu magazines, by size class */
+    u64 cpu_bytes;
 } *mcache;
 
+static u32 (*mcache_cpu_id)(void);
+
+void mcache_set_cpu_id(u32 (*cpu_id)(void))
+{
+    mcache_cpu_id = cpu_id;
+}
+
+static inline int mcache_class(mcache m, bytes b)
+{
+    int order = find_order(b);
+    return order < m->min_order ? 0 : order - m->min_order;
+}
+
+static inline u64 mcache_magazine_capacity(int order)
+{
+    return MIN(MAGAZINE_BYTES >> order, MAGAZINE_MAX_OBJS);
+}
+
+static magazine mcache_cpu_magazines(mcache m)
+{
+    u32 cpu = mcache_cpu_id ? mcache_cpu_id() : 0;
+    assert(cpu < MCACHE_MAX_CPUS);
+    magazine mags = m->cpus[cpu];
+    if (mags)
+        return mags;
+
+    /* the magazine headers are followed by their object slots */
+    int nclasses = m->max_order - m->min_order + 1;
+    mags = allocate(m->meta, m->cpu_bytes);
+    if (mags == INVALID_ADDRESS)
+        return 0;
+    u64 *slots = (u64 *)(mags + nclasses);
+    for (int i = 0; i < nclasses; i++) {
+        mags[i].count = 0;
+        mags[i].capacity = mcache_magazine_capacity(m->min_order + i);
+        mags[i].objs = slots;
+        slots += mags[i].capacity;
+    }
+    m->cpus[cpu] = mags;
+    return mags;
+}
+
+static void magazine_refill(magazine mag, heap o)
+{
+    while (mag->count < mag->capacity / 2) {
+        u64 a = allocate_u64(o, o->pagesize);
+        if (a == INVALID_PHYSICAL)
+            break;
+        mag->objs[mag->count++] = a;
+    }
+}
+
+static void magazine_spill(magazine mag, heap o, u32 keep)
+{
+    while (mag->count > keep)
+        deallocate_u64(o, mag->objs[--mag->count], o->pagesize);
+}
+
 u64 mcache_alloc(heap h, bytes b)
 {
     mcache m = (mcache)h;
-    heap o;
 #ifdef MCACHE_DEBUG
     console("mcache_alloc:   heap ");
     print_u64(u64_from_pointer(h));
@@ -29,38 +107,47 @@ u64 mcache_alloc(heap h, bytes b)
     print_u64(b);
     console(": ");
 #endif
-    /* Could become a binary search if search set is large... */
-    vector_foreach(m->caches, o) {
-	if (o && b <= o->pagesize) {
+    int class = mcache_class(m, b);
+    heap o = class < vector_length(m->caches) ? vector_get(m->caches, class) : 0;
+    if (!o) {
 #ifdef MCACHE_DEBUG
-	    console("match cache ");
-	    print_u64(u64_from_pointer(o));
-	    console(" obj size ");
-	    print_u64(o->pagesize);
-	    console(", pre validate...");
-	    if (objcache_validate((heap)o))
-		console("pass, alloc ");
-	    else
-		halt("failed!\n");
+        console("no matching cache; fail\n");
 #endif
-	    u64 a = allocate_u64(o, o->pagesize);
-	    if (a != INVALID_PHYSICAL)
-		h->allocated += o->pagesize;
+        return INVALID_PHYSICAL;
+    }
 #ifdef MCACHE_DEBUG
-	    print_u64(a);
-	    console(", post validate...");
-	    if (objcache_validate((heap)o))
-		console("pass\n");
-	    else
-		halt("failed!\n");
+    console("match cache ");
+    print_u64(u64_from_pointer(o));
+    console(" obj size ");
+    print_u64(o->pagesize);
+    console(", pre validate...");
+    if (objcache_validate((heap)o))
+        console("pass, alloc ");
+    else
+        halt("failed!\n");
 #endif
-	    return a;
-	}
+
+    u64 a;
+    magazine mags = mcache_cpu_magazines(m);
+    magazine mag = mags ? &mags[class] : 0;
+    if (mag && mag->capacity > 0) {
+        if (mag->count == 0)
+            magazine_refill(mag, o);
+        a = mag->count > 0 ? mag->objs[--mag->count] : INVALID_PHYSICAL;
+    } else {
+        a = allocate_u64(o, o->pagesize);
     }
+    if (a != INVALID_PHYSICAL)
+        h->allocated += o->pagesize;
 #ifdef MCACHE_DEBUG
-    console("no matching cache; fail\n");
+    print_u64(a);
+    console(", post validate...");
+    if (objcache_validate((heap)o))
+        console("pass\n");
+    else
+        halt("failed!\n");
 #endif
-    return INVALID_PHYSICAL;
+    return a;
 }
 
 void mcache_dealloc(heap h, u64 a, bytes b)
@@ -110,7 +197,15 @@ void mcache_dealloc(heap h, u64 a, bytes b)
 
     assert(h->allocated >= o->pagesize);
     h->allocated -= o->pagesize;
-    deallocate(o, a, o->pagesize);
+    magazine mags = mcache_cpu_magazines(m);
+    magazine mag = mags ? &mags[mcache_class(m, o->pagesize)] : 0;
+    if (mag && mag->capacity > 0) {
+        if (mag->count == mag->capacity)
+            magazine_spill(mag, o, mag->capacity / 2);
+        mag->objs[mag->count++] = a;
+    } else {
+        deallocate(o, a, o->pagesize);
+    }
 #ifdef MCACHE_DEBUG
     console(", post validate...");
     if (objcache_validate((heap)o))
@@ -129,6 +224,10 @@ void destroy_mcache(heap h)
 #endif
     mcache m = (mcache)h;
     heap o;
+    for (int cpu = 0; cpu < MCACHE_MAX_CPUS; cpu++) {
+        if (m->cpus[cpu])
+            deallocate(m->meta, m->cpus[cpu], m->cpu_bytes);
+    }
     vector_foreach(m->caches, o) {
 	if (o)
 	    o->destroy(o);
@@ -174,6 +273,13 @@ heap allocate_mcache(heap meta, heap parent, int min_order, int max_order, bytes
     m->parent = parent;
     m->caches = allocate_vector(meta, 1);
     m->pagesize = pagesize;
+    m->min_order = min_order;
+    m->max_order = max_order;
+    m->cpu_bytes = (max_order - min_order + 1) * sizeof(struct magazine);
+    for (int order = min_order; order <= max_order; order++)
+        m->cpu_bytes += mcache_magazine_capacity(order) * sizeof(u64);
+    for (int cpu = 0; cpu < MCACHE_MAX_CPUS; cpu++)
+        m->cpus[cpu] = 0;
 
     for(int i=0, order = min_order; order <= max_order; i++, order++) {
 	u64 obj_size = U64_FROM_BIT(order);
@@ -1,24 +1,211 @@
 #include <runtime.h>
 
+static inline void rmnode_replace_child(rangemap rm, rmnode parent, rmnode old, rmnode new)
+{
+    if (!parent)
+        rm->root = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+static void rmnode_rotate_left(rangemap rm, rmnode x)
+{
+    rmnode y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    rmnode_replace_child(rm, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+static void rmnode_rotate_right(rangemap rm, rmnode x)
+{
+    rmnode y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    rmnode_replace_child(rm, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+static inline boolean rmnode_is_red(rmnode n)
+{
+    return n && n->red;
+}
+
+static void rangemap_insert_fixup(rangemap rm, rmnode n)
+{
+    rmnode p;
+    while ((p = n->parent) && p->red) {
+        rmnode g = p->parent;   /* red parent is never the root */
+        if (p == g->left) {
+            rmnode u = g->right;
+            if (rmnode_is_red(u)) {
+                p->red = u->red = false;
+                g->red = true;
+                n = g;
+                continue;
+            }
+            if (n == p->right) {
+                rmnode_rotate_left(rm, p);
+                n = p;
+                p = n->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rmnode_rotate_right(rm, g);
+        } else {
+            rmnode u = g->left;
+            if (rmnode_is_red(u)) {
+                p->red = u->red = false;
+                g->red = true;
+                n = g;
+                continue;
+            }
+            if (n == p->left) {
+                rmnode_rotate_right(rm, p);
+                n = p;
+                p = n->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rmnode_rotate_left(rm, g);
+        }
+    }
+    rm->root->red = false;
+}
+
 boolean rangemap_insert(rangemap rm, rmnode n)
 {
-    list_foreach(&rm->root, l) {
-        rmnode curr = struct_from_list(l, rmnode, l);
+    /* The in-order neighbors of the insertion point both lie on the
+       search path, so checking each visited node catches any overlap. */
+    rmnode parent = 0;
+    rmnode *link = &rm->root;
+    while (*link) {
+        rmnode curr = *link;
         range i = range_intersection(curr->r, n->r);
         if (range_span(i)) {
             /* XXX bark for now until we know we have all potential cases handled... */
             msg_warn("attempt to insert %p (%R) but overlap with %p (%R)\n", n, n->r, curr, curr->r);
             return false;
         }
-        if (curr->r.start > n->r.start) {
-            list_insert_before(l, &n->l);
-            return true;
-        }
+        parent = curr;
+        link = n->r.start < curr->r.start ? &curr->left : &curr->right;
     }
-    list_insert_before(&rm->root, &n->l);
+    n->parent = parent;
+    n->left = n->right = 0;
+    n->red = true;
+    *link = n;
+    rangemap_insert_fixup(rm, n);
     return true;
 }
 
+static void rangemap_remove_fixup(rangemap rm, rmnode x, rmnode xp)
+{
+    while (x != rm->root && !rmnode_is_red(x)) {
+        if (x == xp->left) {
+            rmnode w = xp->right;
+            if (w->red) {
+                w->red = false;
+                xp->red = true;
+                rmnode_rotate_left(rm, xp);
+                w = xp->right;
+            }
+            if (!rmnode_is_red(w->left) && !rmnode_is_red(w->right)) {
+                w->red = true;
+                x = xp;
+                xp = x->parent;
+                continue;
+            }
+            if (!rmnode_is_red(w->right)) {
+                w->left->red = false;
+                w->red = true;
+                rmnode_rotate_right(rm, w);
+                w = xp->right;
+            }
+            w->red = xp->red;
+            xp->red = false;
+            w->right->red = false;
+            rmnode_rotate_left(rm, xp);
+        } else {
+            rmnode w = xp->left;
+            if (w->red) {
+                w->red = false;
+                xp->red = true;
+                rmnode_rotate_right(rm, xp);
+                w = xp->left;
+            }
+            if (!rmnode_is_red(w->left) && !rmnode_is_red(w->right)) {
+                w->red = true;
+                x = xp;
+                xp = x->parent;
+                continue;
+            }
+            if (!rmnode_is_red(w->left)) {
+                w->right->red = false;
+                w->red = true;
+                rmnode_rotate_left(rm, w);
+                w = xp->left;
+            }
+            w->red = xp->red;
+            xp->red = false;
+            w->left->red = false;
+            rmnode_rotate_right(rm, xp);
+        }
+        x = rm->root;
+        break;
+    }
+    if (x)
+        x->red = false;
+}
+
+void rangemap_remove_node(rangemap rm, rmnode z)
+{
+    rmnode x, xp;
+    boolean removed_red;
+
+    if (!z->left || !z->right) {
+        x = z->left ? z->left : z->right;
+        xp = z->parent;
+        removed_red = z->red;
+        rmnode_replace_child(rm, z->parent, z, x);
+        if (x)
+            x->parent = xp;
+    } else {
+        /* splice in the successor, which has no left child */
+        rmnode y = z->right;
+        while (y->left)
+            y = y->left;
+        removed_red = y->red;
+        x = y->right;
+        if (y->parent == z) {
+            xp = y;
+        } else {
+            xp = y->parent;
+            xp->left = x;
+            if (x)
+                x->parent = xp;
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        rmnode_replace_child(rm, z->parent, z, y);
+        y->parent = z->parent;
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+
+    if (!removed_red)
+        rangemap_remove_fixup(rm, x, xp);
+    z->parent = z->left = z->right = 0;
+}
+
 boolean rangemap_reinsert(rangemap rm, rmnode n, range k)
 {
     rangemap_remove_node(rm, n);
@@ -26,19 +213,61 @@ boolean rangemap_reinsert(rangemap rm, rmnode n, range k)
     return rangemap_insert(rm, n);
 }
 
+rmnode rangemap_first_node(rangemap rm)
+{
+    rmnode n = rm->root;
+    if (!n)
+        return INVALID_ADDRESS;
+    while (n->left)
+        n = n->left;
+    return n;
+}
+
+rmnode rangemap_next_node(rangemap rm, rmnode n)
+{
+    if (n->right) {
+        n = n->right;
+        while (n->left)
+            n = n->left;
+        return n;
+    }
+    rmnode p = n->parent;
+    while (p && n == p->right) {
+        n = p;
+        p = p->parent;
+    }
+    return p ? p : INVALID_ADDRESS;
+}
+
+rmnode rangemap_prev_node(rangemap rm, rmnode n)
+{
+    if (n->left) {
+        n = n->left;
+        while (n->right)
+            n = n->right;
+        return n;
+    }
+    rmnode p = n->parent;
+    while (p && n == p->left) {
+        n = p;
+        p = p->parent;
+    }
+    return p ? p : INVALID_ADDRESS;
+}
+
 boolean rangemap_remove_range(rangemap rm, range k)
 {
     boolean match = false;
-    list l = list_get_next(&rm->root);
+    rmnode curr = rangemap_lookup_at_or_next(rm, k.start);
 
-    while (l && l != &rm->root) {
-        rmnode curr = struct_from_list(l, rmnode, l);
-        list next = list_get_next(l);
+    /* trims leave a node's position unchanged, so no reinsert is needed */
+    while (curr != INVALID_ADDRESS && curr->r.start < k.end) {
+        rmnode next = rangemap_next_node(rm, curr);
         range i = range_intersection(curr->r, k);
 
         /* no intersection */
         if (range_empty(i)) {
-            l = next;
+            curr = next;
             continue;
         }
 
@@ -47,7 +276,7 @@ boolean rangemap_remove_range(rangemap rm, range k)
         /* complete overlap (delete) */
         if (range_equal(curr->r, i)) {
             rangemap_remove_node(rm, curr);
-            l = next;
+            curr = next;
             continue;
         }
 
@@ -67,14 +296,14 @@ boolean rangemap_remove_range(rangemap rm, range k)
                 rn->r.end = curr->r.end;
                 rn->value = curr->value; /* XXX this is perhaps most dubious */
                 msg_warn("unexpected hole trim: curr %R, key %R\n", curr->r, k);
-                list_insert_after(l, &rn->l);
+                rangemap_insert(rm, rn);
 #endif
             }
             curr->r.end = i.start;
         } else if (curr->r.end > i.end) { /* head trim */
             curr->r.start = i.end;
         }
-        l = next;               /* valid even if we inserted one */
+        curr = next;
     }
 
     return match;
@@ -82,9 +311,13 @@ boolean rangemap_remove_range(rangemap rm, range k)
 
 rmnode rangemap_lookup(rangemap rm, u64 point)
 {
-    list_foreach(&rm->root, i) {
-        rmnode curr = struct_from_list(i, rmnode, l);
-        if (point_in_range(curr->r, point))
+    rmnode curr = rm->root;
+    while (curr) {
+        if (point < curr->r.start)
+            curr = curr->left;
+        else if (point >= curr->r.end)
+            curr = curr->right;
+        else
             return curr;
     }
     return INVALID_ADDRESS;
@@ -93,21 +326,31 @@ rmnode rangemap_lookup(rangemap rm, u64 point)
 /* return either an exact match or the neighbor to the right */
 rmnode rangemap_lookup_at_or_next(rangemap rm, u64 point)
 {
-    list_foreach(&rm->root, i) {
-        rmnode curr = struct_from_list(i, rmnode, l);
-        if (point_in_range(curr->r, point) ||
-            curr->r.start > point)
+    rmnode curr = rm->root;
+    rmnode next = INVALID_ADDRESS;
+    while (curr) {
+        if (point_in_range(curr->r, point))
             return curr;
+        if (curr->r.start > point) {
+            next = curr;
+            curr = curr->left;
+        } else {
+            curr = curr->right;
+        }
     }
-    return INVALID_ADDRESS;
+    return next;
 }
 
-/* can be called with rh == 0 for true/false match */
+/* can be called with rh == 0 for true/false match
+
+   The handler may trim, reinsert or remove the node it is given, and
+   may insert new nodes adjacent to it; such new nodes are not visited. */
 boolean rangemap_range_lookup(rangemap rm, range q, rmnode_handler nh)
 {
     boolean match = false;
-    list_foreach(&rm->root, i) {
-        rmnode curr = struct_from_list(i, rmnode, l);
+    rmnode curr = rangemap_lookup_at_or_next(rm, q.start);
+    while (curr != INVALID_ADDRESS && curr->r.start < q.end) {
+        rmnode next = rangemap_next_node(rm, curr);
         range i = range_intersection(curr->r, q);
 
         if (!range_empty(i)) {
@@ -116,6 +359,7 @@ boolean rangemap_range_lookup(rangemap rm, range q, rmnode_handler nh)
                 return true;
             apply(nh, curr);
         }
+        curr = next;
     }
     return match;
 }
@@ -124,15 +368,17 @@ boolean rangemap_range_find_gaps(rangemap rm, range q, range_handler rh)
 {
     boolean match = false;
     u64 lastedge = q.start;
-    list_foreach(&rm->root, l) {
-        rmnode curr = struct_from_list(l, rmnode, l);
+    rmnode curr = rangemap_lookup_at_or_next(rm, q.start);
+    while (curr != INVALID_ADDRESS && curr->r.start < q.end) {
+        rmnode next = rangemap_next_node(rm, curr);
         u64 edge = curr->r.start;
         range i = range_intersection(irange(lastedge, edge), q);
+        lastedge = curr->r.end;
         if (range_span(i)) {
             match = true;
             apply(rh, i);
         }
-        lastedge = curr->r.end;
+        curr = next;
     }
 
     /* check for a gap between the last node and q.end */
@@ -147,13 +393,13 @@ boolean rangemap_range_find_gaps(rangemap rm, range q, range_handler rh)
 rangemap allocate_rangemap(heap h)
 {
     rangemap rm = allocate(h, sizeof(struct rangemap));
+    if (rm == INVALID_ADDRESS)
+        return rm;
     rm->h = h;
-    list_init(&rm->root);
+    rm->root = 0;
     return rm;
 }
 
 void deallocate_rangemap(rangemap r)
 {
 }
-
-
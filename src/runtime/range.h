@@ -1,7 +1,13 @@
 #pragma once
+/* A rangemap is a set of non-overlapping ranges, kept as a red-black
+   tree ordered by range start. Nodes are embedded in the caller's
+   objects and must not be modified while inserted, save for trims
+   that retain the node's position relative to its neighbors. */
+typedef struct rmnode *rmnode;
+
 typedef struct rangemap {
     heap h;
-    struct list root;
+    rmnode root;
 } *rangemap;
 
 // [start, end)
@@ -9,10 +15,13 @@ typedef struct range {
     u64 start, end;
 } range;
 
-typedef struct rmnode {
+struct rmnode {
     range r;
-    struct list l;
-} *rmnode;
+    rmnode parent;
+    rmnode left;
+    rmnode right;
+    boolean red;
+};
 
 #define irange(__s, __e)  (range){__s, __e}        
 #define point_in_range(__r, __p) ((__p >= __r.start) && (__p < __r.end))
@@ -24,10 +33,14 @@ typedef closure_type(range_handler, void, range);
 boolean rangemap_insert(rangemap rm, rmnode n);
 boolean rangemap_reinsert(rangemap rm, rmnode n, range k);
 boolean rangemap_remove_range(rangemap rm, range r);
+void rangemap_remove_node(rangemap rm, rmnode n);
 rmnode rangemap_lookup(rangemap rm, u64 point);
 rmnode rangemap_lookup_at_or_next(rangemap rm, u64 point);
 boolean rangemap_range_lookup(rangemap rm, range q, rmnode_handler nh);
 boolean rangemap_range_find_gaps(rangemap rm, range q, range_handler rh);
+rmnode rangemap_first_node(rangemap rm);
+rmnode rangemap_prev_node(rangemap rm, rmnode n);
+rmnode rangemap_next_node(rangemap rm, rmnode n);
 rangemap allocate_rangemap(heap h);
 void deallocate_rangemap(rangemap rm);
 
@@ -44,34 +57,8 @@ static inline void rmnode_set_range(rmnode n, range r)
 static inline void rmnode_init(rmnode n, range r)
 {
     rmnode_set_range(n, r);
-    list_init(&n->l);
-}
-
-static inline rmnode rangemap_prev_node(rangemap rm, rmnode n)
-{
-    if (n->l.prev == &rm->root)
-        return INVALID_ADDRESS;
-    return struct_from_list(n->l.prev, rmnode, l);
-}
-
-static inline rmnode rangemap_next_node(rangemap rm, rmnode n)
-{
-    if (n->l.next == &rm->root)
-        return INVALID_ADDRESS;
-    return struct_from_list(n->l.next, rmnode, l);
-}
-
-static inline rmnode rangemap_first_node(rangemap rm)
-{
-    if (rm->root.next == &rm->root)
-        return INVALID_ADDRESS;
-    else
-        return struct_from_list(rm->root.next, rmnode, l);
-}
-
-static inline void rangemap_remove_node(rangemap rm, rmnode n)
-{
-    list_delete(&n->l);
+    n->parent = n->left = n->right = 0;
+    n->red = false;
 }
 
 static inline range range_intersection(range a, range b)
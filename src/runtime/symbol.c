@@ -38,6 +38,13 @@ symbol intern(string name)
     halt("intern: alloc fail\n");
 }
 
+/* the symbol for name if it has been interned, else 0 */
+symbol symbol_find(string name)
+{
+    symbol s = table_find(symbols, name);
+    return s ? valueof(s) : 0;
+}
+
 string symbol_string(symbol s)
 {
     return s->s;
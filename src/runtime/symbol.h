@@ -3,6 +3,7 @@ extern void init_symbols(heap h, heap init);
 typedef struct symbol *symbol;
 symbol intern(buffer);
 symbol intern_u64(u64);
+symbol symbol_find(buffer);
 
 string symbol_string(symbol s);
 
@@ -6,9 +6,33 @@
 #define timer_debug(x, ...)
 #endif
 
+#define LEVEL_SHIFT(l) ((l) * TIMER_WHEEL_SLOT_ORDER)
+#define SLOT_MASK      MASK(TIMER_WHEEL_SLOT_ORDER)
+#define WHEEL_REACH    (1ull << LEVEL_SHIFT(TIMER_WHEEL_LEVELS))
+
+/* Level 0 holds timers expiring within TIMER_WHEEL_SLOTS ticks of the
+   current one, a slot per tick. Each slot of a higher level l spans
+   2^(l * TIMER_WHEEL_SLOT_ORDER) ticks; its timers are redistributed
+   to the levels below as the current tick enters that span. */
+struct timerqueue {
+    heap h;
+    u64 tick;                   /* current tick; level 0 slot may hold unexpired timers */
+    struct list wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    pqueue far;                 /* timers beyond reach of the wheel */
+};
+
 // should pass a timer around
-static pqueue timers;
-static heap theap;
+static timerqueue timers;
+
+static inline u64 timer_tick(timestamp t)
+{
+    return t >> TIMER_WHEEL_TICK_ORDER;
+}
+
+static inline struct list *wheel_slot(timerqueue tq, int level, u64 tick)
+{
+    return &tq->wheel[level][(tick >> LEVEL_SHIFT(level)) & SLOT_MASK];
+}
 
 /* The lower time expiry is the higher priority. */
 static boolean timer_compare(void *za, void *zb)
@@ -19,59 +43,237 @@ static boolean timer_compare(void *za, void *zb)
 define_closure_function(1, 0, void, timer_free,
                         timer, t)
 {
-    deallocate(theap, bound(t), sizeof(struct timer));
+    timer t = bound(t);
+    deallocate(t->h, t, sizeof(struct timer));
 }
 
-timer register_timer(clock_id id, timestamp val, boolean absolute, timestamp interval, timer_handler n)
+static boolean timerqueue_wheel_insert(timerqueue tq, timer t)
+{
+    u64 e = timer_tick(timer_expiry(t));
+    if (e < tq->tick)
+        e = tq->tick;           /* already due */
+    u64 d = e - tq->tick;
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        if (d < (1ull << LEVEL_SHIFT(l + 1))) {
+            list_push_back(wheel_slot(tq, l, e), &t->l);
+            t->queued = TIMER_QUEUED_WHEEL;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void timerqueue_insert(timerqueue tq, timer t)
+{
+    if (!timerqueue_wheel_insert(tq, t)) {
+        t->queued = TIMER_QUEUED_HEAP;
+        pqueue_insert(tq->far, t);
+    }
+}
+
+timer timerqueue_register(timerqueue tq, clock_id id, timestamp expiry, timestamp interval,
+                          timer_handler n)
 {
-    timer t = allocate(theap, sizeof(struct timer));
+    timer t = allocate(tq->h, sizeof(struct timer));
     if (t == INVALID_ADDRESS) {
         msg_err("failed to allocate timer\n");
         return INVALID_ADDRESS;
     }
 
+    t->h = tq->h;
     t->id = id;
-    t->expiry = absolute ? val : now(id) + val;
+    t->expiry = expiry;
     t->interval = interval;
     t->disabled = false;
     t->t = n;
 
     init_refcount(&t->refcount, 1, init_closure(&t->free, timer_free, t));
-    pqueue_insert(timers, t);
+    timerqueue_insert(tq, t);
     timer_debug("register timer: %p, expiry %T, interval %T, handler %p\n", t, t->expiry, interval, n);
     return t;
 }
 
-timestamp timer_check(void)
+timer register_timer(clock_id id, timestamp val, boolean absolute, timestamp interval, timer_handler n)
+{
+    return timerqueue_register(timers, id, absolute ? val : now(id) + val, interval, n);
+}
+
+/* Cancellation is immediate for timers on the wheel. Those in the far
+   heap are dropped when they reach its head, and a timer that is
+   firing is released once its handler returns. */
+void remove_timer(timer t, timestamp *remain)
+{
+    assert(!t->disabled);
+    t->disabled = true;
+    if (remain) {
+        timestamp x = timer_expiry(t);
+        timestamp n = now(t->id);
+        *remain = x > n ? x - n : 0;
+    }
+    if (t->queued == TIMER_QUEUED_WHEEL) {
+        list_delete(&t->l);
+        t->queued = TIMER_QUEUED_NONE;
+        refcount_release(&t->refcount);
+    }
+}
+
+static void timerqueue_fire(timerqueue tq, timer t, timestamp here)
+{
+    t->queued = TIMER_QUEUED_NONE;
+    if (!t->disabled) {
+        s64 delta = here - timer_expiry(t);
+        if (t->interval) {
+            u64 overruns = delta > t->interval ? delta / t->interval + 1 : 1;
+            apply(t->t, overruns);
+            if (!t->disabled) {
+                t->expiry += t->interval * overruns;
+                timerqueue_insert(tq, t);
+                return;
+            }
+        } else {
+            apply(t->t, 1);
+        }
+    }
+    refcount_release(&t->refcount);
+}
+
+/* Run the timers in the current slot that have expired. Handlers may
+   add timers which are already due, so repeat until none remain. */
+static void timerqueue_run_slot(timerqueue tq, timestamp here)
+{
+    struct list *slot = wheel_slot(tq, 0, tq->tick);
+    struct list due;
+    do {
+        list_init(&due);
+        list_foreach(slot, l) {
+            if (timer_expiry(struct_from_list(l, timer, l)) <= here) {
+                list_delete(l);
+                list_push_back(&due, l);
+            }
+        }
+        list l;
+        while ((l = list_get_next(&due))) {
+            list_delete(l);
+            timerqueue_fire(tq, struct_from_list(l, timer, l), here);
+        }
+    } while (!list_empty(&due));
+}
+
+static void timerqueue_cascade(timerqueue tq, int level)
+{
+    struct list *slot = wheel_slot(tq, level, tq->tick);
+    list l;
+    while ((l = list_get_next(slot))) {
+        list_delete(l);
+        boolean inserted = timerqueue_wheel_insert(tq, struct_from_list(l, timer, l));
+        assert(inserted);
+    }
+}
+
+/* The next tick beyond the current one at which a level 0 slot is
+   occupied or an occupied slot of a higher level cascades, or
+   infinity if the wheel is empty. */
+static u64 timerqueue_next_tick(timerqueue tq)
+{
+    u64 next = infinity;
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        u64 cur = tq->tick >> LEVEL_SHIFT(l);
+        for (int i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+            if (!list_empty(&tq->wheel[l][(cur + i) & SLOT_MASK])) {
+                next = MIN(next, (cur + i) << LEVEL_SHIFT(l));
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+timestamp timerqueue_check(timerqueue tq, timestamp here)
 {
+    u64 here_tick = timer_tick(here);
     timer t;
-    s64 delta;
-    timestamp here = now(CLOCK_ID_MONOTONIC);
-
-    while ((t = pqueue_peek(timers)) && (delta = here - timer_expiry(t), delta >= 0)) {
-        pqueue_pop(timers);
-        if (!t->disabled) {
-            if (t->interval) {
-                u64 overruns = delta > t->interval ? delta / t->interval + 1 : 1;
-                apply(t->t, overruns);
-                if (!t->disabled) {
-                    t->expiry += t->interval * overruns;
-                    pqueue_insert(timers, t);
-                    continue;
-                }
-            } else {
-                apply(t->t, 1);
+
+    /* bring far timers within reach of the wheel, or at least of the
+       current slot if they have already expired */
+    while ((t = pqueue_peek(tq->far))) {
+        u64 e = timer_tick(timer_expiry(t));
+        if (!t->disabled && e >= tq->tick + WHEEL_REACH && e > here_tick)
+            break;
+        pqueue_pop(tq->far);
+        t->queued = TIMER_QUEUED_NONE;
+        if (t->disabled) {
+            refcount_release(&t->refcount);
+        } else if (!timerqueue_wheel_insert(tq, t)) {
+            list_push_back(wheel_slot(tq, 0, tq->tick), &t->l);
+            t->queued = TIMER_QUEUED_WHEEL;
+        }
+    }
+
+    timerqueue_run_slot(tq, here);
+    while (tq->tick < here_tick) {
+        u64 next = timerqueue_next_tick(tq);
+        if (next > here_tick) {
+            tq->tick = here_tick;
+            break;
+        }
+        tq->tick = next;
+        for (int l = TIMER_WHEEL_LEVELS - 1; l > 0; l--) {
+            if ((next & MASK(LEVEL_SHIFT(l))) == 0)
+                timerqueue_cascade(tq, l);
+        }
+        timerqueue_run_slot(tq, here);
+    }
+
+    /* The next expiry is the earliest in the first occupied level 0
+       slot, unless a higher level cascades before then; timers there
+       may have been placed relative to an earlier tick. */
+    timestamp next = infinity;
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        struct list *slot = wheel_slot(tq, 0, tq->tick + i);
+        list_foreach(slot, l)
+            next = MIN(next, timer_expiry(struct_from_list(l, timer, l)));
+        if (next != infinity)
+            break;
+    }
+    for (int l = 1; l < TIMER_WHEEL_LEVELS; l++) {
+        u64 cur = tq->tick >> LEVEL_SHIFT(l);
+        for (int i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+            if (!list_empty(&tq->wheel[l][(cur + i) & SLOT_MASK])) {
+                next = MIN(next, ((cur + i) << LEVEL_SHIFT(l)) << TIMER_WHEEL_TICK_ORDER);
+                break;
             }
         }
-        refcount_release(&t->refcount);
     }
+    if ((t = pqueue_peek(tq->far)))
+        next = MIN(next, timer_expiry(t));
+    if (next == infinity)
+        return infinity;
+    timestamp dt = next > here ? next - here : 0;
+    timer_debug("check returning dt: %d\n", dt);
+    return dt;
+}
+
+timestamp timer_check(void)
+{
+    return timerqueue_check(timers, now(CLOCK_ID_MONOTONIC));
+}
 
-    if (t) {
-    	timestamp dt = timer_expiry(t) - here;
-    	timer_debug("check returning dt: %d\n", dt);
-    	return dt;
+timerqueue allocate_timerqueue(heap h)
+{
+    timerqueue tq = allocate(h, sizeof(struct timerqueue));
+    if (tq == INVALID_ADDRESS)
+        return tq;
+    tq->h = h;
+    tq->tick = 0;
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; l++)
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+            list_init(&tq->wheel[l][i]);
+    tq->far = allocate_pqueue(h, timer_compare);
+    if (tq->far == INVALID_ADDRESS) {
+        deallocate(h, tq, sizeof(struct timerqueue));
+        return INVALID_ADDRESS;
     }
-    return infinity;
+    return tq;
 }
 
 void print_timestamp(string b, timestamp t)
@@ -96,8 +298,7 @@ void print_timestamp(string b, timestamp t)
 
 void initialize_timers(kernel_heaps kh)
 {
-    heap h = heap_general(kh);
     assert(!timers);
-    timers = allocate_pqueue(h, timer_compare);
-    theap = h;
+    timers = allocate_timerqueue(heap_general(kh));
+    assert(timers != INVALID_ADDRESS);
 }
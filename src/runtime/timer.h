@@ -7,15 +7,41 @@ declare_closure_struct(1, 0, void, timer_free,
                        timer, t);
 
 struct timer {
+    heap h;
     clock_id id;
     timestamp expiry;
     timestamp interval;
     boolean disabled;
+    u8 queued;                  /* TIMER_QUEUED_* */
+    struct list l;              /* wheel slot */
     timer_handler t;
     struct refcount refcount;
     closure_struct(timer_free, free);
 };
 
+#define TIMER_QUEUED_NONE  0    /* firing or released */
+#define TIMER_QUEUED_WHEEL 1
+#define TIMER_QUEUED_HEAP  2
+
+/* Pending timers are kept in a hierarchical timing wheel of
+   TIMER_WHEEL_LEVELS levels of 2^TIMER_WHEEL_SLOT_ORDER slots each,
+   with a tick of 2^TIMER_WHEEL_TICK_ORDER timestamp units (just under
+   a millisecond). Insertion and removal are constant time. Timers
+   expiring beyond the reach of the wheel (about 4.6 hours) wait in a
+   pqueue until they come within range. */
+#define TIMER_WHEEL_TICK_ORDER 22
+#define TIMER_WHEEL_SLOT_ORDER 6
+#define TIMER_WHEEL_SLOTS      (1 << TIMER_WHEEL_SLOT_ORDER)
+#define TIMER_WHEEL_LEVELS     4
+
+typedef struct timerqueue *timerqueue;
+
+timerqueue allocate_timerqueue(heap h);
+timer timerqueue_register(timerqueue tq, clock_id id, timestamp expiry, timestamp interval,
+                          timer_handler n);
+/* run expired timers and return the time until the next may expire */
+timestamp timerqueue_check(timerqueue tq, timestamp here);
+
 typedef closure_type(clock_timer, void, timestamp);
 
 extern clock_timer platform_timer;
@@ -66,16 +92,7 @@ static inline void timer_get_remaining(timer t, timestamp *remain, timestamp *in
 }
 
 /* returns time remaining or 0 if elapsed */
-static inline void remove_timer(timer t, timestamp *remain)
-{
-    assert(!t->disabled);
-    t->disabled = true;
-    if (remain) {
-        timestamp x = timer_expiry(t);
-        timestamp n = now(t->id);
-        *remain = x > n ? x - n : 0;
-    }
-}
+void remove_timer(timer t, timestamp *remain);
 
 void initialize_timers(kernel_heaps kh);
 void print_timestamp(buffer, timestamp);
@@ -212,6 +212,35 @@ void encode_tuple(buffer dest, table dictionary, tuple t)
     }        
 }
 
+/* immediate, leaving out entries rejected by the filter; tuples which
+   are already in the dictionary are encoded by reference */
+void encode_tuple_filtered(buffer dest, table dictionary, tuple t, tuple_filter f)
+{
+    u64 count = 0;
+    table_foreach(t, n, v) {
+        if (apply(f, n, v))
+            count++;
+    }
+    push_header(dest, immediate, type_tuple, count);
+    srecord(dictionary, t);
+    table_foreach(t, n, v) {
+        if (!apply(f, n, v))
+            continue;
+        encode_symbol(dest, dictionary, n);
+        if (!v || tagof(v) != tag_tuple) {
+            encode_value(dest, dictionary, v);
+            continue;
+        }
+        u64 d = u64_from_pointer(table_find(dictionary, v));
+        if (d) {
+            push_header(dest, reference, type_tuple, 0);
+            push_varint(dest, d);
+        } else {
+            encode_tuple_filtered(dest, dictionary, (tuple)v, f);
+        }
+    }
+}
+
 void init_tuples(heap h)
 {
     theap = h;
@@ -14,6 +14,9 @@ static inline void deallocate_tuple(tuple t)
 
 void encode_tuple(buffer dest, table dictionary, tuple t);
 
+typedef closure_type(tuple_filter, boolean, symbol, value);
+void encode_tuple_filtered(buffer dest, table dictionary, tuple t, tuple_filter f);
+
 
 // h is for the bodies, the space for symbols and tuples are both implicit
 void *decode_value(heap h, tuple dictionary, buffer source);
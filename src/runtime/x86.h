@@ -9,3 +9,22 @@ static inline word fetch_and_add(word* variable, word value)
                      );
     return value;
 }
+
+static inline int compare_and_swap_32(u32 *p, u32 old, u32 new)
+{
+    u32 prev;
+    asm volatile("lock; cmpxchgl %2, %1"
+                 : "=a" (prev), "+m" (*p)
+                 : "r" (new), "0" (old)
+                 : "memory");
+    return prev == old;
+}
+
+static inline u32 atomic_swap_32(u32 *p, u32 new)
+{
+    asm volatile("xchgl %0, %1"
+                 : "+r" (new), "+m" (*p)
+                 :
+                 : "memory");
+    return new;
+}
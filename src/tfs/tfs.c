@@ -26,7 +26,8 @@ static inline void report_sha256(buffer b)
 struct fsfile {
     rangemap extentmap;
     filesystem fs;
-    u64 length;
+    u64 length;                 /* visible, may run ahead of the log */
+    u64 logged_length;          /* last filelength written to the log */
     tuple md;
 };
 
@@ -37,7 +38,16 @@ u64 fsfile_get_length(fsfile f)
 
 void fsfile_set_length(fsfile f, u64 length)
 {
-    f->length = length;
+    f->length = f->logged_length = length;
+}
+
+/* Extend the file ahead of its data being written, as for a write
+   held in the page cache. The new length is logged once data up to
+   it has reached storage. */
+void fsfile_extend_length(fsfile f, u64 length)
+{
+    if (length > f->length)
+        f->length = length;
 }
 
 /* range_from_rmnode for file extent range */
@@ -265,6 +275,20 @@ static void filesystem_read_internal(filesystem fs, fsfile f, buffer b, u64 leng
     apply(k, STATUS_OK);
 }
 
+void fsfile_read(fsfile f, void *dest, u64 length, u64 offset, io_status_handler io_complete)
+{
+    filesystem fs = f->fs;
+    tfs_debug("fsfile_read: f %p, dest %p, length %ld, offset %ld, completion %p\n",
+              f, dest, length, offset, io_complete);
+
+    /* b->end will accumulate the read extent and hole lengths, thus
+       effectively handing a read length to the completion. */
+    buffer b = wrap_buffer(fs->h, dest, length);
+    b->end = b->start;
+    status_handler sh = closure(fs->h, filesystem_read_complete, fs->h, io_complete, b);
+    filesystem_read_internal(fs, f, b, length, offset, sh);
+}
+
 void filesystem_read(filesystem fs, tuple t, void *dest, u64 length, u64 offset,
                      io_status_handler io_complete)
 {
@@ -276,13 +300,7 @@ void filesystem_read(filesystem fs, tuple t, void *dest, u64 length, u64 offset,
         apply(io_complete, e, 0);
         return;
     }
-
-    /* b->end will accumulate the read extent and hole lengths, thus
-       effectively handing a read length to the completion. */
-    buffer b = wrap_buffer(fs->h, dest, length);
-    b->end = b->start;
-    status_handler sh = closure(fs->h, filesystem_read_complete, fs->h, io_complete, b);
-    filesystem_read_internal(fs, f, b, length, offset, sh);
+    fsfile_read(f, dest, length, offset, io_complete);
 }
 
 closure_function(3, 1, void, read_entire_complete,
@@ -603,10 +621,13 @@ closure_function(5, 1, void, filesystem_write_data_complete,
         return;
     }
 
-    if (fsfile_get_length(f) < q.end) {
+    /* Data written past the visible length (e.g. pending a truncate,
+       or padding to a sector) doesn't extend the file. */
+    u64 end = MIN(q.end, fsfile_get_length(f));
+    if (f->logged_length < end) {
         /* XXX bother updating resident filelength tuple? */
-        fsfile_set_length(f, q.end);
-        filesystem_write_eav(fs, bound(t), sym(filelength), value_from_u64(fs->h, q.end), apply_merge(bound(m_meta)));
+        f->logged_length = end;
+        filesystem_write_eav(fs, bound(t), sym(filelength), value_from_u64(fs->h, end), apply_merge(bound(m_meta)));
     }
 
     filesystem_flush_log(fs);
@@ -643,19 +664,15 @@ closure_function(5, 1, void, filesystem_write_data_complete,
 */
 
 /* XXX This needs to additionally block if a log flush is in flight. */
-void filesystem_write(filesystem fs, tuple t, buffer b, u64 offset, io_status_handler ish)
+void fsfile_write(fsfile f, buffer b, u64 offset, io_status_handler ish)
 {
+    filesystem fs = f->fs;
+    tuple t = f->md;
     u64 len = buffer_length(b);
     range q = irange(offset, offset + len);
     u64 curr = offset;
 
-    fsfile f;
-    if (!(f = table_find(fs->files, t))) {
-        apply(ish, timm("result", "no such file %t", t), 0);
-        return;
-    }
-
-    tfs_debug("filesystem_write: tuple %p, buffer %p, q %R\n", t, b, q);
+    tfs_debug("fsfile_write: tuple %p, buffer %p, q %R\n", t, b, q);
 
     rmnode node = rangemap_lookup_at_or_next(f->extentmap, q.start);
 
@@ -717,6 +734,17 @@ void filesystem_write(filesystem fs, tuple t, buffer b, u64 offset, io_status_ha
     return;
 }
 
+void filesystem_write(filesystem fs, tuple t, buffer b, u64 offset, io_status_handler ish)
+{
+    fsfile f;
+    if (!(f = table_find(fs->files, t))) {
+        apply(ish, timm("result", "no such file %t", t), 0);
+        return;
+    }
+    fsfile_extend_length(f, offset + buffer_length(b));
+    fsfile_write(f, b, offset, ish);
+}
+
 boolean filesystem_truncate(filesystem fs, fsfile f, u64 len,
         status_handler completion)
 {
@@ -732,10 +760,11 @@ boolean filesystem_truncate(filesystem fs, fsfile f, u64 len,
 
 boolean filesystem_flush(filesystem fs, tuple t, status_handler completion)
 {
-    /* A write() call returns after everything is sent to disk, so nothing to
-     * do here. The only work that might be pending is when directory entries
-     * are modified, see do_mkentry(); to deal with that, flush the filesystem
-     * log.
+    /* File data held in the page cache must be written back by the
+     * caller first; completed data writes have already logged any change
+     * in file length. The only work that might be pending is when
+     * directory entries are modified, see do_mkentry(); to deal with
+     * that, flush the filesystem log.
      */
     return log_flush_complete(fs->tl, completion);
 }
@@ -746,7 +775,7 @@ fsfile allocate_fsfile(filesystem fs, tuple md)
     f->extentmap = allocate_rangemap(fs->h);
     f->fs = fs;
     f->md = md;
-    f->length = 0;
+    f->length = f->logged_length = 0;
     table_set(fs->files, f->md, f);
     return f;
 }
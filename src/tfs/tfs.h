@@ -23,13 +23,16 @@ void create_filesystem(heap h,
 
 // there is a question as to whether tuple->fs file should be mapped inside out outside the filesystem
 // status
-void filesystem_read(filesystem fs, tuple t, void *dest, u64 offset, u64 length, io_status_handler completion);
+void filesystem_read(filesystem fs, tuple t, void *dest, u64 length, u64 offset, io_status_handler completion);
 void filesystem_write(filesystem fs, tuple t, buffer b, u64 offset, io_status_handler completion);
+void fsfile_read(fsfile f, void *dest, u64 length, u64 offset, io_status_handler completion);
+void fsfile_write(fsfile f, buffer b, u64 offset, io_status_handler completion);
 boolean filesystem_truncate(filesystem fs, fsfile f, u64 len,
         status_handler completion);
 boolean filesystem_flush(filesystem fs, tuple t, status_handler completion);
 u64 fsfile_get_length(fsfile f);
 void fsfile_set_length(fsfile f, u64);
+void fsfile_extend_length(fsfile f, u64);
 fsfile fsfile_from_node(filesystem fs, tuple n);
 fsfile file_lookup(filesystem fs, vector v);
 void filesystem_read_entire(filesystem fs, tuple t, heap bufheap, buffer_handler c, status_handler s);
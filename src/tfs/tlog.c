@@ -1,4 +1,7 @@
 #include <tfs_internal.h>
+#ifdef STAGE3
+#include <x86_64.h>
+#endif
 
 //#define TLOG_DEBUG
 #ifdef TLOG_DEBUG
@@ -10,166 +13,441 @@
 #define END_OF_LOG 1
 #define TUPLE_AVAILABLE 2
 #define END_OF_SEGMENT 3
+#define LOG_EXTENSION_LINK 4
+
+/* room for an extension link (two varints) and END_OF_LOG */
+#define LOG_SEGMENT_RESERVE 32
+
+/* A log is a chain of segments, starting with the one at offset 0 and
+   linked together by LOG_EXTENSION_LINK frames which give the byte
+   offset and size of the next segment. Only the tail segment is
+   appended to; a segment which has been linked away from but whose
+   tail hasn't been written yet is kept on the retired list. */
+typedef struct log_segment {
+    u64 offset;                 /* bytes */
+    u64 size;
+    buffer staging;
+    u64 flushed;                /* staging bytes which are on disk */
+} *log_segment;
 
 typedef struct log {
     filesystem fs;
-    u64 remainder;
-    buffer staging;
+    log_segment current;
+    vector segments;            /* the chain, head first */
+    vector retired;
+    buffer frame;
     vector completions;
     table dictionary;
-    u64 offset;
+    u64 appended;               /* bytes logged since the last compaction */
+    u64 compacted;              /* size of the last compacted image */
+    vector superseded;          /* old chain, until the head links past it */
+    boolean flushing;
+    boolean compacting;
     int dirty;              /* cas boolean */
     heap h;
 } *log;
 
-closure_function(1, 1, void, log_write_completion,
-                 vector, v,
-                 status, s)
+static log_segment log_segment_create(log tl, u64 offset, u64 size)
 {
-    // reclaim the buffer now and the vector...make it a whole thing
-    status_handler i;
-    int len = vector_length(bound(v));
-    for (int count = 0; count < len; count++) {
-        i = vector_delete(bound(v), 0);
-        apply(i, s);
-    }
-    closure_finish();
+    log_segment seg = allocate(tl->h, sizeof(struct log_segment));
+    assert(seg != INVALID_ADDRESS);
+    seg->offset = offset;
+    seg->size = size;
+    seg->staging = allocate_buffer(tl->h, size);
+    assert(seg->staging != INVALID_ADDRESS);
+    seg->flushed = 0;
+    return seg;
 }
 
-// xxx  currently we cant take writes during the flush
+static void log_segment_release_staging(log_segment seg)
+{
+    if (seg->staging) {
+        deallocate_buffer(seg->staging);
+        seg->staging = 0;
+    }
+}
 
 /* XXX it's not right to just stick SECTOR_{SIZE,OFFSET} everywhere...
    and add block_log2 to fs */
-range log_block_range(log tl, u64 length)
+static range log_block_range(log tl, u64 offset, u64 length)
 {
-    return irange(tl->offset >> SECTOR_OFFSET,
-                  (tl->offset + pad(length, tl->fs->blocksize)) >> SECTOR_OFFSET);
+    return irange(offset >> SECTOR_OFFSET,
+                  (offset + pad(length, tl->fs->blocksize)) >> SECTOR_OFFSET);
+}
+
+closure_function(4, 1, void, log_segment_written,
+                 log_segment, seg, u64, start, buffer, b, status_handler, sh,
+                 status, s)
+{
+    /* written again from the same point with the next flush */
+    if (!is_ok(s))
+        bound(seg)->flushed = MIN(bound(seg)->flushed, bound(start));
+    deallocate_buffer(bound(b));
+    apply(bound(sh), s);
+    closure_finish();
+}
+
+/* Write the part of the segment which isn't on disk yet, starting from
+   the block containing the first unwritten byte. The write goes out
+   from a copy, as appends to the staging buffer carry on meanwhile,
+   and the END_OF_LOG which terminates the tail is only in the copy. */
+static void log_segment_write(log tl, log_segment seg, boolean end_of_log, status_handler sh)
+{
+    buffer staging = seg->staging;
+    u64 start = seg->flushed & ~(tl->fs->blocksize - 1);
+    u64 end = buffer_length(staging);
+    u64 length = end - start + (end_of_log ? 1 : 0);
+    u64 padded = pad(length, tl->fs->blocksize);
+    tlog_debug("log_segment_write: seg offset 0x%lx, staging [0x%lx, 0x%lx)\n",
+               seg->offset, start, end);
+    buffer b = allocate_buffer(tl->h, padded);
+    assert(b != INVALID_ADDRESS);
+    buffer_write(b, buffer_ref(staging, start), end - start);
+    if (end_of_log)
+        push_u8(b, END_OF_LOG);
+    zero(buffer_ref(b, length), padded - length);
+    seg->flushed = end;
+    apply(tl->fs->w, buffer_ref(b, 0), log_block_range(tl, seg->offset + start, length),
+          closure(tl->h, log_segment_written, seg, start, b, sh));
+}
+
+static void log_compact_schedule(log tl);
+#ifdef STAGE3
+static void log_compact_link(log tl, vector completions);
+#endif
+
+/* The tail is written first and retired segments after it, newest
+   first, so that every link on disk points to a segment which has
+   already been written. A segment which fails to be written is kept
+   for the next flush. */
+closure_function(3, 1, void, log_write_completion,
+                 log, tl, status_handler, done, log_segment, seg,
+                 status, s)
+{
+    log tl = bound(tl);
+    log_segment seg = bound(seg);
+    if (seg) {
+        if (is_ok(s))
+            log_segment_release_staging(seg);
+        else
+            vector_push(tl->retired, seg);
+    }
+    if (is_ok(s) && vector_length(tl->retired) > 0) {
+        bound(seg) = vector_pop(tl->retired);
+        log_segment_write(tl, bound(seg), false, (status_handler)closure_self());
+        return;
+    }
+    apply(bound(done), s);
+    closure_finish();
+}
+
+closure_function(2, 1, void, log_flush_done,
+                 log, tl, vector, completions,
+                 status, s)
+{
+    log tl = bound(tl);
+
+    // reclaim the buffer now and the vector...make it a whole thing
+    status_handler i;
+    vector_foreach(bound(completions), i)
+        apply(i, s);
+    deallocate_vector(bound(completions));
+    tl->flushing = false;
+    closure_finish();
+
+    if (tl->dirty)
+        log_flush(tl);
+    else
+        log_compact_schedule(tl);
 }
 
-/* XXX we're just writing the whole log - instead write only from
-   block of buffer start forward */
 void log_flush(log tl)
 {
+    /* picked up again once the write or compaction in flight is done */
+    if (tl->flushing || tl->compacting)
+        return;
+
     if (!__sync_bool_compare_and_swap(&tl->dirty, 1, 0))
         return;
 
     tlog_debug("log_flush: log %p dirty\n", tl);
-    buffer b = tl->staging;
-    push_u8(b, END_OF_LOG);
+    vector completions = tl->completions;
+    tl->completions = allocate_vector(tl->h, 10);
+#ifdef STAGE3
+    if (tl->superseded) {
+        log_compact_link(tl, completions);
+        return;
+    }
+#endif
+    tl->flushing = true;
+
 #ifdef TLOG_DEBUG
-    u64 z = tl->staging->end;
-    tl->staging->start = 0;
-    tl->staging->end = 1024;
+    buffer b = tl->current->staging;
+    u64 z = b->end;
+    b->end = MIN(z, 1024);
     rprintf("staging contains:\n%X\n", b);
-    tl->staging->end = z;
+    b->end = z;
 #endif
-
-    void * buf = b->contents;
-    u64 length = b->end;
-    range r = log_block_range(tl, length);
-    apply(tl->fs->w, buf, r, closure(tl->h, log_write_completion, tl->completions));
-    b->end -= 1;                /* next write removes END_OF_LOG */
-//    rprintf("was %d now %d\n", b->start, b->end);
-//    b->start = b->end;          /* pick up next write here */
+    status_handler done = closure(tl->h, log_flush_done, tl, completions);
+    log_segment_write(tl, tl->current, true, closure(tl->h, log_write_completion, tl, done, 0));
 }
 
 boolean log_flush_complete(log tl, status_handler completion)
 {
-    if (!tl->dirty) {
+    if (!tl->dirty && !tl->flushing && !tl->compacting) {
         return true;
     }
     vector_push(tl->completions, completion);
+    tl->dirty = true;
     log_flush(tl);
     return false;
 }
 
-void log_write_eav(log tl, tuple e, symbol a, value v, status_handler sh)
+/* Link the tail to a new segment large enough to take a frame of the
+   given length; the old tail is written out with the next flush. */
+static void log_extend(log tl, u64 length)
 {
-    tlog_debug("log_write_eav: tl %p, e %p (%t), a \"%b\", v %v\n", tl, e, e, symbol_string(a), v);
-    /* XXX make log extendable */
-    if (tl->staging->end > INITIAL_LOG_SIZE - 32)
+#ifndef BOOT
+    u64 size = MAX(INITIAL_LOG_SIZE, pad(length + LOG_SEGMENT_RESERVE, tl->fs->blocksize));
+    u64 offset = allocate_u64(tl->fs->storage, size);
+    if (offset == INVALID_PHYSICAL)
         halt("log full\n");
-    push_u8(tl->staging, TUPLE_AVAILABLE);
-    encode_eav(tl->staging, tl->dictionary, e, a, v);
+    tlog_debug("log_extend: new segment at 0x%lx, size 0x%lx\n", offset, size);
+    log_segment old = tl->current;
+    push_u8(old->staging, LOG_EXTENSION_LINK);
+    push_varint(old->staging, offset);
+    push_varint(old->staging, size);
+    vector_push(tl->retired, old);
+    tl->current = log_segment_create(tl, offset, size);
+    vector_push(tl->segments, tl->current);
+#else
+    halt("log full\n");
+#endif
+}
+
+static void log_append_frame(log tl, status_handler sh)
+{
+    buffer f = tl->frame;
+    u64 length = buffer_length(f);
+    if (buffer_length(tl->current->staging) + length + LOG_SEGMENT_RESERVE > tl->current->size)
+        log_extend(tl, length);
+    buffer_write(tl->current->staging, buffer_ref(f, 0), length);
+    buffer_clear(f);
+    tl->appended += length;
     vector_push(tl->completions, sh);
     tl->dirty = true;
 }
 
+void log_write_eav(log tl, tuple e, symbol a, value v, status_handler sh)
+{
+    tlog_debug("log_write_eav: tl %p, e %p (%t), a \"%b\", v %v\n", tl, e, e, symbol_string(a), v);
+    push_u8(tl->frame, TUPLE_AVAILABLE);
+    encode_eav(tl->frame, tl->dictionary, e, a, v);
+    log_append_frame(tl, sh);
+}
+
 void log_write(log tl, tuple t, status_handler sh)
 {
     tlog_debug("log_write: tl %p, t %p (%t)\n", tl, t, t);
-    if (tl->staging->end > INITIAL_LOG_SIZE - 32)
-        halt("log full\n");
-    push_u8(tl->staging, TUPLE_AVAILABLE);
+    push_u8(tl->frame, TUPLE_AVAILABLE);
     // this should be incremental on root!
-    encode_tuple(tl->staging, tl->dictionary, t);
-    vector_push(tl->completions, sh);
-    tl->dirty = true;
+    encode_tuple(tl->frame, tl->dictionary, t);
+    log_append_frame(tl, sh);
 }
 
-closure_function(2, 1, void, log_read_complete,
-                 log, tl, status_handler, sh,
+#ifdef STAGE3
+/* Compaction replaces the chain with a fresh one holding a single image
+   of the persistent part of the tree, then points the head block at
+   it. Appends made in the meantime go to the new chain and are flushed
+   once the head has been switched. */
+
+/* Only tuples already in the log are persistent; "." and ".." are
+   restored by fixup_directory. */
+closure_function(1, 2, boolean, log_compact_filter,
+                 table, dictionary,
+                 symbol, a, value, v)
+{
+    if (a == sym_this(".") || a == sym_this(".."))
+        return false;
+    return !v || tagof(v) != tag_tuple || table_find(bound(dictionary), v);
+}
+
+/* Failing either write leaves the head leading to the old chain, in
+   which case the status goes to those waiting on the flush and the
+   link is tried again with the next one. */
+static void log_compact_failed(log tl, vector completions, status s)
+{
+    msg_err("log compaction failed: %v\n", s);
+    status_handler i;
+    vector_foreach(completions, i)
+        apply(i, s);
+    deallocate_vector(completions);
+    tl->compacting = false;
+    if (tl->dirty)
+        log_flush(tl);
+}
+
+closure_function(2, 1, void, log_compact_linked,
+                 log, tl, vector, completions,
                  status, s)
 {
     log tl = bound(tl);
-    status_handler sh = bound(sh);
-    buffer b = tl->staging;
-    u8 frame = 0;
+    vector completions = bound(completions);
+    closure_finish();
+    if (!is_ok(s)) {
+        log_compact_failed(tl, completions, s);
+        return;
+    }
 
-    tlog_debug("log_read_complete: buffer len %d, status %v\n", buffer_length(b), s);
+    log_segment seg;
+    vector_foreach(tl->superseded, seg) {
+        log_segment_release_staging(seg);
+        if (seg->offset == 0)   /* head stays in place */
+            continue;
+        deallocate_u64(tl->fs->storage, seg->offset, seg->size);
+        deallocate(tl->h, seg, sizeof(struct log_segment));
+    }
+    deallocate_vector(tl->superseded);
+    tl->superseded = 0;
+    tlog_debug("log compaction complete, image size 0x%lx\n", tl->compacted);
+
+    status_handler i;
+    vector_foreach(completions, i)
+        apply(i, s);
+    deallocate_vector(completions);
+    tl->compacting = false;
+    log_flush(tl);
+}
+
+closure_function(2, 1, void, log_compact_written,
+                 log, tl, vector, completions,
+                 status, s)
+{
+    log tl = bound(tl);
+    vector completions = bound(completions);
+    closure_finish();
     if (!is_ok(s)) {
-        apply(sh, s);
-        closure_finish();
+        log_compact_failed(tl, completions, s);
         return;
     }
 
-    /* this is crap, but just fix for now due to time */
+    log_segment head = vector_get(tl->segments, 0);
+    log_segment image = vector_get(tl->segments, 1);
+    buffer b = allocate_buffer(tl->h, tl->fs->blocksize);
+    assert(b != INVALID_ADDRESS);
+    push_u8(b, LOG_EXTENSION_LINK);
+    push_varint(b, image->offset);
+    push_varint(b, image->size);
+    log_segment_release_staging(head);
+    head->staging = b;
+    head->flushed = 0;
+    log_segment_write(tl, head, false, closure(tl->h, log_compact_linked, tl, completions));
+}
 
-    // log extension - length at the beginnin and pointer at the end
-    for (; frame = pop_u8(b), frame == TUPLE_AVAILABLE || frame == END_OF_SEGMENT;) {
-        if (frame == END_OF_SEGMENT) {
-            tlog_debug("-> segment boundary\n");
+/* Write out the new chain and then point the head at it. */
+static void log_compact_link(log tl, vector completions)
+{
+    tl->compacting = true;
+    status_handler done = closure(tl->h, log_compact_written, tl, completions);
+    log_segment_write(tl, tl->current, true, closure(tl->h, log_write_completion, tl, done, 0));
+}
+
+closure_function(1, 0, void, log_compact,
+                 log, tl)
+{
+    log tl = bound(tl);
+    closure_finish();
+
+    table olddict = tl->dictionary;
+    table newdict = allocate_table(tl->h, identity_key, pointer_equal);
+    buffer image = tl->frame;
+    push_u8(image, TUPLE_AVAILABLE);
+    tuple_filter f = closure(tl->h, log_compact_filter, olddict);
+    encode_tuple_filtered(image, newdict, tl->fs->root, f);
+    deallocate_closure(f);
+    u64 length = buffer_length(image);
+
+    u64 size = pad(length + LOG_SEGMENT_RESERVE, tl->fs->blocksize) + INITIAL_LOG_SIZE;
+    u64 offset = allocate_u64(tl->fs->storage, size);
+    if (offset == INVALID_PHYSICAL) {
+        msg_err("log compaction: no space for image of %ld bytes\n", length);
+        buffer_clear(image);
+        deallocate_table(newdict);
+        tl->compacting = false;
+        log_flush(tl);
+        return;
+    }
+    tlog_debug("log_compact: image size 0x%lx at 0x%lx\n", length, offset);
+
+    /* retired tails are covered by the image and never written */
+    log_segment seg;
+    vector_foreach(tl->retired, seg)
+        log_segment_release_staging(seg);
+    vector_clear(tl->retired);
+
+    tl->superseded = tl->segments;
+    tl->segments = allocate_vector(tl->h, 8);
+    vector_push(tl->segments, vector_get(tl->superseded, 0));
+    tl->current = log_segment_create(tl, offset, size);
+    vector_push(tl->segments, tl->current);
+    buffer_write(tl->current->staging, buffer_ref(image, 0), length);
+    buffer_clear(image);
+    deallocate_table(olddict);
+    tl->dictionary = newdict;
+    tl->appended = tl->compacted = length;
+
+    /* the flush links the new chain, along with anything appended */
+    tl->compacting = false;
+    tl->dirty = true;
+    log_flush(tl);
+}
+#endif
+
+static void log_compact_schedule(log tl)
+{
+#ifdef STAGE3
+    if (tl->compacting || tl->appended <= MAX(INITIAL_LOG_SIZE, 2 * tl->compacted))
+        return;
+    tlog_debug("scheduling compaction: appended 0x%lx, compacted 0x%lx\n",
+               tl->appended, tl->compacted);
+    tl->compacting = true;
+    enqueue_grow(&runqueue, closure(tl->h, log_compact, tl));
+#endif
+}
+
+static void log_read_finish(log tl)
+{
+    /* Files may be nested anywhere in a tuple, so look for them among
+       everything that was decoded rather than just top-level frames. */
+    table_foreach(tl->dictionary, k, v) {
+        (void) k;
+        if (tagof(v) != tag_tuple)
             continue;
-        }
-        tuple dv = decode_value(tl->h, tl->dictionary, b);
-        tlog_debug("   decoded %p\n", dv);
-        if (tagof(dv) != tag_tuple)
+        tuple t = (tuple)v;
+        value extents = table_find(t, sym(extents));
+        if (!extents)
             continue;
 
-        fsfile f = 0;
-        u64 filelength = infinity;
-        tuple t = (tuple)dv;
-
-        table_foreach(t, k, v) {
-            if (k == sym(extents)) {
-                tlog_debug("extents: %p\n", v);
-                /* don't know why this needs to be in fs, it's really tlog-specific */
-                if (!(f = table_find(tl->fs->extents, v))) {
-                    f = allocate_fsfile(tl->fs, t);
-                    table_set(tl->fs->extents, v, f);
-                    tlog_debug("   created fsfile %p\n", f);
-                } else {
-                    tlog_debug("   found fsfile %p\n", f);
-                }
-            } else if (k == sym(filelength)) {
-                assert(u64_from_value(v, &filelength));
-            }
+        tlog_debug("extents: %p\n", extents);
+        fsfile f;
+        /* don't know why this needs to be in fs, it's really tlog-specific */
+        if (!(f = table_find(tl->fs->extents, extents))) {
+            f = allocate_fsfile(tl->fs, t);
+            table_set(tl->fs->extents, extents, f);
+            tlog_debug("   created fsfile %p\n", f);
+        } else {
+            tlog_debug("   found fsfile %p\n", f);
         }
-        
-        if (f && filelength != infinity) {
+
+        u64 filelength;
+        value fl = table_find(t, sym(filelength));
+        if (fl) {
+            assert(u64_from_value(fl, &filelength));
             tlog_debug("   update fsfile length to %ld\n", filelength);
             fsfile_set_length(f, filelength);
         }
     }
 
-    if (frame == END_OF_LOG) {
-        *(u8*)(b->contents + b->start - 1) = END_OF_SEGMENT;
-    }
-    /* mark end of log */
-    b->end = b->start;
-    b->start = 0;
-    tlog_debug("   log parse finished, end now at %d\n", b->end);
-
     /* XXX this will only work for reading the log a single time
        through, but at present we're not using any incremental log updates */
     table_foreach(tl->fs->extents, t, f) {
@@ -201,18 +479,73 @@ closure_function(2, 1, void, log_read_complete,
     deallocate_table(tl->dictionary);
     tl->dictionary = newdict;
 #endif
+}
+
+closure_function(2, 1, void, log_read_complete,
+                 log, tl, status_handler, sh,
+                 status, s)
+{
+    log tl = bound(tl);
+    status_handler sh = bound(sh);
+    buffer b = tl->current->staging;
+    u8 frame = 0;
+
+    tlog_debug("log_read_complete: buffer len %d, status %v\n", buffer_length(b), s);
+    if (!is_ok(s)) {
+        apply(sh, s);
+        closure_finish();
+        return;
+    }
+
+    for (; frame = pop_u8(b), frame == TUPLE_AVAILABLE || frame == END_OF_SEGMENT;) {
+        if (frame == END_OF_SEGMENT) {
+            tlog_debug("-> session boundary\n");
+            continue;
+        }
+        tuple dv = decode_value(tl->h, tl->dictionary, b);
+        tlog_debug("   decoded %p\n", dv);
+        (void) dv;
+    }
+    tl->appended += b->start;
+
+    if (frame == LOG_EXTENSION_LINK) {
+        u64 offset = pop_varint(b);
+        u64 size = pop_varint(b);
+        tlog_debug("-> extension at 0x%lx, size 0x%lx\n", offset, size);
+        log_segment_release_staging(tl->current);
+#ifndef BOOT
+        if (!id_heap_set_area(tl->fs->storage, offset, size, true, true)) {
+            apply(sh, timm("result", "log extension at 0x%lx overlaps allocated storage", offset));
+            closure_finish();
+            return;
+        }
+#endif
+        read_log(tl, offset, size, (status_handler)closure_self());
+        return;
+    }
+
+    if (frame == END_OF_LOG) {
+        *(u8*)(b->contents + b->start - 1) = END_OF_SEGMENT;
+    }
+    /* mark end of log */
+    b->end = b->start;
+    b->start = 0;
+    /* the block holding the old END_OF_LOG is rewritten on next flush */
+    tl->current->flushed = b->end > 0 ? b->end - 1 : 0;
+    tlog_debug("   log parse finished, end now at %d\n", b->end);
 
+    log_read_finish(tl);
     apply(sh, 0);
     closure_finish();
 }
 
 void read_log(log tl, u64 offset, u64 size, status_handler sh)
 {
-    tl->staging = allocate_buffer(tl->h, size);
-    status_handler tlc = closure(tl->h, log_read_complete, tl, sh);
-    range r = log_block_range(tl, tl->staging->length);
+    tl->current = log_segment_create(tl, offset, size);
+    vector_push(tl->segments, tl->current);
+    range r = log_block_range(tl, offset, size);
 //    rprintf("blocks %R\n", r);
-    apply(tl->fs->r, tl->staging->contents, r, tlc);
+    apply(tl->fs->r, tl->current->staging->contents, r, sh);
 }
 
 log log_create(heap h, filesystem fs, status_handler sh)
@@ -220,13 +553,18 @@ log log_create(heap h, filesystem fs, status_handler sh)
     tlog_debug("log_create: heap %p, fs %p, sh %p\n", h, fs, sh);
     log tl = allocate(h, sizeof(struct log));
     tl->h = h;
-    tl->offset = 0;
     tl->fs = fs;
+    tl->current = 0;
+    tl->segments = allocate_vector(h, 8);
+    tl->retired = allocate_vector(h, 8);
+    tl->frame = allocate_buffer(h, 256);
     tl->completions = allocate_vector(h, 10);
     tl->dictionary = allocate_table(h, identity_key, pointer_equal);
+    tl->appended = tl->compacted = 0;
+    tl->superseded = 0;
+    tl->flushing = tl->compacting = false;
     tl->dirty = false;
-    tl->staging = 0;
     fs->tl = tl;
-    read_log(tl, 0, INITIAL_LOG_SIZE, sh);
+    read_log(tl, 0, INITIAL_LOG_SIZE, closure(h, log_read_complete, tl, sh));
     return tl;
 }
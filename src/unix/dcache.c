@@ -0,0 +1,121 @@
+#include <unix_internal.h>
+
+//#define DCACHE_DEBUG
+#ifdef DCACHE_DEBUG
+#define dcache_debug(x, ...) do {rprintf("DCACHE: " x, ##__VA_ARGS__);} while(0)
+#else
+#define dcache_debug(x, ...)
+#endif
+
+/* Names longer than DCACHE_NAME_MAX aren't cached. An entry is 64
+   bytes, so the table occupies 2^(DCACHE_ORDER + 6) bytes. */
+#define DCACHE_ORDER    12
+#define DCACHE_NAME_MAX 39
+
+typedef struct dentry {
+    tuple parent;               /* 0 if unused */
+    tuple child;                /* 0 for a negative entry */
+    symbol s;                   /* for revalidating a positive entry */
+    u8 len;
+    char name[DCACHE_NAME_MAX];
+} *dentry;
+
+typedef struct dcache {
+    heap h;
+    struct dentry *entries;
+    struct dcache_stats stats;
+} *dcache;
+
+static dcache global_dcache;
+
+static inline dentry dcache_slot(dcache dc, tuple parent, buffer name)
+{
+    u64 k = fnv64(name) ^ (u64_from_pointer(parent) >> 4);
+    k ^= k >> 29;
+    return &dc->entries[k & MASK(DCACHE_ORDER)];
+}
+
+static inline boolean dentry_match(dentry d, tuple parent, buffer name)
+{
+    return d->parent == parent && d->len == buffer_length(name) &&
+        !runtime_memcmp(d->name, buffer_ref(name, 0), d->len);
+}
+
+tuple dcache_lookup(tuple parent, buffer name)
+{
+    dcache dc = global_dcache;
+    tuple c = children(parent);
+    if (!c)
+        return 0;
+    if (buffer_length(name) > DCACHE_NAME_MAX) {
+        dc->stats.misses++;
+        return table_find(c, intern(name));
+    }
+
+    dentry d = dcache_slot(dc, parent, name);
+    if (dentry_match(d, parent, name)) {
+        if (!d->child) {
+            dc->stats.neg_hits++;
+            return 0;
+        }
+        if (table_find(c, d->s) == d->child) {
+            dc->stats.hits++;
+            return d->child;
+        }
+    }
+
+    /* A name never interned can't be a child of anything, and it
+       needn't be interned to say so. */
+    dc->stats.misses++;
+    symbol s = symbol_find(name);
+    tuple t = s ? table_find(c, s) : 0;
+    dcache_debug("%s: parent %p, name %b -> %p\n", __func__, parent, name, t);
+    d->parent = parent;
+    d->child = t;
+    d->s = s;
+    d->len = buffer_length(name);
+    runtime_memcpy(d->name, buffer_ref(name, 0), d->len);
+    return t;
+}
+
+void dcache_invalidate(tuple parent, buffer name)
+{
+    dcache dc = global_dcache;
+    if (buffer_length(name) > DCACHE_NAME_MAX)
+        return;
+    dentry d = dcache_slot(dc, parent, name);
+    if (dentry_match(d, parent, name)) {
+        dcache_debug("%s: parent %p, name %b\n", __func__, parent, name);
+        d->parent = 0;
+    }
+}
+
+void dcache_flush(void)
+{
+    dcache dc = global_dcache;
+    zero(dc->entries, sizeof(struct dentry) << DCACHE_ORDER);
+}
+
+void dcache_get_stats(dcache_stats s)
+{
+    runtime_memcpy(s, &global_dcache->stats, sizeof(struct dcache_stats));
+}
+
+boolean dcache_init(kernel_heaps kh)
+{
+    build_assert(sizeof(struct dentry) == 64);
+    heap h = heap_general(kh);
+    dcache dc = allocate(h, sizeof(struct dcache));
+    if (dc == INVALID_ADDRESS)
+        return false;
+    dc->h = h;
+    dc->entries = allocate(heap_backed(kh), sizeof(struct dentry) << DCACHE_ORDER);
+    if (dc->entries == INVALID_ADDRESS) {
+        deallocate(h, dc, sizeof(struct dcache));
+        return false;
+    }
+    zero(&dc->stats, sizeof(struct dcache_stats));
+    global_dcache = dc;
+    dcache_flush();
+    return true;
+}
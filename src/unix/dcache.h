@@ -0,0 +1,28 @@
+/* Path component lookup cache
+
+   Lookups of a name in a directory are cached in a fixed, direct-mapped
+   table keyed by (parent tuple, name hash), holding both positive
+   entries and negative entries for names found missing. A positive
+   entry is revalidated against the directory on each hit, so entries
+   for removed names needn't be purged. A negative entry must be
+   invalidated whenever the name may have been created, as by open
+   with O_CREAT, mkdir or rename.
+*/
+
+typedef struct dcache_stats {
+    u64 hits;                   /* positive entries found valid */
+    u64 neg_hits;               /* negative entries found */
+    u64 misses;                 /* lookups requiring a directory search */
+} *dcache_stats;
+
+boolean dcache_init(kernel_heaps kh);
+
+/* look up name in the children of parent, as lookup(parent, intern(name)) */
+tuple dcache_lookup(tuple parent, buffer name);
+
+void dcache_invalidate(tuple parent, buffer name);
+
+/* drop all entries */
+void dcache_flush(void);
+
+void dcache_get_stats(dcache_stats s);
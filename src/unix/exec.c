@@ -130,7 +130,7 @@ void start_process(thread t, void *start)
         console ("gdb!\n");
         init_tcp_gdb(heap_general(get_kernel_heaps()), t->p, 9090);
     } else {
-        enqueue(runqueue, t->run);
+        thread_schedule(t, cpuinfo_from_id(t->cpu));
     }
 }
 
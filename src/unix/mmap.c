@@ -10,7 +10,15 @@
 
 static boolean vmap_attr_equal(vmap a, vmap b)
 {
-    return a->flags == b->flags;
+    return a->flags == b->flags && a->fsf == b->fsf &&
+        (!a->fsf || a->offset - a->node.r.start == b->offset - b->node.r.start);
+}
+
+/* v was split from match, whose range started at start */
+static void vmap_inherit_backing(vmap v, vmap match, u64 start)
+{
+    v->fsf = match->fsf;
+    v->offset = match->offset + (v->node.r.start - start);
 }
 
 static inline u64 page_map_flags(u64 vmflags)
@@ -67,6 +75,163 @@ static boolean do_demand_page(vmap vm, u64 vaddr)
     return true;
 }
 
+/* File-backed faults bring in a cluster of pages starting at the
+   faulting one, as far as both the mapping and the file extend. */
+#define MMAP_FAULT_CLUSTER_PAGES 16
+
+closure_function(3, 2, void, mmap_fault_page_ref,
+                 vector, pages, int, index, status_handler, sh,
+                 status, s, pagecache_page, pp)
+{
+    if (pp)
+        vector_set(bound(pages), bound(index), pp);
+    apply(bound(sh), s);
+    closure_finish();
+}
+
+closure_function(7, 1, void, mmap_fault_complete,
+                 process, p, thread, t, boolean *, done, fsfile, fsf, u64, vaddr, u64, offset, vector, pages,
+                 status, s)
+{
+    thread t = bound(t);
+    u64 vaddr = bound(vaddr);
+    vector pages = bound(pages);
+    kernel_heaps kh = get_kernel_heaps();
+
+    /* the mapping may have gone or changed while pages were filled */
+    vmap vm = (vmap)rangemap_lookup(bound(p)->vmaps, vaddr);
+    boolean valid = vm != INVALID_ADDRESS && vm->fsf == bound(fsf) &&
+        vm->offset + (vaddr - vm->node.r.start) == bound(offset);
+    pf_debug("%s: vaddr 0x%lx, status %v, valid %d", __func__, vaddr, s, valid);
+
+    for (int i = 0; i < vector_length(pages); i++) {
+        pagecache_page pp = vector_get(pages, i);
+        if (!pp)
+            continue;
+        u64 va = vaddr + (i << PAGELOG);
+        if (!valid || va >= vm->node.r.end ||
+            physical_from_virtual(pointer_from_u64(va)) != INVALID_PHYSICAL) {
+            pagecache_page_unref(pp);
+            continue;
+        }
+
+        /* shared mappings use the cache page itself, private ones a copy */
+        if (vm->flags & VMAP_FLAG_SHARED) {
+            pagecache_map_page(pp, va, page_map_flags(vm->flags));
+            continue;
+        }
+        u64 paddr = allocate_u64(heap_physical(kh), PAGESIZE);
+        if (paddr == INVALID_PHYSICAL) {
+            msg_err("cannot get physical page; OOM\n");
+        } else {
+            map(va, paddr, PAGESIZE, page_map_flags(vm->flags), heap_pages(kh));
+            runtime_memcpy(pointer_from_u64(va), pagecache_page_data(pp), PAGESIZE);
+        }
+        pagecache_page_unref(pp);
+    }
+    deallocate_vector(pages);
+
+    if (!t) {
+        *bound(done) = true;
+        closure_finish();
+        return;
+    }
+    if (valid && physical_from_virtual(pointer_from_u64(vaddr)) == INVALID_PHYSICAL) {
+        struct siginfo si = {
+            .si_signo = SIGBUS,
+            .si_errno = 0,
+            .si_code = BUS_ADRERR,
+            .sifields.sigfault = {
+                .addr = vaddr,
+            }
+        };
+        deliver_signal_to_thread(t, &si);
+    }
+    file_op_maybe_wake(t);
+    closure_finish();
+}
+
+/* Start filling a missing page of a file-backed vmap, along with the
+   pages following it. Returns true if they were at hand and are now
+   mapped; otherwise t is woken once they are or, for a fault taken by
+   the kernel (t is zero), *done is set. */
+static boolean file_page_fill(process p, thread t, boolean *done, vmap vm, u64 page_va)
+{
+    heap h = heap_general(get_kernel_heaps());
+    u64 offset = vm->offset + (page_va - vm->node.r.start);
+    u64 flen = pad(fsfile_get_length(vm->fsf), PAGESIZE);
+
+    /* the faulting page is filled even past end of file, with zeros */
+    int n = 1;
+    while (n < MMAP_FAULT_CLUSTER_PAGES && page_va + (n << PAGELOG) < vm->node.r.end &&
+           offset + (n << PAGELOG) < flen)
+        n++;
+    pf_debug("%s: vaddr 0x%lx, offset 0x%lx, %d pages", __func__, page_va, offset, n);
+
+    vector pages = allocate_vector(h, n);
+    for (int i = 0; i < n; i++)
+        vector_push(pages, 0);
+
+    /* fill whatever is missing from the cluster in as few reads as possible */
+    pagecache_readahead(vm->fsf, offset, n << PAGELOG);
+    if (t)
+        file_op_begin(t);
+    merge m = allocate_merge(h, closure(h, mmap_fault_complete, p, t, done, vm->fsf,
+                                        page_va, offset, pages));
+    status_handler k = apply_merge(m);
+    for (int i = 0; i < n; i++) {
+        if (i > 0 && physical_from_virtual(pointer_from_u64(page_va + (i << PAGELOG))) !=
+            INVALID_PHYSICAL)
+            continue;
+        pagecache_get_page_ref(vm->fsf, offset + (i << PAGELOG),
+                               closure(h, mmap_fault_page_ref, pages, i, apply_merge(m)));
+    }
+    apply(k, STATUS_OK);
+    return t ? t->file_op_is_complete : *done;
+}
+
+static boolean do_file_page(vmap vm, u64 vaddr, context frame)
+{
+    thread t = current;
+    cpuinfo ci = current_cpu();
+    u64 page_va = vaddr & ~MASK(PAGELOG);
+
+    /* A user fault sleeps on the fill and retries the access once
+       woken. */
+    if (frame[FRAME_ERROR_CODE] & FRAME_ERROR_PF_US) {
+        if (file_page_fill(t->p, t, 0, vm, page_va))
+            return true;
+        /* as common_handler does on returning to user mode */
+        frame[FRAME_SS] = 0x23;
+        frame[FRAME_CS] = 0x1b;
+        thread_sleep_uninterruptible();
+    }
+
+    /* Kernel code, say a syscall or a bottom half copying to or from
+       a user buffer, can't be resumed after sleeping, so the fault
+       handler itself waits for the fill. */
+    if (frame == ci->int_frame || (t->syscall < 0 && frame != ci->bh_frame)) {
+        msg_err("file-backed page fault at 0x%lx outside of syscall context\n", vaddr);
+        return false;
+    }
+    boolean done = false;
+    if (!file_page_fill(t->p, 0, &done, vm, page_va))
+        kernel_fault_wait(&done);
+    if (physical_from_virtual(pointer_from_u64(page_va)) != INVALID_PHYSICAL)
+        return true;
+
+    /* the page couldn't be read in or the mapping went away */
+    if (frame == ci->bh_frame) {
+        msg_err("failed to fill file-backed page at 0x%lx\n", vaddr);
+        return false;
+    }
+    t->syscall = -1;
+    set_syscall_error(t, EFAULT);
+    thread_fpu_save(t);
+    thread_schedule(t, ci);
+    runloop();
+}
+
 boolean unix_fault_page(u64 vaddr, context frame)
 {
     process p = current->p;
@@ -118,6 +283,8 @@ boolean unix_fault_page(u64 vaddr, context frame)
     }
 
     /* vmap, no prot violation --> demand paging */
+    if (vm->fsf)
+        return do_file_page(vm, vaddr, frame);
     return do_demand_page(vm, vaddr);
 
 }
@@ -129,6 +296,8 @@ vmap allocate_vmap(rangemap rm, range r, u64 flags)
         return vm;
     rmnode_init(&vm->node, r);
     vm->flags = flags;
+    vm->fsf = 0;
+    vm->offset = 0;
     if (!rangemap_insert(rm, &vm->node)) {
         deallocate(rm->h, vm, sizeof(struct vmap));
         return INVALID_ADDRESS;
@@ -304,12 +473,103 @@ static sysreturn mincore(void *addr, u64 length, u8 *vec)
     return 0;
 }
 
+/* User pages lent to the kernel, as for a MSG_ZEROCOPY send, are
+   mapped at a kernel address of their own, so they stay reachable
+   whatever becomes of the user mapping. A pinned page that is unmapped
+   goes back to the physical heap on its last unpin. Entries hold the
+   pin count shifted left by one, with the low bit set once the page
+   has been unmapped. */
+static table pinned_pages;
+
+static void free_phys_range(heap physical, range r)
+{
+    if (range_span(r) > 0 && !id_heap_set_area(physical, r.start, range_span(r), true, false))
+        msg_err("some of physical range %R not allocated in heap\n", r);
+}
+
 closure_function(1, 1, void, dealloc_phys_page,
                  heap, physical,
                  range, r)
 {
-    if (!id_heap_set_area(bound(physical), r.start, range_span(r), true, false))
-        msg_err("some of physical range %R not allocated in heap\n", r);
+    /* shared file mappings map page cache pages directly */
+    if (pagecache_unmap_page(r.start))
+        return;
+    if (table_elements(pinned_pages) > 0) {
+        for (u64 pa = r.start; pa < r.end; pa += PAGESIZE) {
+            u64 v = u64_from_pointer(table_find(pinned_pages, pointer_from_u64(pa)));
+            if (v == 0)
+                continue;
+            table_set(pinned_pages, pointer_from_u64(pa), pointer_from_u64(v | 1));
+            free_phys_range(bound(physical), irange(r.start, pa));
+            r.start = pa + PAGESIZE;
+        }
+    }
+    free_phys_range(bound(physical), r);
+}
+
+closure_function(2, 0, void, user_buffer_unpin,
+                 u64, kva, u64, len)
+{
+    kernel_heaps kh = get_kernel_heaps();
+    u64 kva = bound(kva);
+    u64 len = bound(len);
+    for (u64 va = kva; va < kva + len; va += PAGESIZE) {
+        u64 pa = physical_from_virtual(pointer_from_u64(va));
+        u64 v = u64_from_pointer(table_find(pinned_pages, pointer_from_u64(pa))) - 2;
+        if (v > 1) {
+            table_set(pinned_pages, pointer_from_u64(pa), pointer_from_u64(v));
+            continue;
+        }
+        table_set(pinned_pages, pointer_from_u64(pa), 0);
+        if (v & 1)
+            free_phys_range(heap_physical(kh), irange(pa, pa + PAGESIZE));
+    }
+    unmap(kva, len, heap_pages(kh));
+    deallocate_u64(heap_virtual_page(kh), kva, len);
+    closure_finish();
+}
+
+/* Pin the pages of a user buffer, returning the address at which the
+   kernel may refer to it until *unpin is applied, or 0 if the buffer
+   isn't entirely present, private memory. */
+void *pin_user_buffer(void *buf, u64 length, thunk *unpin)
+{
+    process p = current->p;
+    kernel_heaps kh = get_kernel_heaps();
+    u64 start = u64_from_pointer(buf) & ~MASK(PAGELOG);
+    u64 end = pad(u64_from_pointer(buf) + length, PAGESIZE);
+    if (length == 0 || end <= start)
+        return 0;
+
+    vmap vm = INVALID_ADDRESS;
+    for (u64 va = start; va < end; va += PAGESIZE) {
+        if (vm == INVALID_ADDRESS || va >= vm->node.r.end) {
+            vm = (vmap)rangemap_lookup(p->vmaps, va);
+            /* page cache pages are shared with the file */
+            if (vm == INVALID_ADDRESS || (vm->fsf && (vm->flags & VMAP_FLAG_SHARED)))
+                return 0;
+        }
+        if (physical_from_virtual(pointer_from_u64(va)) == INVALID_PHYSICAL)
+            return 0;
+    }
+
+    u64 len = end - start;
+    u64 kva = allocate_u64(heap_virtual_page(kh), len);
+    if (kva == (u64)INVALID_ADDRESS)
+        return 0;
+    thunk t = closure(heap_general(kh), user_buffer_unpin, kva, len);
+    if (t == INVALID_ADDRESS) {
+        deallocate_u64(heap_virtual_page(kh), kva, len);
+        return 0;
+    }
+    for (u64 off = 0; off < len; off += PAGESIZE) {
+        u64 pa = physical_from_virtual(pointer_from_u64(start + off));
+        map(kva + off, pa, PAGESIZE, PAGE_NO_EXEC, heap_pages(kh));
+        u64 v = u64_from_pointer(table_find(pinned_pages, pointer_from_u64(pa)));
+        table_set(pinned_pages, pointer_from_u64(pa), pointer_from_u64(v + 2));
+    }
+    *unpin = t;
+    return pointer_from_u64(kva + (u64_from_pointer(buf) & MASK(PAGELOG)));
 }
 
 closure_function(5, 2, void, mmap_read_complete,
@@ -435,12 +695,14 @@ closure_function(3, 1, void, vmap_attribute_update_intersection,
         /* create node for intersection */
         vmap mh = allocate_vmap(pvmap, ri, newflags);
         assert(mh != INVALID_ADDRESS);
+        vmap_inherit_backing(mh, match, rn.start);
 
         if (tail) {
             /* create node at tail end */
             range rt = { ri.end, rtend };
             vmap mt = allocate_vmap(pvmap, rt, match->flags);
             assert(mt != INVALID_ADDRESS);
+            vmap_inherit_backing(mt, match, rn.start);
         }
     } else if (tail) {
         /* move node start back */
@@ -450,6 +712,8 @@ closure_function(3, 1, void, vmap_attribute_update_intersection,
         /* create node for intersection */
         vmap mt = allocate_vmap(pvmap, ri, newflags);
         assert(mt != INVALID_ADDRESS);
+        vmap_inherit_backing(mt, match, rn.start);
+        match->offset += ri.end - rn.start;
     } else {
         /* key (range) remains the same, no need to reinsert */
         match->flags = newflags;
@@ -493,6 +757,8 @@ sysreturn mprotect(void * addr, u64 len, int prot)
     struct vmap q;
     q.node.r = r;
     q.flags = new_vmflags;
+    q.fsf = 0;
+    q.offset = 0;
 
     vmap_attribute_update(h, pvmap, &q);
     return 0;
@@ -523,6 +789,7 @@ closure_function(3, 1, void, vmap_paint_intersection,
     if (range_equal(ri, rn)) {
         /* key (range) remains the same, no need to reinsert */
         match->flags = q->flags;
+        vmap_inherit_backing(match, q, q->node.r.start);
         return;
     }
 
@@ -541,11 +808,13 @@ closure_function(3, 1, void, vmap_paint_intersection,
             range rt = { ri.end, rtend };
             vmap mt = allocate_vmap(pvmap, rt, match->flags);
             assert(mt != INVALID_ADDRESS);
+            vmap_inherit_backing(mt, match, rn.start);
         }
     } else if (tail) {
         /* move node start back */
         range rt = { ri.end, rn.end };
         rangemap_reinsert(pvmap, node, rt);
+        match->offset += ri.end - rn.start;
     }
 }
 
@@ -555,6 +824,7 @@ closure_function(3, 1, void, vmap_paint_gap,
 {
     vmap mt = allocate_vmap(bound(pvmap), r, bound(q)->flags);
     assert(mt != INVALID_ADDRESS);
+    vmap_inherit_backing(mt, bound(q), bound(q)->node.r.start);
 }
 
 static void vmap_paint(heap h, rangemap pvmap, vmap q)
@@ -612,6 +882,45 @@ static boolean mmap_reserve_range(process p, range q)
     return true;
 }
 
+closure_function(1, 1, void, msync_dirty_page,
+                 vmap, vm,
+                 range, r)
+{
+    vmap vm = bound(vm);
+    u64 offset = vm->offset + (r.start - vm->node.r.start);
+    u64 flen = fsfile_get_length(vm->fsf);
+
+    /* as with any write, data beyond end of file is dropped */
+    if (offset >= flen)
+        return;
+    u64 length = MIN(range_span(r), flen - offset);
+    pf_debug("%s: vaddr 0x%lx, offset 0x%lx, length 0x%lx", __func__, r.start, offset, length);
+    pagecache_dirty_range(vm->fsf, offset, length);
+}
+
+/* Pages of a shared file mapping are the cache pages themselves, so
+   those modified since the last writeback need only be marked dirty
+   in the cache. */
+static void mmap_writeback(vmap vm, range q)
+{
+    if ((vm->flags & VMAP_FLAG_SHARED) == 0 || !vm->fsf)
+        return;
+    range ri = range_intersection(q, vm->node.r);
+    clean_dirty_pages(ri.start, range_span(ri), stack_closure(msync_dirty_page, vm));
+}
+
+closure_function(1, 1, void, msync_vmap,
+                 range, q,
+                 rmnode, node)
+{
+    mmap_writeback((vmap)node, bound(q));
+}
+
+static void mmap_writeback_range(process p, range q)
+{
+    rangemap_range_lookup(p->vmaps, q, stack_closure(msync_vmap, q));
+}
+
 static sysreturn mmap(void *target, u64 size, int prot, int flags, int fd, u64 offset)
 {
     process p = current->p;
@@ -630,6 +939,19 @@ static sysreturn mmap(void *target, u64 size, int prot, int flags, int fd, u64 o
     if ((prot & PROT_WRITE))
         vmflags |= VMAP_FLAG_WRITABLE;
 
+    file f = 0;
+    fsfile fsf = 0;
+    if ((flags & MAP_ANONYMOUS) == 0) {
+        f = resolve_fd(p, fd);
+        fsf = fsfile_from_node(p->fs, f->n);
+        if (fsf) {
+            if (offset & MASK(PAGELOG))
+                return -EINVAL;
+            if (flags & MAP_SHARED)
+                vmflags |= VMAP_FLAG_SHARED;
+        }
+    }
+
     /* Don't really try to honor a hint, only fixed. */
     boolean fixed = (flags & MAP_FIXED) != 0;
     u64 where = fixed ? u64_from_pointer(target) : 0;
@@ -672,28 +994,43 @@ static sysreturn mmap(void *target, u64 size, int prot, int flags, int fd, u64 o
         }
     }
 
+    /* a mapping replaced here is written back as on munmap */
+    if (fixed)
+        mmap_writeback_range(p, irange(where, where + len));
+
     /* Paint into process vmap */
     struct vmap q;
     q.flags = vmflags;
     q.node.r = irange(where, where + len);
+    q.fsf = fsf;
+    q.offset = offset;
     vmap_paint(h, p->vmaps, &q);
 
+    /* Release any pages left by a mapping this one replaces; the new
+       ones are faulted in on demand. */
+    unmap_pages_with_handler(where, len, stack_closure(dealloc_phys_page, heap_physical(kh)));
+
     if (flags & MAP_ANONYMOUS) {
         thread_log(current, "   anon target: 0x%lx, len: 0x%lx (given size: 0x%lx)", where, len, size);
-        /* If mmap this intersects an existing one, zero any mapped pages. */
-        zero_mapped_pages(where, len);
         return where;
     }
 
-    file f = resolve_fd(current->p, fd);
+    if (fsf) {
+        thread_log(current, "   file target: 0x%lx, len: 0x%lx, offset 0x%lx, %s",
+                   where, len, offset, (flags & MAP_SHARED) ? "shared" : "private");
+        return where;
+    }
+
+    /* no file data to page in from; read whatever the filesystem has */
     u64 flen = MIN(pad(f->length, PAGESIZE), len);
     heap mh = heap_backed(kh);
     buffer b = allocate_buffer(mh, pad(flen, mh->pagesize));
 
     thread_log(current, "  read file at 0x%lx, flen %ld, blocking...", where, flen);
     file_op_begin(current);
-    filesystem_read(p->fs, f->n, buffer_ref(b, 0), flen, offset,
-                    closure(h, mmap_read_complete, current, where, flen, b, page_map_flags(vmflags)));
+    io_status_handler ish = closure(h, mmap_read_complete, current, where, flen, b,
+                                    page_map_flags(vmflags));
+    filesystem_read(p->fs, f->n, buffer_ref(b, 0), flen, offset, ish);
     return file_op_maybe_sleep(current);
 }
 
@@ -725,11 +1062,13 @@ closure_function(2, 1, void, process_unmap_intersection,
             range rt = { ri.end, rtend };
             vmap mt = allocate_vmap(p->vmaps, rt, match->flags);
             assert(mt != INVALID_ADDRESS);
+            vmap_inherit_backing(mt, match, rn.start);
         }
     } else if (tail) {
         /* move node start back */
         range rt = { ri.end, node->r.end };
         assert(rangemap_reinsert(p->vmaps, node, rt));
+        match->offset += ri.end - rn.start;
     } else {
         /* delete outright */
         rangemap_remove_node(p->vmaps, node);
@@ -750,6 +1089,9 @@ closure_function(2, 1, void, process_unmap_intersection,
 
 static void process_unmap_range(process p, range q)
 {
+    /* modified pages of shared file mappings go back to the file,
+       completing in the background */
+    mmap_writeback_range(p, q);
     rmnode_handler nh = stack_closure(process_unmap_intersection, p, q);
     rangemap_range_lookup(p->vmaps, q, nh);
 }
@@ -771,6 +1113,38 @@ static sysreturn munmap(void *addr, u64 length)
     return 0;
 }
 
+closure_function(1, 1, void, msync_complete,
+                 thread, t,
+                 status, s)
+{
+    thread t = bound(t);
+    thread_log(t, "%s: status %v", __func__, s);
+    set_syscall_return(t, is_ok(s) ? 0 : -EIO);
+    file_op_maybe_wake(t);
+    closure_finish();
+}
+
+static sysreturn msync(void *addr, u64 length, int flags)
+{
+    thread_log(current, "msync: addr %p, length 0x%lx, flags 0x%x", addr, length, flags);
+    u64 where = u64_from_pointer(addr);
+    if ((where & MASK(PAGELOG)) || (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC)) ||
+        ((flags & MS_ASYNC) && (flags & MS_SYNC)))
+        return -EINVAL;
+
+    /* Cache pages are mapped directly, so there is nothing to
+       invalidate, and asynchronous writeback needn't be waited on. */
+    mmap_writeback_range(current->p, irange(where, where + pad(length, PAGESIZE)));
+    if ((flags & MS_SYNC) == 0)
+        return 0;
+
+    /* MS_SYNC: the pages must also be written back from the cache */
+    file_op_begin(current);
+    set_syscall_return(current, 0);
+    pagecache_sync(0, closure(heap_general(get_kernel_heaps()), msync_complete, current));
+    return file_op_maybe_sleep(current);
+}
+
 /* kernel start */
 extern void * START;
 
@@ -792,6 +1166,10 @@ void mmap_process_init(process p)
     p->vareas = allocate_rangemap(h);
     p->vmaps = allocate_rangemap(h);
     assert(p->vareas != INVALID_ADDRESS && p->vmaps != INVALID_ADDRESS);
+    if (!pinned_pages) {
+        pinned_pages = allocate_table(h, identity_key, pointer_equal);
+        assert(pinned_pages != INVALID_ADDRESS);
+    }
 
     /* zero page is off-limits */
     add_varea(p, 0, PAGESIZE, p->virtual32, false);
@@ -862,6 +1240,7 @@ void register_mmap_syscalls(struct syscall *map)
     register_syscall(map, mmap, mmap);
     register_syscall(map, mremap, mremap);
     register_syscall(map, munmap, munmap);
+    register_syscall(map, msync, msync);
     register_syscall(map, mprotect, mprotect);
     register_syscall(map, madvise, syscall_ignore);
 }
@@ -72,14 +72,23 @@ u64 notify_get_eventmask_union(notify_set s)
 
 void notify_dispatch_for_thread(notify_set s, u64 events, thread t)
 {
+    notify_entry claimed = 0;
     /* XXX take mutex */
     list_foreach(&s->entries, l) {
         notify_entry n = struct_from_list(l, notify_entry, l);
+        boolean exclusive = (n->eventmask & EPOLLEXCLUSIVE) != 0;
+        if (exclusive && claimed)
+            continue;
 
         /* no guarantee that a transition is represented here; event
            handler needs to keep track itself if edge trigger is used */
         assert(n->eh);
-        apply(n->eh, events & n->eventmask, t);
+        if (apply(n->eh, events & n->eventmask, t) && exclusive)
+            claimed = n;
+    }
+    if (claimed) {
+        list_delete(&claimed->l);
+        list_insert_before(&s->entries, &claimed->l);
     }
     /* XXX release mutex */
 }
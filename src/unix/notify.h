@@ -3,7 +3,13 @@ typedef struct notify_entry *notify_entry;
 
 /* notify handlers receive event changes, including falling edges,
    which are relevant only for waiters on thread t if t is nonzero */
-typedef closure_type(event_handler, void, u64 events, thread t);
+typedef closure_type(event_handler, boolean, u64 events, thread t);
+
+/* Entries added with EPOLLEXCLUSIVE in their eventmask form a group
+   of which only one is handed each dispatch: the first handler to
+   return true claims it, and is moved to the back of the set so that
+   subsequent events go to the others in turn. Non-exclusive entries
+   always see every dispatch, and their return value is ignored. */
 
 /* NOTIFY_EVENTS_RELEASE is a special value of events to signal to the
    event_handler that a notify_set is being deallocated.
@@ -0,0 +1,1022 @@
+#include <unix_internal.h>
+#include <page.h>
+
+//#define PAGECACHE_DEBUG
+#ifdef PAGECACHE_DEBUG
+#define pagecache_debug(x, ...) do {rprintf("PGCACHE: " x, ##__VA_ARGS__);} while(0)
+#else
+#define pagecache_debug(x, ...)
+#endif
+
+/* The cache may grow to 1/2^PAGECACHE_MAX_ORDER of physical memory
+   before it begins to reclaim its own pages. Independent of that
+   limit, pages are reclaimed whenever free physical memory dips below
+   1/2^PAGECACHE_LOWMEM_ORDER of the total. */
+#define PAGECACHE_MAX_ORDER     1
+#define PAGECACHE_LOWMEM_ORDER  5
+#define PAGECACHE_EVICT_BATCH   32
+
+/* Runs of adjacent missing pages are filled with a single read of up
+   to this many pages, staged through a contiguous bounce buffer. */
+#define PAGECACHE_FILL_RUN_MAX  64
+
+/* Writes are absorbed by the cache and written back in runs of up to
+   PAGECACHE_WRITEBACK_RUN_MAX adjacent dirty pages. Dirty pages are
+   written back PAGECACHE_WRITEBACK_DELAY after the first of them is
+   dirtied, or at once when more than 1/2^PAGECACHE_DIRTY_BG_ORDER of
+   the cache limit is dirty. Writers are held back until their file is
+   clean when dirty pages exceed 1/2^PAGECACHE_DIRTY_MAX_ORDER. */
+#define PAGECACHE_WRITEBACK_RUN_MAX     (MAX_EXTENT_SIZE >> PAGELOG)
+#define PAGECACHE_WRITEBACK_DELAY       seconds(1)
+#define PAGECACHE_DIRTY_BG_ORDER        3
+#define PAGECACHE_DIRTY_MAX_ORDER       2
+
+#define PAGECACHE_PAGESTATE_FILLING 0
+#define PAGECACHE_PAGESTATE_READY   1
+
+struct pagecache_page {
+    struct list l;              /* position in clock */
+    fsfile f;
+    u64 index;                  /* file offset >> PAGELOG */
+    void *kvirt;
+    u64 refcount;               /* held for the duration of an operation */
+    u64 mapcount;               /* user mappings, each holding a reference */
+    u8 state;
+    boolean referenced;         /* second chance for clock */
+    boolean detached;           /* removed from cache, free on last release */
+    boolean dirty;              /* contents ahead of storage */
+    boolean writeback;          /* write in flight, holding a reference */
+    struct list dirty_l;        /* position in file dirty list */
+    vector waiters;             /* status_handlers awaiting fill */
+};
+
+typedef struct pagecache_file {
+    fsfile f;
+    table pages;                /* index -> pagecache_page */
+    struct list dirty;          /* dirty pages, in order dirtied */
+    u64 ndirty;
+    u64 writeback;              /* writes in flight */
+    boolean collecting;         /* gathering dirty pages for writeback */
+    vector sync_waiters;        /* status_handlers awaiting a clean file */
+    status error;               /* writeback failure, reported at next sync */
+} *pagecache_file;
+
+typedef struct pagecache {
+    heap h;
+    heap backed;
+    heap physical;
+    heap pages;
+    table files;                /* fsfile -> pagecache_file */
+    table mapped;               /* physical address -> user-mapped page */
+    struct list clock;
+    u64 max_pages;
+    u64 lowmem;
+    u64 dirty_bg;               /* start writeback at this many dirty pages */
+    u64 dirty_max;              /* throttle writers beyond this */
+    timer writeback_timer;
+    thunk sweep;                /* frees state of files with nothing cached */
+    boolean sweep_queued;
+    struct pagecache_stats stats;
+} *pagecache;
+
+static pagecache global_pagecache;
+
+static inline range page_range(pagecache_page pp)
+{
+    return irange(pp->index << PAGELOG, (pp->index + 1) << PAGELOG);
+}
+
+static pagecache_file pagecache_get_file(pagecache pc, fsfile f, boolean create)
+{
+    pagecache_file pf = table_find(pc->files, f);
+    if (!pf && create) {
+        pf = allocate(pc->h, sizeof(struct pagecache_file));
+        assert(pf != INVALID_ADDRESS);
+        pf->f = f;
+        pf->pages = allocate_table(pc->h, identity_key, pointer_equal);
+        list_init(&pf->dirty);
+        pf->ndirty = 0;
+        pf->writeback = 0;
+        pf->collecting = false;
+        pf->sync_waiters = allocate_vector(pc->h, 4);
+        pf->error = STATUS_OK;
+        table_set(pc->files, f, pf);
+    }
+    return pf;
+}
+
+static inline table pagecache_file_pages(pagecache pc, fsfile f, boolean create)
+{
+    pagecache_file pf = pagecache_get_file(pc, f, create);
+    return pf ? pf->pages : 0;
+}
+
+/* A file keeps its cache state while it has pages, dirty or not, or
+   writes, sync waiters or a writeback failure outstanding. */
+static boolean pagecache_file_idle(pagecache_file pf)
+{
+    return table_elements(pf->pages) == 0 && pf->ndirty == 0 && pf->writeback == 0 &&
+        !pf->collecting && vector_length(pf->sync_waiters) == 0 && is_ok(pf->error);
+}
+
+/* Idle files are released from the bottom half rather than as their
+   last page goes, as callers may be in the midst of using them. */
+closure_function(1, 0, void, pagecache_sweep,
+                 pagecache, pc)
+{
+    pagecache pc = bound(pc);
+    pc->sweep_queued = false;
+    vector idle = allocate_vector(pc->h, 8);
+    if (idle == INVALID_ADDRESS)
+        return;
+    table_foreach(pc->files, k, v) {
+        (void) k;
+        if (pagecache_file_idle(v))
+            vector_push(idle, v);
+    }
+    pagecache_file pf;
+    vector_foreach(idle, pf) {
+        pagecache_debug("%s: release f %p\n", __func__, pf->f);
+        table_set(pc->files, pf->f, 0);
+        deallocate_table(pf->pages);
+        deallocate_vector(pf->sync_waiters);
+        deallocate(pc->h, pf, sizeof(struct pagecache_file));
+    }
+    deallocate_vector(idle);
+}
+
+static void pagecache_queue_sweep(pagecache pc)
+{
+    if (pc->sweep_queued)
+        return;
+    pc->sweep_queued = enqueue(bhqueue, pc->sweep);
+}
+
+static void pagecache_page_clean(pagecache pc, pagecache_file pf, pagecache_page pp)
+{
+    assert(pp->dirty);
+    pp->dirty = false;
+    list_delete(&pp->dirty_l);
+    pf->ndirty--;
+    pc->stats.dirty--;
+}
+
+static void pagecache_page_free(pagecache pc, pagecache_page pp)
+{
+    pagecache_debug("%s: f %p, index %ld\n", __func__, pp->f, pp->index);
+    deallocate(pc->backed, pp->kvirt, PAGESIZE);
+    if (pp->waiters)
+        deallocate_vector(pp->waiters);
+    deallocate(pc->h, pp, sizeof(struct pagecache_page));
+}
+
+/* remove page from index and clock; freed now or upon last release */
+static void pagecache_page_detach(pagecache pc, pagecache_page pp)
+{
+    pagecache_file pf = pagecache_get_file(pc, pp->f, false);
+    assert(pf);
+    if (pp->dirty)
+        pagecache_page_clean(pc, pf, pp);
+    table_set(pf->pages, pointer_from_u64(pp->index), 0);
+    list_delete(&pp->l);
+    pp->detached = true;
+    pc->stats.pages--;
+    if (pp->refcount == 0)
+        pagecache_page_free(pc, pp);
+    if (pagecache_file_idle(pf))
+        pagecache_queue_sweep(pc);
+}
+
+static void pagecache_page_release(pagecache pc, pagecache_page pp)
+{
+    assert(pp->refcount > 0);
+    if (--pp->refcount == 0 && pp->detached)
+        pagecache_page_free(pc, pp);
+}
+
+/* Clock (second chance) reclaim: pages referenced since the last pass
+   are spared once, and pages in use (including those being written
+   back), being filled or dirty are skipped. */
+static u64 pagecache_evict(pagecache pc, u64 n)
+{
+    u64 evicted = 0;
+    u64 scan = pc->stats.pages * 2;
+    while (evicted < n && scan-- > 0) {
+        list l = list_get_next(&pc->clock);
+        if (!l)
+            break;
+        pagecache_page pp = struct_from_list(l, pagecache_page, l);
+        if (pp->refcount == 0 && pp->state == PAGECACHE_PAGESTATE_READY &&
+            !pp->referenced && !pp->dirty && !pp->writeback) {
+            pagecache_page_detach(pc, pp);
+            evicted++;
+            continue;
+        }
+        pp->referenced = false;
+        list_delete(l);
+        list_push_back(&pc->clock, l);
+    }
+    pagecache_debug("%s: requested %ld, evicted %ld\n", __func__, n, evicted);
+    pc->stats.evictions += evicted;
+    return evicted;
+}
+
+static inline boolean pagecache_under_pressure(pagecache pc)
+{
+    return pc->stats.pages >= pc->max_pages ||
+        pc->physical->allocated + pc->lowmem > id_heap_total(pc->physical);
+}
+
+static void pagecache_writeback_all(pagecache pc);
+
+static pagecache_page pagecache_allocate_page(pagecache pc, table pages, fsfile f, u64 index)
+{
+    /* clean pages may yet come of writeback */
+    if (pagecache_under_pressure(pc) &&
+        pagecache_evict(pc, PAGECACHE_EVICT_BATCH) == 0 && pc->stats.dirty > 0)
+        pagecache_writeback_all(pc);
+
+    void *kvirt = allocate(pc->backed, PAGESIZE);
+    if (kvirt == INVALID_ADDRESS) {
+        if (!pagecache_evict(pc, PAGECACHE_EVICT_BATCH) ||
+            (kvirt = allocate(pc->backed, PAGESIZE)) == INVALID_ADDRESS) {
+            msg_err("unable to allocate page\n");
+            return INVALID_ADDRESS;
+        }
+    }
+
+    pagecache_page pp = allocate(pc->h, sizeof(struct pagecache_page));
+    if (pp == INVALID_ADDRESS) {
+        deallocate(pc->backed, kvirt, PAGESIZE);
+        return pp;
+    }
+    pp->f = f;
+    pp->index = index;
+    pp->kvirt = kvirt;
+    pp->refcount = 0;
+    pp->mapcount = 0;
+    pp->state = PAGECACHE_PAGESTATE_FILLING;
+    pp->referenced = false;
+    pp->detached = false;
+    pp->dirty = false;
+    pp->writeback = false;
+    pp->waiters = 0;
+    table_set(pages, pointer_from_u64(index), pp);
+    list_push_back(&pc->clock, &pp->l);
+    pc->stats.pages++;
+    return pp;
+}
+
+static void pagecache_release_pages(pagecache pc, vector pages)
+{
+    pagecache_page pp;
+    vector_foreach(pages, pp)
+        pagecache_page_release(pc, pp);
+    deallocate_vector(pages);
+}
+
+static void pagecache_fill_done(pagecache pc, pagecache_page pp, status s, bytes length)
+{
+    pagecache_debug("%s: f %p, index %ld, status %v, length %ld\n",
+                    __func__, pp->f, pp->index, s, length);
+    if (is_ok(s)) {
+        /* anything past the end of file reads as zero */
+        if (length < PAGESIZE)
+            zero(pp->kvirt + length, PAGESIZE - length);
+        pp->state = PAGECACHE_PAGESTATE_READY;
+    } else if (!pp->detached) {
+        pagecache_page_detach(pc, pp);
+    }
+
+    /* waiters may release the last reference */
+    vector waiters = pp->waiters;
+    pp->waiters = 0;
+    status_handler sh;
+    vector_foreach(waiters, sh)
+        apply(sh, s);
+    deallocate_vector(waiters);
+}
+
+closure_function(2, 2, void, pagecache_fill_complete,
+                 pagecache, pc, pagecache_page, pp,
+                 status, s, bytes, length)
+{
+    pagecache_fill_done(bound(pc), bound(pp), s, length);
+    pagecache_page_release(bound(pc), bound(pp));
+    closure_finish();
+}
+
+/* A page being filled holds a reference of its own until the read
+   completes, keeping it safe from truncation in the meantime. */
+closure_function(3, 2, void, pagecache_fill_run_complete,
+                 pagecache, pc, vector, run, void *, buf,
+                 status, s, bytes, length)
+{
+    pagecache pc = bound(pc);
+    vector run = bound(run);
+    pagecache_page pp;
+    u64 offset = 0;
+    vector_foreach(run, pp) {
+        bytes n = offset < length ? MIN(length - offset, PAGESIZE) : 0;
+        if (is_ok(s))
+            runtime_memcpy(pp->kvirt, bound(buf) + offset, n);
+        pagecache_fill_done(pc, pp, s, n);
+        offset += PAGESIZE;
+    }
+    deallocate(pc->backed, bound(buf), vector_length(run) << PAGELOG);
+    pagecache_release_pages(pc, run);
+    closure_finish();
+}
+
+static void pagecache_fill_run(pagecache pc, fsfile f, vector run)
+{
+    pagecache_page first = vector_get(run, 0);
+    u64 n = vector_length(run);
+    pagecache_debug("%s: f %p, index %ld, %ld pages\n", __func__, f, first->index, n);
+    void *buf = n > 1 ? allocate(pc->backed, n << PAGELOG) : INVALID_ADDRESS;
+    if (buf != INVALID_ADDRESS) {
+        fsfile_read(f, buf, n << PAGELOG, first->index << PAGELOG,
+                    closure(pc->h, pagecache_fill_run_complete, pc, run, buf));
+        return;
+    }
+
+    /* no bounce buffer to be had; fill pages individually */
+    pagecache_page pp;
+    vector_foreach(run, pp)
+        fsfile_read(f, pp->kvirt, PAGESIZE, pp->index << PAGELOG,
+                    closure(pc->h, pagecache_fill_complete, pc, pp));
+    deallocate_vector(run);
+}
+
+/* Create pages for any part of [start_index, end_index) not yet
+   cached and start filling them, coalescing adjacent pages into
+   larger reads. */
+static void pagecache_fill_range(pagecache pc, table pages, fsfile f,
+                                 u64 start_index, u64 end_index)
+{
+    vector run = 0;
+    for (u64 i = start_index; i < end_index; i++) {
+        if (!table_find(pages, pointer_from_u64(i))) {
+            pagecache_page pp = pagecache_allocate_page(pc, pages, f, i);
+            if (pp != INVALID_ADDRESS) {
+                pc->stats.misses++;
+                pp->refcount++;
+                pp->waiters = allocate_vector(pc->h, 4);
+                if (!run)
+                    run = allocate_vector(pc->h, MIN(end_index - i, PAGECACHE_FILL_RUN_MAX));
+                vector_push(run, pp);
+                if (vector_length(run) < PAGECACHE_FILL_RUN_MAX)
+                    continue;
+            }
+        }
+        if (run) {
+            pagecache_fill_run(pc, f, run);
+            run = 0;
+        }
+    }
+    if (run)
+        pagecache_fill_run(pc, f, run);
+}
+
+/* Look up or create a page and take a reference to it. If the page
+   contents are not yet valid, a handle from m is queued for
+   completion of the fill. A page that is created with fill == false
+   is zeroed and immediately valid. */
+static pagecache_page pagecache_get_page(pagecache pc, table pages, fsfile f, u64 index,
+                                         boolean fill, merge m)
+{
+    pagecache_page pp = table_find(pages, pointer_from_u64(index));
+    if (pp) {
+        if (pp->state == PAGECACHE_PAGESTATE_READY)
+            pc->stats.hits++;
+        pp->referenced = true;
+        pp->refcount++;
+        if (pp->state != PAGECACHE_PAGESTATE_READY)
+            vector_push(pp->waiters, apply_merge(m));
+        return pp;
+    }
+
+    pc->stats.misses++;
+    pp = pagecache_allocate_page(pc, pages, f, index);
+    if (pp == INVALID_ADDRESS)
+        return pp;
+    pp->refcount++;
+    if (!fill) {
+        zero(pp->kvirt, PAGESIZE);
+        pp->state = PAGECACHE_PAGESTATE_READY;
+        return pp;
+    }
+
+    pagecache_debug("%s: fill f %p, index %ld\n", __func__, f, index);
+    pp->refcount++;
+    pp->waiters = allocate_vector(pc->h, 4);
+    vector_push(pp->waiters, apply_merge(m));
+    fsfile_read(f, pp->kvirt, PAGESIZE, index << PAGELOG,
+                closure(pc->h, pagecache_fill_complete, pc, pp));
+    return pp;
+}
+
+static void pagecache_drop_pages(pagecache pc, fsfile f, u64 start_index, u64 end_index)
+{
+    table pages = pagecache_file_pages(pc, f, false);
+    if (!pages)
+        return;
+    table_foreach(pages, k, v) {
+        u64 index = u64_from_pointer(k);
+        if (index >= start_index && index < end_index)
+            pagecache_page_detach(pc, (pagecache_page)v);
+    }
+}
+
+closure_function(5, 1, void, pagecache_read_complete,
+                 pagecache, pc, vector, pages, void *, dest, range, q, io_status_handler, completion,
+                 status, s)
+{
+    pagecache pc = bound(pc);
+    range q = bound(q);
+    pagecache_debug("%s: q %R, status %v\n", __func__, q, s);
+    if (is_ok(s)) {
+        pagecache_page pp;
+        vector_foreach(bound(pages), pp) {
+            range i = range_intersection(q, page_range(pp));
+            runtime_memcpy(bound(dest) + (i.start - q.start),
+                           pp->kvirt + (i.start & MASK(PAGELOG)), range_span(i));
+        }
+    }
+    pagecache_release_pages(pc, bound(pages));
+    apply(bound(completion), s, is_ok(s) ? range_span(q) : 0);
+    closure_finish();
+}
+
+void pagecache_read(fsfile f, void *dest, u64 length, u64 offset, io_status_handler completion)
+{
+    pagecache pc = global_pagecache;
+    u64 file_length = fsfile_get_length(f);
+    pagecache_debug("%s: f %p, dest %p, length %ld, offset %ld, file length %ld\n",
+                    __func__, f, dest, length, offset, file_length);
+    if (offset >= file_length || length == 0) {
+        apply(completion, STATUS_OK, 0);
+        return;
+    }
+
+    range q = irange(offset, MIN(offset + length, file_length));
+    u64 start = q.start >> PAGELOG;
+    u64 end = (q.end + MASK(PAGELOG)) >> PAGELOG;
+    table pages = pagecache_file_pages(pc, f, true);
+    pagecache_fill_range(pc, pages, f, start, end);
+    vector v = allocate_vector(pc->h, end - start);
+    merge m = allocate_merge(pc->h, closure(pc->h, pagecache_read_complete,
+                                            pc, v, dest, q, completion));
+    status_handler k = apply_merge(m);
+    status s = STATUS_OK;
+    for (u64 i = start; i < end; i++) {
+        pagecache_page pp = pagecache_get_page(pc, pages, f, i, true, m);
+        if (pp == INVALID_ADDRESS) {
+            s = timm("result", "failed to allocate page cache page");
+            break;
+        }
+        vector_push(v, pp);
+    }
+    apply(k, s);
+}
+
+static void pagecache_file_check_waiters(pagecache pc, pagecache_file pf);
+static void pagecache_arm_writeback_timer(pagecache pc);
+
+closure_function(4, 2, void, pagecache_writeback_complete,
+                 pagecache, pc, pagecache_file, pf, buffer, b, vector, pages,
+                 status, s, bytes, length)
+{
+    pagecache pc = bound(pc);
+    pagecache_file pf = bound(pf);
+    buffer b = bound(b);
+    u64 n = vector_length(bound(pages));
+    pagecache_debug("%s: f %p, %ld pages, status %v\n", __func__, pf->f, n, s);
+    /* the data is lost to storage; keep the failure for the next sync */
+    if (!is_ok(s) && is_ok(pf->error))
+        pf->error = s;
+    deallocate(pc->backed, b->contents, n << PAGELOG);
+    unwrap_buffer(pc->h, b);
+    pagecache_page pp;
+    vector_foreach(bound(pages), pp)
+        pp->writeback = false;
+    pagecache_release_pages(pc, bound(pages));
+    pc->stats.writeback -= n;
+    pf->writeback--;
+    closure_finish();
+
+    /* pages dirtied again meanwhile were held back for this write */
+    if (pf->ndirty > 0)
+        pagecache_arm_writeback_timer(pc);
+    pagecache_file_check_waiters(pc, pf);
+}
+
+/* Copy a run of adjacent dirty pages to a bounce buffer and write it
+   out, so that the pages are clean and may be dirtied again at once.
+   Each page is held under writeback until the write completes, so
+   that it is neither dropped from the cache, to be read back stale,
+   nor written again by an overlapping write. */
+static boolean pagecache_write_run(pagecache pc, pagecache_file pf, vector run)
+{
+    pagecache_page first = vector_get(run, 0);
+    u64 n = vector_length(run);
+    u64 offset = first->index << PAGELOG;
+    u64 file_length = fsfile_get_length(pf->f);
+    void *buf = allocate(pc->backed, n << PAGELOG);
+    if (buf == INVALID_ADDRESS)
+        return false;
+
+    vector pages = allocate_vector(pc->h, n);
+    pagecache_page pp;
+    u64 i = 0;
+    vector_foreach(run, pp) {
+        runtime_memcpy(buf + (i++ << PAGELOG), pp->kvirt, PAGESIZE);
+        pagecache_page_clean(pc, pf, pp);
+        pp->writeback = true;
+        pp->refcount++;
+        vector_push(pages, pp);
+    }
+
+    /* Pages hold zeros beyond the end of file, so the last sector may
+       be written whole rather than read back and merged. */
+    u64 length = MIN(n << PAGELOG, pad(file_length - offset, SECTOR_SIZE));
+    pagecache_debug("%s: f %p, offset %ld, length %ld\n", __func__, pf->f, offset, length);
+    buffer b = wrap_buffer(pc->h, buf, length);
+    pc->stats.writeback += n;
+    pf->writeback++;
+    fsfile_write(pf->f, b, offset, closure(pc->h, pagecache_writeback_complete, pc, pf, b, pages));
+    return true;
+}
+
+static boolean pagecache_page_index_compare(void *a, void *b)
+{
+    return ((pagecache_page)a)->index > ((pagecache_page)b)->index;
+}
+
+/* Write back all dirty pages of a file, coalescing adjacent pages.
+   Writes may complete before this returns, so completions must not
+   start another pass over the dirty list meanwhile. */
+static void pagecache_file_writeback(pagecache pc, pagecache_file pf)
+{
+    if (pf->ndirty == 0 || pf->collecting)
+        return;
+    pagecache_debug("%s: f %p, %ld dirty pages\n", __func__, pf->f, pf->ndirty);
+    pf->collecting = true;
+    pqueue pq = allocate_pqueue(pc->h, pagecache_page_index_compare);
+    u64 file_length = fsfile_get_length(pf->f);
+    list_foreach(&pf->dirty, l) {
+        pagecache_page pp = struct_from_list(l, pagecache_page, dirty_l);
+        /* left by a truncate racing with the write */
+        if ((pp->index << PAGELOG) >= file_length)
+            pagecache_page_clean(pc, pf, pp);
+        else if (!pp->writeback)    /* else deferred until the write in flight is done */
+            pqueue_insert(pq, pp);
+    }
+
+    boolean stalled = false;
+    vector run = allocate_vector(pc->h, PAGECACHE_WRITEBACK_RUN_MAX);
+    pagecache_page pp;
+    do {
+        pp = pqueue_pop(pq);
+        if (vector_length(run) > 0) {
+            pagecache_page last = vector_get(run, vector_length(run) - 1);
+            if (!pp || pp->index != last->index + 1 ||
+                vector_length(run) == PAGECACHE_WRITEBACK_RUN_MAX) {
+                if (!pagecache_write_run(pc, pf, run))
+                    stalled = true;
+                vector_clear(run);
+            }
+        }
+        if (pp)
+            vector_push(run, pp);
+    } while (pp);
+    deallocate_vector(run);
+    deallocate_pqueue(pq);
+    pf->collecting = false;
+
+    /* out of memory for bounce buffers; try again later */
+    if (stalled) {
+        msg_err("unable to allocate writeback buffer\n");
+        pagecache_arm_writeback_timer(pc);
+        return;
+    }
+    pagecache_file_check_waiters(pc, pf);
+}
+
+static void pagecache_writeback_all(pagecache pc)
+{
+    pagecache_debug("%s: %ld dirty pages\n", __func__, pc->stats.dirty);
+    table_foreach(pc->files, k, v) {
+        (void) k;
+        pagecache_file_writeback(pc, (pagecache_file)v);
+    }
+}
+
+/* Waiters are released once the file has no dirty pages and no
+   writes in flight. Pages dirtied in the meantime are written back
+   as soon as the previous writes are done. */
+static void pagecache_file_check_waiters(pagecache pc, pagecache_file pf)
+{
+    if (vector_length(pf->sync_waiters) == 0 || pf->writeback > 0 || pf->collecting)
+        return;
+    if (pf->ndirty > 0) {
+        pagecache_file_writeback(pc, pf);
+        return;
+    }
+    vector waiters = pf->sync_waiters;
+    pf->sync_waiters = allocate_vector(pc->h, 4);
+    status_handler sh;
+    vector_foreach(waiters, sh)
+        apply(sh, STATUS_OK);
+    deallocate_vector(waiters);
+}
+
+closure_function(1, 1, void, pagecache_writeback_timer,
+                 pagecache, pc,
+                 u64, overruns)
+{
+    pagecache pc = bound(pc);
+    pc->writeback_timer = 0;
+    pagecache_writeback_all(pc);
+    closure_finish();
+}
+
+static void pagecache_arm_writeback_timer(pagecache pc)
+{
+    if (pc->writeback_timer)
+        return;
+    pc->writeback_timer = register_timer(CLOCK_ID_MONOTONIC, PAGECACHE_WRITEBACK_DELAY, false, 0,
+                                         closure(pc->h, pagecache_writeback_timer, pc));
+    if (pc->writeback_timer == INVALID_ADDRESS) {
+        msg_err("failed to allocate writeback timer\n");
+        pc->writeback_timer = 0;
+    }
+}
+
+static void pagecache_page_dirty(pagecache pc, pagecache_file pf, pagecache_page pp)
+{
+    if (pp->dirty)
+        return;
+    pp->dirty = true;
+    list_push_back(&pf->dirty, &pp->dirty_l);
+    pf->ndirty++;
+    pc->stats.dirty++;
+}
+
+closure_function(2, 1, void, pagecache_write_throttle_complete,
+                 io_status_handler, completion, bytes, length,
+                 status, s)
+{
+    apply(bound(completion), STATUS_OK, bound(length));
+    closure_finish();
+}
+
+/* Copy the part of a write that falls in pp, which is then released.
+   The file grows as each page lands, so it never reaches past the
+   data written. */
+static void pagecache_write_page(pagecache pc, pagecache_file pf, pagecache_page pp,
+                                 void *src, range q)
+{
+    range pr = page_range(pp);
+    range i = range_intersection(q, pr);
+    runtime_memcpy(pp->kvirt + (i.start - pr.start), src + (i.start - q.start), range_span(i));
+    pagecache_page_dirty(pc, pf, pp);
+    pagecache_page_release(pc, pp);
+    fsfile_extend_length(pf->f, i.end);
+}
+
+/* The write is complete once the data is in the cache. Should a page
+   fail to fill or be allocated, the pages written so far stand. */
+static void pagecache_write_done(pagecache pc, pagecache_file pf, vector v, range q, u64 index,
+                                 status s, io_status_handler completion)
+{
+    u64 written = index << PAGELOG;
+    bytes length = written > q.start ? MIN(written, q.end) - q.start : 0;
+    pagecache_debug("%s: q %R, written %ld, status %v\n", __func__, q, length, s);
+    deallocate_vector(v);
+    if (!is_ok(s) && length == 0) {
+        apply(completion, s, 0);
+        return;
+    }
+    if (pc->stats.dirty >= pc->dirty_max) {
+        pagecache_debug("%s: throttling, %ld dirty pages\n", __func__, pc->stats.dirty);
+        vector_push(pf->sync_waiters, closure(pc->h, pagecache_write_throttle_complete,
+                                              completion, length));
+        pagecache_file_writeback(pc, pf);
+        return;
+    }
+    if (pc->stats.dirty >= pc->dirty_bg)
+        pagecache_writeback_all(pc);
+    else
+        pagecache_arm_writeback_timer(pc);
+    apply(completion, STATUS_OK, length);
+}
+
+static void pagecache_write_pages(pagecache pc, pagecache_file pf, vector v, void *src, range q,
+                                  u64 index, io_status_handler completion);
+
+closure_function(7, 1, void, pagecache_write_fill_complete,
+                 pagecache, pc, pagecache_file, pf, vector, v, void *, src, range, q, u64, index,
+                 io_status_handler, completion,
+                 status, s)
+{
+    pagecache pc = bound(pc);
+    pagecache_file pf = bound(pf);
+    vector v = bound(v);
+    void *src = bound(src);
+    range q = bound(q);
+    u64 index = bound(index);
+    io_status_handler completion = bound(completion);
+    closure_finish();
+
+    pagecache_page pp = vector_pop(v);
+    if (!is_ok(s)) {
+        if (pp)
+            pagecache_page_release(pc, pp);
+        pagecache_write_done(pc, pf, v, q, index, s, completion);
+        return;
+    }
+    pagecache_write_page(pc, pf, pp, src, q);
+    pagecache_write_pages(pc, pf, v, src, q, index + 1, completion);
+}
+
+/* Data is copied into the cache a page at a time, so that a write of
+   any size holds just the page it is copying into. A page is filled
+   first if it holds file data that the write doesn't replace, or
+   waited on if it is being filled already; the write resumes from
+   that page once the fill is done. */
+static void pagecache_write_pages(pagecache pc, pagecache_file pf, vector v, void *src, range q,
+                                  u64 index, io_status_handler completion)
+{
+    u64 end = (q.end + MASK(PAGELOG)) >> PAGELOG;
+    for (; index < end; index++) {
+        range valid = range_intersection(irange(index << PAGELOG, (index + 1) << PAGELOG),
+                                         irange(0, fsfile_get_length(pf->f)));
+        boolean fill = !range_empty(valid) && !range_contains(q, valid);
+        pagecache_page pp = table_find(pf->pages, pointer_from_u64(index));
+        if (pp ? pp->state != PAGECACHE_PAGESTATE_READY : fill) {
+            merge m = allocate_merge(pc->h, closure(pc->h, pagecache_write_fill_complete,
+                                                    pc, pf, v, src, q, index, completion));
+            status_handler k = apply_merge(m);
+            pp = pagecache_get_page(pc, pf->pages, pf->f, index, true, m);
+            if (pp == INVALID_ADDRESS) {
+                apply(k, timm("result", "failed to allocate page cache page"));
+                return;
+            }
+            vector_push(v, pp);
+            apply(k, STATUS_OK);
+            return;
+        }
+        pp = pagecache_get_page(pc, pf->pages, pf->f, index, false, 0);
+        if (pp == INVALID_ADDRESS) {
+            pagecache_write_done(pc, pf, v, q, index,
+                                 timm("result", "failed to allocate page cache page"), completion);
+            return;
+        }
+        pagecache_write_page(pc, pf, pp, src, q);
+    }
+    pagecache_write_done(pc, pf, v, q, index, STATUS_OK, completion);
+}
+
+void pagecache_write(fsfile f, void *src, u64 length, u64 offset, io_status_handler completion)
+{
+    pagecache pc = global_pagecache;
+    pagecache_debug("%s: f %p, src %p, length %ld, offset %ld, file length %ld\n",
+                    __func__, f, src, length, offset, fsfile_get_length(f));
+    if (length == 0) {
+        apply(completion, STATUS_OK, 0);
+        return;
+    }
+
+    pagecache_file pf = pagecache_get_file(pc, f, true);
+    range q = irange(offset, offset + length);
+    pagecache_write_pages(pc, pf, allocate_vector(pc->h, 1), src, q, q.start >> PAGELOG, completion);
+}
+
+/* Pages written through a shared mapping are already in the cache
+   and need only be marked dirty. Pages no longer cached, as after a
+   truncate, hold nothing to write. */
+void pagecache_dirty_range(fsfile f, u64 offset, u64 length)
+{
+    pagecache pc = global_pagecache;
+    pagecache_debug("%s: f %p, offset %ld, length %ld\n", __func__, f, offset, length);
+    pagecache_file pf = pagecache_get_file(pc, f, false);
+    if (!pf || length == 0)
+        return;
+    u64 end = (offset + length + MASK(PAGELOG)) >> PAGELOG;
+    for (u64 i = offset >> PAGELOG; i < end; i++) {
+        pagecache_page pp = table_find(pf->pages, pointer_from_u64(i));
+        if (pp && pp->state == PAGECACHE_PAGESTATE_READY)
+            pagecache_page_dirty(pc, pf, pp);
+    }
+    if (pc->stats.dirty >= pc->dirty_bg)
+        pagecache_writeback_all(pc);
+    else if (pf->ndirty > 0)
+        pagecache_arm_writeback_timer(pc);
+}
+
+closure_function(3, 1, void, pagecache_sync_complete,
+                 pagecache, pc, pagecache_file, pf, status_handler, sh,
+                 status, s)
+{
+    pagecache_file pf = bound(pf);
+    if (is_ok(s)) {
+        s = pf->error;
+        pf->error = STATUS_OK;
+    }
+    if (pagecache_file_idle(pf))
+        pagecache_queue_sweep(bound(pc));
+    apply(bound(sh), s);
+    closure_finish();
+}
+
+static void pagecache_file_sync(pagecache pc, pagecache_file pf, status_handler sh)
+{
+    status_handler c = closure(pc->h, pagecache_sync_complete, pc, pf, sh);
+    if (pf->ndirty == 0 && pf->writeback == 0) {
+        apply(c, STATUS_OK);
+        return;
+    }
+    vector_push(pf->sync_waiters, c);
+    pagecache_file_writeback(pc, pf);
+}
+
+void pagecache_sync(fsfile f, status_handler complete)
+{
+    pagecache pc = global_pagecache;
+    pagecache_debug("%s: f %p\n", __func__, f);
+    if (f) {
+        pagecache_file pf = pagecache_get_file(pc, f, false);
+        if (pf)
+            pagecache_file_sync(pc, pf, complete);
+        else
+            apply(complete, STATUS_OK);
+        return;
+    }
+    merge m = allocate_merge(pc->h, complete);
+    status_handler sh = apply_merge(m);
+    table_foreach(pc->files, k, v) {
+        (void) k;
+        pagecache_file_sync(pc, (pagecache_file)v, apply_merge(m));
+    }
+    apply(sh, STATUS_OK);
+}
+
+void pagecache_readahead(fsfile f, u64 offset, u64 length)
+{
+    pagecache pc = global_pagecache;
+    u64 file_length = fsfile_get_length(f);
+    pagecache_debug("%s: f %p, offset %ld, length %ld, file length %ld\n",
+                    __func__, f, offset, length, file_length);
+    if (offset >= file_length || length == 0)
+        return;
+    u64 start = offset >> PAGELOG;
+    /* length may be infinity, or large enough to wrap */
+    u64 limit = length > file_length - offset ? file_length : offset + length;
+    u64 end = (limit + MASK(PAGELOG)) >> PAGELOG;
+    u64 n = pc->stats.misses;
+    pagecache_fill_range(pc, pagecache_file_pages(pc, f, true), f, start, end);
+    pc->stats.readahead += pc->stats.misses - n;
+}
+
+void pagecache_drop_unused(fsfile f, u64 offset, u64 length)
+{
+    pagecache pc = global_pagecache;
+    pagecache_debug("%s: f %p, offset %ld, length %ld\n", __func__, f, offset, length);
+    table pages = pagecache_file_pages(pc, f, false);
+    if (!pages || length == 0)
+        return;
+    u64 start = offset >> PAGELOG;
+    u64 end = length > infinity - offset ? infinity : (offset + length) >> PAGELOG;
+    table_foreach(pages, k, v) {
+        u64 index = u64_from_pointer(k);
+        pagecache_page pp = v;
+        if (index >= start && index < end && pp->refcount == 0 &&
+            pp->state == PAGECACHE_PAGESTATE_READY && !pp->dirty && !pp->writeback)
+            pagecache_page_detach(pc, pp);
+    }
+}
+
+void pagecache_truncate(fsfile f, u64 offset)
+{
+    pagecache pc = global_pagecache;
+    pagecache_debug("%s: f %p, offset %ld\n", __func__, f, offset);
+
+    /* A dirty page straddling the new end keeps the data before it;
+       the remainder must read as zero should the file grow again. */
+    u64 start = offset >> PAGELOG;
+    if (offset & MASK(PAGELOG)) {
+        table pages = pagecache_file_pages(pc, f, false);
+        pagecache_page pp = pages ? table_find(pages, pointer_from_u64(start)) : 0;
+        if (pp && pp->dirty) {
+            zero(pp->kvirt + (offset & MASK(PAGELOG)), PAGESIZE - (offset & MASK(PAGELOG)));
+            start++;
+        }
+    }
+    pagecache_drop_pages(pc, f, start, infinity);
+}
+
+closure_function(3, 1, void, pagecache_get_page_ref_complete,
+                 pagecache, pc, vector, pages, pagecache_page_handler, handler,
+                 status, s)
+{
+    pagecache_page pp = vector_get(bound(pages), 0);
+    deallocate_vector(bound(pages));
+    if (!is_ok(s) && pp) {
+        pagecache_page_release(bound(pc), pp);
+        pp = 0;
+    }
+    apply(bound(handler), s, pp);
+    closure_finish();
+}
+
+void pagecache_get_page_ref(fsfile f, u64 offset, pagecache_page_handler handler)
+{
+    pagecache pc = global_pagecache;
+    pagecache_debug("%s: f %p, offset %ld\n", __func__, f, offset);
+    table pages = pagecache_file_pages(pc, f, true);
+    vector v = allocate_vector(pc->h, 1);
+    merge m = allocate_merge(pc->h, closure(pc->h, pagecache_get_page_ref_complete,
+                                            pc, v, handler));
+    status_handler k = apply_merge(m);
+    status s = STATUS_OK;
+    pagecache_page pp = pagecache_get_page(pc, pages, f, offset >> PAGELOG, true, m);
+    if (pp == INVALID_ADDRESS)
+        s = timm("result", "failed to allocate page cache page");
+    else
+        vector_push(v, pp);
+    apply(k, s);
+}
+
+void pagecache_page_ref(pagecache_page pp)
+{
+    assert(pp->refcount > 0);
+    pp->refcount++;
+}
+
+void pagecache_page_unref(pagecache_page pp)
+{
+    pagecache_page_release(global_pagecache, pp);
+}
+
+void *pagecache_page_data(pagecache_page pp)
+{
+    return pp->kvirt;
+}
+
+void pagecache_map_page(pagecache_page pp, u64 vaddr, u64 flags)
+{
+    pagecache pc = global_pagecache;
+    u64 phys = physical_from_virtual(pp->kvirt);
+    pagecache_debug("%s: f %p, index %ld, vaddr 0x%lx, phys 0x%lx\n",
+                    __func__, pp->f, pp->index, vaddr, phys);
+    assert(pp->refcount > 0);
+    if (pp->mapcount++ == 0)
+        table_set(pc->mapped, pointer_from_u64(phys), pp);
+    map(vaddr, phys, PAGESIZE, flags, pc->pages);
+}
+
+boolean pagecache_unmap_page(u64 phys)
+{
+    pagecache pc = global_pagecache;
+    pagecache_page pp = table_find(pc->mapped, pointer_from_u64(phys));
+    if (!pp)
+        return false;
+    pagecache_debug("%s: f %p, index %ld, phys 0x%lx\n", __func__, pp->f, pp->index, phys);
+    assert(pp->mapcount > 0);
+    if (--pp->mapcount == 0)
+        table_set(pc->mapped, pointer_from_u64(phys), 0);
+    pagecache_page_release(pc, pp);
+    return true;
+}
+
+void pagecache_get_stats(pagecache_stats s)
+{
+    runtime_memcpy(s, &global_pagecache->stats, sizeof(struct pagecache_stats));
+}
+
+boolean pagecache_init(kernel_heaps kh)
+{
+    heap h = heap_general(kh);
+    pagecache pc = allocate(h, sizeof(struct pagecache));
+    if (pc == INVALID_ADDRESS)
+        return false;
+    pc->h = h;
+    pc->backed = heap_backed(kh);
+    pc->physical = heap_physical(kh);
+    pc->pages = heap_pages(kh);
+    pc->files = allocate_table(h, identity_key, pointer_equal);
+    pc->mapped = allocate_table(h, identity_key, pointer_equal);
+    list_init(&pc->clock);
+    u64 total = id_heap_total(pc->physical);
+    pc->max_pages = (total >> PAGECACHE_MAX_ORDER) >> PAGELOG;
+    pc->lowmem = total >> PAGECACHE_LOWMEM_ORDER;
+    pc->dirty_bg = pc->max_pages >> PAGECACHE_DIRTY_BG_ORDER;
+    pc->dirty_max = pc->max_pages >> PAGECACHE_DIRTY_MAX_ORDER;
+    pc->writeback_timer = 0;
+    pc->sweep = closure(h, pagecache_sweep, pc);
+    pc->sweep_queued = false;
+    zero(&pc->stats, sizeof(struct pagecache_stats));
+    global_pagecache = pc;
+    return true;
+}
@@ -0,0 +1,62 @@
+/* Page cache for regular file data
+
+   Cached pages are keyed by (fsfile, page index) and shared by read,
+   write, sendfile and file-backed mmap. Writes are write-back: a write
+   completes once its data is in the cache, extending the file length
+   as needed, and dirty pages are later written to the filesystem in
+   runs of adjacent pages. pagecache_sync provides durability.
+*/
+
+typedef struct pagecache_stats {
+    u64 hits;                   /* page lookups satisfied by the cache */
+    u64 misses;                 /* page lookups requiring a fill */
+    u64 evictions;              /* pages reclaimed by the clock */
+    u64 pages;                  /* resident pages */
+    u64 readahead;              /* pages filled ahead of demand */
+    u64 dirty;                  /* pages awaiting writeback */
+    u64 writeback;              /* pages being written back */
+} *pagecache_stats;
+
+boolean pagecache_init(kernel_heaps kh);
+
+void pagecache_read(fsfile f, void *dest, u64 length, u64 offset, io_status_handler completion);
+void pagecache_write(fsfile f, void *src, u64 length, u64 offset, io_status_handler completion);
+
+/* mark cached pages in range dirty after they were modified in place */
+void pagecache_dirty_range(fsfile f, u64 offset, u64 length);
+
+/* Write back the dirty pages of a file, or of all files if f is zero,
+   completing once they and any earlier writebacks have reached the
+   filesystem. Writeback failures since the last sync are reported. */
+void pagecache_sync(fsfile f, status_handler complete);
+
+/* Start filling any uncached pages in the given range without
+   waiting for them; used for readahead and fadvise(WILLNEED). */
+void pagecache_readahead(fsfile f, u64 offset, u64 length);
+
+/* drop cached pages in range which are neither in use nor mapped */
+void pagecache_drop_unused(fsfile f, u64 offset, u64 length);
+
+/* drop all cached pages at or beyond the page containing offset */
+void pagecache_truncate(fsfile f, u64 offset);
+
+void pagecache_get_stats(pagecache_stats s);
+
+/* Individual pages may be held by reference, e.g. to transmit file
+   data without copying. A held page stays valid (though not
+   necessarily cached) until its last reference is dropped. */
+typedef struct pagecache_page *pagecache_page;
+typedef closure_type(pagecache_page_handler, void, status, pagecache_page);
+
+/* take a reference to the page holding offset, filling it as needed */
+void pagecache_get_page_ref(fsfile f, u64 offset, pagecache_page_handler handler);
+void pagecache_page_ref(pagecache_page pp);
+void pagecache_page_unref(pagecache_page pp);
+void *pagecache_page_data(pagecache_page pp);
+
+/* Map a held page into user space for a shared file mapping. The
+   caller's reference passes to the mapping and is dropped by
+   pagecache_unmap_page, which returns false if the physical page
+   doesn't belong to the cache. */
+void pagecache_map_page(pagecache_page pp, u64 vaddr, u64 flags);
+boolean pagecache_unmap_page(u64 phys);
@@ -1,5 +1,4 @@
 #include <unix_internal.h>
-#include <buffer.h>
 
 //#define PIPE_DEBUG
 #ifdef PIPE_DEBUG
@@ -8,7 +7,6 @@
 #define pipe_debug(x, ...)
 #endif
 
-#define INITIAL_PIPE_DATA_SIZE  100
 #define DEFAULT_PIPE_MAX_SIZE   (16 * PAGESIZE) /* see pipe(7) */
 #define PIPE_READ               0
 #define PIPE_WRITE              1
@@ -24,25 +22,35 @@ struct pipe_file {
     blockq bq;
 };
 
+/* Pipe data is held as references to pages: pages of our own for
+   written data, or page cache pages spliced in from a file. A page
+   may be shared by pipes after tee(), or with a socket sending from
+   it, and lives until the last reference is dropped. */
+typedef struct pipe_page {
+    u64 refcount;
+    void *data;
+    u64 size;                   /* of our own data */
+    pagecache_page pp;          /* or the cache page held */
+} *pipe_page;
+
+typedef struct pipe_buf {
+    struct list l;
+    pipe_page pg;
+    u64 offset;
+    u64 length;
+} *pipe_buf;
+
 struct pipe {
     struct pipe_file files[2];
     process proc;
     heap h;
     u64 ref_cnt;
     u64 max_size;               /* XXX: can change with F_SETPIPE_SZ */
-    buffer data;
+    struct list bufs;           /* pipe_buf, oldest first */
+    u64 length;                 /* bytes held */
+    u64 nbufs;                  /* up to max_size / PAGESIZE, as in Linux */
 };
 
-#define BUFFER_DEBUG(BUF,LENGTH) do { \
-    pipe_debug("%s:%d - requested %d -- contents %p start/end %d/%d  -- len %d %d\n", \
-        __func__, __LINE__, \
-        (LENGTH), \
-        (BUF)->contents, \
-        (BUF)->start, \
-        (BUF)->end, \
-        (BUF)->length, buffer_length((BUF))); \
-} while(0)
-
 boolean pipe_init(unix_heaps uh)
 {
     heap general = heap_general((kernel_heaps)uh);
@@ -52,6 +60,165 @@ boolean pipe_init(unix_heaps uh)
     return (uh->pipe_cache == INVALID_ADDRESS ? false : true);
 }
 
+static pipe_page pipe_page_alloc(u64 size)
+{
+    kernel_heaps kh = get_kernel_heaps();
+    pipe_page pg = allocate(heap_general(kh), sizeof(struct pipe_page));
+    if (pg == INVALID_ADDRESS)
+        return pg;
+    pg->size = pad(size, PAGESIZE);
+    pg->data = allocate(heap_backed(kh), pg->size);
+    if (pg->data == INVALID_ADDRESS) {
+        deallocate(heap_general(kh), pg, sizeof(struct pipe_page));
+        return INVALID_ADDRESS;
+    }
+    pg->refcount = 1;
+    pg->pp = 0;
+    return pg;
+}
+
+/* takes over the caller's reference to pp */
+static pipe_page pipe_page_cached(pagecache_page pp)
+{
+    pipe_page pg = allocate(heap_general(get_kernel_heaps()), sizeof(struct pipe_page));
+    if (pg == INVALID_ADDRESS)
+        return pg;
+    pg->refcount = 1;
+    pg->data = pagecache_page_data(pp);
+    pg->size = 0;
+    pg->pp = pp;
+    return pg;
+}
+
+static inline void pipe_page_ref(pipe_page pg)
+{
+    fetch_and_add(&pg->refcount, 1);
+}
+
+static void pipe_page_unref(pipe_page pg)
+{
+    if (fetch_and_add(&pg->refcount, -1) != 1)
+        return;
+    kernel_heaps kh = get_kernel_heaps();
+    if (pg->pp)
+        pagecache_page_unref(pg->pp);
+    else
+        deallocate(heap_backed(kh), pg->data, pg->size);
+    deallocate(heap_general(kh), pg, sizeof(struct pipe_page));
+}
+
+closure_function(1, 0, void, pipe_page_release,
+                 pipe_page, pg)
+{
+    pipe_page_unref(bound(pg));
+    closure_finish();
+}
+
+static inline pipe_buf pipe_head(pipe p)
+{
+    return list_empty(&p->bufs) ? 0 : struct_from_list(p->bufs.next, pipe_buf, l);
+}
+
+/* the last buffer, if written data may be added to it in place */
+static pipe_buf pipe_tail_open(pipe p)
+{
+    if (list_empty(&p->bufs))
+        return 0;
+    pipe_buf b = struct_from_list(p->bufs.prev, pipe_buf, l);
+    if (b->pg->pp || b->pg->refcount > 1 || b->offset + b->length == b->pg->size)
+        return 0;
+    return b;
+}
+
+/* bytes which can be added now */
+static u64 pipe_space(pipe p)
+{
+    if (p->length >= p->max_size)
+        return 0;
+    u64 slots = p->max_size >> PAGELOG;
+    u64 room = p->nbufs < slots ? (slots - p->nbufs) * PAGESIZE : 0;
+    pipe_buf b = pipe_tail_open(p);
+    if (b)
+        room += b->pg->size - (b->offset + b->length);
+    return MIN(room, p->max_size - p->length);
+}
+
+static inline boolean pipe_slot_free(pipe p)
+{
+    return p->length < p->max_size && p->nbufs < (p->max_size >> PAGELOG);
+}
+
+/* append a buffer referencing pg, taking over the caller's reference */
+static boolean pipe_add(pipe p, pipe_page pg, u64 offset, u64 length)
+{
+    pipe_buf b = allocate(p->h, sizeof(struct pipe_buf));
+    if (b == INVALID_ADDRESS) {
+        pipe_page_unref(pg);
+        return false;
+    }
+    b->pg = pg;
+    b->offset = offset;
+    b->length = length;
+    list_push_back(&p->bufs, &b->l);
+    p->length += length;
+    p->nbufs++;
+    return true;
+}
+
+/* drop length bytes from the front */
+static void pipe_consume(pipe p, u64 length)
+{
+    pipe_buf b;
+    while (length > 0 && (b = pipe_head(p))) {
+        u64 n = MIN(length, b->length);
+        b->offset += n;
+        b->length -= n;
+        p->length -= n;
+        length -= n;
+        if (b->length == 0) {
+            list_delete(&b->l);
+            p->nbufs--;
+            pipe_page_unref(b->pg);
+            deallocate(p->h, b, sizeof(struct pipe_buf));
+        }
+    }
+}
+
+/* write(): fill the open tail buffer, then pages of our own */
+static u64 pipe_copy_in(pipe p, void *src, u64 length)
+{
+    u64 n = 0;
+    length = MIN(length, pipe_space(p));
+    while (n < length) {
+        pipe_buf b = pipe_tail_open(p);
+        if (!b) {
+            pipe_page pg = pipe_page_alloc(PAGESIZE);
+            if (pg == INVALID_ADDRESS || !pipe_add(p, pg, 0, 0))
+                break;
+            continue;
+        }
+        u64 xfer = MIN(length - n, b->pg->size - (b->offset + b->length));
+        runtime_memcpy(b->pg->data + b->offset + b->length, src + n, xfer);
+        b->length += xfer;
+        p->length += xfer;
+        n += xfer;
+    }
+    return n;
+}
+
+static u64 pipe_copy_out(pipe p, void *dest, u64 length)
+{
+    u64 n = 0;
+    pipe_buf b;
+    while (n < length && (b = pipe_head(p))) {
+        u64 xfer = MIN(length - n, b->length);
+        runtime_memcpy(dest + n, b->pg->data + b->offset, xfer);
+        pipe_consume(p, xfer);
+        n += xfer;
+    }
+    return n;
+}
+
 static inline void pipe_notify_reader(pipe_file pf, int events)
 {
     pipe_file read_pf = &pf->pipe->files[PIPE_READ];
@@ -98,8 +265,7 @@ static void pipe_release(pipe p)
 {
     if (!p->ref_cnt || (fetch_and_add(&p->ref_cnt, -1) == 1)) {
         pipe_debug("%s(%p): deallocating pipe\n", __func__, p);
-        if (p->data != INVALID_ADDRESS)
-            deallocate_buffer(p->data);
+        pipe_consume(p, p->length);
 
         pipe_file_release(&(p->files[PIPE_READ]));
         pipe_file_release(&(p->files[PIPE_WRITE]));
@@ -149,10 +315,10 @@ closure_function(5, 1, sysreturn, pipe_read_bh,
         goto out;
     }
 
-    buffer b = pf->pipe->data;
-    rv = MIN(buffer_length(b), bound(length));
+    pipe p = pf->pipe;
+    rv = MIN(p->length, bound(length));
     if (rv == 0) {
-        if (pf->pipe->files[PIPE_WRITE].fd == -1)
+        if (p->files[PIPE_WRITE].fd == -1)
             goto out;
         if (pf->f.flags & O_NONBLOCK) {
             rv = -EAGAIN;
@@ -161,15 +327,10 @@ closure_function(5, 1, sysreturn, pipe_read_bh,
         return BLOCKQ_BLOCK_REQUIRED;
     }
 
-    buffer_read(b, bound(dest), rv);
+    pipe_copy_out(p, bound(dest), rv);
     pipe_notify_writer(pf, EPOLLOUT);
-
-    // If we have consumed all of the buffer, reset it. This might prevent future writes to allocte new buffer
-    // in buffer_write/buffer_extend. Can improve things until a proper circular buffer is available
-    if (buffer_length(b) == 0) {
-        buffer_clear(b);
+    if (p->length == 0)
         notify_dispatch(pf->f.ns, 0); /* for edge trigger */
-    }
   out:
     blockq_handle_completion(pf->bq, flags, bound(completion), bound(t), rv);
     closure_finish();
@@ -204,8 +365,7 @@ closure_function(5, 1, sysreturn, pipe_write_bh,
 
     u64 length = bound(length);
     pipe p = pf->pipe;
-    buffer b = p->data;
-    u64 avail = p->max_size - buffer_length(b);
+    u64 avail = pipe_space(p);
 
     if (avail == 0) {
         if (pf->pipe->files[PIPE_READ].fd == -1) {
@@ -219,9 +379,12 @@ closure_function(5, 1, sysreturn, pipe_write_bh,
         return BLOCKQ_BLOCK_REQUIRED;
     }
 
-    u64 real_length = MIN(length, avail);
-    buffer_write(b, bound(dest), real_length);
-    if (avail == length)
+    u64 real_length = pipe_copy_in(p, bound(dest), length);
+    if (real_length == 0) {
+        rv = -ENOMEM;
+        goto out;
+    }
+    if (pipe_space(p) == 0)
         notify_dispatch(pf->f.ns, 0); /* for edge trigger */
 
     pipe_notify_reader(pf, EPOLLIN);
@@ -252,7 +415,7 @@ closure_function(1, 1, u32, pipe_read_events,
 {
     pipe_file pf = bound(pf);
     assert(pf->f.read);
-    u32 events = buffer_length(pf->pipe->data) ? EPOLLIN : 0;
+    u32 events = pf->pipe->length ? EPOLLIN : 0;
     if (pf->pipe->files[PIPE_WRITE].fd == -1)
         events |= EPOLLIN | EPOLLHUP;
     return events;
@@ -264,12 +427,489 @@ closure_function(1, 1, u32, pipe_write_events,
 {
     pipe_file pf = bound(pf);
     assert(pf->f.write);
-    u32 events = buffer_length(pf->pipe->data) < pf->pipe->max_size ? EPOLLOUT : 0;
+    u32 events = pipe_space(pf->pipe) ? EPOLLOUT : 0;
     if (pf->pipe->files[PIPE_READ].fd == -1)
         events |= EPOLLHUP;
     return events;
 }
 
+/* splice(2), tee(2) and vmsplice(2)
+
+   Data moves between pipes by reference: a buffer taken from one pipe
+   is appended to the other without copying, and tee() leaves it in
+   both. Pages spliced in from a regular file are page cache pages, and
+   pages spliced out to a socket are sent by reference and held until
+   transmitted. Other files and user memory are copied through pages
+   of our own. As with sendfile_zc, page lookups and I/O may complete
+   synchronously, so progress is driven from a loop. */
+
+#define SPLICE_PIPE         0   /* pipe to pipe, or tee */
+#define SPLICE_TO_IOV       1
+#define SPLICE_FROM_IOV     2
+#define SPLICE_TO_SOCKET    3
+#define SPLICE_TO_FILE      4   /* any other writable fd */
+#define SPLICE_FROM_CACHE   5   /* regular file via the page cache */
+#define SPLICE_FROM_FILE    6   /* any other readable fd */
+
+typedef struct splice_op {
+    heap h;
+    thread t;
+    int kind;
+    pipe_file in;               /* pipe ends, if any */
+    pipe_file out;
+    fdesc fin;                  /* the other end */
+    fdesc fout;
+    fsfile fsf;
+    u64 *off_in;
+    u64 *off_out;
+    u64 pos;                    /* file offset for SPLICE_FROM_CACHE */
+    struct iovec *iov;
+    u64 iovcnt;
+    u64 len;
+    u64 done;
+    sysreturn rv;
+    boolean tee;
+    boolean nonblock;
+    boolean stop;
+    boolean io_pending;
+    boolean running;
+    boolean resume;
+} *splice_op;
+
+static void splice_run(splice_op op);
+
+static void splice_finish(splice_op op)
+{
+    thread t = op->t;
+    pipe_debug("%s: kind %d, done %ld, rv %ld\n", __func__, op->kind, op->done, op->rv);
+    if (op->done > 0) {
+        if (op->off_in)
+            *op->off_in += op->done;
+        else if (op->kind == SPLICE_FROM_CACHE)
+            ((file)op->fin)->offset += op->done;
+        if (op->off_out)
+            *op->off_out += op->done;
+    }
+    if (op->in)
+        pipe_release(op->in->pipe);
+    if (op->out)
+        pipe_release(op->out->pipe);
+    set_syscall_return(t, op->done > 0 ? op->done : op->rv);
+    deallocate(op->h, op, sizeof(struct splice_op));
+    file_op_maybe_wake(t);
+}
+
+/* 0 if data can be moved, 1 at end of input, BLOCKQ_BLOCK_REQUIRED
+   with the blockq to wait on, or an error */
+static sysreturn splice_check(splice_op op, blockq *bq)
+{
+    if (op->in) {
+        pipe p = op->in->pipe;
+        if (p->length == 0) {
+            if (p->files[PIPE_WRITE].fd == -1)
+                return 1;
+            *bq = op->in->bq;
+            return BLOCKQ_BLOCK_REQUIRED;
+        }
+    } else if (op->kind == SPLICE_FROM_CACHE && op->pos >= fsfile_get_length(op->fsf)) {
+        return 1;
+    }
+    if (op->out) {
+        pipe p = op->out->pipe;
+        if (p->files[PIPE_READ].fd == -1)
+            return -EPIPE;
+        if (op->kind == SPLICE_FROM_IOV ? pipe_space(p) == 0 : !pipe_slot_free(p)) {
+            *bq = op->out->bq;
+            return BLOCKQ_BLOCK_REQUIRED;
+        }
+    }
+    return 0;
+}
+
+closure_function(1, 2, void, splice_wait_complete,
+                 splice_op, op,
+                 thread, t, sysreturn, rv)
+{
+    splice_op op = bound(op);
+    /* woken from the wait; I/O from here on is uninterruptible */
+    if (thread_in_interruptible_sleep(t))
+        t->blocked_on = INVALID_ADDRESS;
+    if (rv < 0) {
+        op->rv = rv;
+        op->stop = true;
+    }
+    closure_finish();
+    splice_run(op);
+}
+
+/* Also completes if the other end is now the one to wait on, so that
+   the run loop may queue there instead. */
+closure_function(2, 1, sysreturn, splice_wait,
+                 splice_op, op, blockq, bq,
+                 u64, flags)
+{
+    splice_op op = bound(op);
+    blockq wait_bq = bound(bq);
+    blockq bq;
+    sysreturn rv = splice_check(op, &bq);
+    if (rv == BLOCKQ_BLOCK_REQUIRED) {
+        if (flags & BLOCKQ_ACTION_NULLIFY)
+            rv = -EINTR;
+        else if (bq == wait_bq)
+            return rv;
+        else
+            rv = 0;
+    } else if (rv > 0) {
+        rv = 0;
+    }
+    blockq_handle_completion(wait_bq, flags, closure(op->h, splice_wait_complete, op), op->t, rv);
+    closure_finish();
+    return rv;
+}
+
+/* append buffers from the front of in to out by reference */
+static u64 pipe_move(pipe in, pipe out, u64 length, boolean tee)
+{
+    u64 n = 0;
+    list l = in->bufs.next;
+    while (n < length && l != &in->bufs && pipe_slot_free(out)) {
+        pipe_buf b = struct_from_list(l, pipe_buf, l);
+        l = l->next;
+        u64 xfer = MIN(MIN(b->length, length - n), out->max_size - out->length);
+        pipe_page_ref(b->pg);
+        if (!pipe_add(out, b->pg, b->offset, xfer))
+            break;
+        if (!tee)
+            pipe_consume(in, xfer);
+        n += xfer;
+    }
+    return n;
+}
+
+static u64 splice_iov(splice_op op)
+{
+    u64 n = 0;
+    for (u64 i = 0; i < op->iovcnt; i++) {
+        void *base = op->iov[i].iov_base;
+        u64 len = op->iov[i].iov_len;
+        u64 xfer = op->kind == SPLICE_FROM_IOV ? pipe_copy_in(op->out->pipe, base, len) :
+            pipe_copy_out(op->in->pipe, base, len);
+        n += xfer;
+        if (xfer < len)
+            break;
+    }
+    return n;
+}
+
+closure_function(3, 2, void, splice_written,
+                 splice_op, op, pipe_page, pg, u64, length,
+                 thread, t, sysreturn, rv)
+{
+    splice_op op = bound(op);
+    op->io_pending = false;
+    if (op->kind != SPLICE_TO_SOCKET)
+        pipe_page_unref(bound(pg));
+    if (rv > 0) {
+        pipe_consume(op->in->pipe, rv);
+        pipe_notify_writer(op->in, EPOLLOUT);
+        op->done += rv;
+        if (rv < bound(length))
+            op->stop = true;
+    } else {
+        op->rv = rv;
+        op->stop = true;
+    }
+    closure_finish();
+    splice_run(op);
+}
+
+closure_function(2, 2, void, splice_read,
+                 splice_op, op, pipe_page, pg,
+                 thread, t, sysreturn, rv)
+{
+    splice_op op = bound(op);
+    op->io_pending = false;
+    if (rv <= 0) {
+        pipe_page_unref(bound(pg));
+        op->rv = rv;
+    } else if (pipe_add(op->out->pipe, bound(pg), 0, rv)) {
+        pipe_notify_reader(op->out, EPOLLIN);
+        op->done += rv;
+    } else {
+        op->rv = -ENOMEM;
+    }
+    op->stop = true;
+    closure_finish();
+    splice_run(op);
+}
+
+closure_function(1, 2, void, splice_page,
+                 splice_op, op,
+                 status, s, pagecache_page, pp)
+{
+    splice_op op = bound(op);
+    if (!is_ok(s)) {
+        op->rv = -EIO;
+        op->stop = true;
+        goto out;
+    }
+    pipe p = op->out->pipe;
+    u64 end = MIN(fsfile_get_length(op->fsf), op->pos + (op->len - op->done));
+    u64 n = MIN(end, (op->pos & ~MASK(PAGELOG)) + PAGESIZE) - op->pos;
+    n = MIN(n, p->max_size - p->length);
+    pipe_page pg = pipe_page_cached(pp);
+    if (pg == INVALID_ADDRESS) {
+        pagecache_page_unref(pp);
+        op->rv = -ENOMEM;
+        op->stop = true;
+    } else if (!pipe_add(p, pg, op->pos & MASK(PAGELOG), n)) {
+        op->rv = -ENOMEM;
+        op->stop = true;
+    } else {
+        pipe_notify_reader(op->out, EPOLLIN);
+        op->pos += n;
+        op->done += n;
+    }
+  out:
+    closure_finish();
+    splice_run(op);
+}
+
+/* move the next piece; any I/O issued completes to splice_run */
+static void splice_xfer(splice_op op)
+{
+    thread t = op->t;
+    sysreturn rv;
+    u64 n;
+
+    switch (op->kind) {
+    case SPLICE_PIPE:
+    case SPLICE_TO_IOV:
+    case SPLICE_FROM_IOV:
+        n = op->kind == SPLICE_PIPE ?
+            pipe_move(op->in->pipe, op->out->pipe, op->len - op->done, op->tee) : splice_iov(op);
+        if (n == 0)
+            op->rv = -ENOMEM;
+        if (op->in && !op->tee)
+            pipe_notify_writer(op->in, EPOLLOUT);
+        if (op->out)
+            pipe_notify_reader(op->out, EPOLLIN);
+        op->done += n;
+        op->stop = true;
+        break;
+    case SPLICE_TO_SOCKET:
+    case SPLICE_TO_FILE: {
+        pipe_buf b = pipe_head(op->in->pipe);
+        n = MIN(b->length, op->len - op->done);
+        pipe_page_ref(b->pg);
+        io_completion c = closure(op->h, splice_written, op, b->pg, n);
+        op->io_pending = true;
+#ifdef NET
+        if (op->kind == SPLICE_TO_SOCKET)
+            rv = socket_write_zerocopy(op->fout, b->pg->data + b->offset, n,
+                                       closure(op->h, pipe_page_release, b->pg), t, c);
+        else
+#endif
+            rv = apply(op->fout->write, b->pg->data + b->offset, n,
+                       op->off_out ? *op->off_out + op->done : infinity, t, true, c);
+        if (op->io_pending && rv != SYSRETURN_CONTINUE_BLOCKING)
+            apply(c, t, rv);
+        break;
+    }
+    case SPLICE_FROM_CACHE:
+        pagecache_get_page_ref(op->fsf, op->pos, closure(op->h, splice_page, op));
+        break;
+    case SPLICE_FROM_FILE: {
+        pipe p = op->out->pipe;
+        n = MIN(op->len - op->done, p->max_size - p->length);
+        pipe_page pg = pipe_page_alloc(n);
+        if (pg == INVALID_ADDRESS) {
+            op->rv = -ENOMEM;
+            op->stop = true;
+            break;
+        }
+        io_completion c = closure(op->h, splice_read, op, pg);
+        op->io_pending = true;
+        rv = apply(op->fin->read, pg->data, n, op->off_in ? *op->off_in : infinity, t, true, c);
+        if (op->io_pending && rv != SYSRETURN_CONTINUE_BLOCKING)
+            apply(c, t, rv);
+        break;
+    }
+    }
+}
+
+static void splice_run(splice_op op)
+{
+    if (op->running) {
+        op->resume = true;
+        return;
+    }
+    op->running = true;
+    do {
+        op->resume = false;
+        if (op->stop || op->done == op->len) {
+            splice_finish(op);
+            return;
+        }
+        blockq bq;
+        sysreturn rv = splice_check(op, &bq);
+        if (rv == BLOCKQ_BLOCK_REQUIRED) {
+            /* return what has been moved rather than wait for more */
+            if (op->done > 0 || op->nonblock) {
+                op->rv = -EAGAIN;
+                splice_finish(op);
+                return;
+            }
+            if (blockq_check(bq, op->t, closure(op->h, splice_wait, op, bq), true) == -EAGAIN) {
+                op->rv = -EAGAIN;
+                op->stop = op->resume = true;
+            }
+            continue;
+        }
+        if (rv != 0) {
+            if (rv < 0)
+                op->rv = rv;
+            splice_finish(op);
+            return;
+        }
+        splice_xfer(op);
+    } while (op->resume);
+    op->running = false;
+}
+
+static splice_op splice_alloc(int kind, pipe_file in, fdesc fin, pipe_file out, fdesc fout,
+                              u64 len, boolean nonblock)
+{
+    heap h = heap_general(get_kernel_heaps());
+    splice_op op = allocate(h, sizeof(struct splice_op));
+    if (op == INVALID_ADDRESS)
+        return op;
+    zero(op, sizeof(struct splice_op));
+    op->h = h;
+    op->t = current;
+    op->kind = kind;
+    op->in = in;
+    op->out = out;
+    op->fin = fin;
+    op->fout = fout;
+    op->len = len;
+    op->nonblock = nonblock;
+    return op;
+}
+
+static sysreturn splice_start(splice_op op)
+{
+    thread t = op->t;
+    pipe_debug("%s: kind %d, len %ld, nonblock %d\n", __func__, op->kind, op->len, op->nonblock);
+
+    /* the pipes stay around until we're done, even if closed */
+    if (op->in)
+        fetch_and_add(&op->in->pipe->ref_cnt, 1);
+    if (op->out)
+        fetch_and_add(&op->out->pipe->ref_cnt, 1);
+    file_op_begin(t);
+    splice_run(op);
+
+    u64 flags = irq_disable_save();
+    if (!t->file_op_is_complete) {
+        if (t->blocked_on)
+            thread_sleep_interruptible();
+        thread_sleep_uninterruptible();
+    }
+    irq_restore(flags);
+    return get_syscall_return(t);
+}
+
+static inline pipe_file pipe_file_of(fdesc f)
+{
+    return f->type == FDESC_TYPE_PIPE ? (pipe_file)f : 0;
+}
+
+sysreturn pipe_splice(fdesc in, u64 *off_in, fsfile in_fsf, fdesc out, u64 *off_out, u64 len,
+                      unsigned int flags)
+{
+    if (flags & ~(SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT))
+        return -EINVAL;
+    if (!in->read || !out->write)
+        return -EBADF;
+    pipe_file pin = pipe_file_of(in);
+    pipe_file pout = pipe_file_of(out);
+    if (!pin && !pout)
+        return -EINVAL;
+    if (pin && pout && pin->pipe == pout->pipe)
+        return -EINVAL;
+    if ((off_in && in->type != FDESC_TYPE_REGULAR) || (off_out && out->type != FDESC_TYPE_REGULAR))
+        return -ESPIPE;
+    if (len == 0)
+        return 0;
+
+    int kind;
+    if (pin && pout)
+        kind = SPLICE_PIPE;
+    else if (pin)
+        kind = out->type == FDESC_TYPE_SOCKET ? SPLICE_TO_SOCKET : SPLICE_TO_FILE;
+    else
+        kind = in_fsf ? SPLICE_FROM_CACHE : SPLICE_FROM_FILE;
+    splice_op op = splice_alloc(kind, pin, in, pout, out, len, (flags & SPLICE_F_NONBLOCK) != 0);
+    if (op == INVALID_ADDRESS)
+        return -ENOMEM;
+    op->fsf = in_fsf;
+    op->off_in = off_in;
+    op->off_out = off_out;
+    if (kind == SPLICE_FROM_CACHE)
+        op->pos = off_in ? *off_in : ((file)in)->offset;
+    return splice_start(op);
+}
+
+sysreturn pipe_tee(fdesc in, fdesc out, u64 len, unsigned int flags)
+{
+    if (flags & ~(SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT))
+        return -EINVAL;
+    pipe_file pin = pipe_file_of(in);
+    pipe_file pout = pipe_file_of(out);
+    if (!pin || !pout || pin->pipe == pout->pipe)
+        return -EINVAL;
+    if (!in->read || !out->write)
+        return -EBADF;
+    if (len == 0)
+        return 0;
+
+    splice_op op = splice_alloc(SPLICE_PIPE, pin, in, pout, out, len, (flags & SPLICE_F_NONBLOCK) != 0);
+    if (op == INVALID_ADDRESS)
+        return -ENOMEM;
+    op->tee = true;
+    return splice_start(op);
+}
+
+/* No page mapping here: the data is copied to or from user memory, so
+   SPLICE_F_GIFT has no effect. */
+sysreturn pipe_vmsplice(fdesc f, struct iovec *iov, u64 nr_segs, unsigned int flags)
+{
+    if (flags & ~(SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT))
+        return -EINVAL;
+    pipe_file pf = pipe_file_of(f);
+    if (!pf)
+        return -EBADF;
+    if (nr_segs > IOV_MAX)
+        return -EINVAL;
+
+    u64 len = 0;
+    for (u64 i = 0; i < nr_segs; i++)
+        len += iov[i].iov_len;
+    if (len == 0)
+        return 0;
+
+    boolean nonblock = (flags & SPLICE_F_NONBLOCK) || (f->flags & O_NONBLOCK);
+    splice_op op = f->write ?
+        splice_alloc(SPLICE_FROM_IOV, 0, 0, pf, f, len, nonblock) :
+        splice_alloc(SPLICE_TO_IOV, pf, f, 0, 0, len, nonblock);
+    if (op == INVALID_ADDRESS)
+        return -ENOMEM;
+    op->iov = iov;
+    op->iovcnt = nr_segs;
+    return splice_start(op);
+}
+
 int do_pipe2(int fds[2], int flags)
 {
     unix_heaps uh = get_unix_heaps();
@@ -289,8 +929,10 @@ int do_pipe2(int fds[2], int flags)
     }
 
     pipe->h = heap_general((kernel_heaps)uh);
-    pipe->data = INVALID_ADDRESS;
     pipe->proc = current->p;
+    list_init(&pipe->bufs);
+    pipe->length = 0;
+    pipe->nbufs = 0;
 
     pipe->files[PIPE_READ].fd = -1;
     pipe->files[PIPE_READ].pipe = pipe;
@@ -303,12 +945,6 @@ int do_pipe2(int fds[2], int flags)
     pipe->ref_cnt = 0;
     pipe->max_size = DEFAULT_PIPE_MAX_SIZE;
 
-    pipe->data = allocate_buffer(pipe->h, INITIAL_PIPE_DATA_SIZE);
-    if (pipe->data == INVALID_ADDRESS) {
-        msg_err("failed to allocate pipe's data buffer\n");
-        goto err;
-    }
-
     /* init reader */
     {
         pipe_file reader = &pipe->files[PIPE_READ];
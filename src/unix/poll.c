@@ -16,12 +16,16 @@ typedef struct epollfd {
     int fd;
     u32 eventmask;  /* epoll events registered - XXX need lock */
     u32 lastevents; /* retain last received events; for edge trigger */
+    u32 pending;    /* edges yet to be reported; for edge trigger */
     u64 data;	    /* may be multiple versions of data? */
     struct refcount refcount;
     closure_struct(epollfd_free, free);
     epoll e;
     boolean registered;
     boolean zombie;		/* freed or masked by oneshot */
+    boolean onready;		/* on epoll ready list, holding a reference */
+    struct list ready_l;
+    thread target;		/* if readied by events for one thread only */
     notify_entry notify_handle;
 } *epollfd;
 
@@ -72,6 +76,7 @@ struct epoll {
     vector events;		/* epollfds indexed by fd */
     int nfds;
     bitmap fds;			/* fds being watched / epollfd registered */
+    struct list ready;		/* epollfds with events to report (epoll only) */
 };
     
 define_closure_function(1, 0, void, epoll_free,
@@ -93,6 +98,7 @@ static epoll epoll_alloc_internal(void)
 	return e;
 
     list_init(&e->blocked_head);
+    list_init(&e->ready);
     init_refcount(&e->refcount, 1, init_closure(&e->free, epoll_free, e));
     e->h = heap_general(get_kernel_heaps());
     e->events = allocate_vector(e->h, 8);
@@ -130,11 +136,14 @@ static epollfd alloc_epollfd(epoll e, int fd, u32 eventmask, u64 data)
     efd->fd = fd;
     efd->eventmask = eventmask;
     efd->lastevents = 0;
+    efd->pending = 0;
     efd->e = e;
     efd->data = data;
     init_refcount(&efd->refcount, 1, init_closure(&efd->free, epollfd_free, efd));
     efd->registered = false;
     efd->zombie = false;
+    efd->onready = false;
+    efd->target = 0;
     vector_set(e->events, fd, efd);
     bitmap_set(e->fds, fd, 1);
     if (fd >= e->nfds)
@@ -154,6 +163,24 @@ static void unregister_epollfd(epollfd efd)
     refcount_release(&efd->refcount); /* registration */
 }
 
+static void epollfd_ready(epollfd efd)
+{
+    if (efd->onready)
+        return;
+    efd->onready = true;
+    refcount_reserve(&efd->refcount);
+    list_push_back(&efd->e->ready, &efd->ready_l);
+}
+
+static void epollfd_unready(epollfd efd)
+{
+    if (!efd->onready)
+        return;
+    efd->onready = false;
+    list_delete(&efd->ready_l);
+    refcount_release(&efd->refcount);
+}
+
 static void release_epollfd(epollfd efd)
 {
     epoll e = efd->e;
@@ -163,6 +190,7 @@ static void release_epollfd(epollfd efd)
     vector_set(e->events, fd, 0);
     bitmap_set(e->fds, fd, 0);
     efd->zombie = true;
+    epollfd_unready(efd);
     if (efd->registered)
         unregister_epollfd(efd);
     refcount_release(&efd->refcount); /* alloc */
@@ -276,55 +304,145 @@ static inline u32 report_from_notify_events(epollfd efd, u64 notify_events)
     return edge_detect ? ~efd->lastevents & events : events;
 }
 
-closure_function(1, 2, void, epoll_wait_notify,
+/* Place efd on the ready list if events are to be reported */
+static boolean epollfd_post(epollfd efd, u32 events, thread t)
+{
+    u32 report = report_from_notify_events(efd, events);
+    epoll_debug("efd->fd %d, events 0x%x, report 0x%x, zombie %d\n",
+                efd->fd, events, report, efd->zombie);
+    if (efd->eventmask & EPOLLET)
+        efd->pending = (efd->pending & events) | report;
+    if (report == 0 || efd->zombie)
+        return false;
+
+    /* Thread-specific events (signalfd) are left on the ready list
+       for that thread to collect; once they're mixed with events for
+       another thread, or for any, the entry is anyone's. */
+    if (!efd->onready)
+        efd->target = t;
+    else if (efd->target != t)
+        efd->target = 0;
+    epollfd_ready(efd);
+    return true;
+}
+
+/* Notifications place an epollfd on the ready list of its epoll and
+   wake a waiter, which collects events from the ready list; idle fds
+   cost nothing per epoll_wait that finds events there. Returns
+   true if the event was claimed by a waiter on an EPOLLEXCLUSIVE
+   registration, in which case it isn't offered to other exclusive
+   registrations. */
+static boolean epollfd_event(epollfd efd, u64 notify_events, thread t)
+{
+    if (!epollfd_post(efd, (u32)notify_events, t))
+        return false;
+
+    /* thread-specific events (signalfd) are only for that thread's waiter */
+    epoll_blocked w = 0;
+    list_foreach(&efd->e->blocked_head, l) {
+        epoll_blocked b = struct_from_list(l, epoll_blocked, blocked_list);
+        if (!t || b->t == t) {
+            w = b;
+            break;
+        }
+    }
+    if (!w)
+        return false;
+    epoll_debug("   waking tid %d\n", w->t->tid);
+    blockq_wake_one(w->t->thread_bq);
+    return (efd->eventmask & EPOLLEXCLUSIVE) != 0;
+}
+
+closure_function(1, 2, boolean, epoll_wait_notify,
                  epollfd, efd,
                  u64, notify_events,
                  thread, t)
 {
     epollfd efd = bound(efd);
-    list l = list_get_next(&efd->e->blocked_head);
 
     /* only path to freedom - even fd removals trigger release */
     if (notify_events == NOTIFY_EVENTS_RELEASE) {
         epoll_debug("efd->fd %d unregistered\n", efd->fd);
         efd->registered = false;
         closure_finish();
-        return;
+
+        /* A closed fd leaves the epoll set. If this is instead the
+           result of removal, the registration is released there. */
+        if (vector_get(efd->e->events, efd->fd) == efd) {
+            release_epollfd(efd);
+            refcount_release(&efd->refcount); /* registration */
+        }
+        return false;
     }
 
-    epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
-    u32 events = (u32)notify_events;
-    u32 report = report_from_notify_events(efd, events);
     assert(efd->registered);
-    epoll_debug("efd->fd %d, events 0x%x, report 0x%x, blocked %p, zombie %d\n",
-                efd->fd, events, report, w, efd->zombie);
-
-    /* XXX need to do some work to properly dole out to multiple epoll_waits (threads)... */
-    if (report == 0 || !w || efd->zombie)
-        return;
+    return epollfd_event(efd, notify_events, t);
+}
 
-    if (t && t != w->t)
-        return;
+/* Move events from the ready list to the waiter's buffer. Entries for
+   edge-triggered fds are reported from the edges accumulated since
+   the last report; level-triggered ones are checked anew and, if still
+   ready, requeued behind the others so that a later wait finds them
+   without another notification. Entries readied for another thread
+   alone are left for that thread unless this one has events too. */
+static void epoll_collect_ready(epoll_blocked w)
+{
+    epoll e = w->e;
+    buffer b = w->user_events;
+    list l;
+    struct list requeue;
+    list_init(&requeue);
+    while (b->end + sizeof(struct epoll_event) <= b->length &&
+           (l = list_get_next(&e->ready))) {
+        epollfd efd = struct_from_list(l, epollfd, ready_l);
+        list_delete(l);
+        boolean other = efd->target && efd->target != w->t;
+        u32 report = 0;
+        if (!efd->zombie) {
+            if (efd->eventmask & EPOLLET) {
+                if (other) {
+                    list_push_back(&requeue, l);
+                    continue;
+                }
+                report = efd->pending;
+                efd->pending = 0;
+            } else {
+                fdesc f = resolve_fd_noret(w->t->p, efd->fd);
+                if (f)
+                    report = apply(f->events, w->t) & efd->eventmask;
+                if (f && report == 0 && other) {
+                    list_push_back(&requeue, l);
+                    continue;
+                }
+            }
+        }
+        if (report == 0) {
+            efd->onready = false;
+            refcount_release(&efd->refcount);
+            continue;
+        }
 
-    if (!w->user_events || (w->user_events->length - w->user_events->end) <= 0) {
-        /* XXX here we should advance to the next blocked head, probably */
-        epoll_debug("   user_events null or full\n");
-        return;
+        struct epoll_event *ev = buffer_ref(b, b->end);
+        ev->data = efd->data;
+        ev->events = report;
+        b->end += sizeof(struct epoll_event);
+        epoll_debug("   fd %d, data 0x%lx, events 0x%x\n", efd->fd, ev->data, ev->events);
+        efd->lastevents |= report;
+        if (efd->eventmask & EPOLLONESHOT)
+            efd->zombie = true;
+
+        if (!(efd->eventmask & (EPOLLET | EPOLLONESHOT))) {
+            list_push_back(&requeue, l);
+        } else {
+            efd->onready = false;
+            refcount_release(&efd->refcount);
+        }
     }
 
-    struct epoll_event *e = buffer_ref(w->user_events, w->user_events->end);
-    e->data = efd->data;
-    e->events = report;
-    w->user_events->end += sizeof(struct epoll_event);
-    epoll_debug("   epoll_event %p, data 0x%lx, events 0x%x\n", e, e->data, e->events);
-
-    /* XXX check this */
-    if (efd->eventmask & EPOLLONESHOT)
-        efd->zombie = true;
-
-    /* now that we've reported these events, update last */
-    efd->lastevents |= report;
-    blockq_wake_one(w->t->thread_bq);
+    while ((l = list_get_next(&requeue))) {
+        list_delete(l);
+        list_push_back(&e->ready, l);
+    }
 }
 
 static epoll_blocked alloc_epoll_blocked(epoll e)
@@ -349,6 +467,26 @@ static void check_fdesc(fdesc f, thread t)
     notify_dispatch_for_thread(f->ns, apply(f->events, t), t);
 }
 
+static void epollfd_check(epollfd efd, fdesc f, thread t)
+{
+    epollfd_event(efd, apply(f->events, t) & efd->eventmask, t);
+}
+
+/* Not every change of fd state is notified (that of lwIP sockets,
+   for one), so a waiter that finds nothing on the ready list polls
+   the registered fds before blocking or returning. */
+static boolean epoll_poll_fds(epoll e, thread t)
+{
+    boolean ready = false;
+    bitmap_foreach_set(e->fds, fd) {
+        epollfd efd = vector_get(e->events, fd);
+        fdesc f = resolve_fd_noret(t->p, fd);
+        if (f && epollfd_post(efd, apply(f->events, t) & efd->eventmask, t))
+            ready = true;
+    }
+    return ready;
+}
+
 /* It would be nice to devise a way to allow a poll waiter to continue
    to collect events between wakeup (first event) and running. */
 
@@ -359,6 +497,11 @@ closure_function(3, 1, sysreturn, epoll_wait_bh,
     sysreturn rv;
     thread t = bound(t);
     epoll_blocked w = bound(w);
+    if (buffer_length(w->user_events) == 0) {
+        epoll_collect_ready(w);
+        if (buffer_length(w->user_events) == 0 && epoll_poll_fds(w->e, t))
+            epoll_collect_ready(w);
+    }
     int eventcount = user_event_count(w);
 
     epoll_debug("w %p on tid %d, blockable %d, flags 0x%lx, event count %d\n",
@@ -389,12 +532,10 @@ closure_function(3, 1, sysreturn, epoll_wait_bh,
 }
 
 /* Depending on the epoll flags given, we may:
-   - notify all waiters on a match (default)
-   - notify on a match only once until condition is reset (EPOLLET)
-   - notify once before removing the registration, handled upstream (EPOLLONESHOT)
-   - notify only one matching waiter, even across multiple epoll instances (EPOLLEXCLUSIVE)
-     - XXX Not implemented; will require tracking reported events on a per fd - not per
-           registration - basis.
+   - report an event for as long as the condition holds (default)
+   - report an event only once until condition is reset (EPOLLET)
+   - report once before masking the registration (EPOLLONESHOT)
+   - wake only one waiter, even across multiple epoll instances (EPOLLEXCLUSIVE)
 */
 sysreturn epoll_wait(int epfd,
                      struct epoll_event *events,
@@ -410,28 +551,6 @@ sysreturn epoll_wait(int epfd,
     w->epoll_type = EPOLL_TYPE_EPOLL;
     w->user_events = wrap_buffer(e->h, events, maxevents * sizeof(struct epoll_event));
     w->user_events->end = 0;
-
-    bitmap_foreach_set(e->fds, fd) {
-	epollfd efd = vector_get(e->events, fd);
-	assert(efd);
-        assert(efd->fd == fd);
-
-        if (efd->zombie)
-            continue;
-
-        fdesc f = resolve_fd_noret(current->p, efd->fd);
-        if (!f) {
-            epoll_debug("   x fd %d\n", efd->fd);
-            release_epollfd(efd);
-            continue;
-        }
-
-        /* event transitions may in some cases need to be polled for
-           (e.g. due to change in lwIP internal state), so request a check */
-        if (efd->registered)
-            check_fdesc(f, current);
-    }
-
     return blockq_check_timeout(w->t->thread_bq, current,
                                 closure(e->h, epoll_wait_bh, w, current, timeout != 0), false,
                                 CLOCK_ID_MONOTONIC, timeout > 0 ? milliseconds(timeout) : 0, false);
@@ -448,16 +567,19 @@ static epollfd epollfd_from_fd(epoll e, int fd)
 
 static void epollfd_update(epollfd efd, fdesc f)
 {
-    /* It may seem excessive to perform a check for all
-       waiters. However, thanks to thread-specific fd events (thanks
-       in turn to signalfd), we could have independent events for
-       multiple threads that require waking - even on the same fd. */
+    /* Seed the ready list with the current state of the fd. Thanks
+       to thread-specific fd events (thanks in turn to signalfd), we
+       could have independent events for multiple threads that require
+       waking - even on the same fd - so check for each waiter too. */
 
     /* XXX take lock */
+    epollfd_check(efd, f, current);
     list_foreach(&efd->e->blocked_head, l) {
         epoll_blocked w = struct_from_list(l, epoll_blocked, blocked_list);
+        if (w->t == current)
+            continue;
         epoll_debug("   posting check for blocked waiter (tid %d)\n", w->t->tid);
-        check_fdesc(f, w->t);
+        epollfd_check(efd, f, w->t);
     }
     /* XXX release lock */
 }
@@ -506,11 +628,10 @@ sysreturn epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
         return set_syscall_error(current, EFAULT);
     }
 
-    /* EPOLLEXCLUSIVE not yet implemented */
-    if (event && (event->events & EPOLLEXCLUSIVE)) {
-        msg_err("add: EPOLLEXCLUSIVE not supported\n");
+    /* EPOLLEXCLUSIVE may only be given on add, and not with oneshot */
+    if (event && (event->events & EPOLLEXCLUSIVE) &&
+        (op != EPOLL_CTL_ADD || (event->events & EPOLLONESHOT)))
         return set_syscall_error(current, EINVAL);
-    }
 
     if ((f->type == FDESC_TYPE_REGULAR) || (f->type == FDESC_TYPE_DIRECTORY)) {
 	return set_syscall_error(current, EPERM);
@@ -524,6 +645,9 @@ sysreturn epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
         return set_syscall_return(current, remove_fd(e, fd));
     case EPOLL_CTL_MOD:
 	epoll_debug("   modifying %d, events 0x%x, data 0x%lx\n", fd, event->events, event->data);
+        epollfd efd = epollfd_from_fd(e, fd);
+        if (efd != INVALID_ADDRESS && (efd->eventmask & EPOLLEXCLUSIVE))
+            return set_syscall_error(current, EINVAL);
         sysreturn rv = remove_fd(e, fd);
         if (rv != 0)
             return set_syscall_return(current, rv);
@@ -542,7 +666,7 @@ sysreturn epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 #define POLLFDMASK_WRITE	(EPOLLOUT | EPOLLHUP | EPOLLERR)
 #define POLLFDMASK_EXCEPT	(EPOLLPRI)
 
-closure_function(1, 2, void, select_notify,
+closure_function(1, 2, boolean, select_notify,
                  epollfd, efd,
                  u64, notify_events,
                  thread, t)
@@ -554,7 +678,7 @@ closure_function(1, 2, void, select_notify,
         epoll_debug("efd->fd %d unregistered\n", efd->fd);
         efd->registered = false;
         closure_finish();
-        return;
+        return false;
     }
 
     epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
@@ -563,10 +687,10 @@ closure_function(1, 2, void, select_notify,
 	    efd->fd, events, w, efd->zombie);
 
     if (efd->zombie || !w || efd->fd >= w->nfds)
-        return;
+        return false;
 
     if (t && t != w->t)
-        return;
+        return false;
 
     assert(w->epoll_type == EPOLL_TYPE_SELECT);
     int count = 0;
@@ -589,6 +713,7 @@ closure_function(1, 2, void, select_notify,
         epoll_debug("   event on %d, events 0x%x\n", efd->fd, events);
         blockq_wake_one(w->t->thread_bq);
     }
+    return false;
 }
 
 closure_function(3, 1, sysreturn, select_bh,
@@ -779,7 +904,7 @@ sysreturn select(int nfds,
     return select_internal(nfds, readfds, writefds, exceptfds, timeout ? time_from_timeval(timeout) : infinity, 0);
 }
 
-closure_function(1, 2, void, poll_notify,
+closure_function(1, 2, boolean, poll_notify,
                  epollfd, efd,
                  u64, notify_events,
                  thread, t)
@@ -791,7 +916,7 @@ closure_function(1, 2, void, poll_notify,
         epoll_debug("efd->fd %d unregistered\n", efd->fd);
         efd->registered = false;
         closure_finish();
-        return;
+        return false;
     }
 
     epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
@@ -801,16 +926,17 @@ closure_function(1, 2, void, poll_notify,
     assert(efd->registered);
 
     if (events == 0 || !w || efd->zombie)
-        return;
+        return false;
 
     if (t && t != w->t)
-        return;
+        return false;
 
     struct pollfd *pfd = buffer_ref(w->poll_fds, efd->data * sizeof(struct pollfd));
     fetch_and_add(&w->poll_retcount, 1);
     pfd->revents = events;
     epoll_debug("   event on %d (%d), events 0x%x\n", efd->fd, pfd->fd, pfd->revents);
     blockq_wake_one(w->t->thread_bq);
+    return false;
 }
 
 closure_function(3, 1, sysreturn, poll_bh,
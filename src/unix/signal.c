@@ -393,7 +393,7 @@ static void setup_ucontext(struct ucontext * uctx, struct sigaction * sa,
 {
     struct sigcontext * mcontext = &(uctx->uc_mcontext);
 
-    /* XXX for now we ignore everything but mcontext, incluing FP state ... */
+    /* XXX for now we ignore everything but mcontext; FP state is set up separately */
 
     runtime_memset((void *)uctx, 0, sizeof(struct ucontext));
     mcontext->r8 = f[FRAME_R8];
@@ -452,6 +452,49 @@ static void restore_ucontext(struct ucontext * uctx, context f)
     f[FRAME_CS] = mcontext->cs;
 }
 
+static inline u64 fpstate_frame_size(void)
+{
+    return fpu_state_size + (fpu_xfeatures ? FP_XSTATE_MAGIC2_SIZE : 0);
+}
+
+/*
+ * Copy the extended register state of thread t to *fp, in the layout
+ * Linux uses, and give the handler a clean state to run with
+ */
+static void setup_fpstate(thread t, struct _fpstate_64 *fp)
+{
+    thread_fpu_save(t);
+    runtime_memcpy(fp, t->fpu_state, fpu_state_size);
+    if (fpu_xfeatures) {
+        fp->sw_reserved.magic1 = FP_XSTATE_MAGIC1;
+        fp->sw_reserved.extended_size = fpstate_frame_size();
+        fp->sw_reserved.xfeatures = fpu_xfeatures;
+        fp->sw_reserved.xstate_size = fpu_state_size;
+        *(u32 *)((void *)fp + fpu_state_size) = FP_XSTATE_MAGIC2;
+    }
+    fpu_init_state(t->fpu_state);
+    thread_fpu_invalidate(t);
+}
+
+/*
+ * Reload the extended register state from *fp; an image without the
+ * XSAVE magic only carries the legacy FXSAVE region
+ */
+static void restore_fpstate(thread t, struct _fpstate_64 *fp)
+{
+    fpu_init_state(t->fpu_state);
+    if (fp) {
+        u64 length = sizeof(struct _fpstate_64);
+        if (fpu_xfeatures && fp->sw_reserved.magic1 == FP_XSTATE_MAGIC1 &&
+            fp->sw_reserved.xstate_size == fpu_state_size &&
+            *(u32 *)((void *)fp + fpu_state_size) == FP_XSTATE_MAGIC2)
+            length = fpu_state_size;
+        runtime_memcpy(t->fpu_state, fp, length);
+        fpu_sanitize_state(t->fpu_state, length);
+    }
+    thread_fpu_invalidate(t);
+}
+
 sysreturn rt_sigreturn(void)
 {
     struct rt_sigframe *frame;
@@ -474,6 +517,7 @@ sysreturn rt_sigreturn(void)
         sig_debug("-> restore ucontext\n");
         restore_ucontext(&(frame->uc), t->frame);
     }
+    restore_fpstate(t, frame->uc.uc_mcontext.fpstate);
     t->frame[FRAME_RAX] = t->saved_rax;
     running_frame = t->frame;
 
@@ -487,6 +531,7 @@ sysreturn rt_sigreturn(void)
     dispatch_signals(current);
 
     /* return - XXX or reschedule? */
+    kern_exit_to_user();
     IRETURN(running_frame);
     return 0;
 }
@@ -931,7 +976,7 @@ closure_function(1, 0, sysreturn, signalfd_close,
     return 0;
 }
 
-closure_function(1, 2, void, signalfd_notify,
+closure_function(1, 2, boolean, signalfd_notify,
                  signal_fd, sfd,
                  u64, events,
                  thread, t)
@@ -940,14 +985,16 @@ closure_function(1, 2, void, signalfd_notify,
     if (events == NOTIFY_EVENTS_RELEASE) {
         sig_debug("%d released\n", sfd->fd);
         closure_finish();
+        return false;
     }
 
     if ((events & sfd->mask) == 0) {
         sig_debug("%d spurious notify\n", sfd->fd);
-        return;
+        return false;
     }
     blockq_wake_one_for_thread(sfd->bq, t);
     notify_dispatch_for_thread(sfd->f.ns, EPOLLIN, t);
+    return false;
 }
 
 static void signalfd_update_siginterest(thread t)
@@ -1054,9 +1101,12 @@ static void setup_sigframe(thread t, int signum, struct siginfo *si)
        typically pushes the frame pointer on the stack, thus
        re-aligning to 16 before executing the function body.
     */
-    t->sigframe[FRAME_RSP] = ((t->sigframe[FRAME_RSP] & ~15)
-                              - 128 /* redzone */
-                              - 8 /* same effect as call pushing ra */);
+    u64 sp = t->sigframe[FRAME_RSP] - 128 /* redzone */;
+
+    /* extended state goes above the rt_sigframe, aligned for XSAVE */
+    sp = (sp - fpstate_frame_size()) & ~(FPU_STATE_ALIGN - 1);
+    struct _fpstate_64 *fp = pointer_from_u64(sp);
+    t->sigframe[FRAME_RSP] = sp - 8 /* same effect as call pushing ra */;
 
     /* create space for rt_sigframe */
     t->sigframe[FRAME_RSP] -= pad(sizeof(struct rt_sigframe), 16);
@@ -1075,6 +1125,12 @@ static void setup_sigframe(thread t, int signum, struct siginfo *si)
         t->sigframe[FRAME_RDX] = 0;
     }
 
+    /* rt_sigreturn finds the fp state through the ucontext */
+    setup_fpstate(t, fp);
+    frame->uc.uc_mcontext.fpstate = fp;
+    if (fpu_xfeatures)
+        frame->uc.uc_flags |= UC_FP_XSTATE;
+
     /* setup regs for signal handler */
     t->sigframe[FRAME_RIP] = u64_from_pointer(sa->sa_handler);
     t->sigframe[FRAME_RDI] = signum;
@@ -1,5 +1,6 @@
 #include <unix_internal.h>
 #include <ftrace.h>
+#include <virtio/virtio.h>
 
 typedef struct special_file {
     const char *path;
@@ -55,22 +56,72 @@ static u32 text_events(const char *text, bytes text_len, file f)
     return events;
 }
 
-static const char cpu_online[] = "0-0\n";
-
 static sysreturn cpu_online_read(file f, void *dest, u64 length, u64 offset)
 {
-    return text_read(cpu_online, sizeof(cpu_online) - 1, f, dest, length, offset);
+    buffer b = little_stack_buffer(16);
+    bprintf(b, "0-%d\n", total_processors - 1);
+    return text_read(buffer_ref(b, 0), buffer_length(b), f, dest, length, offset);
 }
 
 static u32 cpu_online_events(file f)
 {
-    return text_events(cpu_online, sizeof(cpu_online) - 1, f);
+    return EPOLLIN | EPOLLOUT;
+}
+
+static sysreturn pagecache_stats_read(file f, void *dest, u64 length, u64 offset)
+{
+    struct pagecache_stats s;
+    pagecache_get_stats(&s);
+    buffer b = little_stack_buffer(256);
+    bprintf(b, "hits %ld\nmisses %ld\nevictions %ld\npages %ld\nreadahead %ld\n"
+            "dirty %ld\nwriteback %ld\n", s.hits, s.misses, s.evictions, s.pages,
+            s.readahead, s.dirty, s.writeback);
+    return text_read(buffer_ref(b, 0), buffer_length(b), f, dest, length, offset);
+}
+
+static u32 pagecache_stats_events(file f)
+{
+    return EPOLLIN | EPOLLOUT;
+}
+
+static sysreturn dcache_stats_read(file f, void *dest, u64 length, u64 offset)
+{
+    struct dcache_stats s;
+    dcache_get_stats(&s);
+    buffer b = little_stack_buffer(128);
+    bprintf(b, "hits %ld\nneg_hits %ld\nmisses %ld\n", s.hits, s.neg_hits, s.misses);
+    return text_read(buffer_ref(b, 0), buffer_length(b), f, dest, length, offset);
+}
+
+static u32 dcache_stats_events(file f)
+{
+    return EPOLLIN | EPOLLOUT;
+}
+
+static sysreturn virtio_net_stats_read(file f, void *dest, u64 length, u64 offset)
+{
+    struct virtio_net_stats s;
+    virtio_net_get_stats(&s);
+    buffer b = little_stack_buffer(512);
+    bprintf(b, "rx_packets %ld\nrx_dropped %ld\nrx_nobuf %ld\nrx_ring_empty %ld\nrx_refills %ld\n"
+            "rx_csum_err %ld\nrx_recycled %ld\n",
+            s.rx_packets, s.rx_dropped, s.rx_nobuf, s.rx_ring_empty, s.rx_refills,
+            s.rx_csum_err, s.rx_recycled);
+    return text_read(buffer_ref(b, 0), buffer_length(b), f, dest, length, offset);
+}
+
+static u32 virtio_net_stats_events(file f)
+{
+    return EPOLLIN | EPOLLOUT;
 }
 
 static special_file special_files[] = {
     { "/dev/urandom", .read = urandom_read, .write = 0, .events = urandom_events },
     { "/dev/null", .read = null_read, .write = null_write, .events = null_events },
     { "/sys/devices/system/cpu/online", .read = cpu_online_read, .write = null_write, .events = cpu_online_events },
+    { "/sys/kernel/mm/pagecache/stats", .read = pagecache_stats_read, .write = 0, .events = pagecache_stats_events },
+    { "/sys/kernel/fs/dcache/stats", .read = dcache_stats_read, .write = 0, .events = dcache_stats_events },
+    { "/sys/kernel/net/virtio/stats", .read = virtio_net_stats_read, .write = 0, .events = virtio_net_stats_events },
     FTRACE_SPECIAL_FILES
 };
 
@@ -89,6 +140,9 @@ void register_special_files(process p)
     }
 
     filesystem_mkdir(p->fs, 0, "/sys/devices/system/cpu/cpu0", false);
+
+    /* entries were made behind the back of the lookup cache */
+    dcache_flush();
 }
 
 static special_file *
@@ -31,7 +31,6 @@ io_completion syscall_io_complete;
 
 void register_other_syscalls(struct syscall *map)
 {
-    register_syscall(map, msync, 0);
     register_syscall(map, shmget, 0);
     register_syscall(map, shmat, 0);
     register_syscall(map, shmctl, 0);
@@ -101,7 +100,6 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, _sysctl, 0);
     register_syscall(map, adjtimex, 0);
     register_syscall(map, chroot, 0);
-    register_syscall(map, sync, 0);
     register_syscall(map, acct, 0);
     register_syscall(map, settimeofday, 0);
     register_syscall(map, mount, 0);
@@ -125,7 +123,6 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, afs_syscall, 0);
     register_syscall(map, tuxcall, 0);
     register_syscall(map, security, 0);
-    register_syscall(map, readahead, 0);
     register_syscall(map, setxattr, 0);
     register_syscall(map, lsetxattr, 0);
     register_syscall(map, fsetxattr, 0);
@@ -151,7 +148,6 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, remap_file_pages, 0);
     register_syscall(map, restart_syscall, 0);
     register_syscall(map, semtimedop, 0);
-    register_syscall(map, fadvise64, 0);
     register_syscall(map, clock_settime, 0);
     register_syscall(map, utimes, 0);
     register_syscall(map, vserver, 0);
@@ -185,10 +181,7 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, unshare, 0);
     register_syscall(map, set_robust_list, 0);
     register_syscall(map, get_robust_list, 0);
-    register_syscall(map, splice, 0);
-    register_syscall(map, tee, 0);
     register_syscall(map, sync_file_range, 0);
-    register_syscall(map, vmsplice, 0);
     register_syscall(map, move_pages, 0);
     register_syscall(map, utimensat, 0);
     register_syscall(map, fallocate, 0);
@@ -196,13 +189,11 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, preadv, 0);
     register_syscall(map, pwritev, 0);
     register_syscall(map, perf_event_open, 0);
-    register_syscall(map, recvmmsg, 0);
     register_syscall(map, fanotify_init, 0);
     register_syscall(map, fanotify_mark, 0);
     register_syscall(map, name_to_handle_at, 0);
     register_syscall(map, open_by_handle_at, 0);
     register_syscall(map, clock_adjtime, 0);
-    register_syscall(map, syncfs, 0);
     register_syscall(map, setns, 0);
     register_syscall(map, getcpu, 0);
     register_syscall(map, process_vm_readv, 0);
@@ -239,7 +230,7 @@ static inline tuple resolve_cstring(tuple cwd, const char *f)
     while ((y = *f)) {
         if (y == '/') {
             if (buffer_length(a)) {
-                t = lookup(t, intern(a));
+                t = dcache_lookup(t, a);
                 if (!t)
                     return t;
                 buffer_clear(a);
@@ -256,7 +247,7 @@ static inline tuple resolve_cstring(tuple cwd, const char *f)
     }
 
     if (buffer_length(a)) {
-        t = lookup(t, intern(a));
+        t = dcache_lookup(t, a);
     }
 
     return t;
@@ -277,7 +268,7 @@ static inline tuple resolve_cstring_parent(tuple cwd, const char *f)
                     return false;
                 }
                 parent = t;
-                t = lookup(parent, intern(a));
+                t = dcache_lookup(parent, a);
                 buffer_clear(a);
             }
             f++;
@@ -300,6 +291,23 @@ static inline tuple resolve_cstring_parent(tuple cwd, const char *f)
     return parent;
 }
 
+/* Drop any cached lookup of the last component of a path which is
+   about to be created, removed or renamed. */
+static void dcache_invalidate_path(tuple cwd, const char *f)
+{
+    tuple parent = resolve_cstring_parent(cwd, f);
+    if (!parent)
+        return;
+    const char *end = f + runtime_strlen(f);
+    while (end > f && end[-1] == '/')
+        end--;
+    const char *name = end;
+    while (name > f && name[-1] != '/')
+        name--;
+    if (name < end)
+        dcache_invalidate(parent, alloca_wrap_buffer(name, end - name));
+}
+
 static int file_get_path(tuple n, char *buf, u64 len)
 {
     if (len < 2) {
@@ -620,6 +628,147 @@ out_complete:
     closure_finish();
 }
 
+#ifdef NET
+/* Zero-copy sendfile from a regular file to a socket: the range is
+   streamed a page at a time, each cached page being handed to the
+   socket by reference and held until the network stack is done with
+   it. Page lookups and socket writes may complete synchronously, so progress
+   is driven from a loop rather than by recursion. */
+typedef struct sendfile_zc {
+    heap h;
+    thread t;
+    fdesc out;
+    file in;
+    fsfile fsf;
+    int *offset;
+    u64 pos;
+    u64 end;
+    u64 sent;
+    sysreturn rv;
+    pagecache_page pp;          /* page under pos, if held */
+    boolean done;
+    boolean running;
+    boolean resume;
+} *sendfile_zc;
+
+static void sendfile_zc_run(sendfile_zc z);
+
+static void sendfile_zc_finish(sendfile_zc z)
+{
+    thread t = z->t;
+    thread_log(t, "%s: sent %ld, rv %ld", __func__, z->sent, z->rv);
+    if (z->pp)
+        pagecache_page_unref(z->pp);
+    if (z->sent > 0) {
+        if (z->offset)
+            *z->offset += z->sent;
+        else
+            z->in->offset += z->sent;
+    }
+    set_syscall_return(t, z->sent > 0 ? z->sent : z->rv);
+    deallocate(z->h, z, sizeof(struct sendfile_zc));
+    file_op_maybe_wake(t);
+}
+
+closure_function(1, 0, void, sendfile_zc_release,
+                 pagecache_page, pp)
+{
+    pagecache_page_unref(bound(pp));
+    closure_finish();
+}
+
+closure_function(1, 2, void, sendfile_zc_page,
+                 sendfile_zc, z,
+                 status, s, pagecache_page, pp)
+{
+    sendfile_zc z = bound(z);
+    if (is_ok(s)) {
+        z->pp = pp;
+    } else {
+        z->rv = -EIO;
+        z->done = true;
+    }
+    closure_finish();
+    sendfile_zc_run(z);
+}
+
+closure_function(1, 2, void, sendfile_zc_sent,
+                 sendfile_zc, z,
+                 thread, t, sysreturn, rv)
+{
+    sendfile_zc z = bound(z);
+    thread_log(t, "%s: pos %ld, rv %ld", __func__, z->pos, rv);
+    if (rv <= 0) {
+        z->rv = rv;
+        z->done = true;
+    } else {
+        z->pos += rv;
+        z->sent += rv;
+        if ((z->pos & MASK(PAGELOG)) == 0 || z->pos == z->end) {
+            pagecache_page_unref(z->pp);
+            z->pp = 0;
+        }
+    }
+    closure_finish();
+    sendfile_zc_run(z);
+}
+
+static void sendfile_zc_run(sendfile_zc z)
+{
+    if (z->running) {
+        z->resume = true;
+        return;
+    }
+    z->running = true;
+    do {
+        z->resume = false;
+        if (z->done || z->pos == z->end) {
+            sendfile_zc_finish(z);
+            return;
+        }
+        if (!z->pp) {
+            pagecache_get_page_ref(z->fsf, z->pos, closure(z->h, sendfile_zc_page, z));
+            continue;
+        }
+        u64 len = MIN(z->end, (z->pos & ~MASK(PAGELOG)) + PAGESIZE) - z->pos;
+        pagecache_page_ref(z->pp);
+        socket_write_zerocopy(z->out, pagecache_page_data(z->pp) + (z->pos & MASK(PAGELOG)), len,
+                              closure(z->h, sendfile_zc_release, z->pp), z->t,
+                              closure(z->h, sendfile_zc_sent, z));
+    } while (z->resume);
+    z->running = false;
+}
+
+static sysreturn sendfile_zerocopy(fdesc outfile, file infile, fsfile fsf, int *offset, bytes count)
+{
+    thread t = current;
+    heap h = heap_general(get_kernel_heaps());
+    u64 pos = offset ? *offset : infile->offset;
+    u64 length = fsfile_get_length(fsf);
+    if (pos >= length || count == 0)
+        return 0;
+
+    sendfile_zc z = allocate(h, sizeof(struct sendfile_zc));
+    if (z == INVALID_ADDRESS)
+        return -ENOMEM;
+    z->h = h;
+    z->t = t;
+    z->out = outfile;
+    z->in = infile;
+    z->fsf = fsf;
+    z->offset = offset;
+    z->pos = pos;
+    z->end = MIN(pos + count, length);
+    z->sent = 0;
+    z->rv = 0;
+    z->pp = 0;
+    z->done = z->running = z->resume = false;
+    file_op_begin(t);
+    sendfile_zc_run(z);
+    return file_op_maybe_sleep(t);
+}
+#endif
+
 static sysreturn sendfile(int out_fd, int in_fd, int *offset, bytes count)
 {
     thread_log(current, "%s: out %d, in %d, offset %p, *offset %d, count %ld",
@@ -630,13 +779,94 @@ static sysreturn sendfile(int out_fd, int in_fd, int *offset, bytes count)
 
     if (!infile->read || !outfile->write)
         return set_syscall_error(current, EINVAL);
-    
+
+#ifdef NET
+    if (infile->type == FDESC_TYPE_REGULAR && outfile->type == FDESC_TYPE_SOCKET) {
+        file f = (file)infile;
+        fsfile fsf = is_special(f->n) ? 0 : fsfile_from_node(current->p->fs, f->n);
+        if (fsf)
+            return sendfile_zerocopy(outfile, f, fsf, offset, count);
+    }
+#endif
+
     void *buf = allocate(h, count);
     io_completion read_complete = closure(h, sendfile_bh, h, outfile, offset, buf, count, 0, 0, false);
     apply(infile->read, buf, count, offset ? *offset : infinity, current, false, read_complete);
     return sysreturn_value(current);
 }
 
+static sysreturn splice(int fd_in, u64 *off_in, int fd_out, u64 *off_out, u64 len,
+                        unsigned int flags)
+{
+    thread_log(current, "%s: in %d, off_in %p, out %d, off_out %p, len %ld, flags 0x%x",
+               __func__, fd_in, off_in, fd_out, off_out, len, flags);
+    fdesc in = resolve_fd(current->p, fd_in);
+    fdesc out = resolve_fd(current->p, fd_out);
+    fsfile fsf = 0;
+
+    /* regular files are spliced from the page cache by reference */
+    if (in->type == FDESC_TYPE_REGULAR) {
+        file f = (file)in;
+        if (!is_special(f->n))
+            fsf = fsfile_from_node(current->p->fs, f->n);
+    }
+    return pipe_splice(in, off_in, fsf, out, off_out, len, flags);
+}
+
+static sysreturn tee(int fd_in, int fd_out, u64 len, unsigned int flags)
+{
+    thread_log(current, "%s: in %d, out %d, len %ld, flags 0x%x", __func__, fd_in, fd_out, len, flags);
+    fdesc in = resolve_fd(current->p, fd_in);
+    fdesc out = resolve_fd(current->p, fd_out);
+    return pipe_tee(in, out, len, flags);
+}
+
+static sysreturn vmsplice(int fd, struct iovec *iov, u64 nr_segs, unsigned int flags)
+{
+    thread_log(current, "%s: fd %d, iov %p, nr_segs %ld, flags 0x%x", __func__, fd, iov, nr_segs, flags);
+    fdesc f = resolve_fd(current->p, fd);
+    return pipe_vmsplice(f, iov, nr_segs, flags);
+}
+
+/* Sequential readers get an asynchronous readahead window which
+   starts at FILE_READAHEAD_MIN and doubles, up to FILE_READAHEAD_MAX,
+   each time the reader catches up with its first half. A read at any
+   other offset collapses the window. */
+#define FILE_READAHEAD_MIN (128 * KB)
+#define FILE_READAHEAD_MAX (2 * MB)
+
+static void file_readahead(file f, fsfile fsf, u64 offset, u64 length)
+{
+    u64 end = offset + length;
+    boolean sequential = offset == f->ra_next;
+    f->ra_next = end;
+    if (f->advice == POSIX_FADV_RANDOM)
+        return;
+    if (!sequential && f->advice != POSIX_FADV_SEQUENTIAL) {
+        f->ra_window = 0;
+        f->ra_end = 0;
+        return;
+    }
+
+    u64 ra_start = MAX(end, f->ra_end);
+    if (f->ra_window == 0) {
+        f->ra_window = f->advice == POSIX_FADV_SEQUENTIAL ?
+            FILE_READAHEAD_MAX : FILE_READAHEAD_MIN;
+    } else {
+        if (ra_start - end >= f->ra_window / 2)
+            return;
+        f->ra_window = MIN(f->ra_window * 2, FILE_READAHEAD_MAX);
+    }
+
+    u64 ra_limit = MIN(end + f->ra_window, fsfile_get_length(fsf));
+    if (ra_limit <= ra_start)
+        return;
+    thread_log(current, "%s: f %p, readahead [0x%lx, 0x%lx), window %ld",
+               __func__, f, ra_start, ra_limit, f->ra_window);
+    pagecache_readahead(fsf, ra_start, ra_limit - ra_start);
+    f->ra_end = ra_limit;
+}
+
 closure_function(2, 6, sysreturn, file_read,
                  file, f, fsfile, fsf,
                  void *, dest, u64, length, u64, offset_arg, thread, t, boolean, bh, io_completion, completion)
@@ -656,10 +886,15 @@ closure_function(2, 6, sysreturn, file_read,
 
     if (offset < f->length) {
         file_op_begin(t);
-        filesystem_read(t->p->fs, f->n, dest, length, offset,
-                        closure(heap_general(get_kernel_heaps()),
-                                file_op_complete, t, f, fsf, is_file_offset,
-                                completion));
+        io_status_handler ish = closure(heap_general(get_kernel_heaps()),
+                                        file_op_complete, t, f, fsf, is_file_offset,
+                                        completion);
+        if (fsf) {
+            pagecache_read(fsf, dest, length, offset, ish);
+            file_readahead(f, fsf, offset, length);
+        } else {
+            filesystem_read(t->p->fs, f->n, dest, length, offset, ish);
+        }
 
         /* possible direct return in top half */
         return bh ? SYSRETURN_CONTINUE_BLOCKING : file_op_maybe_sleep(t);
@@ -671,6 +906,29 @@ closure_function(2, 6, sysreturn, file_read,
 
 #define PAD_WRITES 0
 
+closure_function(2, 1, void, file_write_sync_complete,
+                 io_status_handler, completion, bytes, length,
+                 status, s)
+{
+    apply(bound(completion), s, is_ok(s) ? bound(length) : 0);
+    closure_finish();
+}
+
+/* O_DSYNC / O_SYNC: the write completes once its data, and the file
+   length, have reached storage */
+closure_function(2, 2, void, file_write_sync,
+                 fsfile, fsf, io_status_handler, completion,
+                 status, s, bytes, length)
+{
+    io_status_handler completion = bound(completion);
+    if (is_ok(s))
+        pagecache_sync(bound(fsf), closure(heap_general(get_kernel_heaps()),
+                                           file_write_sync_complete, completion, length));
+    else
+        apply(completion, s, length);
+    closure_finish();
+}
+
 closure_function(2, 6, sysreturn, file_write,
                  file, f, fsfile, fsf,
                  void *, dest, u64, length, u64, offset_arg, thread, t, boolean, bh, io_completion, completion)
@@ -684,6 +942,17 @@ closure_function(2, 6, sysreturn, file_write,
                length, f->length);
     heap h = heap_general(get_kernel_heaps());
 
+    /* regular file data is copied into the page cache directly */
+    if (fsf && !is_special(f->n)) {
+        file_op_begin(t);
+        io_status_handler ish = closure(h, file_op_complete, t, f, fsf, is_file_offset,
+                                        completion);
+        if (f->f.flags & O_DSYNC)
+            ish = closure(h, file_write_sync, fsf, ish);
+        pagecache_write(fsf, dest, length, offset, ish);
+        return bh ? SYSRETURN_CONTINUE_BLOCKING : file_op_maybe_sleep(t);
+    }
+
     u64 final_length = PAD_WRITES ? pad(length, SECTOR_SIZE) : length;
     void *buf = allocate(h, final_length);
 
@@ -724,8 +993,11 @@ closure_function(2, 0, sysreturn, file_close,
         ret = spec_close(f);
     }
         
-    if (ret == 0)
+    if (ret == 0) {
+        if (f->dir_entries)
+            deallocate_vector(f->dir_entries);
         unix_cache_free(get_unix_heaps(), file, f);
+    }
     return 0;
 }
 
@@ -766,6 +1038,7 @@ sysreturn open_internal(tuple cwd, const char *name, int flags, int mode)
             thread_log(current, "\"%s\" opened with O_EXCL but already exists", name);
             return set_syscall_error(current, EEXIST);
         } else if (!n) {
+            dcache_invalidate_path(cwd, name);
             fs_status fs = filesystem_creat(current->p->fs, cwd, name, mode);
             if (fs != FS_STATUS_OK)
                 return sysreturn_from_fs_status(fs);
@@ -816,6 +1089,11 @@ sysreturn open_internal(tuple cwd, const char *name, int flags, int mode)
     f->n = n;
     f->length = length;
     f->offset = (flags & O_APPEND) ? length : 0;
+    f->ra_next = 0;
+    f->ra_end = 0;
+    f->ra_window = 0;
+    f->advice = POSIX_FADV_NORMAL;
+    f->dir_entries = 0;
 
     if (is_special(f->n)) {
         int spec_ret = spec_open(f);
@@ -895,6 +1173,7 @@ sysreturn mkdir(const char *pathname, int mode)
     if (pathname == 0)
         return set_syscall_error(current, EINVAL);
 
+    dcache_invalidate_path(current->p->cwd, pathname);
     fs_status fs = filesystem_mkdir(current->p->fs, current->p->cwd, pathname, true);
     return sysreturn_from_fs_status(fs);
 }
@@ -920,6 +1199,7 @@ sysreturn mkdirat(int dirfd, char *pathname, int mode)
     tuple cwd;
     cwd = resolve_dir(dirfd, pathname);
 
+    dcache_invalidate_path(cwd, pathname);
     fs_status fs = filesystem_mkdir(current->p->fs, cwd, pathname, true);
     return sysreturn_from_fs_status(fs);
 }
@@ -951,128 +1231,83 @@ sysreturn getrandom(void *buf, u64 buflen, unsigned int flags)
     return random_buffer(b);
 }
 
-static int try_write_dirent(tuple root, struct linux_dirent *dirp, char *p,
-        int *read_sofar, int *written_sofar, u64 *f_offset,
-        unsigned int *count, int ft)
+/* Directory streams read from a snapshot of the child names, taken
+   whenever the stream is at its start. The file offset is an index
+   into the snapshot, so each call resumes where the last left off,
+   and entries come straight from the children table without path
+   resolution. Entries removed since the snapshot are skipped; entries
+   added since are seen once the stream is rewound. */
+static void dir_snapshot(file f, tuple c)
 {
-    int len = runtime_strlen(p);
-    *read_sofar += len;
-    if (*read_sofar > *f_offset) {
-        int reclen = sizeof(struct linux_dirent) + len + 3;
-        // include this element in the getdents output
-        if (reclen > *count) {
-            // can't include, there's no space
-            *read_sofar -= len;
-            return -1;
-        } else {
-            tuple n = resolve_cstring(root, p);
-            // include the entry in the buffer
-            runtime_memset((u8*)dirp, 0, reclen);
-            dirp->d_ino = u64_from_pointer(n);
-            dirp->d_reclen = reclen;
-            runtime_memcpy(dirp->d_name, p, len + 1);
-            dirp->d_off = dirp->d_reclen; // XXX: in the future, pad this.
-            dirp->d_name[len + 2] = 0; /* some zero padding */
-            ((char *)dirp)[dirp->d_reclen - 1] = ft;
-
-            // advance dirp
-            *written_sofar += reclen;
-            *count -= reclen;
-            return reclen;
-        }
+    heap h = heap_general(get_kernel_heaps());
+    if (f->dir_entries)
+        deallocate_vector(f->dir_entries);
+    f->dir_entries = allocate_vector(h, table_elements(c));
+    table_foreach(c, k, v) {
+        (void) v;
+        vector_push(f->dir_entries, k);
     }
-    return 0;
 }
 
-sysreturn getdents(int fd, struct linux_dirent *dirp, unsigned int count)
+static sysreturn getdents_internal(int fd, void *dirp, unsigned int count, boolean is64)
 {
     file f = resolve_fd(current->p, fd);
     tuple c = children(f->n);
     if (!c)
         return -ENOTDIR;
+    if (!f->dir_entries || f->offset == 0)
+        dir_snapshot(f, c);
 
-    int r = 0;
-    int read_sofar = 0, written_sofar = 0;
+    int written = 0;
+    u64 i;
     buffer tmpbuf = little_stack_buffer(NAME_MAX + 1);
-    table_foreach(c, k, v) {
-        char *p = cstring(symbol_string(k), tmpbuf);
-        r = try_write_dirent(f->n, dirp, p,
-                    &read_sofar, &written_sofar, &f->offset, &count,
-                    is_dir(v) ? DT_DIR : DT_REG);
-        if (r < 0)
-            goto done;
+    for (i = f->offset; i < vector_length(f->dir_entries); i++) {
+        symbol s = vector_get(f->dir_entries, i);
+        tuple n = table_find(c, s);
+        if (!n)
+            continue;
+        char *p = cstring(symbol_string(s), tmpbuf);
+        int len = runtime_strlen(p);
+        int reclen = (is64 ? sizeof(struct linux_dirent64) : sizeof(struct linux_dirent)) + len + 3;
+        if (reclen > count - written)
+            break;
 
-        dirp = (struct linux_dirent *)(((char *)dirp) + r);
+        u8 ft = is_dir(n) ? DT_DIR : DT_REG;
+        void *d = dirp + written;
+        runtime_memset(d, 0, reclen);
+        if (is64) {
+            struct linux_dirent64 *d64 = d;
+            d64->d_ino = u64_from_pointer(n);
+            d64->d_off = i + 1;
+            d64->d_reclen = reclen;
+            d64->d_type = ft;
+            runtime_memcpy(d64->d_name, p, len + 1);
+        } else {
+            struct linux_dirent *d32 = d;
+            d32->d_ino = u64_from_pointer(n);
+            d32->d_off = i + 1;
+            d32->d_reclen = reclen;
+            runtime_memcpy(d32->d_name, p, len + 1);
+            ((char *)d)[reclen - 1] = ft;
+        }
+        written += reclen;
     }
+    f->offset = i;
 
-done:
-    f->offset = read_sofar;
-    if (r < 0 && written_sofar == 0)
+    /* not even one entry fit */
+    if (written == 0 && i < vector_length(f->dir_entries))
         return -EINVAL;
-
-    return written_sofar;
+    return written;
 }
 
-static int try_write_dirent64(tuple root, struct linux_dirent64 *dirp, char *p,
-        int *read_sofar, int *written_sofar, u64 *f_offset,
-        unsigned int *count, int ft)
+sysreturn getdents(int fd, struct linux_dirent *dirp, unsigned int count)
 {
-    int len = runtime_strlen(p);
-    *read_sofar += len;
-    if (*read_sofar > *f_offset) {
-        int reclen = sizeof(struct linux_dirent64) + len + 3;
-        // include this element in the getdents output
-        if (reclen > *count) {
-            // can't include, there's no space
-            *read_sofar -= len;
-            return -1;
-        } else {
-            tuple n = resolve_cstring(root, p);
-            // include the entry in the buffer
-            runtime_memset((u8*)dirp, 0, reclen);
-            dirp->d_ino = u64_from_pointer(n);
-            dirp->d_reclen = reclen;
-            runtime_memcpy(dirp->d_name, p, len + 1);
-            dirp->d_off = dirp->d_reclen; // XXX: in the future, pad this.
-            dirp->d_name[len + 2] = 0; /* some zero padding */
-            dirp->d_type = ft;
-
-            // advance dirp
-            *written_sofar += reclen;
-            *count -= reclen;
-            return reclen;
-        }
-    }
-    return 0;
+    return getdents_internal(fd, dirp, count, false);
 }
 
 sysreturn getdents64(int fd, struct linux_dirent64 *dirp, unsigned int count)
 {
-    file f = resolve_fd(current->p, fd);
-    tuple c = children(f->n);
-    if (!c)
-        return -ENOTDIR;
-
-    int r = 0;
-    int read_sofar = 0, written_sofar = 0;
-    buffer tmpbuf = little_stack_buffer(NAME_MAX + 1);
-    table_foreach(c, k, v) {
-        char *p = cstring(symbol_string(k), tmpbuf);
-        r = try_write_dirent64(f->n, dirp, p,
-                    &read_sofar, &written_sofar, &f->offset, &count,
-                    is_dir(v) ? DT_DIR : DT_REG);
-        if (r < 0)
-            goto done;
-
-        dirp = (struct linux_dirent64 *)(((char *)dirp) + r);
-    }
-
-done:
-    f->offset = read_sofar;
-    if (r < 0 && written_sofar == 0)
-        return -EINVAL;
-
-    return written_sofar;
+    return getdents_internal(fd, dirp, count, true);
 }
 
 sysreturn chdir(const char *path)
@@ -1123,6 +1358,7 @@ static sysreturn truncate_internal(tuple t, long length)
     if (!fsf) {
         return set_syscall_error(current, ENOENT);
     }
+    pagecache_truncate(fsf, length);
     file_op_begin(current);
     if (filesystem_truncate(current->p->fs, fsf, length,
             closure(heap_general(get_kernel_heaps()), truncate_complete,
@@ -1166,20 +1402,132 @@ closure_function(2, 1, void, fsync_complete,
     closure_finish();
 }
 
+/* cached file data is written back before the log is flushed */
+closure_function(2, 1, void, fsync_data_complete,
+                 thread, t, file, f,
+                 status, s)
+{
+    thread t = bound(t);
+    file f = bound(f);
+    closure_finish();
+    if (is_ok(s) && !filesystem_flush(t->p->fs, f->n,
+            closure(heap_general(get_kernel_heaps()), fsync_complete, t, f)))
+        return;
+    set_syscall_return(t, is_ok(s) ? 0 : -EIO);
+    file_op_maybe_wake(t);
+}
+
 sysreturn fsync(int fd)
 {
     file f = resolve_fd(current->p, fd);
+    fsfile fsf = f->f.type == FDESC_TYPE_REGULAR && !is_special(f->n) ?
+        fsfile_from_node(current->p->fs, f->n) : 0;
+    status_handler sh = closure(heap_general(get_kernel_heaps()), fsync_data_complete,
+                                current, f);
 
     file_op_begin(current);
-    if (filesystem_flush(current->p->fs, f->n,
-            closure(heap_general(get_kernel_heaps()), fsync_complete, current,
-            f))) {
-        /* Nothing to sync. */
-        return set_syscall_return(current, 0);
-    }
+    if (fsf)
+        pagecache_sync(fsf, sh);
+    else
+        apply(sh, STATUS_OK);
     return file_op_maybe_sleep(current);
 }
 
+closure_function(2, 1, void, sync_files_complete,
+                 filesystem, fs, status_handler, sh,
+                 status, s)
+{
+    filesystem fs = bound(fs);
+    status_handler sh = bound(sh);
+    closure_finish();
+    if (!is_ok(s) || filesystem_flush(fs, 0, sh))
+        apply(sh, s);
+}
+
+/* write back all cached file data, then flush the filesystem log */
+static void sync_all(filesystem fs, status_handler sh)
+{
+    pagecache_sync(0, closure(heap_general(get_kernel_heaps()), sync_files_complete, fs, sh));
+}
+
+closure_function(2, 1, void, sync_complete,
+                 thread, t, boolean, report,
+                 status, s)
+{
+    thread t = bound(t);
+    thread_log(t, "%s: status %v", __func__, s);
+    set_syscall_return(t, is_ok(s) || !bound(report) ? 0 : -EIO);
+    file_op_maybe_wake(t);
+    closure_finish();
+}
+
+sysreturn sync(void)
+{
+    file_op_begin(current);
+    sync_all(current->p->fs, closure(heap_general(get_kernel_heaps()), sync_complete,
+                                     current, false));
+    return file_op_maybe_sleep(current);
+}
+
+sysreturn syncfs(int fd)
+{
+    resolve_fd(current->p, fd);
+    file_op_begin(current);
+    sync_all(current->p->fs, closure(heap_general(get_kernel_heaps()), sync_complete,
+                                     current, true));
+    return file_op_maybe_sleep(current);
+}
+
+sysreturn fadvise64(int fd, s64 offset, s64 len, int advice)
+{
+    thread_log(current, "%s: fd %d, offset %ld, len %ld, advice %d",
+               __func__, fd, offset, len, advice);
+    file f = resolve_fd(current->p, fd);
+    if (f->f.type != FDESC_TYPE_REGULAR)
+        return set_syscall_error(current, ESPIPE);
+    if (offset < 0 || len < 0)
+        return set_syscall_error(current, EINVAL);
+    fsfile fsf = is_special(f->n) ? 0 : fsfile_from_node(current->p->fs, f->n);
+    u64 length = len == 0 ? infinity : len;
+
+    switch (advice) {
+    case POSIX_FADV_NORMAL:
+    case POSIX_FADV_RANDOM:
+    case POSIX_FADV_SEQUENTIAL:
+        f->advice = advice;
+        f->ra_window = 0;
+        f->ra_end = 0;
+        break;
+    case POSIX_FADV_WILLNEED:
+        if (fsf)
+            pagecache_readahead(fsf, offset, length);
+        break;
+    case POSIX_FADV_DONTNEED:
+        if (fsf)
+            pagecache_drop_unused(fsf, offset, length);
+        break;
+    case POSIX_FADV_NOREUSE:
+        break;
+    default:
+        return set_syscall_error(current, EINVAL);
+    }
+    return 0;
+}
+
+sysreturn readahead(int fd, s64 offset, u64 count)
+{
+    thread_log(current, "%s: fd %d, offset %ld, count %ld", __func__, fd, offset, count);
+    file f = resolve_fd(current->p, fd);
+    if (f->f.type != FDESC_TYPE_REGULAR || offset < 0)
+        return set_syscall_error(current, EINVAL);
+    fsfile fsf = is_special(f->n) ? 0 : fsfile_from_node(current->p->fs, f->n);
+    if (fsf)
+        pagecache_readahead(fsf, offset, count);
+    return 0;
+}
+
+/* Writeback of cached data logs any change in file length, and the
+   remaining metadata is no costlier to flush, so this is fsync. */
 sysreturn fdatasync(int fd)
 {
     return fsync(fd);
@@ -1486,6 +1834,7 @@ static sysreturn unlink_internal(tuple cwd, const char *pathname)
     if (is_dir(n)) {
         return set_syscall_error(current, EISDIR);
     }
+    dcache_invalidate_path(cwd, pathname);
     file_op_begin(current);
     filesystem_delete(current->p->fs, cwd, pathname,
             closure(heap_general(get_kernel_heaps()), file_delete_complete,
@@ -1512,6 +1861,7 @@ static sysreturn rmdir_internal(tuple cwd, const char *pathname)
             return set_syscall_error(current, ENOTEMPTY);
         }
     }
+    dcache_invalidate_path(cwd, pathname);
     file_op_begin(current);
     filesystem_delete(current->p->fs, cwd, pathname,
             closure(heap_general(get_kernel_heaps()), file_delete_complete,
@@ -1588,6 +1938,8 @@ static sysreturn rename_internal(tuple oldwd, const char *oldpath, tuple newwd,
     if (filepath_is_ancestor(oldwd, oldpath, newwd, newpath)) {
         return set_syscall_error(current, EINVAL);
     }
+    dcache_invalidate_path(oldwd, oldpath);
+    dcache_invalidate_path(newwd, newpath);
     file_op_begin(current);
     filesystem_rename(current->p->fs, oldwd, oldpath, newwd, newpath,
             closure(heap_general(get_kernel_heaps()), file_rename_complete,
@@ -1632,6 +1984,8 @@ sysreturn renameat2(int olddirfd, const char *oldpath, int newdirfd,
         if (!old || !new) {
             return set_syscall_error(current, ENOENT);
         }
+        dcache_invalidate_path(oldwd, oldpath);
+        dcache_invalidate_path(newwd, newpath);
         file_op_begin(current);
         filesystem_exchange(current->p->fs, oldwd, oldpath, newwd, newpath,
                 closure(heap_general(get_kernel_heaps()), file_rename_complete,
@@ -1754,9 +2108,22 @@ void exit(int code)
     runloop();
 }
 
+closure_function(1, 1, void, exit_group_sync_complete,
+                 int, code,
+                 status, s)
+{
+    if (!is_ok(s))
+        msg_err("failed to write back file data: %v\n", s);
+    vm_exit(bound(code));
+}
+
 sysreturn exit_group(int status)
 {
-    vm_exit(status);
+    /* cached file data would be lost with the vm */
+    file_op_begin(current);
+    sync_all(current->p->fs, closure(heap_general(get_kernel_heaps()),
+                                     exit_group_sync_complete, status));
+    return file_op_maybe_sleep(current);
 }
 
 sysreturn pipe2(int fds[2], int flags)
@@ -1786,7 +2153,7 @@ sysreturn sched_getaffinity(int pid, u64 cpusetsize, cpu_set_t *mask)
 {
     if (!mask || cpusetsize < sizeof(mask->mask[0]))
         return set_syscall_error(current, EINVAL);
-    mask->mask[0] = 1;      /* always cpu 0 */
+    mask->mask[0] = MASK(total_processors);
     return sizeof(mask->mask[0]);
 }
 
@@ -1849,6 +2216,9 @@ void register_file_syscalls(struct syscall *map)
     register_syscall(map, dup3, dup3);
     register_syscall(map, fstat, fstat);
     register_syscall(map, sendfile, sendfile);
+    register_syscall(map, splice, splice);
+    register_syscall(map, tee, tee);
+    register_syscall(map, vmsplice, vmsplice);
     register_syscall(map, stat, stat);
     register_syscall(map, lstat, stat);
     register_syscall(map, readv, readv);
@@ -1857,6 +2227,10 @@ void register_file_syscalls(struct syscall *map)
     register_syscall(map, ftruncate, ftruncate);
     register_syscall(map, fdatasync, fdatasync);
     register_syscall(map, fsync, fsync);
+    register_syscall(map, sync, sync);
+    register_syscall(map, syncfs, syncfs);
+    register_syscall(map, fadvise64, fadvise64);
+    register_syscall(map, readahead, readahead);
     register_syscall(map, access, access);
     register_syscall(map, lseek, lseek);
     register_syscall(map, fcntl, fcntl);
@@ -1924,6 +2298,9 @@ static context syscall_frame;
 
 static void syscall_debug()
 {
+    kern_lock();
+    current_cpu()->state = CPU_STATE_KERNEL;
+
     sysreturn rv = -ENOSYS;
     u64 *f = running_frame;     /* usually current->frame, except for sigreturn */
     int call = f[FRAME_VECTOR];
@@ -1967,6 +2344,7 @@ static void syscall_debug()
     current->syscall = -1;
 
     dispatch_signals(current);
+    kern_exit_to_user();
 }
 
 boolean syscall_notrace(int syscall)
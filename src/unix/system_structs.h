@@ -115,8 +115,10 @@ typedef struct iovec {
 #define O_TRUNC		00001000
 #define O_APPEND	00002000
 #define O_NONBLOCK	00004000
+#define O_DSYNC         00010000
 #define O_DIRECT        00040000
 #define O_CLOEXEC       02000000
+#define O_SYNC          04010000
 
 #define F_LINUX_SPECIFIC_BASE   0x400
 
@@ -173,6 +175,7 @@ struct flock {
 #define AT_NO_AUTOMOUNT     0x800       /* Suppress terminal automount traversal */
 #define AT_EMPTY_PATH       0x1000      /* Allow empty relative pathname */
 
+#define MAP_SHARED	0x01
 #define MAP_FIXED 0x10
 #define MAP_ANONYMOUS 0x20
 #define MAP_PRIVATE	0x02
@@ -181,6 +184,10 @@ struct flock {
 #define MAP_STACK	0x20000
 #define MAP_32BIT	0x40
 
+#define MS_ASYNC	1
+#define MS_INVALIDATE	2
+#define MS_SYNC		4
+
 #define PROT_READ       0x1
 #define PROT_WRITE      0x2
 #define PROT_EXEC       0x4
@@ -265,6 +272,13 @@ struct itimerval {
 #define SEEK_CUR 1
 #define SEEK_END 2
 
+#define POSIX_FADV_NORMAL     0
+#define POSIX_FADV_RANDOM     1
+#define POSIX_FADV_SEQUENTIAL 2
+#define POSIX_FADV_WILLNEED   3
+#define POSIX_FADV_DONTNEED   4
+#define POSIX_FADV_NOREUSE    5
+
 struct rlimit {
     u64 rlim_cur;  /* Soft limit */
     u64 rlim_max;  /* Hard limit (ceiling for rlim_cur) */
@@ -332,6 +346,11 @@ struct rlimit {
 # define SEGV_PKUERR    4   /* failed protection key checks */
 #define NSIGSEGV    4
 
+/*
+ * SIGBUS si_codes
+ */
+#define BUS_ADRERR  2   /* nonexistent physical address */
+
 typedef union sigval {
     s32 sival_int;
     void * sival_ptr;
@@ -555,6 +574,10 @@ typedef struct {
  * This extended area typically grows with newer CPUs that have larger and
  * larger XSAVE areas.
  */
+#define FP_XSTATE_MAGIC1        0x46505853U
+#define FP_XSTATE_MAGIC2        0x46505845U
+#define FP_XSTATE_MAGIC2_SIZE   sizeof(u32)
+
 struct _fpx_sw_bytes {
     u32 magic1;
     u32 extended_size;
@@ -647,7 +670,7 @@ struct sigcontext {
     u64 trapno;
     u64 oldmask;
     u64 cr2;
-    struct _fpstate *fpstate; /* Zero when no FPU context */
+    struct _fpstate_64 *fpstate; /* Zero when no FPU context */
     u64 reserved1[8];
 };
 
@@ -723,7 +746,7 @@ struct epoll_event {
 #define EPOLLWRBAND	0x00000200
 #define EPOLLMSG	0x00000400
 #define EPOLLRDHUP	0x00002000
-#define EPOLLEXCLUSIVE	(1u << 29)
+#define EPOLLEXCLUSIVE	(1u << 28)
 #define EPOLLWAKEUP	(1u << 29)
 #define EPOLLONESHOT	(1u << 30)
 #define EPOLLET		(1u << 31)
@@ -734,12 +757,17 @@ typedef u32 uid_t;
 typedef u32 gid_t;
 
 
-/* set/getsockopt optnames */
+/* set/getsockopt levels and optnames */
+#define SOL_SOCKET   1
+
 #define SO_DEBUG     1
 #define SO_REUSEADDR 2
 #define SO_TYPE      3
 #define SO_ERROR     4
 #define SO_SNDBUF    7
+#define SO_RCVBUF    8
+#define SO_KEEPALIVE 9
+#define SO_ZEROCOPY  60
 
 
 /* eventfd flags */
@@ -747,6 +775,11 @@ typedef u32 gid_t;
 #define EFD_NONBLOCK    00004000
 #define EFD_SEMAPHORE   00000001
 
+#define SPLICE_F_MOVE       1
+#define SPLICE_F_NONBLOCK   2
+#define SPLICE_F_MORE       4
+#define SPLICE_F_GIFT       8
+
 /* timerfd flags */
 #define TFD_CLOEXEC             O_CLOEXEC
 #define TFD_NONBLOCK            O_NONBLOCK
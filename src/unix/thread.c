@@ -2,7 +2,6 @@
 #include <ftrace.h>
 
 thread dummy_thread;
-thread current;
 
 sysreturn gettid()
 {
@@ -45,7 +44,7 @@ static inline void thread_make_runnable(thread t)
 {
     t->blocked_on = 0;
     t->syscall = -1;
-    enqueue(runqueue, t->run);
+    thread_schedule(t, cpuinfo_from_id(t->cpu));
 }
 
 sysreturn clone(unsigned long flags, void *child_stack, int *ptid, int *ctid, unsigned long newtls)
@@ -63,6 +62,8 @@ sysreturn clone(unsigned long flags, void *child_stack, int *ptid, int *ctid, un
     /* clone thread context up to FRAME_VECTOR */
     thread t = create_thread(current->p);
     runtime_memcpy(t->frame, current->frame, sizeof(u64) * FRAME_ERROR_CODE);
+    thread_fpu_save(current);
+    runtime_memcpy(t->fpu_state, current->fpu_state, fpu_state_size);
     thread_clone_sigmask(t, current);
 
     /* clone behaves like fork at the syscall level, returning 0 to the child */
@@ -109,12 +110,29 @@ closure_function(1, 0, void, run_thread,
                  thread, t)
 {
     thread t = bound(t);
+    cpuinfo ci = current_cpu();
+    cpuinfo last = cpuinfo_from_id(t->cpu);
+
+    /* A run is queued only for a stopped thread and only once, so the
+       thread can't still be executing user code on its last cpu. */
+    assert(t->scheduled);
+    assert(last == ci || last->current_thread != t || last->state != CPU_STATE_USER);
+    t->scheduled = false;
+
     thread old = current;
     current = t;
+    t->cpu = ci->id;
 
     /* ftrace needs to know about the switch event */
     ftrace_thread_switch(old, current);
 
+    /* Extended state is restored on first use, when a SIMD instruction
+       traps with CR0.TS set, unless this cpu still holds it. */
+    if (ci->fpu_owner == t && t->fpu_cpu == ci->id)
+        fpu_enable();
+    else
+        fpu_disable();
+
     thread_log(t, "run frame %p, RIP=%p", t->frame, t->frame[FRAME_RIP]);
     proc_enter_user(current->p);
     running_frame = t->frame;
@@ -126,14 +144,47 @@ closure_function(1, 0, void, run_thread,
     dispatch_signals(t);
 
     running_frame[FRAME_FLAGS] |= U64_FROM_BIT(FLAG_INTERRUPT);
+    kern_exit_to_user();
     IRETURN(running_frame);
 }
 
+/* Threads may resume on another cpu, so live extended state is saved
+   whenever a thread gives up its cpu. It stays in the registers too,
+   so resuming here needs no restore. */
+void thread_fpu_save(thread t)
+{
+    cpuinfo ci = current_cpu();
+    if (ci->fpu_owner == t && t->fpu_cpu == ci->id)
+        fpu_save(t->fpu_state);
+}
+
+/* t->fpu_state was rewritten; no cpu's registers match it anymore */
+void thread_fpu_invalidate(thread t)
+{
+    cpuinfo ci = current_cpu();
+    if (ci->fpu_owner == t) {
+        ci->fpu_owner = 0;
+        fpu_disable();
+    }
+    t->fpu_cpu = -1;
+}
+
+/* device-not-available: first SIMD use since t was switched in */
+void thread_fpu_trap(thread t)
+{
+    cpuinfo ci = current_cpu();
+    fpu_enable();
+    fpu_restore(t->fpu_state);
+    ci->fpu_owner = t;
+    t->fpu_cpu = ci->id;
+}
+
 void thread_sleep_interruptible(void)
 {
     disable_interrupts();
     assert(current->blocked_on);
     thread_log(current, "sleep interruptible (on \"%s\")", blockq_name(current->blocked_on));
+    thread_fpu_save(current);
     runloop();
 }
 
@@ -143,6 +194,7 @@ void thread_sleep_uninterruptible(void)
     assert(!current->blocked_on);
     current->blocked_on = INVALID_ADDRESS;
     thread_log(current, "sleep uninterruptible");
+    thread_fpu_save(current);
     runloop();
 }
 
@@ -153,10 +205,22 @@ void thread_yield(void)
     assert(!current->blocked_on);
     current->syscall = -1;
     set_syscall_return(current, 0);
-    enqueue(runqueue, current->run);
+    thread_fpu_save(current);
+    thread_schedule(current, current_cpu());
     runloop();
 }
 
+/* Queue t to resume on ci. A thread already queued stays where it
+   is: that run resumes it, so the wakeup is folded in rather than
+   lost or doubled. */
+void thread_schedule(thread t, cpuinfo ci)
+{
+    if (t->scheduled)
+        return;
+    t->scheduled = true;
+    schedule_on_cpu(ci, t->run);
+}
+
 void thread_wakeup(thread t)
 {
     thread_log(current, "%s: %ld->%ld blocked_on %s, RIP=0x%lx", __func__, current->tid, t->tid,
@@ -184,7 +248,9 @@ boolean thread_attempt_interrupt(thread t)
 define_closure_function(1, 0, void, free_thread,
                         thread, t)
 {
-    deallocate(heap_general(get_kernel_heaps()), bound(t), sizeof(struct thread));
+    heap h = heap_general(get_kernel_heaps());
+    deallocate(h, bound(t)->fpu_state, fpu_state_size);
+    deallocate(h, bound(t), sizeof(struct thread));
 }
 
 thread create_thread(process p)
@@ -205,6 +271,13 @@ thread create_thread(process p)
     if (t->signalfds == INVALID_ADDRESS)
         goto fail_sfds;
 
+    t->fpu_state = allocate(h, fpu_state_size);
+    if (t->fpu_state == INVALID_ADDRESS)
+        goto fail_fpu;
+    assert((u64_from_pointer(t->fpu_state) & (FPU_STATE_ALIGN - 1)) == 0);
+    fpu_init_state(t->fpu_state);
+    t->fpu_cpu = -1;
+
     t->p = p;
     t->syscall = -1;
     t->uh = *p->uh;
@@ -216,6 +289,8 @@ thread create_thread(process p)
     zero(t->frame, sizeof(t->frame));
     t->frame[FRAME_FAULT_HANDLER] = u64_from_pointer(create_fault_handler(h, t));
     t->run = closure(h, run_thread, t);
+    t->cpu = current_cpu()->id;
+    t->scheduled = false;
     t->blocked_on = 0;
     t->file_op_is_complete = false;
     init_sigstate(&t->signals);
@@ -224,6 +299,7 @@ thread create_thread(process p)
 
     if (ftrace_thread_init(t)) {
         msg_err("failed to init ftrace state for thread\n");
+        deallocate(h, t->fpu_state, fpu_state_size);
         deallocate_blockq(t->thread_bq);
         deallocate(h, t, sizeof(struct thread));
         return INVALID_ADDRESS;
@@ -232,6 +308,8 @@ thread create_thread(process p)
     // XXX sigframe
     vector_set(p->threads, t->tid, t);
     return t;
+  fail_fpu:
+    deallocate_notify_set(t->signalfds);
   fail_sfds:
     deallocate_blockq(t->thread_bq);
   fail_bq:
@@ -286,6 +364,10 @@ void exit_thread(thread t)
 
     ftrace_thread_deinit(t, dummy_thread);
 
+    cpuinfo ci = current_cpu();
+    if (ci->fpu_owner == t)
+        ci->fpu_owner = 0;
+
     current = dummy_thread;
     running_frame = dummy_thread->frame;
     refcount_release(&t->refcount);
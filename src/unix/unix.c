@@ -47,6 +47,13 @@ closure_function(1, 1, context, default_fault_handler,
             return frame;
     }
 
+    /* device not available: lazy restore of user extended state */
+    if (frame[FRAME_VECTOR] == 7 &&
+        (frame == bound(t)->frame || frame == bound(t)->sigframe)) {
+        thread_fpu_trap(bound(t));
+        return frame;
+    }
+
     print_frame(frame);
     print_stack(frame);
 
@@ -274,6 +281,10 @@ process init_unix(kernel_heaps kh, tuple root, filesystem fs)
 	goto alloc_fail;
     if (!unix_timers_init(uh))
         goto alloc_fail;
+    if (!pagecache_init(kh))
+        goto alloc_fail;
+    if (!dcache_init(kh))
+        goto alloc_fail;
     if (ftrace_init(uh, fs))
 	goto alloc_fail;
 
@@ -281,6 +292,11 @@ process init_unix(kernel_heaps kh, tuple root, filesystem fs)
     process kernel_process = create_process(uh, root, fs);
     current = dummy_thread = create_thread(kernel_process);
     running_frame = current->frame;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cpuinfo ci = cpuinfo_from_id(i);
+        if (!ci->current_thread)
+            ci->current_thread = dummy_thread;
+    }
 
     runtime_memcpy(dummy_thread->name, "dummy_thread",
         sizeof(dummy_thread->name));
@@ -305,7 +321,7 @@ process init_unix(kernel_heaps kh, tuple root, filesystem fs)
     init_syscalls();
     register_file_syscalls(linux_syscalls);
 #ifdef NET
-    if (!netsyscall_init(uh))
+    if (!netsyscall_init(uh, root))
 	goto alloc_fail;
     register_net_syscalls(linux_syscalls);
 #endif
@@ -116,6 +116,7 @@ typedef struct unix_heaps {
     heap pipe_cache;
 #ifdef NET
     heap socket_cache;
+    heap udp_entry_cache;
 #endif
 
     /* id heaps */
@@ -185,6 +186,8 @@ typedef struct epoll *epoll;
 struct ftrace_graph_entry;
 
 #include <notify.h>
+#include <pagecache.h>
+#include <dcache.h>
 
 typedef struct thread {
     // if we use an array typedef its fragile
@@ -210,6 +213,8 @@ typedef struct thread {
     int tid;
 
     thunk run;
+    int cpu;                    /* last cpu run on; wakeups are queued there */
+    boolean scheduled;          /* run is on a run queue */
 
     /* blockq thread is waiting on, INVALID_ADDRESS for uninterruptible */
     blockq blocked_on;
@@ -228,6 +233,10 @@ typedef struct thread {
     notify_set signalfds;
     u16 active_signo;
 
+    /* extended register state, current unless live on fpu_cpu */
+    void *fpu_state;
+    int fpu_cpu;
+
 #ifdef CONFIG_FTRACE
     int graph_idx;
     struct ftrace_graph_entry * graph_stack;
@@ -271,6 +280,11 @@ struct file {
     tuple n;
     u64 offset;
     u64 length;
+    u64 ra_next;                /* offset following the last read */
+    u64 ra_end;                 /* end of readahead issued so far */
+    u64 ra_window;              /* readahead size, 0 until sequential */
+    int advice;                 /* POSIX_FADV_* */
+    vector dir_entries;         /* directory snapshot for getdents */
 };
 
 void epoll_finish(epoll e);
@@ -279,10 +293,13 @@ void epoll_finish(epoll e);
 #define VMAP_FLAG_ANONYMOUS     2
 #define VMAP_FLAG_WRITABLE      4
 #define VMAP_FLAG_EXEC          8
+#define VMAP_FLAG_SHARED        16
 
 typedef struct vmap {
     struct rmnode node;
     u64 flags;
+    fsfile fsf;                 /* backing file, if any */
+    u64 offset;                 /* file offset at node start */
 } *vmap;
 
 vmap allocate_vmap(rangemap rm, range r, u64 flags);
@@ -331,7 +348,7 @@ typedef struct sigaction *sigaction;
 #define SIGACT_SIGNALFD 0x00000002 /* TODO */
 
 extern thread dummy_thread;
-extern thread current;
+#define current (current_cpu()->current_thread)
 
 static inline thread thread_from_tid(process p, int tid)
 {
@@ -460,6 +477,14 @@ boolean syscall_notrace(int syscall);
 
 void register_file_syscalls(struct syscall *);
 void register_net_syscalls(struct syscall *);
+#ifdef NET
+/* Write to a socket from memory held until release is applied, which
+   happens once the network stack and drivers no longer refer to it
+   (TCP) or immediately (datagrams are copied). The completion is
+   always applied. */
+sysreturn socket_write_zerocopy(fdesc f, void *buf, u64 length, thunk release,
+                                thread t, io_completion completion);
+#endif
 void register_signal_syscalls(struct syscall *);
 void register_mmap_syscalls(struct syscall *);
 void register_thread_syscalls(struct syscall *);
@@ -479,6 +504,7 @@ boolean unix_timers_init(unix_heaps uh);
 
 extern sysreturn syscall_ignore();
 boolean unix_fault_page(u64 vaddr, context frame);
+void *pin_user_buffer(void *buf, u64 length, thunk *unpin);
 
 void thread_log_internal(thread t, const char *desc, ...);
 #define thread_log(__t, __desc, ...) thread_log_internal(__t, __desc, ##__VA_ARGS__)
@@ -487,7 +513,11 @@ void thread_sleep_interruptible(void) __attribute__((noreturn));
 void thread_sleep_uninterruptible(void) __attribute__((noreturn));
 void thread_yield(void) __attribute__((noreturn));
 void thread_wakeup(thread);
+void thread_schedule(thread t, cpuinfo ci);
 boolean thread_attempt_interrupt(thread t);
+void thread_fpu_save(thread t);
+void thread_fpu_invalidate(thread t);
+void thread_fpu_trap(thread t);
 
 static inline boolean thread_in_interruptible_sleep(thread t)
 {
@@ -567,6 +597,10 @@ static inline boolean futex_wake_one_by_uaddr(process p, int *uaddr)
 }
 
 int do_pipe2(int fds[2], int flags);
+sysreturn pipe_splice(fdesc in, u64 *off_in, fsfile in_fsf, fdesc out, u64 *off_out, u64 len,
+                      unsigned int flags);
+sysreturn pipe_tee(fdesc in, fdesc out, u64 len, unsigned int flags);
+sysreturn pipe_vmsplice(fdesc f, struct iovec *iov, u64 nr_segs, unsigned int flags);
 
 sysreturn socketpair(int domain, int type, int protocol, int sv[2]);
 
@@ -5,5 +5,18 @@
 void init_network_iface(tuple root);
 void init_virtio_network(kernel_heaps kh);
 
+/* summed over all virtio-net devices */
+typedef struct virtio_net_stats {
+    u64 rx_packets;
+    u64 rx_dropped;             /* refused by the stack */
+    u64 rx_nobuf;               /* failed to allocate a receive buffer */
+    u64 rx_ring_empty;          /* completions leaving no buffers posted */
+    u64 rx_refills;             /* refill batches, one notify each */
+    u64 rx_csum_err;            /* failed checksum verification */
+    u64 rx_recycled;            /* consumed buffers reposted without reallocation */
+} *virtio_net_stats;
+
+void virtio_net_get_stats(virtio_net_stats s);
+
 void virtio_register_scsi(kernel_heaps kh, storage_attach a);
 void virtio_register_blk(kernel_heaps kh, storage_attach a);
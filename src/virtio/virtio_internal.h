@@ -50,6 +50,9 @@ status virtqueue_alloc(vtpci dev,
                        thunk *t);
 
 void virtqueue_set_max_queued(virtqueue, int);
+u16 virtqueue_entries(virtqueue vq);
+u16 virtqueue_max_chain(virtqueue vq);
+void virtqueue_kick(virtqueue vq);
 
 /* The Host uses this in used->flags to advise the Guest: don't kick me
  * when you add a buffer.  It's unreliable, so it's simply an
@@ -67,4 +70,5 @@ typedef struct vqmsg *vqmsg;
 vqmsg allocate_vqmsg(virtqueue vq);
 void deallocate_vqmsg(virtqueue vq, vqmsg m);
 void vqmsg_push(virtqueue vq, vqmsg m, void * addr, u32 len, boolean write);
+void vqmsg_queue(virtqueue vq, vqmsg m, vqfinish completion);
 void vqmsg_commit(virtqueue vq, vqmsg m, vqfinish completion);
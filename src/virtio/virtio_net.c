@@ -40,60 +40,230 @@
 #include "lwip/snmp.h"
 #include "lwip/ethip6.h"
 #include "lwip/etharp.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/prot/ip.h"
+#include "lwip/prot/ip4.h"
 #include "lwip/dhcp.h"
 #include "lwip/timeouts.h"
 #include "netif/ethernet.h"
 #include "virtio_internal.h"
 #include "virtio_net.h"
+#include "virtio.h"
 
 #include <io.h>
+#include <x86_64.h>
 
-typedef struct vnet {
+/* Receive buffers are reposted in batches of this many (bounded by
+   half the ring), or right away should the ring run dry. */
+#define RX_REFILL_BATCH 32
+
+/* HOST_TSO4 is not offered: lwIP never builds a TCP segment larger
+   than the MSS, so there would be nothing for the device to split. */
+#define VIRTIO_NET_FEATURES (VIRTIO_NET_F_MAC | VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | \
+                             VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_MRG_RXBUF | \
+                             VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ)
+
+/* offset of max_virtqueue_pairs in the device config */
+#define VIRTIO_NET_R_MAX_VQ_PAIRS 8
+
+/* no more queue pairs than cpus we could bring up */
+#define VIRTIO_NET_MAX_QUEUE_PAIRS MAX_CPUS
+
+/* largest frame the device may hand us with GUEST_TSO4 */
+#define VIRTIO_NET_MAX_RX_SEGMENT 65535
+
+typedef struct xpbuf *xpbuf;
+typedef struct vnet *vnet;
+
+/* an rx/tx virtqueue pair, each queue with its own MSI-X vector */
+typedef struct vnet_queue {
+    vnet vn;
+    struct virtqueue *txq;
+    struct virtqueue *rxq;
+    boolean tx_held;            /* frames queued during a transmit batch */
+    u16 rxq_size;
+    u16 rx_posted;              /* buffers handed to the device */
+    u16 rx_unkicked;            /* of those, recycled since the last notify */
+    u16 rx_refill_batch;
+    xpbuf rx_head;              /* packet being assembled from merged buffers */
+    u16 rx_remaining;           /* buffers still to come for rx_head */
+    struct virtio_net_hdr rx_hdr;
+} *vnet_queue;
+
+struct vnet {
     vtpci dev;
     u16 port;
     heap rxbuffers;
     int rxbuflen;
+    u16 net_header_len;         /* 12 with mergeable rx buffers, else 10 */
+    u16 queue_pairs;            /* pairs in use for transmit */
+    u16 max_queue_pairs;        /* pairs allocated */
+    vnet_queue queues;
+    heap txhdrs;
     struct netif *n;
-    struct virtqueue *txq;
-    struct virtqueue *rxq;
     struct virtqueue *ctl;
-    void *empty; // just a mac..fix, from pre-heap days
-} *vnet;
+};
 
-typedef struct xpbuf
+struct xpbuf
 {
     struct pbuf_custom p;
-    vnet vn;
-} *xpbuf;
-
+    vnet_queue q;
+};
 
-closure_function(1, 1, void, tx_complete,
-                 struct pbuf *, p,
+closure_function(3, 1, void, tx_complete,
+                 vnet, vn, struct pbuf *, p, void *, hdr,
                  u64, len)
 {
     // unfortunately we dont have control over the allocation
     // path (?)
     // free me!
     pbuf_free(bound(p));
+    deallocate(bound(vn)->txhdrs, bound(hdr), bound(vn)->net_header_len);
     closure_finish();
 }
 
+/* the IPv4 header of an unfragmented frame, if it lies within the first pbuf */
+static struct ip_hdr *frame_ipv4_header(struct pbuf *p)
+{
+    if (p->len < SIZEOF_ETH_HDR + IP_HLEN)
+        return 0;
+    struct eth_hdr *eh = p->payload;
+    if (eh->type != PP_HTONS(ETHTYPE_IP))
+        return 0;
+    struct ip_hdr *iph = (struct ip_hdr *)((u8 *)p->payload + SIZEOF_ETH_HDR);
+    if (IPH_V(iph) != 4 || IPH_HL_BYTES(iph) < IP_HLEN ||
+        p->len < SIZEOF_ETH_HDR + IPH_HL_BYTES(iph) ||
+        (IPH_OFFSET(iph) & PP_HTONS(IP_OFFMASK | IP_MF)))
+        return 0;
+    return iph;
+}
+
+/* folded, uncomplemented sum of the TCP/UDP pseudo header */
+static u16 pseudo_header_sum(struct ip_hdr *iph, u8 proto, u16 len)
+{
+    u32 acc = (iph->src.addr & 0xffff) + (iph->src.addr >> 16) +
+        (iph->dest.addr & 0xffff) + (iph->dest.addr >> 16) +
+        lwip_htons((u16)proto) + lwip_htons(len);
+    acc = (acc >> 16) + (acc & 0xffff);
+    acc = (acc >> 16) + (acc & 0xffff);
+    return acc;
+}
+
+/* Describe the checksum work left for the device. The stack leaves
+   TCP and UDP checksums to us once VIRTIO_NET_F_CSUM is negotiated. */
+static void tx_fill_header(vnet vn, struct virtio_net_hdr *h, struct pbuf *p)
+{
+    zero(h, vn->net_header_len);
+    if (!(vn->dev->features & VIRTIO_NET_F_CSUM))
+        return;
+    struct ip_hdr *iph = frame_ipv4_header(p);
+    if (!iph)
+        return;
+
+    u8 proto = IPH_PROTO(iph);
+    u16 csum_offset;
+    if (proto == IP_PROTO_TCP)
+        csum_offset = 16;
+    else if (proto == IP_PROTO_UDP)
+        csum_offset = 6;
+    else
+        return;
+
+    u16 iphl = IPH_HL_BYTES(iph);
+    u16 l4 = SIZEOF_ETH_HDR + iphl;
+    u16 l4len = lwip_htons(IPH_LEN(iph)) - iphl;
+    u16 sum = pseudo_header_sum(iph, proto, l4len);
+
+    if (p->len < l4 + csum_offset + sizeof(u16)) {
+        /* transport header is split across pbufs; checksum it here */
+        u16 zero = 0;
+        ip4_addr_t src, dest;
+        src.addr = iph->src.addr;
+        dest.addr = iph->dest.addr;
+        pbuf_take_at(p, &zero, sizeof(zero), l4 + csum_offset);
+        pbuf_remove_header(p, l4);
+        sum = inet_chksum_pseudo(p, proto, l4len, &src, &dest);
+        pbuf_add_header(p, l4);
+        if (proto == IP_PROTO_UDP && sum == 0)
+            sum = 0xffff;
+        pbuf_take_at(p, &sum, sizeof(sum), l4 + csum_offset);
+        return;
+    }
+
+    u8 *l4hdr = (u8 *)p->payload + l4;
+    *(u16 *)(l4hdr + csum_offset) = sum;
+    h->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    h->csum_start = l4;
+    h->csum_offset = csum_offset;
+}
+
+/* Keep each flow on one queue pair. The device steers a flow's
+   receive traffic to the pair it last transmitted on, so both
+   directions of a flow complete on the same pair of vectors. */
+static vnet_queue tx_queue(vnet vn, struct pbuf *p)
+{
+    if (vn->queue_pairs == 1)
+        return &vn->queues[0];
+    struct ip_hdr *iph = frame_ipv4_header(p);
+    if (!iph)
+        return &vn->queues[0];
+    u32 hash = iph->src.addr ^ iph->dest.addr;
+    u8 proto = IPH_PROTO(iph);
+    u16 l4 = SIZEOF_ETH_HDR + IPH_HL_BYTES(iph);
+    if ((proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) && p->len >= l4 + sizeof(u32))
+        hash ^= *(u32 *)((u8 *)p->payload + l4); /* source and destination ports */
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+    return &vn->queues[hash % vn->queue_pairs];
+}
+
+boolean net_tx_batching(void);
+void net_register_tx_flush(thunk flush);
+
+/* notify the device of frames held back during a transmit batch */
+closure_function(1, 0, void, vnet_tx_flush,
+                 vnet, vn)
+{
+    vnet vn = bound(vn);
+    for (int i = 0; i < vn->max_queue_pairs; i++) {
+        vnet_queue q = &vn->queues[i];
+        if (q->tx_held) {
+            q->tx_held = false;
+            virtqueue_kick(q->txq);
+        }
+    }
+}
 
 static err_t low_level_output(struct netif *netif, struct pbuf *p)
 {
     vnet vn = netif->state;
+    vnet_queue q = tx_queue(vn, p);
+    struct virtqueue *txq = q->txq;
+
+    struct virtio_net_hdr *h = allocate(vn->txhdrs, vn->net_header_len);
+    if (h == INVALID_ADDRESS) {
+        LINK_STATS_INC(link.memerr);
+        return ERR_MEM;
+    }
+    tx_fill_header(vn, h, p);
 
-    vqmsg m = allocate_vqmsg(vn->txq);
+    vqmsg m = allocate_vqmsg(txq);
     assert(m != INVALID_ADDRESS);
-    vqmsg_push(vn->txq, m, vn->empty, NET_HEADER_LENGTH, false);
+    vqmsg_push(txq, m, h, vn->net_header_len, false);
 
     pbuf_ref(p);
 
-    for (struct pbuf * q = p; q != NULL; q = q->next)
-        vqmsg_push(vn->txq, m, q->payload, q->len, false);
+    for (struct pbuf * b = p; b != NULL; b = b->next)
+        vqmsg_push(txq, m, b->payload, b->len, false);
+
+    vqfinish c = closure(vn->dev->general, tx_complete, vn, p, h);
+    if (net_tx_batching()) {
+        vqmsg_queue(txq, m, c);
+        q->tx_held = true;
+    } else {
+        vqmsg_commit(txq, m, c);
+    }
 
-    vqmsg_commit(vn->txq, m, closure(vn->dev->general, tx_complete, p));
-    
     MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
     if (((u8_t *)p->payload)[0] & 1) {
         /* broadcast or multicast packet*/
@@ -109,43 +279,148 @@ static err_t low_level_output(struct netif *netif, struct pbuf *p)
     return ERR_OK;
 }
 
+static struct virtio_net_stats vnet_stats;
+
+void virtio_net_get_stats(virtio_net_stats s)
+{
+    runtime_memcpy(s, &vnet_stats, sizeof(*s));
+}
+
+static boolean post_receive_buffer(vnet_queue q, xpbuf x);
+
+/* Buffers the stack is done with go straight back on their ring while
+   it has room, rather than to the cache to be allocated again by the
+   next refill. The device is notified in batches, or as soon as the
+   buffers it already knows of run low. */
 static void receive_buffer_release(struct pbuf *p)
 {
     xpbuf x  = (void *)p;
-    deallocate(x->vn->rxbuffers, x, x->vn->rxbuflen + sizeof(struct xpbuf));
+    vnet_queue q = x->q;
+    if (q->rx_posted < q->rxq_size && post_receive_buffer(q, x)) {
+        vnet_stats.rx_recycled++;
+        q->rx_unkicked++;
+        if (q->rx_unkicked >= q->rx_refill_batch ||
+            q->rx_posted - q->rx_unkicked < q->rx_refill_batch) {
+            q->rx_unkicked = 0;
+            virtqueue_kick(q->rxq);
+        }
+        return;
+    }
+    deallocate(q->vn->rxbuffers, x, q->vn->rxbuflen + sizeof(struct xpbuf));
+}
+
+static void rx_refill(vnet_queue q);
+
+/* With VIRTIO_NET_F_GUEST_CSUM the stack no longer checks TCP
+   checksums, so verify those the device hasn't vouched for here. A
+   partial checksum on anything else is completed for the stack to
+   check as usual. TCP within IP fragments can't be verified until
+   reassembly and is passed through. */
+static boolean rx_checksum(vnet vn, struct pbuf *p, struct virtio_net_hdr *h)
+{
+    if (!(vn->dev->features & VIRTIO_NET_F_GUEST_CSUM) ||
+        (h->flags & VIRTIO_NET_HDR_F_DATA_VALID))
+        return true;
+
+    struct ip_hdr *iph = frame_ipv4_header(p);
+    boolean tcp = iph && IPH_PROTO(iph) == IP_PROTO_TCP;
+    u16 iphl = 0;
+    if (iph) {
+        iphl = IPH_HL_BYTES(iph);
+        u16 iplen = lwip_htons(IPH_LEN(iph));
+        if (iplen < iphl || SIZEOF_ETH_HDR + iplen > p->tot_len)
+            return true;        /* malformed; the stack will drop it */
+
+        /* strip ethernet padding, as ip4_input would, before summing;
+           IPv6 frames are never short enough to have any */
+        pbuf_realloc(p, SIZEOF_ETH_HDR + iplen);
+    }
+    if (h->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        if (!tcp && h->csum_start + h->csum_offset + sizeof(u16) <= p->len) {
+            pbuf_remove_header(p, h->csum_start);
+            u16 sum = inet_chksum_pbuf(p);
+            pbuf_add_header(p, h->csum_start);
+            *(u16 *)((u8 *)p->payload + h->csum_start + h->csum_offset) = sum;
+        }
+        return true;
+    }
+    if (!tcp)
+        return true;
+
+    u16 iplen = p->tot_len - SIZEOF_ETH_HDR;
+    ip4_addr_t src, dest;
+    src.addr = iph->src.addr;
+    dest.addr = iph->dest.addr;
+    pbuf_remove_header(p, SIZEOF_ETH_HDR + iphl);
+    u16 sum = inet_chksum_pseudo(p, IP_PROTO_TCP, iplen - iphl, &src, &dest);
+    pbuf_add_header(p, SIZEOF_ETH_HDR + iphl);
+    return sum == 0;
 }
 
-static void post_receive(vnet vn);
+static void rx_deliver(vnet vn, struct pbuf *p, struct virtio_net_hdr *h)
+{
+    if (!rx_checksum(vn, p, h)) {
+        pbuf_free(p);
+        vnet_stats.rx_csum_err++;
+        return;
+    }
+    if (vn->n->input(p, vn->n) != ERR_OK) {
+        pbuf_free(p);
+        vnet_stats.rx_dropped++;
+    } else {
+        vnet_stats.rx_packets++;
+    }
+}
 
 closure_function(1, 1, void, input,
                  xpbuf, x,
                  u64, len)
 {
     xpbuf x = bound(x);
-    vnet vn= x->vn;
-    // under what conditions does a virtio queue give us zero?
-    if (x != NULL) {
-        len -= NET_HEADER_LENGTH;
-        assert(len <= x->p.pbuf.len);
-        x->p.pbuf.tot_len = x->p.pbuf.len = len;
-        x->p.pbuf.payload += NET_HEADER_LENGTH;
-        if (vn->n->input(&x->p.pbuf, vn->n) != ERR_OK) {
-            receive_buffer_release(&x->p.pbuf);
+    vnet_queue q = x->q;
+    vnet vn = q->vn;
+    struct pbuf *p = &x->p.pbuf;
+    assert(q->rx_posted > 0);
+    if (--q->rx_posted == 0)
+        vnet_stats.rx_ring_empty++;
+
+    assert(len <= p->len);
+    if (q->rx_head) {
+        /* continuation of a merged packet; no header */
+        p->tot_len = p->len = len;
+        pbuf_cat(&q->rx_head->p.pbuf, p);
+        if (--q->rx_remaining == 0) {
+            rx_deliver(vn, &q->rx_head->p.pbuf, &q->rx_hdr);
+            q->rx_head = 0;
         }
+    } else if (len < vn->net_header_len) {
+        receive_buffer_release(p);
+        vnet_stats.rx_dropped++;
     } else {
-        rprintf ("virtio null\n");
+        struct virtio_net_hdr_mrg_rxbuf *h = p->payload;
+        u16 nbufs = (vn->dev->features & VIRTIO_NET_F_MRG_RXBUF) ? h->num_buffers : 1;
+        q->rx_hdr = h->hdr;
+        len -= vn->net_header_len;
+        p->tot_len = p->len = len;
+        p->payload += vn->net_header_len;
+        if (nbufs > 1) {
+            q->rx_head = x;
+            q->rx_remaining = nbufs - 1;
+        } else {
+            rx_deliver(vn, p, &q->rx_hdr);
+        }
     }
-    // we need to get a signal from the device side that there was
-    // an underrun here to open up the window
-    post_receive(vn);
+
+    if (q->rx_posted == 0 || q->rxq_size - q->rx_posted >= q->rx_refill_batch)
+        rx_refill(q);
     closure_finish();
 }
 
-
-static void post_receive(vnet vn)
+/* queue a receive buffer, new or recycled; the caller kicks the device */
+static boolean post_receive_buffer(vnet_queue q, xpbuf x)
 {
-    xpbuf x = allocate(vn->rxbuffers, sizeof(struct xpbuf) + vn->rxbuflen);
-    x->vn = vn;
+    vnet vn = q->vn;
+    x->q = q;
     x->p.custom_free_function = receive_buffer_release;
     pbuf_alloced_custom(PBUF_RAW,
                         vn->rxbuflen,
@@ -154,10 +429,44 @@ static void post_receive(vnet vn)
                         x+1,
                         vn->rxbuflen);
 
-    vqmsg m = allocate_vqmsg(vn->rxq);
-    assert(m != INVALID_ADDRESS);
-    vqmsg_push(vn->rxq, m, x+1, vn->rxbuflen, true);
-    vqmsg_commit(vn->rxq, m, closure(vn->dev->general, input, x));
+    vqmsg m = allocate_vqmsg(q->rxq);
+    if (m == INVALID_ADDRESS)
+        return false;
+    vqmsg_push(q->rxq, m, x+1, vn->rxbuflen, true);
+    vqmsg_queue(q->rxq, m, closure(vn->dev->general, input, x));
+    q->rx_posted++;
+    return true;
+}
+
+static boolean post_receive(vnet_queue q)
+{
+    vnet vn = q->vn;
+    xpbuf x = allocate(vn->rxbuffers, sizeof(struct xpbuf) + vn->rxbuflen);
+    if (x == INVALID_ADDRESS)
+        return false;
+    if (!post_receive_buffer(q, x)) {
+        deallocate(vn->rxbuffers, x, sizeof(struct xpbuf) + vn->rxbuflen);
+        return false;
+    }
+    return true;
+}
+
+/* top up the receive ring, notifying the device once */
+static void rx_refill(vnet_queue q)
+{
+    int posted = 0;
+    while (q->rx_posted < q->rxq_size) {
+        if (!post_receive(q)) {
+            vnet_stats.rx_nobuf++;
+            break;
+        }
+        posted++;
+    }
+    if (posted > 0 || q->rx_unkicked > 0) {
+        q->rx_unkicked = 0;
+        virtqueue_kick(q->rxq);
+        vnet_stats.rx_refills++;
+    }
 }
 
 void lwip_status_callback(struct netif *netif);
@@ -181,37 +490,119 @@ static err_t virtioif_init(struct netif *netif)
     /* don't set NETIF_FLAG_ETHARP if this device is not an ethernet one */
     netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP | NETIF_FLAG_UP;
 
-    // fix
-    post_receive(vn);
-    post_receive(vn);
-    post_receive(vn);
-    
+    u16 checksums = NETIF_CHECKSUM_ENABLE_ALL;
+    if (vn->dev->features & VIRTIO_NET_F_CSUM)
+        checksums &= ~(NETIF_CHECKSUM_GEN_TCP | NETIF_CHECKSUM_GEN_UDP);
+    if (vn->dev->features & VIRTIO_NET_F_GUEST_CSUM)
+        checksums &= ~NETIF_CHECKSUM_CHECK_TCP; /* see rx_checksum */
+    NETIF_SET_CHECKSUM_CTRL(netif, checksums);
+
+    for (int i = 0; i < vn->max_queue_pairs; i++)
+        rx_refill(&vn->queues[i]);
     return ERR_OK;
 }
 
-static void virtio_net_attach(heap general, heap page_allocator, pci_dev d)
+struct vnet_ctrl_mq {
+    struct virtio_net_ctrl_hdr hdr;
+    struct virtio_net_ctrl_mq mq;
+    u8 ack;
+};
+
+closure_function(2, 1, void, ctrl_mq_complete,
+                 vnet, vn, struct vnet_ctrl_mq *, c,
+                 u64, len)
+{
+    vnet vn = bound(vn);
+    struct vnet_ctrl_mq *c = bound(c);
+    /* transmit stays on the first pair until the device agrees */
+    if (c->ack == VIRTIO_NET_OK)
+        vn->queue_pairs = c->mq.virtqueue_pairs;
+    else
+        msg_err("device refused %d queue pairs\n", c->mq.virtqueue_pairs);
+    deallocate(vn->dev->contiguous, c, vn->dev->contiguous->pagesize);
+    closure_finish();
+}
+
+static void vnet_set_queue_pairs(vnet vn, u16 pairs)
 {
-    //u32 badness = VIRTIO_F_BAD_FEATURE | VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM |
-    //    VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 |  VIRTIO_NET_F_GUEST_ECN|
-    //    VIRTIO_NET_F_GUEST_UFO | VIRTIO_NET_F_CTRL_VLAN | VIRTIO_NET_F_MQ;
+    struct vnet_ctrl_mq *c = allocate(vn->dev->contiguous, vn->dev->contiguous->pagesize);
+    assert(c != INVALID_ADDRESS);
+    c->hdr.class = VIRTIO_NET_CTRL_MQ;
+    c->hdr.cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+    c->mq.virtqueue_pairs = pairs;
+    c->ack = VIRTIO_NET_ERR;
+    vqmsg m = allocate_vqmsg(vn->ctl);
+    assert(m != INVALID_ADDRESS);
+    vqmsg_push(vn->ctl, m, &c->hdr, sizeof(c->hdr), false);
+    vqmsg_push(vn->ctl, m, &c->mq, sizeof(c->mq), false);
+    vqmsg_push(vn->ctl, m, &c->ack, sizeof(c->ack), true);
+    vqmsg_commit(vn->ctl, m, closure(vn->dev->general, ctrl_mq_complete, vn, c));
+}
+
+/* Queue pairs to allocate: bounded by what the device offers and by
+   the MSI-X table, which needs a vector for each queue plus the
+   control queue that follows the device's last pair. */
+static u16 vnet_probe_queue_pairs(vtpci dev)
+{
+    if ((dev->features & (VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ)) !=
+        (VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ))
+        return 1;
+    u16 device_pairs = in16(dev->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_NET_R_MAX_VQ_PAIRS);
+    if (device_pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+        pci_get_msix_count(dev->dev) <= 2 * device_pairs)
+        return 1;
+    return MIN(device_pairs, VIRTIO_NET_MAX_QUEUE_PAIRS);
+}
 
-    vtpci dev = attach_vtpci(general, page_allocator, d, VIRTIO_NET_F_MAC);
+static void virtio_net_attach(heap general, heap page_allocator, pci_dev d)
+{
+    vtpci dev = attach_vtpci(general, page_allocator, d, VIRTIO_NET_FEATURES);
     vnet vn = allocate(dev->general, sizeof(struct vnet));
     vn->n = allocate(dev->general, sizeof(struct netif));
-    vn->rxbuflen = NET_HEADER_LENGTH + sizeof(struct eth_hdr) + sizeof(struct eth_vlan_hdr) + 1500;
+    vn->net_header_len = (dev->features & VIRTIO_NET_F_MRG_RXBUF) ?
+        sizeof(struct virtio_net_hdr_mrg_rxbuf) : NET_HEADER_LENGTH;
+    /* without mergeable buffers, a large segment must fit in one buffer */
+    u32 frame_len = (dev->features & (VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_MRG_RXBUF)) ==
+        VIRTIO_NET_F_GUEST_TSO4 ? VIRTIO_NET_MAX_RX_SEGMENT : 1500;
+    vn->rxbuflen = vn->net_header_len + sizeof(struct eth_hdr) + sizeof(struct eth_vlan_hdr) + frame_len;
     vn->rxbuffers = allocate_objcache(dev->general, page_allocator,
 				      vn->rxbuflen + sizeof(struct xpbuf), PAGESIZE_2M);
-    /* rx = 0, tx = 1, ctl = 2 by 
-       page 53 of http://docs.oasis-open.org/virtio/virtio/v1.0/cs01/virtio-v1.0-cs01.pdf */
+    /* rx(n) = 2n, tx(n) = 2n + 1, ctl = 2 * max_virtqueue_pairs by
+       section 5.1.2 of http://docs.oasis-open.org/virtio/virtio/v1.0/cs01/virtio-v1.0-cs01.pdf */
     vn->dev = dev;
-    vtpci_alloc_virtqueue(dev, 1, &vn->txq);
-    vtpci_alloc_virtqueue(dev, 0, &vn->rxq);
-    // just need 10 contig bytes really
-    vn->empty = allocate(dev->contiguous, dev->contiguous->pagesize);
-    for (int i = 0; i < NET_HEADER_LENGTH ; i++)  ((u8 *)vn->empty)[i] = 0;
+    vn->max_queue_pairs = vnet_probe_queue_pairs(dev);
+    vn->queue_pairs = 1;
+    vn->queues = allocate_zero(dev->general, vn->max_queue_pairs * sizeof(struct vnet_queue));
+    for (int i = 0; i < vn->max_queue_pairs; i++) {
+        vnet_queue q = &vn->queues[i];
+        q->vn = vn;
+        if (!is_ok(vtpci_alloc_virtqueue(dev, 2 * i + 1, &q->txq)) ||
+            !is_ok(vtpci_alloc_virtqueue(dev, 2 * i, &q->rxq))) {
+            assert(i > 0);
+            msg_err("failed to allocate queue pair %d\n", i);
+            vn->max_queue_pairs = i;
+            break;
+        }
+        q->rxq_size = virtqueue_entries(q->rxq);
+        q->rx_refill_batch = MAX(1, MIN(RX_REFILL_BATCH, q->rxq_size / 2));
+    }
+    if (vn->max_queue_pairs > 1) {
+        u16 device_pairs = in16(dev->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_NET_R_MAX_VQ_PAIRS);
+        if (!is_ok(vtpci_alloc_virtqueue(dev, 2 * device_pairs, &vn->ctl))) {
+            msg_err("failed to allocate control queue\n");
+            vn->max_queue_pairs = 1;
+        }
+    }
+    /* per-packet headers; small objects in 2M pages never straddle a
+       physical discontiguity */
+    vn->txhdrs = allocate_objcache(dev->general, page_allocator,
+                                   vn->net_header_len, PAGESIZE_2M);
     vn->n->state = vn;
+    net_register_tx_flush(closure(dev->general, vnet_tx_flush, vn));
     // initialization complete
     vtpci_set_status(dev, VIRTIO_CONFIG_STATUS_DRIVER_OK);
+    if (vn->max_queue_pairs > 1)
+        vnet_set_queue_pairs(vn, vn->max_queue_pairs);
 
     netif_add(vn->n,
               0, 0, 0, 
@@ -88,8 +88,11 @@ vtpci attach_vtpci(heap h, heap page_allocator, pci_dev d, u64 feature_mask)
     vtpci_set_status(dev, VIRTIO_CONFIG_STATUS_ACK);
     vtpci_set_status(dev, VIRTIO_CONFIG_STATUS_DRIVER);
 
-    dev->features = in32(dev->base + VIRTIO_PCI_HOST_FEATURES);
-    out32(dev->base + VIRTIO_PCI_GUEST_FEATURES, dev->features & feature_mask);
+    /* keep the negotiated set so drivers can test for features; ring
+       features are handled by the transport for all devices */
+    dev->features = in32(dev->base + VIRTIO_PCI_HOST_FEATURES) &
+        (feature_mask | VIRTIO_RING_F_EVENT_IDX | VIRTIO_RING_F_INDIRECT_DESC);
+    out32(dev->base + VIRTIO_PCI_GUEST_FEATURES, dev->features);
     vtpci_set_status(dev, VIRTIO_CONFIG_STATUS_FEATURE); 
 
     dev->general = h;
@@ -1,6 +1,7 @@
 #include <runtime.h>
 #include <x86_64.h>
 #include <drivers/storage.h>
+#include <drivers/blkqueue.h>
 #include <virtio/scsi.h>
 #include <x86_64.h>
 #include <io.h>
@@ -113,8 +114,15 @@ struct virtio_scsi {
     u16 lun;
     u64 capacity;
     u64 block_size;
+
+    u32 seg_max;
+    u32 max_sectors;
+    u32 cmd_per_lun;
 };
 
+/* data segments per request without indirect descriptors */
+#define VIRTIO_SCSI_DIRECT_SEGS 8
+
 typedef struct virtio_scsi *virtio_scsi;
 
 /*
@@ -176,7 +184,8 @@ static virtio_scsi_request virtio_scsi_alloc_request(virtio_scsi s, u16 target,
     return r;
 }
 
-static void virtio_scsi_enqueue_request(virtio_scsi s, virtio_scsi_request r, void *buf, u64 length, vsr_complete c)
+static void virtio_scsi_enqueue_request_sg(virtio_scsi s, virtio_scsi_request r,
+                                           blkqueue_seg segs, int nsegs, vsr_complete c)
 {
     vqfinish f = closure(s->v->general, virtio_scsi_request_complete, c, s, r);
     virtqueue vq = s->requestq;
@@ -185,26 +194,32 @@ static void virtio_scsi_enqueue_request(virtio_scsi s, virtio_scsi_request r, vo
 
     vqmsg_push(vq, m, &r->req, sizeof(r->req), false);
     if (r->req.cdb[0] == SCSI_CMD_WRITE_16) {
-        if (length > 0)
-            vqmsg_push(vq, m, buf, length, false);          // dataout
-        vqmsg_push(vq, m, &r->resp, sizeof(r->resp), true); // response
+        for (int i = 0; i < nsegs; i++)
+            vqmsg_push(vq, m, segs[i].buf, segs[i].length, false);  // dataout
+        vqmsg_push(vq, m, &r->resp, sizeof(r->resp), true);         // response
     } else {
-        vqmsg_push(vq, m, &r->resp, sizeof(r->resp), true); // response
-        if (length > 0)
-            vqmsg_push(vq, m, buf, length, true);           // datain
+        vqmsg_push(vq, m, &r->resp, sizeof(r->resp), true);         // response
+        for (int i = 0; i < nsegs; i++)
+            vqmsg_push(vq, m, segs[i].buf, segs[i].length, true);   // datain
     }
 
     vqmsg_commit(vq, m, f);
 }
 
+static void virtio_scsi_enqueue_request(virtio_scsi s, virtio_scsi_request r, void *buf, u64 length, vsr_complete c)
+{
+    struct blkqueue_seg seg = { .buf = buf, .length = length };
+    virtio_scsi_enqueue_request_sg(s, r, &seg, length > 0 ? 1 : 0, c);
+}
+
 /*
  * Device driver hooks
  *
  * If we ever really care, the following may be simplified by re-using
  * closures and maintaining a little state machine.
  */
-closure_function(3, 2, void, virtio_scsi_io_done,
-                 status_handler, sh, void *, buf, u64, len,
+closure_function(1, 2, void, virtio_scsi_io_done,
+                 status_handler, sh,
                  virtio_scsi, s, virtio_scsi_request, r)
 {
     struct virtio_scsi_resp_cmd *resp = &r->resp;
@@ -222,40 +237,52 @@ closure_function(3, 2, void, virtio_scsi_io_done,
     closure_finish();
 }
 
-static void virtio_scsi_io(virtio_scsi s, u8 cmd, void *buf, range blocks, status_handler sh)
+/* one READ_16/WRITE_16 for blocks gathered from the segments by the blkqueue */
+closure_function(1, 5, void, virtio_scsi_io,
+                 virtio_scsi, s,
+                 boolean, write, blkqueue_seg, segs, int, nsegs, range, blocks, status_handler, sh)
 {
+    virtio_scsi s = bound(s);
+    u8 cmd = write ? SCSI_CMD_WRITE_16 : SCSI_CMD_READ_16;
     virtio_scsi_request r = virtio_scsi_alloc_request(s, s->target, s->lun, cmd);
     struct scsi_cdb_readwrite_16 *cdb = (struct scsi_cdb_readwrite_16 *) r->req.cdb;
     u32 nblocks = range_span(blocks);
     cdb->addr = htobe64(blocks.start);
     cdb->length = htobe32(nblocks);
-    virtio_scsi_debug("%s: cmd %d, blocks %R, addr 0x%016lx, length 0x%08x\n",
-        __func__, cmd, blocks, cdb->addr, cdb->length);
-    virtio_scsi_enqueue_request(s, r, buf, nblocks * s->block_size,
-        closure(s->v->general, virtio_scsi_io_done, sh, buf, nblocks * s->block_size));
-}
-
-closure_function(1, 3, void, virtio_scsi_write,
-                 virtio_scsi, s,
-                 void *, buf, range, blocks, status_handler, sh)
-{
-    virtio_scsi_io(bound(s), SCSI_CMD_WRITE_16, buf, blocks, sh);
-}
-
-closure_function(1, 3, void, virtio_scsi_read,
-                 virtio_scsi, s,
-                 void *, buf, range, blocks, status_handler, sh)
-{
-    virtio_scsi_io(bound(s), SCSI_CMD_READ_16, buf, blocks, sh);
+    virtio_scsi_debug("%s: cmd %d, blocks %R, %d segs, addr 0x%016lx, length 0x%08x\n",
+        __func__, cmd, blocks, nsegs, cdb->addr, cdb->length);
+    virtio_scsi_enqueue_request_sg(s, r, segs, nsegs,
+        closure(s->v->general, virtio_scsi_io_done, sh));
 }
 
 closure_function(2, 0, void, virtio_scsi_init_done,
                  virtio_scsi, s, storage_attach, a)
 {
     virtio_scsi s = bound(s);
-    block_io in = closure(s->v->general, virtio_scsi_read, s);
-    block_io out = closure(s->v->general, virtio_scsi_write, s);
-    apply(bound(a), in, out, s->capacity);
+
+    /* As for virtio-blk, keep the ring full when requests take a
+       single indirect descriptor each; cmd_per_lun bounds what the
+       target will accept. */
+    struct blkqueue_limits l;
+    u16 entries = virtqueue_entries(s->requestq);
+    l.block_size = s->block_size;
+    l.max_blocks = s->max_sectors ? MAX((s->max_sectors * 512) / s->block_size, 1) : 0;
+    l.max_seg_size = 0;
+    if (s->v->features & VIRTIO_RING_F_INDIRECT_DESC) {
+        l.max_segs = MIN(s->seg_max, virtqueue_max_chain(s->requestq) - 2);
+        l.max_inflight = entries;
+    } else {
+        l.max_segs = MIN(s->seg_max, VIRTIO_SCSI_DIRECT_SEGS);
+        l.max_inflight = MAX(entries / (l.max_segs + 2), 1);
+    }
+    l.max_segs = MAX(l.max_segs, 1);
+    if (s->cmd_per_lun)
+        l.max_inflight = MIN(l.max_inflight, s->cmd_per_lun);
+    virtio_scsi_debug("%s: max blocks %ld, max segs %d, max inflight %d\n",
+        __func__, l.max_blocks, l.max_segs, l.max_inflight);
+    blkqueue bq = allocate_blkqueue(s->v->general, closure(s->v->general, virtio_scsi_io, s), &l);
+    assert(bq != INVALID_ADDRESS);
+    apply(bound(a), blkqueue_reader(bq), blkqueue_writer(bq), s->capacity);
     closure_finish();
 }
 
@@ -289,7 +316,7 @@ closure_function(3, 2, void, virtio_scsi_read_capacity_done,
     virtio_scsi_debug("%s: target %d, lun %d, block size 0x%lx, capacity 0x%lx\n",
         __func__, target, lun, s->block_size, s->capacity);
 
-    enqueue(runqueue, closure(s->v->general, virtio_scsi_init_done, s, bound(a)));
+    enqueue_grow(&runqueue, closure(s->v->general, virtio_scsi_init_done, s, bound(a)));
   out:
     closure_finish();
 }
@@ -442,15 +469,6 @@ static void virtio_scsi_attach(heap general, storage_attach a, heap page_allocat
     u32 num_queues = in32(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_SCSI_R_NUM_QUEUES);
     virtio_scsi_debug("num queues %d\n", num_queues);
 
-    u32 seg_max = in32(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_SCSI_R_SEG_MAX);
-    virtio_scsi_debug("seg max %d\n", seg_max);
-
-    u32 max_sectors = in32(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_SCSI_R_MAX_SECTORS);
-    virtio_scsi_debug("max sectors %d\n", max_sectors);
-
-    u32 cmd_per_lun = in32(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_SCSI_R_CMD_PER_LUN);
-    virtio_scsi_debug("cmd per lun %d\n", cmd_per_lun);
-
     u32 event_info_size = in32(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_SCSI_R_EVENT_INFO_SIZE);
     virtio_scsi_debug("event info size %d\n", event_info_size);
 
@@ -458,6 +476,15 @@ static void virtio_scsi_attach(heap general, storage_attach a, heap page_allocat
     virtio_scsi_debug("max channel %d\n", max_channel);
 #endif
 
+    s->seg_max = in32(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_SCSI_R_SEG_MAX);
+    virtio_scsi_debug("seg max %d\n", s->seg_max);
+
+    s->max_sectors = in32(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_SCSI_R_MAX_SECTORS);
+    virtio_scsi_debug("max sectors %d\n", s->max_sectors);
+
+    s->cmd_per_lun = in32(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_SCSI_R_CMD_PER_LUN);
+    virtio_scsi_debug("cmd per lun %d\n", s->cmd_per_lun);
+
     s->max_target = in16(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_SCSI_R_MAX_TARGET);
     virtio_scsi_debug("max target %d\n", s->max_target);
 
@@ -1,4 +1,5 @@
 #include <drivers/storage.h>
+#include <drivers/blkqueue.h>
 #include <io.h>
 
 #include "virtio_internal.h"
@@ -59,6 +60,13 @@ struct virtio_blk_config {
 #define VIRTIO_BLK_T_OUT        1
 #define VIRTIO_BLK_T_FLUSH      4
 
+/* Feature bits */
+#define VIRTIO_BLK_F_SIZE_MAX   U64_FROM_BIT(1)
+#define VIRTIO_BLK_F_SEG_MAX    U64_FROM_BIT(2)
+
+/* data segments per request without indirect descriptors */
+#define VIRTIO_BLK_DIRECT_SEGS  8
+
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
@@ -105,33 +113,34 @@ closure_function(4, 1, void, complete,
     closure_finish();
 }
 
-static inline void storage_rw_internal(storage st, boolean write, void * buf,
-                                       range sectors, status_handler sh)
+/* Issue one request for the blocks, scattered over the segments; the
+   blkqueue has already split and merged within the device limits. */
+closure_function(1, 5, void, storage_io,
+                 storage, st,
+                 boolean, write, blkqueue_seg, segs, int, nsegs, range, sectors, status_handler, sh)
 {
+    storage st = bound(st);
     char * err = 0;
-    virtio_blk_debug("virtio_%s: block range %R cap %ld\n", write ? "write" : "read", sectors, st->capacity);
+    virtio_blk_debug("virtio_%s: block range %R, %d segs, cap %ld\n", write ? "write" : "read",
+                     sectors, nsegs, st->capacity);
 
     /* XXX so no, not page aligned but what? 16? */
-    if ((u64_from_pointer(buf) & 15)) {
-        msg_err("misaligned buf: %p\n", buf);
-        err = "write buffer not properly aligned";
-        goto out_inval;
-    }
-
-    u64 start_sector = sectors.start;
-    u64 nsectors = range_span(sectors);
-    if (nsectors == 0) {
-        err = "length must be > 0";
-        goto out_inval;
+    for (int i = 0; i < nsegs; i++) {
+        if ((u64_from_pointer(segs[i].buf) & 15)) {
+            msg_err("misaligned buf: %p\n", segs[i].buf);
+            err = "write buffer not properly aligned";
+            goto out_inval;
+        }
     }
 
     virtio_blk_req req = allocate_virtio_blk_req(st, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
-                                                 start_sector);
+                                                 sectors.start);
     virtqueue vq = st->command;
     vqmsg m = allocate_vqmsg(vq);
     assert(m != INVALID_ADDRESS);
     vqmsg_push(vq, m, req, VIRTIO_BLK_REQ_HEADER_SIZE, false);
-    vqmsg_push(vq, m, buf, nsectors * st->block_size, !write);
+    for (int i = 0; i < nsegs; i++)
+        vqmsg_push(vq, m, segs[i].buf, segs[i].length, !write);
     void * statusp = ((void *)req) + VIRTIO_BLK_REQ_HEADER_SIZE;
     vqmsg_push(vq, m, statusp, VIRTIO_BLK_REQ_STATUS_SIZE, true);
     vqfinish c = closure(st->v->general, complete, st, sh, statusp, req);
@@ -142,24 +151,10 @@ static inline void storage_rw_internal(storage st, boolean write, void * buf,
     apply(sh, timm("result", "%s", err));
 }
 
-closure_function(1, 3, void, storage_write,
-                 storage, st,
-                 void *, source, range, blocks, status_handler, s)
-{
-    storage_rw_internal(bound(st), true, source, blocks, s);
-}
-
-closure_function(1, 3, void, storage_read,
-                 storage, st,
-                 void *, target, range, blocks, status_handler, s)
-{
-    storage_rw_internal(bound(st), false, target, blocks, s);
-}
-
 static void virtio_blk_attach(heap general, storage_attach a, heap page_allocator, heap pages, pci_dev d)
 {
     storage s = allocate(general, sizeof(struct storage));
-    s->v = attach_vtpci(general, page_allocator, d, 0);
+    s->v = attach_vtpci(general, page_allocator, d, VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX);
 
     s->block_size = in32(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_BLK_R_BLOCK_SIZE);
     s->capacity = (in32(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_BLK_R_CAPACITY_LOW) |
@@ -168,9 +163,31 @@ static void virtio_blk_attach(heap general, storage_attach a, heap page_allocato
     // initialization complete
     vtpci_set_status(s->v, VIRTIO_CONFIG_STATUS_DRIVER_OK);
 
-    block_io in = closure(general, storage_read, s);
-    block_io out = closure(general, storage_write, s);
-    apply(a, in, out, s->capacity);
+    /* With indirect descriptors each request takes one ring entry, so
+       the ring can be kept full; otherwise a request takes its data
+       segments plus the header and status. */
+    struct blkqueue_limits l;
+    u16 entries = virtqueue_entries(s->command);
+    l.block_size = s->block_size;
+    l.max_blocks = 0;
+    l.max_seg_size = 0;
+    if (s->v->features & VIRTIO_BLK_F_SIZE_MAX)
+        l.max_seg_size = in32(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_BLK_R_SIZE_MAX);
+    u32 seg_max = (s->v->features & VIRTIO_BLK_F_SEG_MAX) ?
+        in32(s->v->base + VIRTIO_MSI_DEVICE_CONFIG + VIRTIO_BLK_R_SEG_MAX) : 1;
+    if (s->v->features & VIRTIO_RING_F_INDIRECT_DESC) {
+        l.max_segs = MIN(seg_max, virtqueue_max_chain(s->command) - 2);
+        l.max_inflight = entries;
+    } else {
+        l.max_segs = MIN(seg_max, VIRTIO_BLK_DIRECT_SEGS);
+        l.max_inflight = MAX(entries / (l.max_segs + 2), 1);
+    }
+    l.max_segs = MAX(l.max_segs, 1);
+    virtio_blk_debug("size max %ld, seg max %d, max inflight %d\n",
+                     l.max_seg_size, l.max_segs, l.max_inflight);
+    blkqueue bq = allocate_blkqueue(general, closure(general, storage_io, s), &l);
+    assert(bq != INVALID_ADDRESS);
+    apply(a, blkqueue_reader(bq), blkqueue_writer(bq), s->capacity);
 }
 
 closure_function(4, 1, boolean, virtio_blk_probe,
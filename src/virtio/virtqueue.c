@@ -75,13 +75,25 @@ struct vring_used {
     struct vring_used_elem ring[0];
 } __attribute__((packed));
 
+/* Most uses here are a chain of 3 or less descriptors; longer chains
+   spill into descv. */
+#define VQMSG_INLINE_DESCS      3
+
 typedef struct vqmsg {
     struct list l;
     u64 count;
+    struct vring_desc descs[VQMSG_INLINE_DESCS];
     buffer descv;               /* XXX should be a variable stride vector */
+    struct vring_desc *indirect; /* table posted in place of a long chain */
     vqfinish completion;
 } *vqmsg;
-    
+
+/* an indirect table occupies one page of the contiguous heap */
+#define VQ_INDIRECT_MAX(vq)     ((vq)->dev->contiguous->pagesize / sizeof(struct vring_desc))
+
+/* completions applied per pass of the service bottom half */
+#define VQ_SERVICE_BATCH        32
+
 typedef struct virtqueue {
     vtpci dev;
     u16 entries;
@@ -90,27 +102,61 @@ typedef struct virtqueue {
     volatile struct vring_desc *desc;
     volatile struct vring_avail *avail;
     volatile struct vring_used *used;    
+    volatile u16 *used_event;   /* in avail ring, with EVENT_IDX */
+    volatile u16 *avail_event;  /* in used ring, with EVENT_IDX */
+    boolean event_idx;
+    boolean indirect;
     u64 free_cnt;               /* atomic */
     u16 desc_idx;               /* head of descriptor free list */
-    u16 last_used_idx;          /* irq only */
+    u16 last_used_idx;          /* service bh only */
+    u32 service_scheduled;      /* atomic */
+    thunk service;
     struct list msgqueue;
     int max_queued;
+    struct vqmsg *msg_pool;     /* one message per descriptor */
+    struct list free_msgs;
     vqmsg msgs[0];
 } *virtqueue;
 
-/* Most uses here are a chain of 3 or less descriptors. */
-#define VQMSG_DEFAULT_SIZE     3
+static inline boolean vqmsg_pooled(virtqueue vq, vqmsg m)
+{
+    return m >= vq->msg_pool && m < vq->msg_pool + vq->entries;
+}
+
+/* ring descriptors taken by a message */
+static inline u64 vqmsg_ring_descs(vqmsg m)
+{
+    return m->indirect ? 1 : m->count;
+}
+
+static inline struct vring_desc *vqmsg_desc(vqmsg m, int i)
+{
+    return i < VQMSG_INLINE_DESCS ? &m->descs[i] :
+        buffer_ref(m->descv, (i - VQMSG_INLINE_DESCS) * sizeof(struct vring_desc));
+}
+
+/* Messages come from the per-queue pool; there can be no more in
+   flight than descriptors, so the heap is only touched when many more
+   are waiting on msgqueue. */
 vqmsg allocate_vqmsg(virtqueue vq)
 {
-    heap h = vq->dev->general;
-    vqmsg m = allocate(h, sizeof(struct vqmsg));
+    vqmsg m = INVALID_ADDRESS;
+    u64 flags = irq_disable_save();
+    list l = list_get_next(&vq->free_msgs);
+    if (l) {
+        list_delete(l);
+        m = struct_from_list(l, vqmsg, l);
+    }
+    irq_restore(flags);
+    if (m == INVALID_ADDRESS) {
+        m = allocate(vq->dev->general, sizeof(struct vqmsg));
+        if (m == INVALID_ADDRESS)
+            return m;
+    }
     list_init(&m->l);
     m->count = 0;
-    m->descv = allocate_buffer(h, sizeof(struct vring_desc) * VQMSG_DEFAULT_SIZE);
-    if (m->descv == INVALID_ADDRESS) {
-        deallocate(h, m, sizeof(struct vqmsg));
-        return INVALID_ADDRESS;
-    }
+    m->descv = 0;
+    m->indirect = 0;
     m->completion = 0;          /* fill on queue */
     return m;
 }
@@ -118,14 +164,29 @@ vqmsg allocate_vqmsg(virtqueue vq)
 /* must be safe at interrupt level */
 void deallocate_vqmsg_irq(virtqueue vq, vqmsg m)
 {
-    deallocate_buffer(m->descv);
-    deallocate(vq->dev->general, m, sizeof(struct vqmsg));
+    if (m->descv)
+        deallocate_buffer(m->descv);
+    if (m->indirect)
+        deallocate(vq->dev->contiguous, m->indirect, vq->dev->contiguous->pagesize);
+    if (vqmsg_pooled(vq, m)) {
+        u64 flags = irq_disable_save();
+        list_insert_after(&vq->free_msgs, &m->l);
+        irq_restore(flags);
+    } else {
+        deallocate(vq->dev->general, m, sizeof(struct vqmsg));
+    }
 }
 
 void vqmsg_push(virtqueue vq, vqmsg m, void * addr, u32 len, boolean write)
 {
-    buffer_extend(m->descv, (m->count + 1) * sizeof(struct vring_desc));
-    struct vring_desc * d = buffer_ref(m->descv, m->count * sizeof(struct vring_desc));
+    if (m->count >= VQMSG_INLINE_DESCS) {
+        if (!m->descv)
+            m->descv = allocate_buffer(vq->dev->general, sizeof(struct vring_desc) * VQMSG_INLINE_DESCS);
+        assert(m->descv != INVALID_ADDRESS);
+        buffer_extend(m->descv, sizeof(struct vring_desc));
+        buffer_produce(m->descv, sizeof(struct vring_desc));
+    }
+    struct vring_desc * d = vqmsg_desc(m, m->count);
     d->busaddr = physical_from_virtual(addr);
     d->len = len;
     d->flags = write ? VRING_DESC_F_WRITE : 0;
@@ -136,66 +197,134 @@ void vqmsg_push(virtqueue vq, vqmsg m, void * addr, u32 len, boolean write)
 static void virtqueue_fill(virtqueue vq);
 static void virtqueue_fill_irq(virtqueue vq);
 
-void vqmsg_commit(virtqueue vq, vqmsg m, vqfinish completion)
+/* Queue a message without handing it to the device; a subsequent
+   virtqueue_kick() posts everything queued with a single notify. */
+void vqmsg_queue(virtqueue vq, vqmsg m, vqfinish completion)
 {
     m->completion = completion;
-    /* XXX noirq */
+
+    /* Long chains go out as one indirect descriptor, so that a
+       scatter-gather request neither starves the ring nor waits for
+       it to drain. */
+    if (vq->indirect && m->count > VQMSG_INLINE_DESCS && m->count <= VQ_INDIRECT_MAX(vq)) {
+        m->indirect = allocate(vq->dev->contiguous, vq->dev->contiguous->pagesize);
+        if (m->indirect == INVALID_ADDRESS) {
+            m->indirect = 0;
+        } else {
+            for (int i = 0; i < m->count; i++) {
+                m->indirect[i] = *vqmsg_desc(m, i);
+                if (i < m->count - 1) {
+                    m->indirect[i].flags |= VRING_DESC_F_NEXT;
+                    m->indirect[i].next = i + 1;
+                }
+            }
+        }
+    }
+    u64 flags = irq_disable_save();
     list_push_back(&vq->msgqueue, &m->l);
+    irq_restore(flags);
+}
+
+void vqmsg_commit(virtqueue vq, vqmsg m, vqfinish completion)
+{
+    vqmsg_queue(vq, m, completion);
     virtqueue_fill(vq);
 }
 
-closure_function(2, 0, void, vq_complete,
-                 vqfinish, f, u16, len)
+/* Ask the device to interrupt once more used entries are posted, and
+   return true if some already were, in which case the caller should
+   keep servicing. */
+static boolean virtqueue_enable_interrupt(virtqueue vq)
 {
-    apply(bound(f), bound(len));
-    closure_finish();
+    if (vq->event_idx)
+        *vq->used_event = vq->last_used_idx;
+    else
+        vq->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    memory_barrier();
+    return vq->last_used_idx != vq->used->idx;
 }
 
-closure_function(1, 0, void, vq_interrupt,
+/* Reap used descriptors and run their completions, VQ_SERVICE_BATCH
+   at a time. Only one instance runs per queue, so last_used_idx needs
+   no further protection; the descriptor free list is shared with
+   virtqueue_fill and is touched with interrupts disabled. */
+closure_function(1, 0, void, vq_service,
                  virtqueue, vq)
 {
-    // ensure we see up-to-date used->idx (updated by host)
-    memory_barrier();
     virtqueue vq = bound(vq);
-    virtqueue_debug_verbose("%s: ENTRY: vq %p: entries %d, last_used_idx %d, used->idx %d, desc_idx %d\n",
-        __func__, vq, vq->entries, vq->last_used_idx, vq->used->idx, vq->desc_idx);
-    
+    vqfinish completions[VQ_SERVICE_BATCH];
+    u64 lens[VQ_SERVICE_BATCH];
     int processed = 0;
-    while (vq->last_used_idx != vq->used->idx) {
-        volatile struct vring_used_elem *uep = vq->used->ring + (vq->last_used_idx & (vq->entries - 1));
-        virtqueue_debug_verbose("%s: vq %p: last_used_idx %d, id %d, len %d\n",
-            __func__, vq, vq->last_used_idx, uep->id, uep->len);
-        u16 head = uep->id;
-        u16 len = uep->len;
-        vqmsg m = vq->msgs[head];
-        vqfinish completion = m->completion;
-
-        /* return descriptor(s) to free list */
-        int dcount = 1;
-        volatile struct vring_desc *d = vq->desc + head;
-        while ((d->flags & VRING_DESC_F_NEXT)) {
-            d = vq->desc + d->next;
-            dcount++;
+
+    while (1) {
+        int n = 0;
+        u64 flags = irq_disable_save();
+        memory_barrier();       /* see up-to-date used->idx */
+        while (n < VQ_SERVICE_BATCH && vq->last_used_idx != vq->used->idx) {
+            volatile struct vring_used_elem *uep = vq->used->ring + (vq->last_used_idx & (vq->entries - 1));
+            virtqueue_debug_verbose("%s: vq %p: last_used_idx %d, id %d, len %d\n",
+                __func__, vq, vq->last_used_idx, uep->id, uep->len);
+            u16 head = uep->id;
+            vqmsg m = vq->msgs[head];
+            completions[n] = m->completion;
+            lens[n] = uep->len;
+            n++;
+
+            /* return descriptor(s) to free list */
+            int dcount = 1;
+            volatile struct vring_desc *d = vq->desc + head;
+            while ((d->flags & VRING_DESC_F_NEXT)) {
+                d = vq->desc + d->next;
+                dcount++;
+            }
+            assert(dcount == vqmsg_ring_descs(m));
+            d->next = vq->desc_idx;
+            vq->desc_idx = head;
+
+            vq->last_used_idx++;
+            fetch_and_add(&vq->free_cnt, vqmsg_ring_descs(m));
+            vq->msgs[head] = 0;
+            deallocate_vqmsg_irq(vq, m);
         }
-        assert(dcount == m->count);
-        d->next = vq->desc_idx;
-        vq->desc_idx = head;
-
-        vq->last_used_idx++;
-        processed++;
-        fetch_and_add(&vq->free_cnt, m->count);
-        vq->msgs[head] = 0;
-        deallocate_vqmsg_irq(vq, m);
-
-        /* XXX seems like we could devise a way to avoid another enqueue */
-        enqueue(bhqueue, closure(vq->dev->general, vq_complete, completion, len));
-    }
 
-    virtqueue_fill_irq(vq);
+        /* post anything that was waiting on descriptors */
+        if (n > 0)
+            virtqueue_fill_irq(vq);
+        irq_restore(flags);
+
+        for (int i = 0; i < n; i++)
+            apply(completions[i], lens[i]);
+        processed += n;
+
+        if (n == VQ_SERVICE_BATCH)
+            continue;
+
+        /* Drop the scheduled flag before rearming so that an interrupt
+           arriving after the recheck schedules us again. */
+        __atomic_store_n(&vq->service_scheduled, 0, __ATOMIC_RELEASE);
+        if (!virtqueue_enable_interrupt(vq) ||
+            !compare_and_swap_32(&vq->service_scheduled, 0, 1))
+            break;
+    }
     virtqueue_debug("%s: EXIT: vq %p: processed %d, last_used_idx %d, desc_idx %d\n",
         __func__, vq, processed, vq->last_used_idx, vq->desc_idx);
 }
 
+/* Schedule a single service pass for however many entries the device
+   has posted, and suppress further interrupts until it has run. */
+closure_function(1, 0, void, vq_interrupt,
+                 virtqueue, vq)
+{
+    virtqueue vq = bound(vq);
+    virtqueue_debug_verbose("%s: ENTRY: vq %p: entries %d, last_used_idx %d, used->idx %d, desc_idx %d\n",
+        __func__, vq, vq->entries, vq->last_used_idx, vq->used->idx, vq->desc_idx);
+    if (!compare_and_swap_32(&vq->service_scheduled, 0, 1))
+        return;
+    if (!vq->event_idx)
+        vq->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+    enqueue_grow(&bhqueue, vq->service);
+}
+
 status virtqueue_alloc(vtpci dev,
                        u16 queue,
                        u16 size,
@@ -205,12 +334,22 @@ status virtqueue_alloc(vtpci dev,
 {
     virtqueue vq;
     u64 d = size * sizeof(struct vring_desc);
-    u64 avail_end = pad(d + sizeof(*vq->avail) + sizeof(vq->avail->ring[0]) * size, align);
-    bytes alloc = avail_end + pad(sizeof(*vq->used) + sizeof(vq->used->ring[0]) * size, align);
+    /* the trailing u16s are used_event and avail_event */
+    u64 avail_end = pad(d + sizeof(*vq->avail) + sizeof(vq->avail->ring[0]) * size + sizeof(u16), align);
+    bytes alloc = avail_end + pad(sizeof(*vq->used) + sizeof(vq->used->ring[0]) * size + sizeof(u16), align);
     vq = allocate(dev->general, sizeof(struct virtqueue) + size * sizeof(vqmsg));
     
     if (vq == INVALID_ADDRESS) 
         return timm("status", "cannot allocate virtqueue");
+
+    vq->msg_pool = allocate(dev->general, size * sizeof(struct vqmsg));
+    if (vq->msg_pool == INVALID_ADDRESS) {
+        deallocate(dev->general, vq, sizeof(struct virtqueue) + size * sizeof(vqmsg));
+        return timm("status", "cannot allocate virtqueue message pool");
+    }
+    list_init(&vq->free_msgs);
+    for (int i = 0; i < size; i++)
+        list_insert_after(&vq->free_msgs, &vq->msg_pool[i].l);
     
     virtqueue_debug("%s: vq %p: idx %d, size %d, alloc %d\n",
         __func__, vq, queue, size, alloc);
@@ -220,11 +359,19 @@ status virtqueue_alloc(vtpci dev,
     vq->free_cnt = size;
     list_init(&vq->msgqueue);
     vq->max_queued = 0;
+    vq->last_used_idx = 0;
+    vq->service_scheduled = 0;
+    vq->event_idx = (dev->features & VIRTIO_RING_F_EVENT_IDX) != 0;
+    vq->indirect = (dev->features & VIRTIO_RING_F_INDIRECT_DESC) != 0;
 
     if ((vq->ring_mem = allocate_zero(dev->contiguous, alloc)) != INVALID_ADDRESS) {
         vq->desc = (struct vring_desc *) vq->ring_mem;
         vq->avail = (struct vring_avail *) (vq->desc + size);
         vq->used = (struct vring_used *) (vq->ring_mem  + avail_end);
+        vq->used_event = (u16 *) ((void *) vq->avail + sizeof(*vq->avail) +
+                                  sizeof(vq->avail->ring[0]) * size);
+        vq->avail_event = (u16 *) ((void *) vq->used + sizeof(*vq->used) +
+                                   sizeof(vq->used->ring[0]) * size);
         virtqueue_debug("%s: vq %p: desc %p, avail %p, used %p\n",
             __func__, vq, vq->desc, vq->avail, vq->used);
 
@@ -233,6 +380,7 @@ status virtqueue_alloc(vtpci dev,
             vq->desc[i].next = i + 1;
         vq->desc[vq->entries - 1].next = VQ_RING_DESC_CHAIN_END;
 
+        vq->service = closure(dev->general, vq_service, vq);
         *t = closure(dev->general, vq_interrupt, vq);
         *vqp = vq;
         return 0;
@@ -247,17 +395,37 @@ void virtqueue_set_max_queued(virtqueue vq, int max_queued)
     virtqueue_debug("%s: vq %p: max_queued = %d\n", __func__, vq, vq->max_queued);
 }
 
+u16 virtqueue_entries(virtqueue vq)
+{
+    return vq->entries;
+}
+
+/* longest descriptor chain a single message may carry */
+u16 virtqueue_max_chain(virtqueue vq)
+{
+    return vq->indirect ? VQ_INDIRECT_MAX(vq) : vq->entries;
+}
+
 physical virtqueue_paddr(virtqueue vq)
 {
     return (physical_from_virtual(vq->ring_mem));
 }
 
-static int virtqueue_notify(virtqueue vq)
+/* as in the virtio spec: has the device asked to be notified at an
+   index in (old, new]? */
+static inline boolean vring_need_event(u16 event, u16 new, u16 old)
+{
+    return (u16)(new - event - 1) < (u16)(new - old);
+}
+
+static int virtqueue_notify(virtqueue vq, u16 old_idx)
 {
     // ensure used->flags update is visible to us
     // and updated avail->idx is visible to host
     memory_barrier();
-    int should_notify = (vq->used->flags & VRING_USED_F_NO_NOTIFY) == 0;
+    int should_notify = vq->event_idx ?
+        vring_need_event(*vq->avail_event, vq->avail->idx, old_idx) :
+        (vq->used->flags & VRING_USED_F_NO_NOTIFY) == 0;
     if (should_notify)
         vtpci_notify_virtqueue(vq->dev, vq->queue_index);
     return should_notify;
@@ -270,10 +438,12 @@ static void virtqueue_fill_irq(virtqueue vq)
         __func__, vq, vq->entries, vq->desc_idx, vq->avail->idx);
     list n = list_get_next(&vq->msgqueue);
 
+    u16 old_idx = vq->avail->idx;
     u16 added = 0;
     while (n && n != &vq->msgqueue) {
         vqmsg m = struct_from_list(n, vqmsg, l);
-        if (vq->free_cnt < m->count) {
+        u64 ndesc = vqmsg_ring_descs(m);
+        if (vq->free_cnt < ndesc) {
             virtqueue_debug_verbose("%s: vq %p: queue full (vq->free_cnt %ld)\n",
                 __func__, vq, vq->free_cnt);
             break;
@@ -289,13 +459,19 @@ static void virtqueue_fill_irq(virtqueue vq)
         u16 head = vq->desc_idx;
         vq->msgs[head] = m;
 
-        for (int i = 0; i < m->count; i++) {
-            struct vring_desc *src = buffer_ref(m->descv, i * sizeof(*src));
+        struct vring_desc ind;
+        if (m->indirect) {
+            ind.busaddr = physical_from_virtual(m->indirect);
+            ind.len = m->count * sizeof(struct vring_desc);
+            ind.flags = VRING_DESC_F_INDIRECT;
+        }
+        for (int i = 0; i < ndesc; i++) {
+            struct vring_desc *src = m->indirect ? &ind : vqmsg_desc(m, i);
             volatile struct vring_desc *d = vq->desc + vq->desc_idx;
             d->busaddr = src->busaddr;
             d->len = src->len;
             d->flags = src->flags;
-            if (i < m->count - 1)
+            if (i < ndesc - 1)
                 d->flags |= VRING_DESC_F_NEXT;
             vq->desc_idx = d->next;
 
@@ -307,7 +483,7 @@ static void virtqueue_fill_irq(virtqueue vq)
         vq->avail->ring[avail_idx] = head;
         virtqueue_debug_verbose("%s: vq %p: msg %p (count %d): avail->ring[%d] = %d\n",
             __func__, vq, m, m->count, avail_idx, head);
-        fetch_and_add(&vq->free_cnt, -m->count);
+        fetch_and_add(&vq->free_cnt, -ndesc);
         added++;
 
         // ensure desc and avail ring updates above are visible before updating avail->idx
@@ -321,7 +497,7 @@ static void virtqueue_fill_irq(virtqueue vq)
 
     int notified = 0;
     if (added > 0)
-        notified = virtqueue_notify(vq);
+        notified = virtqueue_notify(vq, old_idx);
     (void) notified;
     virtqueue_debug("%s: EXIT: vq %p: added %d, notified %d, desc_idx %d\n",
         __func__, vq, added, notified, vq->desc_idx);
@@ -334,3 +510,8 @@ static void virtqueue_fill(virtqueue vq)
     virtqueue_fill_irq(vq);
     irq_restore(flags);
 }
+
+void virtqueue_kick(virtqueue vq)
+{
+    virtqueue_fill(vq);
+}
@@ -0,0 +1,116 @@
+        ;; Application processor startup trampoline
+        ;;
+        ;; This is copied to AP_BOOT_PAGE in low memory and entered in
+        ;; real mode, at CS:IP = (AP_BOOT_PAGE >> 4):0, upon receipt of
+        ;; a startup IPI. The fields following the code are filled in
+        ;; by start_secondary_cpus() before the IPIs are sent.
+
+%macro global_data 1
+	global %1:data (%1.end - %1)
+%endmacro
+
+%define CR0_PE   (1 << 0)
+%define CR0_PG   (1 << 31)
+%define CR4_PAE  (1 << 5)
+%define EFER_MSR 0xc0000080
+%define AP_COUNT_CLOSED (1 << 31)
+
+        bits 16
+global ap_start_begin
+ap_start_begin:
+        cli
+        mov ax, cs
+        mov ds, ax
+        lgdt [ap_gdt_pointer - ap_start_begin]
+
+        mov eax, cr4
+        or eax, CR4_PAE
+        mov cr4, eax
+        mov eax, [ap_pagetable - ap_start_begin]
+        mov cr3, eax
+        mov ecx, EFER_MSR
+        mov eax, [ap_efer - ap_start_begin]
+        xor edx, edx
+        wrmsr
+        mov eax, cr0
+        or eax, CR0_PE | CR0_PG
+        mov cr0, eax
+
+        ;; straight to long mode
+        o32 jmp far [ap_long_mode - ap_start_begin]
+
+        bits 64
+global ap_start64
+ap_start64:
+        mov ax, 0x10
+        mov ds, ax
+        mov es, ax
+        mov ss, ax
+        xor eax, eax
+        mov fs, ax
+        mov gs, ax
+
+        ;; claim a cpu id and the stack that goes with it, unless all
+        ;; are taken or the BSP has stopped waiting and closed the count
+.claim:
+        mov eax, [rel ap_count]
+        test eax, AP_COUNT_CLOSED
+        jnz .halt
+        cmp eax, [rel ap_limit]
+        jae .halt
+        lea edx, [rax + 1]
+        lock cmpxchg [rel ap_count], edx
+        jnz .claim
+        mov rbx, [rel ap_stacks]
+        mov rsp, [rbx + rdx * 8]
+        mov edi, edx
+        mov rax, [rel ap_entry]
+        call rax
+.halt:
+        hlt
+        jmp .halt
+
+        align 8
+global_data ap_gdt
+ap_gdt:
+        dq 0                    ; null
+        dq 0x00209a0000000000   ; code - 0x08
+        dq 0x0000920000000000   ; data - 0x10
+.end:
+global_data ap_gdt_pointer
+ap_gdt_pointer:
+        dw ap_gdt_pointer - ap_gdt - 1
+        dd 0                    ; linear address of ap_gdt
+.end:
+global_data ap_long_mode
+ap_long_mode:
+        dd 0                    ; linear address of ap_start64
+        dw 0x08
+.end:
+global_data ap_pagetable
+ap_pagetable:
+        dd 0
+.end:
+global_data ap_efer
+ap_efer:
+        dd 0
+.end:
+global_data ap_count
+ap_count:
+        dd 0                    ; ids claimed, AP_COUNT_CLOSED once closed
+.end:
+global_data ap_limit
+ap_limit:
+        dd 0                    ; ids available
+.end:
+        align 8
+global_data ap_stacks
+ap_stacks:
+        dq 0                    ; stack tops, indexed by cpu id
+.end:
+global_data ap_entry
+ap_entry:
+        dq 0
+.end:
+global ap_start_end
+ap_start_end:
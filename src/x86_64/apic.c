@@ -30,6 +30,7 @@
 #define TMR_TSC_DEADLINE 0x40000
 #define TMR_BASEDIV      (1 << 20)
 #define APIC_LVT_INTMASK 0x00010000
+#define APIC_ICR_PENDING 0x00001000
 
 static heap apic_heap = 0;
 static u64 apic_vbase;
@@ -55,6 +56,8 @@ static inline void apic_clear(int reg, u32 v)
 }
 
 static u32 apic_timer_cal_sec;
+static u32 apic_timer_lvt;      /* replicated to secondary cpus */
+static u32 apic_err_lvt;
 
 /* We could possibly trim this if the extra delay in boot becomes a concern. */
 #define CALIBRATE_DURATION_MS 10
@@ -89,7 +92,8 @@ void lapic_set_tsc_deadline_mode(u32 v)
 {
     assert(apic_vbase);
     write_barrier();
-    apic_write(APIC_LVT_TMR, v | TMR_TSC_DEADLINE);
+    apic_timer_lvt = v | TMR_TSC_DEADLINE;
+    apic_write(APIC_LVT_TMR, apic_timer_lvt);
     write_barrier();
 }
 
@@ -99,26 +103,55 @@ clock_timer init_lapic_timer(void)
     clock_timer ct = closure(apic_heap, lapic_timer);
     apic_write(APIC_TMRDIV, 3 /* 16 */);
     int v = allocate_interrupt();
+    apic_timer_lvt = v | APIC_LVT_INTMASK;
     apic_write(APIC_LVT_TMR, v); /* one shot */
     register_interrupt(v, closure(apic_heap, int_ignore));
     calibrate_lapic_timer();
     return ct;
 }
 
-void init_apic(kernel_heaps kh)
+u32 apic_id(void)
 {
-    apic_heap = heap_general(kh);
-    apic_vbase = allocate_u64(heap_virtual_page(kh), PAGESIZE);
-    assert(apic_vbase != INVALID_PHYSICAL);
-    map(apic_vbase, APIC_BASE, PAGESIZE, PAGE_DEV_FLAGS, heap_pages(kh));
+    return apic_read(APIC_APICID) >> 24;
+}
+
+void apic_ipi(u32 target, u64 flags, u8 vector)
+{
+    write_barrier();
+    apic_write(APIC_ICRH, target << 24);
+    apic_write(APIC_ICRL, flags | vector);
+    while (apic_read(APIC_ICRL) & APIC_ICR_PENDING)
+        kern_pause();
+}
+
+/* Local APIC setup for the running cpu; the mapping and vector
+   assignments are shared with the BSP. */
+void apic_per_cpu_init(void)
+{
+    assert(apic_vbase);
 
     /* enable spurious interrupts */
     apic_set(APIC_SPURIOUS, APIC_SW_ENABLE);
     apic_write(APIC_LVT_LINT0, APIC_DISABLE);
     apic_write(APIC_LVT_LINT1, APIC_DISABLE);
+    apic_write(APIC_LVT_ERR, apic_err_lvt);
+
+    if (apic_timer_lvt) {
+        apic_write(APIC_TMRDIV, 3 /* 16 */);
+        apic_write(APIC_LVT_TMR, apic_timer_lvt);
+    }
+}
+
+void init_apic(kernel_heaps kh)
+{
+    apic_heap = heap_general(kh);
+    apic_vbase = allocate_u64(heap_virtual_page(kh), PAGESIZE);
+    assert(apic_vbase != INVALID_PHYSICAL);
+    map(apic_vbase, APIC_BASE, PAGESIZE, PAGE_DEV_FLAGS, heap_pages(kh));
 
     /* set up error interrupt */
     u64 lvt_err_irq = allocate_interrupt();
     assert(lvt_err_irq != INVALID_PHYSICAL);
-    apic_write(APIC_LVT_ERR, lvt_err_irq);
+    apic_err_lvt = lvt_err_irq;
+    apic_per_cpu_init();
 }
@@ -2,3 +2,11 @@ void lapic_eoi(void);
 void init_apic(kernel_heaps kh);
 void lapic_set_tsc_deadline_mode(u32 v);
 clock_timer init_lapic_timer(void);
+u32 apic_id(void);
+void apic_ipi(u32 target, u64 flags, u8 vector);
+void apic_per_cpu_init(void);
+
+#define ICR_TYPE_INIT           0x00000500
+#define ICR_TYPE_STARTUP        0x00000600
+#define ICR_ASSERT              0x00004000
+#define ICR_DEST_ALL_EXC_SELF   0x000c0000
@@ -9,17 +9,22 @@
         
 global_func _start
 extern  init_service
-extern  running_frame
-extern  syscall_stack_top
 
 %include "frame.inc"
         
 %define FS_MSR 0xc0000100
         
 extern common_handler
+        ;; Stack on entry holds the vector and an error code (real or
+        ;; placeholder), followed by the interrupt stack frame. The GS
+        ;; base is swapped in only when entering from user mode.
 interrupt_common:
+        test qword [rsp+24], 3  ; cs
+        jz .kernel_entry
+        swapgs
+.kernel_entry:
         push rbx
-        mov rbx, [running_frame]
+        mov rbx, [gs:CPUINFO_RUNNING_FRAME]
         mov [rbx+FRAME_RAX*8], rax
         mov [rbx+FRAME_RCX*8], rcx
         mov [rbx+FRAME_RDX*8], rdx
@@ -44,14 +49,8 @@ interrupt_common:
         mov [rbx+FRAME_RBX*8], rax
         pop rax            ; vector
         mov [rbx+FRAME_VECTOR*8], rax
-        
-        ;;  could avoid this branch with a different inter layout - write as different handler
-        cmp rax, 0xe
-        je geterr
-        cmp rax, 0xd
-        je geterr
-        
-getrip:
+        pop rax            ; error code
+        mov [rbx+FRAME_ERROR_CODE*8], rax
         pop rax            ; eip
         mov [rbx+FRAME_RIP*8], rax
         pop rax            ; cs
@@ -66,7 +65,7 @@ getrip:
 
 global interrupt_exit
 interrupt_exit:
-        mov rbx, [running_frame]
+        mov rbx, [gs:CPUINFO_RUNNING_FRAME]
 
         ; set fs selector to null before writing hidden base (for intel/no-accel)
         mov rax, 0
@@ -96,16 +95,13 @@ interrupt_exit:
         push qword [rbx+FRAME_FLAGS*8] ; rflags
         push qword [rbx+FRAME_CS*8]    ; cs
         push qword [rbx+FRAME_RIP*8]   ; rip
+        test qword [rbx+FRAME_CS*8], 3
+        jz .kernel_exit
+        swapgs
+.kernel_exit:
         mov rbx, [rbx+FRAME_RBX*8]
         iretq
 
-global_func geterr
-geterr:
-        pop rax
-        mov [rbx+FRAME_ERROR_CODE*8], rax
-        jmp getrip
-.end:
-
         interrupts equ 0x30
 
 global_data n_interrupt_vectors
@@ -117,11 +113,20 @@ interrupt_vector_size:
         dd interrupt1 - interrupt0
 .end:
 
+        ;; vectors 8, 10-14, 17, 21, 29 and 30 push an error code
+        %define ERROR_CODE_VECTORS 0x60227d00
+
+        ;; stubs are aligned so that interrupt_vector_size gives the stride
+align 16
 global interrupt_vectors
 interrupt_vectors:
         %assign i 0
         %rep interrupts
+        align 16
         interrupt %+ i:
+        %if i >= 32 || ((ERROR_CODE_VECTORS >> i) & 1) == 0
+        push qword 0
+        %endif
         push qword i
         jmp interrupt_common
         %assign i i+1
@@ -131,8 +136,9 @@ interrupt_vectors:
 extern syscall
 global_func syscall_enter
 syscall_enter:
+        swapgs
         push rax
-        mov rax, [running_frame]
+        mov rax, [gs:CPUINFO_RUNNING_FRAME]
         mov [rax+FRAME_RBX*8], rbx
         pop rbx
         mov [rax+FRAME_VECTOR*8], rbx
@@ -152,9 +158,9 @@ syscall_enter:
         mov [rax+FRAME_RIP*8], rcx
         mov rax, syscall
         mov rax, [rax]
-        mov rsp, [syscall_stack_top]
+        mov rsp, [gs:CPUINFO_SYSCALL_STACK]
         call rax
-        mov rbx, [running_frame]
+        mov rbx, [gs:CPUINFO_RUNNING_FRAME]
         ;; fall through to frame_return
 .end:
 
@@ -188,6 +194,7 @@ frame_return:
         mov rsp, [rax+FRAME_RSP*8]
         mov rcx, [rax+FRAME_RIP*8]
         mov rax, [rax+FRAME_RAX*8]
+        swapgs
         o64 sysret
 .end:
 
@@ -0,0 +1,116 @@
+#include <runtime.h>
+#include <x86_64.h>
+
+//#define FPU_DEBUG
+#ifdef FPU_DEBUG
+#define fpu_debug(x, ...) do {rprintf("FPU: " x, ##__VA_ARGS__);} while(0)
+#else
+#define fpu_debug(x, ...)
+#endif
+
+/* User extended register state (x87, SSE, AVX and AVX-512 where
+   present) lives in a per-thread area of fpu_state_size bytes. With
+   XSAVE the area is sized by CPUID for the features enabled in XCR0,
+   and XSAVEOPT skips components which are in their initial state or
+   unmodified since the last XRSTOR from the same area. Without it we
+   fall back to the 512 byte FXSAVE format. The kernel itself is built
+   without SSE and never touches these registers. */
+
+#define CPUID_FEATURE_XSAVE     U64_FROM_BIT(26) /* leaf 1, ecx */
+#define CPUID_XSAVEOPT          U64_FROM_BIT(0)  /* leaf 0xd subleaf 1, eax */
+
+#define XCR0_AVX512     (U64_FROM_BIT(5) | U64_FROM_BIT(6) | U64_FROM_BIT(7))
+
+#define FPU_FCW_OFFSET          0
+#define FPU_MXCSR_OFFSET        24
+#define FPU_MXCSR_MASK_OFFSET   28
+#define FPU_FCW_INIT            0x37f
+#define FPU_MXCSR_INIT          0x1f80
+#define FPU_MXCSR_MASK_DEFAULT  0xffbf
+
+u64 fpu_state_size = FXSAVE_SIZE;
+u64 fpu_xfeatures;              /* enabled in XCR0, or 0 without XSAVE */
+static u32 fpu_mxcsr_mask = FPU_MXCSR_MASK_DEFAULT;
+static boolean fpu_xsaveopt;
+
+void fpu_save(void *area)
+{
+    if (fpu_xsaveopt)
+        asm volatile("xsaveopt64 (%0)" : : "r" (area), "a" (-1), "d" (-1) : "memory");
+    else if (fpu_xfeatures)
+        asm volatile("xsave64 (%0)" : : "r" (area), "a" (-1), "d" (-1) : "memory");
+    else
+        asm volatile("fxsave64 (%0)" : : "r" (area) : "memory");
+}
+
+void fpu_restore(void *area)
+{
+    if (fpu_xfeatures)
+        asm volatile("xrstor64 (%0)" : : "r" (area), "a" (-1), "d" (-1) : "memory");
+    else
+        asm volatile("fxrstor64 (%0)" : : "r" (area) : "memory");
+}
+
+/* The state a new thread or signal handler starts with. An empty XSAVE
+   header marks every component as initial; MXCSR is always loaded
+   from the legacy region. */
+void fpu_init_state(void *area)
+{
+    zero(area, fpu_state_size);
+    *(u16 *)(area + FPU_FCW_OFFSET) = FPU_FCW_INIT;
+    *(u32 *)(area + FPU_MXCSR_OFFSET) = FPU_MXCSR_INIT;
+}
+
+/* Make state of the given length taken from user memory safe to
+   restore; reserved bits in MXCSR or the XSAVE header would fault. A
+   legacy-only image carries just the x87 and SSE components. */
+void fpu_sanitize_state(void *area, u64 length)
+{
+    *(u32 *)(area + FPU_MXCSR_OFFSET) &= fpu_mxcsr_mask;
+    if (!fpu_xfeatures)
+        return;
+    u64 *header = area + FXSAVE_SIZE;
+    if (length < FXSAVE_SIZE + XSAVE_HEADER_SIZE) {
+        zero(header, fpu_state_size - FXSAVE_SIZE);
+        header[0] = XCR0_X87 | XCR0_SSE;
+    } else {
+        header[0] &= fpu_xfeatures;
+        zero(&header[1], XSAVE_HEADER_SIZE - sizeof(u64));
+    }
+}
+
+void init_fpu(void)
+{
+    u32 v[4];
+    u64 cr4;
+
+    cpuid(1, 0, v);
+    if (v[2] & CPUID_FEATURE_XSAVE) {
+        mov_from_cr("cr4", cr4);
+        mov_to_cr("cr4", cr4 | CR4_OSXSAVE);
+
+        /* subleaf 0 reports the supported user state components */
+        cpuid(0xd, 0, v);
+        u64 supported = v[0] | ((u64)v[3] << 32);
+        fpu_xfeatures = supported & (XCR0_X87 | XCR0_SSE | XCR0_AVX);
+        if ((supported & XCR0_AVX512) == XCR0_AVX512)
+            fpu_xfeatures |= XCR0_AVX512;
+        write_xmsr(0, fpu_xfeatures);
+
+        /* ebx now gives the area size for the enabled set */
+        cpuid(0xd, 0, v);
+        fpu_state_size = v[1];
+        cpuid(0xd, 1, v);
+        fpu_xsaveopt = (v[0] & CPUID_XSAVEOPT) != 0;
+    }
+
+    u8 fx[FXSAVE_SIZE] __attribute__((aligned(16)));
+    zero(fx, sizeof(fx));
+    asm volatile("fxsave64 (%0)" : : "r" (fx) : "memory");
+    u32 mask = *(u32 *)(fx + FPU_MXCSR_MASK_OFFSET);
+    if (mask)
+        fpu_mxcsr_mask = mask;
+
+    fpu_debug("xfeatures 0x%lx, state size %ld, xsaveopt %d, mxcsr mask 0x%x\n",
+              fpu_xfeatures, fpu_state_size, fpu_xsaveopt, fpu_mxcsr_mask);
+}
@@ -40,3 +40,7 @@
 
 #define FRAME_CR2 30
 #define FRAME_MAX 31
+
+#define CPUINFO_SELF 0
+#define CPUINFO_RUNNING_FRAME 8
+#define CPUINFO_SYSCALL_STACK 16
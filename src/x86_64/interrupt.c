@@ -97,7 +97,6 @@ static void write_idt(int interrupt, u64 offset, u64 ist)
 }
 
 static thunk *handlers;
-context running_frame;
 
 char * find_elf_sym(u64 a, u64 *offset, u64 *len);
 
@@ -194,28 +193,39 @@ void print_frame(context f)
     }
 }
 
-context miscframe;              /* for context save on interrupt */
-context intframe;               /* for context save on exception within interrupt */
-context bhframe;
-
+/* Idle with the kernel lock released; an interrupt or wakeup IPI
+   brings us back holding it. */
 void kernel_sleep()
 {
-    running_frame = miscframe;
+    cpuinfo ci = current_cpu();
+    running_frame = ci->misc_frame;
+    ci->state = CPU_STATE_IDLE;
+    kern_unlock();
     enable_interrupts();
     __asm__("hlt");
     disable_interrupts();
+    kern_lock();
+    ci->state = CPU_STATE_KERNEL;
 }
 
-void install_fallback_fault_handler(fault_handler h)
+static fault_handler fallback_fault_handler;
+
+static void cpu_set_fault_handler(cpuinfo ci, fault_handler h)
 {
-    assert(miscframe);
-    assert(intframe);
-    miscframe[FRAME_FAULT_HANDLER] = u64_from_pointer(h);
-    intframe[FRAME_FAULT_HANDLER] = u64_from_pointer(h);
-    bhframe[FRAME_FAULT_HANDLER] = u64_from_pointer(h);
+    ci->misc_frame[FRAME_FAULT_HANDLER] = u64_from_pointer(h);
+    ci->int_frame[FRAME_FAULT_HANDLER] = u64_from_pointer(h);
+    ci->bh_frame[FRAME_FAULT_HANDLER] = u64_from_pointer(h);
 }
 
-void * bh_stack_top;
+void install_fallback_fault_handler(fault_handler h)
+{
+    fallback_fault_handler = h;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cpuinfo ci = cpuinfo_from_id(i);
+        if (ci->state != CPU_STATE_OFFLINE)
+            cpu_set_fault_handler(ci, h);
+    }
+}
 
 extern u32 n_interrupt_vectors;
 extern u32 interrupt_vector_size;
@@ -224,18 +234,35 @@ extern void * interrupt_vectors;
 NOTRACE
 void common_handler()
 {
+    cpuinfo ci = current_cpu();
     int i = running_frame[FRAME_VECTOR];
-    boolean in_bh = running_frame == bhframe;
-    boolean in_inthandler = running_frame == intframe;
+    boolean in_bh = running_frame == ci->bh_frame;
+    boolean in_inthandler = running_frame == ci->int_frame;
     boolean in_usermode = (!in_inthandler && !in_bh) &&
         (running_frame[FRAME_SS] == 0 || running_frame[FRAME_SS] == 0x13);
 
+    /* shootdowns are serviced without the kernel lock, as the
+       initiator holds it while waiting on us */
+    if (i == tlb_flush_vector) {
+        smp_tlb_flush_ack(ci);
+        lapic_eoi();
+        if (in_usermode) {
+            running_frame[FRAME_SS] = 0x23;
+            running_frame[FRAME_CS] = 0x1b;
+        }
+        return;
+    }
+
+    kern_lock();
+    if (ci->state == CPU_STATE_USER)
+        ci->state = CPU_STATE_KERNEL;
+
     if (in_inthandler) {
         console("exception during interrupt handling\n");
     }
 
     if ((i < n_interrupt_vectors) && handlers[i]) {
-        frame_push(intframe);   /* catch any spurious exceptions during int handling */
+        frame_push(ci->int_frame);  /* catch any spurious exceptions during int handling */
         apply(handlers[i]);
         lapic_eoi();
         frame_pop();
@@ -262,8 +289,8 @@ void common_handler()
     /* if the interrupt didn't occur during bottom half or int handler
        execution, switch context to bottom half processing */
     if (!in_bh && !in_inthandler) {
-        frame_push(bhframe);
-        switch_stack(bh_stack_top, process_bhqueue);
+        frame_push(ci->bh_frame);
+        switch_stack(ci->bh_stack, process_bhqueue);
     }
 }
 
@@ -298,16 +325,16 @@ void unregister_interrupt(int vector)
 #define SYSCALL_STACK_PAGES     8
 
 extern volatile void * TSS;
-static inline void write_tss_u64(int offset, u64 val)
+static inline void write_tss_u64(void *tss, int offset, u64 val)
 {
-    u64 * vec = (u64 *)(u64_from_pointer(&TSS) + offset);
+    u64 * vec = (u64 *)(u64_from_pointer(tss) + offset);
     *vec = val;
 }
 
-static void set_ist(int i, u64 sp)
+static void set_ist(void *tss, int i, u64 sp)
 {
     assert(i > 0 && i <= 7);
-    write_tss_u64(0x24 + (i - 1) * 8, sp);
+    write_tss_u64(tss, 0x24 + (i - 1) * 8, sp);
 }
 
 context allocate_frame(heap h)
@@ -325,42 +352,104 @@ void * allocate_stack(heap pages, int npages)
     return base + pages->pagesize * npages - STACK_ALIGNMENT;
 }
 
-void * syscall_stack_top;
+static heap fault_stack_heap;
 
 #define IST_INTERRUPT 1         /* for all interrupts */
 #define IST_PAGEFAULT 2         /* page fault specific */
 
-void start_interrupts(kernel_heaps kh)
+/* Frames and stacks private to a cpu */
+void init_cpu_interrupt_state(cpuinfo ci, kernel_heaps kh, void *tss)
 {
     heap general = heap_general(kh);
     heap pages = heap_pages(kh);
 
-    /* Exception handlers */
-    handlers = allocate_zero(general, n_interrupt_vectors * sizeof(thunk));
-    assert(handlers != INVALID_ADDRESS);
-
     /* Alternate frame storage */
-    miscframe = allocate_frame(general);
-    intframe = allocate_frame(general);
-    bhframe = allocate_frame(general);
+    ci->misc_frame = allocate_frame(general);
+    ci->int_frame = allocate_frame(general);
+    ci->bh_frame = allocate_frame(general);
+    ci->current_frame = ci->misc_frame;
+    if (fallback_fault_handler)
+        cpu_set_fault_handler(ci, fallback_fault_handler);
 
     /* Page fault alternate stack */
-    void * fault_stack_top = allocate_stack(pages, FAULT_STACK_PAGES);
-    assert(fault_stack_top != INVALID_ADDRESS);
-    set_ist(IST_PAGEFAULT, u64_from_pointer(fault_stack_top));
+    ci->tss = tss;
+    ci->fault_stack = allocate_stack(pages, FAULT_STACK_PAGES);
+    assert(ci->fault_stack != INVALID_ADDRESS);
+    set_ist(tss, IST_PAGEFAULT, u64_from_pointer(ci->fault_stack));
 
     /* Interrupt handlers run on their own stack. */
     void * int_stack_top = allocate_stack(pages, INT_STACK_PAGES);
     assert(int_stack_top != INVALID_ADDRESS);
-    set_ist(IST_INTERRUPT, u64_from_pointer(int_stack_top));
+    set_ist(tss, IST_INTERRUPT, u64_from_pointer(int_stack_top));
 
     /* Syscall stack */
-    syscall_stack_top = allocate_stack(pages, SYSCALL_STACK_PAGES);
-    assert(syscall_stack_top != INVALID_ADDRESS);
+    ci->syscall_stack = allocate_stack(pages, SYSCALL_STACK_PAGES);
+    assert(ci->syscall_stack != INVALID_ADDRESS);
 
     /* Bottom half stack */
-    bh_stack_top = allocate_stack(pages, BH_STACK_PAGES);
-    assert(bh_stack_top != INVALID_ADDRESS);
+    ci->bh_stack = allocate_stack(pages, BH_STACK_PAGES);
+    assert(ci->bh_stack != INVALID_ADDRESS);
+}
+
+/* A page fault taken by kernel code, which can't sleep, is resolved
+   by waiting here until a bottom half sets *done, then retrying the
+   access. The kernel lock is released meanwhile, and interrupts and
+   bottom halves are serviced - by hand if the fault was taken within
+   a bottom half, as interrupts then don't run them. The faulting
+   context, saved in the running frame, is set aside so interrupts
+   may reuse it, and faults taken while waiting go to a stack of their
+   own so as to leave this one be. */
+void kernel_fault_wait(boolean *done)
+{
+    cpuinfo ci = current_cpu();
+    context f = running_frame;
+    u64 saved[FRAME_MAX];
+    runtime_memcpy(saved, f, sizeof(saved));
+    void *fault_stack = ci->fault_stack;
+    ci->fault_stack = allocate_stack(fault_stack_heap, FAULT_STACK_PAGES);
+    assert(ci->fault_stack != INVALID_ADDRESS);
+    set_ist(ci->tss, IST_PAGEFAULT, u64_from_pointer(ci->fault_stack));
+
+    while (!*(volatile boolean *)done) {
+        if (f == ci->bh_frame) {
+            thunk t;
+            while ((t = dequeue(bhqueue)))
+                apply(t);
+            if (*(volatile boolean *)done)
+                break;
+        }
+        kern_unlock();
+        enable_interrupts();
+        kern_pause();
+        disable_interrupts();
+        kern_lock();
+    }
+
+    set_ist(ci->tss, IST_PAGEFAULT, u64_from_pointer(fault_stack));
+    bytes len = fault_stack_heap->pagesize * FAULT_STACK_PAGES;
+    deallocate(fault_stack_heap, ci->fault_stack + STACK_ALIGNMENT - len, len);
+    ci->fault_stack = fault_stack;
+    running_frame = f;
+    runtime_memcpy(f, saved, sizeof(saved));
+}
+
+void load_idt(void)
+{
+    void *idt_desc = idt_from_interrupt(n_interrupt_vectors); /* placed after last entry */
+    asm("lidt %0": : "m"(*(u64*)idt_desc));
+}
+
+void start_interrupts(kernel_heaps kh)
+{
+    heap general = heap_general(kh);
+    heap pages = heap_pages(kh);
+    fault_stack_heap = pages;
+
+    /* Exception handlers */
+    handlers = allocate_zero(general, n_interrupt_vectors * sizeof(thunk));
+    assert(handlers != INVALID_ADDRESS);
+
+    init_cpu_interrupt_state(current_cpu(), kh, (void *)&TSS);
 
     interrupt_vector_heap = create_id_heap(general, INTERRUPT_VECTOR_START,
                                            n_interrupt_vectors - INTERRUPT_VECTOR_START, 1);
@@ -379,7 +468,7 @@ void start_interrupts(kernel_heaps kh)
     void *idt_desc = idt_from_interrupt(n_interrupt_vectors); /* placed after last entry */
     *(u16*)idt_desc = 2 * sizeof(u64) * n_interrupt_vectors - 1;
     *(u64*)(idt_desc + sizeof(u16)) = u64_from_pointer(idt);
-    asm("lidt %0": : "m"(*(u64*)idt_desc));
+    load_idt();
 
     /* APIC initialization */
     init_apic(kh);
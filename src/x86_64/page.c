@@ -195,8 +195,28 @@ static boolean force_entry(heap h, page b, u64 v, physical p, int level,
     }
 }
 
+#ifndef BOOT
+/* Set by local invalidations and acted on, if other cpus are online,
+   once the page table update is complete. */
+static boolean shootdown_pending;
+
+static inline void page_shootdown(void)
+{
+    if (!shootdown_pending)
+        return;
+    shootdown_pending = false;
+    if (total_processors > 1)
+        smp_flush_tlb();
+}
+#else
+#define page_shootdown()
+#endif
+
 static inline void page_invalidate(u64 v)
 {
+#ifndef BOOT
+    shootdown_pending = true;
+#endif
 #ifdef PAGE_USE_FLUSH
     /* It isn't efficient to do this for each page, but this option is
        only used for stage2 and debugging... */
@@ -306,6 +326,30 @@ void update_map_flags(u64 vaddr, u64 length, u64 flags)
     page_debug("vaddr 0x%lx, length 0x%lx, flags 0x%lx\n", vaddr, length, flags);
 
     traverse_ptes(vaddr, length, stack_closure(update_pte_flags, flags));
+    page_shootdown();
+}
+
+closure_function(1, 3, boolean, clean_pte,
+                 range_handler, rh,
+                 int, level, u64, addr, u64 *, entry)
+{
+    u64 old = *entry;
+    if (!pt_entry_is_present(old) || !pt_entry_is_pte(level, old) || (old & PAGE_DIRTY) == 0)
+        return true;
+
+    *entry = old & ~PAGE_DIRTY;
+    page_invalidate(addr);
+    apply(bound(rh), irange(addr, addr + (pt_entry_is_fat(level, old) ? PAGESIZE_2M : PAGESIZE)));
+    return true;
+}
+
+/* Clear the dirty bit of pages mapped within a given area, passing the
+   virtual range of each page that was dirty to rh */
+void clean_dirty_pages(u64 vaddr, u64 length, range_handler rh)
+{
+    page_debug("vaddr 0x%lx, length 0x%lx\n", vaddr, length);
+    traverse_ptes(vaddr, length, stack_closure(clean_pte, rh));
+    page_shootdown();
 }
 
 closure_function(3, 3, boolean, remap_entry,
@@ -352,6 +396,7 @@ void remap_pages(u64 vaddr_new, u64 vaddr_old, u64 length, heap h)
     assert(range_empty(range_intersection(irange(vaddr_new, vaddr_new + length),
                                           irange(vaddr_old, vaddr_old + length))));
     traverse_ptes(vaddr_old, length, stack_closure(remap_entry, vaddr_new, vaddr_old, h));
+    page_shootdown();
 }
 
 closure_function(0, 3, boolean, zero_page,
@@ -371,6 +416,7 @@ closure_function(0, 3, boolean, zero_page,
 void zero_mapped_pages(u64 vaddr, u64 length)
 {
     traverse_ptes(vaddr, length, stack_closure(zero_page));
+    page_shootdown();
 }
 
 closure_function(1, 3, boolean, unmap_page,
@@ -399,6 +445,7 @@ void unmap_pages_with_handler(u64 virtual, u64 length, range_handler rh)
 {
     assert(!((virtual & PAGEMASK) || (length & PAGEMASK)));
     traverse_ptes(virtual, length, stack_closure(unmap_page, rh));
+    page_shootdown();
 }
 
 // error processing
@@ -456,6 +503,7 @@ static void map_range(u64 virtual, physical p, u64 length, u64 flags, heap h)
 #endif
 
     memory_barrier();
+    page_shootdown();
 }
 
 void map(u64 virtual, physical p, u64 length, u64 flags, heap h)
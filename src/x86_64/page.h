@@ -72,6 +72,7 @@ static inline void unmap_pages(u64 virtual, u64 length)
 }
 
 void update_map_flags(u64 vaddr, u64 length, u64 flags);
+void clean_dirty_pages(u64 vaddr, u64 length, range_handler rh);
 void zero_mapped_pages(u64 vaddr, u64 length);
 void remap_pages(u64 vaddr_new, u64 vaddr_old, u64 length, heap h);
 
@@ -149,6 +149,18 @@ void pci_enable_msix(pci_dev dev)
      }
 }
 
+/* number of entries in the MSI-X table, or 0 if the device has none */
+int pci_get_msix_count(pci_dev dev)
+{
+    u32 cp = pci_cfgread(dev, PCIR_CAPABILITIES_POINTER, 1);
+    while (cp != 0) {
+        if (pci_cfgread(dev, cp, 1) == PCI_CAPABILITY_MSIX)
+            return (pci_cfgread(dev, cp + 2, 2) & 0x7ff) + 1;
+        cp = pci_cfgread(dev, cp + 1, 1);
+    }
+    return 0;
+}
+
 void msi_format(u32 *address, u32 *data, int vector)
 {
     u32 dm = 0;             // destination mode: ignored if rh == 0
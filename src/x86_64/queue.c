@@ -1,112 +1,153 @@
 #include <runtime.h>
 #include <x86_64.h>
 
+/* Bounded multi-producer, multi-consumer ring after Vyukov. Each slot
+   carries a sequence number which tells producers and consumers, given
+   their claimed position, whether the slot is free to fill, holds an
+   item to take, or has not yet been released by the previous lap. A
+   position is claimed by a CAS on write or read, so neither side ever
+   spins on a slot that another cpu has claimed but not yet filled, and
+   a consumer can claim a run of published slots with a single CAS.
+
+   A full queue fails the enqueue; producers must handle this rather
+   than drop the item. The scheduling queues are only ever used with
+   the kernel lock held, so their producers use enqueue_grow() to
+   replace a full queue with a larger one instead. */
+
 void queue_dump(queue q)
 {
+    u64 read = __atomic_load_n(&q->read, __ATOMIC_ACQUIRE);
+    u64 write = __atomic_load_n(&q->write, __ATOMIC_ACQUIRE);
     rprintf("queue @ %p being dumped\n", q);
     rprintf("queue size: %p\n", q->size);
-    rprintf("queue count: %p\n", q->count);
-    for (int i = 0; i < q->size; i ++) {
-        if (i >= q->read % q->size && i < q->write % q->size) {
-            rprintf("+ ");
-        } else {
-            rprintf("- ");
-        }
-
-        rprintf("%p: ", i);
-        rprintf("%p\n", q->buf[i]);
+    rprintf("queue read: %p, write: %p\n", read, write);
+    for (u64 i = 0; i < q->size; i ++) {
+        qslot s = &q->slots[i];
+        rprintf("%p: seq %p, %p\n", i, s->seq, s->p);
     }
 }
 
 boolean enqueue(queue q, void *n)
 {
-    u64 count = fetch_and_add(&q->count, 1);
-    u64 write;
-    boolean r;
-
-    if (count >= q->size) {
-        // can't enqueue more elements than the bounds
-        fetch_and_add(&q->count, -1);
-        return false;
+    u64 pos = __atomic_load_n(&q->write, __ATOMIC_RELAXED);
+    qslot s;
+
+    while (1) {
+        s = &q->slots[pos & q->mask];
+        s64 diff = (s64)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->write, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            /* slot not yet released by the consumer a lap behind */
+            return false;
+        } else {
+            pos = __atomic_load_n(&q->write, __ATOMIC_RELAXED);
+        }
     }
+    s->p = n;
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
 
-    // rusty 'acquire the ownership' of the next element in the queue
-    write = fetch_and_add(&q->write, 1);
-
-    // put the data in the buf
-    r = __sync_bool_compare_and_swap(&q->buf[write % q->size], 0, n);
-    if (!r) {
-        // should never happen
-        // if it does, then something went horribly wrong.
-        queue_dump(q);
-        halt("queue is in inconsistent state");
+/* Claim up to n published items with one CAS on read. Only the
+   consumer whose claim covers a slot may release it, so the run found
+   before the CAS cannot change under us once the CAS succeeds. */
+int dequeue_n(queue q, void **buf, int n)
+{
+    u64 pos = __atomic_load_n(&q->read, __ATOMIC_RELAXED);
+    int avail;
+
+    while (1) {
+        for (avail = 0; avail < n; avail++) {
+            qslot s = &q->slots[(pos + avail) & q->mask];
+            if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + avail + 1)
+                break;
+        }
+        if (avail == 0) {
+            s64 diff = (s64)(__atomic_load_n(&q->slots[pos & q->mask].seq,
+                                             __ATOMIC_ACQUIRE) - (pos + 1));
+            if (diff < 0)
+                return 0;       /* empty */
+            /* another consumer got here first */
+            pos = __atomic_load_n(&q->read, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&q->read, &pos, pos + avail, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
     }
 
-    // otherwise we are done
-    return true;
+    for (int i = 0; i < avail; i++) {
+        qslot s = &q->slots[(pos + i) & q->mask];
+        buf[i] = s->p;
+        __atomic_store_n(&s->seq, pos + i + q->size, __ATOMIC_RELEASE);
+    }
+    return avail;
 }
 
-int queue_length(queue q)
+void *dequeue(queue q)
 {
-    return __atomic_load_n(&q->count, __ATOMIC_ACQUIRE);
+    void *p;
+    return dequeue_n(q, &p, 1) ? p : 0;
 }
 
-void *queue_peek(queue q)
+int queue_length(queue q)
 {
-    if (__atomic_load_n(&q->count, __ATOMIC_ACQUIRE) == 0)
-        return 0;
-
-    return __atomic_load_n(&q->buf[q->read % q->size], __ATOMIC_ACQUIRE);
+    u64 read = __atomic_load_n(&q->read, __ATOMIC_ACQUIRE);
+    u64 write = __atomic_load_n(&q->write, __ATOMIC_ACQUIRE);
+    /* claimed but not yet filled slots are counted */
+    return write > read ? MIN(write - read, q->size) : 0;
 }
 
-#define DEQUEUE_MAX_BACKOFF 10000
-void *dequeue(queue q)
+/* Only meaningful with a single consumer. */
+void *queue_peek(queue q)
 {
-    int backoff = 1;
-    int i;
-    void *r;
-
-    if (__atomic_load_n(&q->count, __ATOMIC_ACQUIRE) == 0)
+    u64 pos = __atomic_load_n(&q->read, __ATOMIC_ACQUIRE);
+    qslot s = &q->slots[pos & q->mask];
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + 1)
         return 0;
-
-retry:
-    r = __atomic_exchange_n(&q->buf[q->read ++ % q->size], 0, __ATOMIC_ACQUIRE);
-    if (!r) {
-        // if we had already backed off that maximum, let the dequeueing fail
-        if (backoff >= DEQUEUE_MAX_BACKOFF)
-            return false;
-
-        // issue @backoff PAUSE instructions
-        for (i = 0; i < backoff; i ++) {
-            // make sure the compiler does not optimize away the
-            asm volatile("pause");
-        }
-
-        // exponentially increase the amount of PAUSE instructions executed
-        backoff *= 10;
-        goto retry;
-    }
-
-    // formally tell tell the queue that the element is gone
-    fetch_and_add(&q->count, -1);
-    return r;
+    return s->p;
 }
 
 queue allocate_queue(heap h, u64 size)
 {
-    queue q = allocate(h, sizeof(struct queue) + size * sizeof(void *));
+    size = U64_FROM_BIT(find_order(size));
+    queue q = allocate(h, sizeof(struct queue) + size * sizeof(struct qslot));
+    if (q == INVALID_ADDRESS)
+        return q;
     q->size = size;
-    q->count = 0;
+    q->mask = size - 1;
     q->write = q->read = 0;
     q->h = h;
-    zero(q->buf, size * sizeof(void *));
-    // XXX: we could do a release ordering here, however let's just use a full
-    // barrier for now.
+    for (u64 i = 0; i < size; i++) {
+        q->slots[i].seq = i;
+        q->slots[i].p = 0;
+    }
     memory_barrier();
     return q;
 }
 
 void deallocate_queue(queue q)
 {
-    deallocate(q->h, q, sizeof(struct queue) + q->size * sizeof(void *));
+    deallocate(q->h, q, sizeof(struct queue) + q->size * sizeof(struct qslot));
+}
+
+/* Enqueue to *qp, doubling the queue if it is full. The caller must
+   exclude all other users of the queue, as the kernel lock does. */
+void enqueue_grow(queue *qp, void *n)
+{
+    queue q = *qp;
+    if (enqueue(q, n))
+        return;
+    queue nq = allocate_queue(q->h, q->size * 2);
+    if (nq == INVALID_ADDRESS)
+        halt("%s: queue %p full and cannot grow\n", __func__, q);
+    void *p;
+    while ((p = dequeue(q)))
+        assert(enqueue(nq, p));
+    assert(enqueue(nq, n));
+    *qp = nq;
+    deallocate_queue(q);
 }
@@ -77,22 +77,29 @@ extern void interrupt_exit(void);
 /* could make a generic hook/register if more users... */
 thunk unix_interrupt_checks;
 
+/* bottom half items must return, so they can be claimed in batches on the stack */
+#define BHQUEUE_BATCH   64
+
 NOTRACE
 void process_bhqueue()
 {
     /* XXX - we're on bh frame & stack; re-enable ints here */
-    thunk t;
+    thunk batch[BHQUEUE_BATCH];
     int defer_waiters = queue_length(deferqueue);
-    while ((t = dequeue(bhqueue))) {
-        apply(t);
+    int n;
+    while ((n = dequeue_n(bhqueue, (void **)batch, BHQUEUE_BATCH)) > 0) {
+        for (int i = 0; i < n; i++)
+            apply(batch[i]);
     }
 
     /* only process deferred items that were queued prior to call -
        this allows bhqueue and deferqueue waiters to re-schedule for
        subsequent bh processing */
-    while (defer_waiters > 0 && (t = dequeue(deferqueue))) {
-        apply(t);
-        defer_waiters--;
+    while (defer_waiters > 0 &&
+           (n = dequeue_n(deferqueue, (void **)batch, MIN(defer_waiters, BHQUEUE_BATCH))) > 0) {
+        for (int i = 0; i < n; i++)
+            apply(batch[i]);
+        defer_waiters -= n;
     }
 
     timer_update();
@@ -102,18 +109,39 @@ void process_bhqueue()
 
     if (unix_interrupt_checks)
         apply(unix_interrupt_checks);
+
+    /* drop the kernel lock if resuming user code */
+    if (running_frame[FRAME_CS] & 3)
+        kern_exit_to_user();
     interrupt_exit();
 }
 
+static thunk runqueue_next(cpuinfo ci)
+{
+    if (ci->runq_batch_next == ci->runq_batch_count) {
+        ci->runq_batch_next = 0;
+        ci->runq_batch_count = dequeue_n(runqueue, ci->runq_batch, RUNQUEUE_BATCH);
+        if (ci->runq_batch_count == 0)
+            return 0;
+    }
+    return ci->runq_batch[ci->runq_batch_next++];
+}
+
 void runloop()
 {
+    cpuinfo ci = current_cpu();
     thunk t;
 
     while(1) {
-        while((t = dequeue(runqueue))) {
+        while((t = runqueue_next(ci))) {
             apply(t);
             disable_interrupts();
         }
+        if ((t = cpu_next_thunk(ci))) {
+            apply(t);
+            disable_interrupts();
+            continue;
+        }
         if (current) {
             proc_pause(current->p);
         }
@@ -161,7 +189,7 @@ closure_function(1, 2, void, fsstarted,
                  filesystem, fs, status, s)
 {
     assert(s == STATUS_OK);
-    enqueue(runqueue, create_init(&heaps, bound(root), fs));
+    enqueue_grow(&runqueue, create_init(&heaps, bound(root), fs));
     closure_finish();
 }
 
@@ -276,6 +304,9 @@ static void __attribute__((noinline)) init_service_new_stack()
     heap misc = heap_general(kh);
     heap pages = heap_pages(kh);
 
+    /* per-cpu state for the BSP, reached through the GS base */
+    init_cpuinfo_bsp();
+
     /* runtime and console init */
     init_debug("in init_service_new_stack");
     unmap(0, PAGESIZE, pages);  /* unmap zero page */
@@ -291,10 +322,10 @@ static void __attribute__((noinline)) init_service_new_stack()
     pci_discover(); // early PCI discover to configure VGA console
 
     /* scheduling queues init */
-    runqueue = allocate_queue(misc, 64);
+    runqueue = allocate_queue(misc, 512);
     /* XXX bhqueue is large to accomodate vq completions; explore batch processing on vq side */
     bhqueue = allocate_queue(misc, 2048);
-    deferqueue = allocate_queue(misc, 64);
+    deferqueue = allocate_queue(misc, 512);
     unix_interrupt_checks = 0;
 
     /* interrupts */
@@ -360,6 +391,15 @@ static void __attribute__((noinline)) init_service_new_stack()
     init_debug("pci_discover (for virtio & ata)");
     pci_discover(); // do PCI discover again for other devices
 
+    /* APs copy the control register state set up here */
+    init_debug("extended register state");
+    init_fpu();
+
+    /* The AP trampoline lives in the initial map, so this must
+       precede the unmap below. */
+    init_debug("start secondary cpus");
+    start_secondary_cpus(kh);
+
     /* Switch to stage3 GDT64, enable TSS and free up initial map */
     init_debug("install GDT64 and TSS");
     install_gdt64_and_tss();
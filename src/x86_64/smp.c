@@ -0,0 +1,328 @@
+#include <runtime.h>
+#include <x86_64.h>
+#include <page.h>
+#include <apic.h>
+
+//#define SMP_DEBUG
+#ifdef SMP_DEBUG
+#define smp_debug(x, ...) do {rprintf("SMP: " x, ##__VA_ARGS__);} while(0)
+#else
+#define smp_debug(x, ...)
+#endif
+
+#define AP_BOOT_PAGE            0x8000
+#define AP_START_TIMEOUT_MS     100
+#define AP_START_SETTLE_MS      10
+#define AP_COUNT_CLOSED         0x80000000  /* as in ap_start.s */
+#define CPU_THREAD_QUEUE_SIZE   1024
+
+#define TSS_SIZE                0x68
+#define TSS_SELECTOR            0x28
+#define AP_GDT_ENTRIES          7
+
+#define KERNEL_GS_MSR           0xc0000102
+
+struct cpuinfo cpuinfos[MAX_CPUS];
+u32 total_processors = 1;
+u64 tlb_flush_vector;
+
+static u64 wakeup_vector;
+static kernel_heaps smp_kh;
+static u64 bsp_cr0, bsp_cr4, bsp_xcr0;
+
+static inline boolean cpu_online(cpuinfo ci)
+{
+    return ci->state != CPU_STATE_OFFLINE;
+}
+
+/* 0 when free, otherwise the id of the holding cpu plus one */
+static volatile u32 kernel_lock_owner;
+
+/* trampoline image and the fields patched into it, from ap_start.s */
+extern u8 ap_start_begin, ap_start_end, ap_start64;
+extern u8 ap_gdt, ap_gdt_pointer, ap_long_mode, ap_pagetable, ap_efer;
+extern u8 ap_count, ap_limit, ap_stacks, ap_entry;
+
+void init_cpu_interrupt_state(cpuinfo ci, kernel_heaps kh, void *tss);
+void load_idt(void);
+
+boolean kern_lock_held(void)
+{
+    return kernel_lock_owner == current_cpu()->id + 1;
+}
+
+void kern_lock(void)
+{
+    cpuinfo ci = current_cpu();
+    u32 me = ci->id + 1;
+    if (kernel_lock_owner == me)
+        return;
+    while (!compare_and_swap_32((u32 *)&kernel_lock_owner, 0, me)) {
+        /* the holder may be waiting on us to complete a shootdown */
+        if (ci->tlb_flush_pending)
+            smp_tlb_flush_ack(ci);
+        kern_pause();
+    }
+}
+
+void kern_unlock(void)
+{
+    assert(kern_lock_held());
+    atomic_swap_32((u32 *)&kernel_lock_owner, 0);
+}
+
+static void cpu_set_gs(cpuinfo ci)
+{
+    write_msr(GS_MSR, u64_from_pointer(ci));
+    write_msr(KERNEL_GS_MSR, 0);
+}
+
+static u32 current_cpu_id(void)
+{
+    return current_cpu()->id;
+}
+
+void init_cpuinfo_bsp(void)
+{
+    cpuinfo ci = cpuinfo_from_id(0);
+    ci->self = ci;
+    ci->id = 0;
+    ci->state = CPU_STATE_KERNEL;
+    cpu_set_gs(ci);
+    kern_lock();
+
+    /* allocator magazines may now be kept per cpu */
+    build_assert(MAX_CPUS <= MCACHE_MAX_CPUS);
+    mcache_set_cpu_id(current_cpu_id);
+}
+
+void smp_tlb_flush_ack(cpuinfo ci)
+{
+    u64 cr3;
+    mov_from_cr("cr3", cr3);
+    mov_to_cr("cr3", cr3);
+    ci->tlb_flush_pending = 0;
+}
+
+/* Called with the kernel lock held after page table entries have been
+   invalidated locally. Other cpus could be holding stale translations
+   whether they are running user code or idle, so all must ack. */
+void smp_flush_tlb(void)
+{
+    cpuinfo self = current_cpu();
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cpuinfo ci = cpuinfo_from_id(i);
+        if (ci == self || !cpu_online(ci))
+            continue;
+        ci->tlb_flush_pending = 1;
+        apic_ipi(ci->lapic_id, 0, tlb_flush_vector);
+    }
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cpuinfo ci = cpuinfo_from_id(i);
+        while (ci->tlb_flush_pending)
+            kern_pause();
+    }
+}
+
+void wakeup_cpu(cpuinfo ci)
+{
+    if (ci != current_cpu() && ci->state == CPU_STATE_IDLE)
+        apic_ipi(ci->lapic_id, 0, wakeup_vector);
+}
+
+void schedule_on_cpu(cpuinfo ci, thunk t)
+{
+    enqueue_grow(&ci->thread_queue, t);
+    if (ci->state == CPU_STATE_IDLE) {
+        wakeup_cpu(ci);
+        return;
+    }
+
+    /* target is busy; kick an idle cpu so that it may steal the work */
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cpuinfo idle = cpuinfo_from_id(i);
+        if (idle != current_cpu() && idle->state == CPU_STATE_IDLE) {
+            wakeup_cpu(idle);
+            break;
+        }
+    }
+}
+
+/* Take from our own queue first, then steal from the longest. */
+thunk cpu_next_thunk(cpuinfo ci)
+{
+    thunk t = dequeue(ci->thread_queue);
+    if (t)
+        return t;
+
+    cpuinfo victim = 0;
+    int victim_len = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cpuinfo other = cpuinfo_from_id(i);
+        if (other == ci || !cpu_online(other))
+            continue;
+        int len = queue_length(other->thread_queue);
+        if (len > victim_len) {
+            victim = other;
+            victim_len = len;
+        }
+    }
+    if (!victim)
+        return 0;
+    smp_debug("cpu %d stealing from cpu %d (%d queued)\n", ci->id, victim->id, victim_len);
+    return dequeue(victim->thread_queue);
+}
+
+closure_function(0, 0, void, wakeup_handler)
+{
+}
+
+static void cpu_install_gdt_tss(cpuinfo ci)
+{
+    u64 *gdt = allocate_zero(heap_general(smp_kh), AP_GDT_ENTRIES * sizeof(u64));
+    assert(gdt != INVALID_ADDRESS);
+    gdt[1] = 0x00209a0000000000ull; /* code - 0x08 */
+    gdt[2] = 0x0000920000000000ull; /* data - 0x10 */
+    gdt[3] = 0x0020fa0000000000ull; /* user code - 0x18 */
+    gdt[4] = 0x0000f20000000000ull; /* user data - 0x20 */
+
+    /* TSS descriptor - 0x28 */
+    u64 tss = u64_from_pointer(ci->tss);
+    gdt[5] = (TSS_SIZE - 1) | ((tss & MASK(24)) << 16) | (0x89ull << 40) |
+        (((tss >> 24) & MASK(8)) << 56);
+    gdt[6] = tss >> 32;
+
+    struct {
+        u16 limit;
+        u64 base;
+    } __attribute__((packed)) gdtp = { AP_GDT_ENTRIES * sizeof(u64) - 1, u64_from_pointer(gdt) };
+    asm volatile("lgdt %0" : : "m"(gdtp));
+    asm volatile("ltr %w0" : : "r"(TSS_SELECTOR));
+}
+
+void ap_start(int id)
+{
+    if (id >= MAX_CPUS) {
+        /* no room; leave this one parked */
+        while (1)
+            asm volatile("cli; hlt");
+    }
+
+    cpuinfo ci = cpuinfo_from_id(id);
+    ci->self = ci;
+    ci->id = id;
+    mov_to_cr("cr0", bsp_cr0);
+    mov_to_cr("cr4", bsp_cr4);
+    if (bsp_cr4 & CR4_OSXSAVE)
+        write_xmsr(0, bsp_xcr0);
+    cpu_set_gs(ci);
+
+    kern_lock();
+    ci->tss = allocate_zero(heap_general(smp_kh), TSS_SIZE);
+    assert(ci->tss != INVALID_ADDRESS);
+    cpu_install_gdt_tss(ci);
+    init_cpu_interrupt_state(ci, smp_kh, ci->tss);
+    load_idt();
+    apic_per_cpu_init();
+    ci->lapic_id = apic_id();
+    set_syscall_handler(syscall_enter);
+    ci->thread_queue = allocate_queue(heap_general(smp_kh), CPU_THREAD_QUEUE_SIZE);
+    assert(ci->thread_queue != INVALID_ADDRESS);
+    ci->state = CPU_STATE_KERNEL;
+    total_processors++;
+    smp_debug("cpu %d online, lapic id %d\n", id, ci->lapic_id);
+    runloop();
+}
+
+#define ap_field(sym, type) ((type *)pointer_from_u64(AP_BOOT_PAGE + (&(sym) - &ap_start_begin)))
+
+void start_secondary_cpus(kernel_heaps kh)
+{
+    heap h = heap_general(kh);
+    cpuinfo bsp = current_cpu();
+    smp_kh = kh;
+
+    bsp->lapic_id = apic_id();
+    bsp->thread_queue = allocate_queue(h, CPU_THREAD_QUEUE_SIZE);
+    assert(bsp->thread_queue != INVALID_ADDRESS);
+
+    wakeup_vector = allocate_interrupt();
+    assert(wakeup_vector != INVALID_PHYSICAL);
+    register_interrupt(wakeup_vector, closure(h, wakeup_handler));
+    tlb_flush_vector = allocate_interrupt();
+    assert(tlb_flush_vector != INVALID_PHYSICAL);
+
+    /* APs replicate the BSP control register state */
+    mov_from_cr("cr0", bsp_cr0);
+    mov_from_cr("cr4", bsp_cr4);
+    if (bsp_cr4 & CR4_OSXSAVE)
+        bsp_xcr0 = read_xmsr(0);
+
+    /* the trampoline page lies within the initial identity map */
+    u64 cr3;
+    mov_from_cr("cr3", cr3);
+    assert(cr3 < U64_FROM_BIT(32));
+    u64 len = &ap_start_end - &ap_start_begin;
+    assert(len <= PAGESIZE);
+    runtime_memcpy(pointer_from_u64(AP_BOOT_PAGE), &ap_start_begin, len);
+    *(u32 *)(ap_field(ap_gdt_pointer, u8) + sizeof(u16)) = AP_BOOT_PAGE + (&ap_gdt - &ap_start_begin);
+    *ap_field(ap_long_mode, u32) = AP_BOOT_PAGE + (&ap_start64 - &ap_start_begin);
+    *ap_field(ap_pagetable, u32) = cr3;
+    *ap_field(ap_efer, u32) = read_msr(EFER_MSR) & ~EFER_LMA;
+    *ap_field(ap_count, u32) = 0;
+    *ap_field(ap_limit, u32) = MAX_CPUS - 1;
+    *ap_field(ap_entry, u64) = u64_from_pointer(ap_start);
+
+    /* stack tops indexed by cpu id; slot 0 is the BSP */
+    u64 *stacks = allocate_zero(h, MAX_CPUS * sizeof(u64));
+    assert(stacks != INVALID_ADDRESS);
+    for (int i = 1; i < MAX_CPUS; i++) {
+        void *s = allocate_stack(heap_backed(kh), KERNEL_STACK_PAGES);
+        assert(s != INVALID_ADDRESS);
+        stacks[i] = u64_from_pointer(s);
+    }
+    *ap_field(ap_stacks, u64) = u64_from_pointer(stacks);
+    memory_barrier();
+
+    /* INIT, then two SIPIs, per the MP spec; APs spin on the kernel
+       lock during their own initialization, so drop it meanwhile */
+    kern_unlock();
+    apic_ipi(0, ICR_DEST_ALL_EXC_SELF | ICR_ASSERT | ICR_TYPE_INIT, 0);
+    kernel_delay(milliseconds(10));
+    for (int i = 0; i < 2; i++) {
+        apic_ipi(0, ICR_DEST_ALL_EXC_SELF | ICR_ASSERT | ICR_TYPE_STARTUP,
+                 AP_BOOT_PAGE >> PAGELOG);
+        kernel_delay(microseconds(200));
+    }
+
+    /* wait for every AP that has claimed an id to come online */
+    volatile u32 *count = ap_field(ap_count, u32);
+    timestamp start = now(CLOCK_ID_MONOTONIC);
+    timestamp elapsed;
+    do {
+        /* APs may initiate shootdowns while we're without the lock */
+        if (bsp->tlb_flush_pending)
+            smp_tlb_flush_ack(bsp);
+        kern_pause();
+        elapsed = now(CLOCK_ID_MONOTONIC) - start;
+        u32 expected = *count + 1;
+        if (elapsed >= milliseconds(AP_START_SETTLE_MS) &&
+            *(volatile u32 *)&total_processors == expected)
+            break;
+    } while (elapsed < milliseconds(AP_START_TIMEOUT_MS));
+    kern_lock();
+
+    /* Close the count so that a late AP parks itself rather than
+       claiming a stack we are about to release. */
+    u32 claimed;
+    do {
+        claimed = *count;
+    } while (!compare_and_swap_32((u32 *)count, claimed, claimed | AP_COUNT_CLOSED));
+
+    /* release stacks for ids that were never claimed */
+    for (int i = claimed + 1; i < MAX_CPUS; i++)
+        deallocate(heap_backed(kh), pointer_from_u64(stacks[i] + STACK_ALIGNMENT -
+                                                     KERNEL_STACK_PAGES * PAGESIZE),
+                   KERNEL_STACK_PAGES * PAGESIZE);
+    smp_debug("%d cpus online\n", total_processors);
+}
@@ -31,6 +31,9 @@
 #define TSC_DEADLINE_MSR 0x6e0
 
 #define C0_WP   0x00010000
+#define C0_TS   0x00000008
+
+#define CR4_OSXSAVE     (1 << 18)
 
 #define FLAG_INTERRUPT 9
 
@@ -50,6 +53,37 @@ extern void syscall_enter();
 #define mov_to_cr(__x, __y) asm volatile("mov %0,%%"__x : : "a"(__y) : "memory");
 #define mov_from_cr(__x, __y) asm volatile("mov %%"__x", %0" : "=a"(__y) : : "memory");
 
+/* extended (x87/SSE/AVX) user register state */
+#define FXSAVE_SIZE             512
+#define XSAVE_HEADER_SIZE       64
+#define FPU_STATE_ALIGN         64
+
+#define XCR0_X87        U64_FROM_BIT(0)
+#define XCR0_SSE        U64_FROM_BIT(1)
+#define XCR0_AVX        U64_FROM_BIT(2)
+
+extern u64 fpu_state_size;
+extern u64 fpu_xfeatures;
+void init_fpu(void);
+void fpu_save(void *area);
+void fpu_restore(void *area);
+void fpu_init_state(void *area);
+void fpu_sanitize_state(void *area, u64 length);
+
+/* clear CR0.TS, allowing SIMD use without a device-not-available trap */
+static inline void fpu_enable(void)
+{
+    asm volatile("clts");
+}
+
+static inline void fpu_disable(void)
+{
+    u64 cr0;
+    mov_from_cr("cr0", cr0);
+    if (!(cr0 & C0_TS))
+        mov_to_cr("cr0", cr0 | C0_TS);
+}
+
 static inline void enable_interrupts()
 {
     asm volatile("sti");
@@ -66,9 +100,89 @@ static inline void disable_interrupts()
 
 typedef u64 *context;
 
-extern context running_frame;
+#define MAX_CPUS 16
+
+#define CPU_STATE_OFFLINE  0
+#define CPU_STATE_IDLE     1
+#define CPU_STATE_KERNEL   2
+#define CPU_STATE_USER     3
+
+struct thread;
+typedef struct queue *queue;
+
+#define RUNQUEUE_BATCH  16
+
+/* Per-processor state, found through the GS base while in the
+   kernel. The first members are accessed from assembly at the offsets
+   given in frame.h. */
+typedef struct cpuinfo {
+    struct cpuinfo *self;
+    context current_frame;
+    void *syscall_stack;
+
+    u32 id;
+    u32 lapic_id;
+    volatile u32 state;
+    volatile u32 tlb_flush_pending;
+    struct thread *current_thread;
+    queue thread_queue;         /* runnable threads bound to this cpu */
+
+    context misc_frame;         /* for context save on interrupt */
+    context int_frame;          /* for context save on exception within interrupt */
+    context bh_frame;
+    void *bh_stack;
+    void *tss;
+    void *fault_stack;          /* where page faults are taken */
+
+    /* runqueue items claimed by this cpu but not yet run; kept here
+       because a thunk applied from the runloop may not return */
+    void *runq_batch[RUNQUEUE_BATCH];
+    int runq_batch_next;
+    int runq_batch_count;
+
+    /* thread whose extended state may be live in this cpu's registers */
+    struct thread *fpu_owner;
+} *cpuinfo;
+
+extern struct cpuinfo cpuinfos[MAX_CPUS];
+extern u32 total_processors;
+
+static inline cpuinfo current_cpu(void)
+{
+    u64 addr;
+    asm("movq %%gs:0, %0" : "=r" (addr)); /* CPUINFO_SELF */
+    return (cpuinfo)pointer_from_u64(addr);
+}
+
+static inline cpuinfo cpuinfo_from_id(int cpu)
+{
+    return &cpuinfos[cpu];
+}
+
+#define running_frame (current_cpu()->current_frame)
 
-extern void * syscall_stack_top;
+/* The kernel lock serializes all kernel execution; it is taken on
+   entry from user mode or idle and dropped on return to user mode or
+   idle. Acquisition is a no-op if already held by this cpu. */
+void kern_lock(void);
+void kern_unlock(void);
+boolean kern_lock_held(void);
+
+/* drop the kernel lock on the way out to user mode */
+static inline void kern_exit_to_user(void)
+{
+    current_cpu()->state = CPU_STATE_USER;
+    kern_unlock();
+}
+
+void init_cpuinfo_bsp(void);
+void start_secondary_cpus(kernel_heaps kh);
+void wakeup_cpu(cpuinfo ci);
+void schedule_on_cpu(cpuinfo ci, thunk t);
+thunk cpu_next_thunk(cpuinfo ci);
+void smp_flush_tlb(void);
+void smp_tlb_flush_ack(cpuinfo ci);
+extern u64 tlb_flush_vector;
 
 #define BREAKPOINT_INSTRUCTION 00
 #define BREAKPOINT_WRITE 01
@@ -183,7 +297,6 @@ rdtsc_precise(void)
 
 #undef __vdso_dat
 
-typedef struct queue *queue;
 extern queue runqueue;
 extern queue bhqueue;
 extern queue deferqueue;
@@ -198,13 +311,16 @@ typedef closure_type(fault_handler, context, context);
 void configure_timer(timestamp rate, thunk t);
 
 boolean enqueue(queue q, void *n);
+void enqueue_grow(queue *qp, void *n);
 void *dequeue(queue q);
+int dequeue_n(queue q, void **buf, int n);
 void *queue_peek(queue q);
 int queue_length(queue q);
 queue allocate_queue(heap h, u64 size);
 void deallocate_queue(queue q);
 
 context allocate_frame(heap h);
+void * allocate_stack(heap pages, int npages);
 
 static inline void frame_push(context new)
 {
@@ -226,6 +342,7 @@ static inline void frame_pop(void)
 
 void runloop() __attribute__((noreturn));
 void kernel_sleep();
+void kernel_fault_wait(boolean *done);
 void kernel_delay(timestamp delta);
 void init_clock(void);
 boolean init_hpet(kernel_heaps kh);
@@ -234,13 +351,19 @@ void process_bhqueue();
 void install_fallback_fault_handler(fault_handler h);
 
 // xxx - hide
+typedef struct qslot {
+    u64 seq;
+    void *p;
+} *qslot;
+
+/* producers and consumers each contend on their own cache line */
 struct queue {
-    u64 count;
-    u64 write;
-    u64 read;
     u64 size;
+    u64 mask;
     heap h;
-    void *buf[];
+    u64 write __attribute__((aligned(64)));
+    u64 read __attribute__((aligned(64)));
+    struct qslot slots[] __attribute__((aligned(64)));
 };
 
 void msi_format(u32 *address, u32 *data, int vector);
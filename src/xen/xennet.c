@@ -261,7 +261,7 @@ static void xennet_service_tx_ring(xennet_dev xd)
             txp->gntref = GRANT_INVALID;
 
             if (txp->end) {
-                enqueue(bhqueue, closure(xd->h, xennet_tx_buf_finish, txb->p));
+                enqueue_grow(&bhqueue, closure(xd->h, xennet_tx_buf_finish, txb->p));
                 xennet_return_txbuf(xd, txb);
             }
 
@@ -549,7 +549,7 @@ static void xennet_service_rx_ring(xennet_dev xd)
             rxb->p.pbuf.tot_len = rx->status;
             rxb->p.pbuf.payload += rx->offset;
 
-            enqueue(bhqueue, closure(xd->h, xennet_rx_buf_finish, xd, &rxb->p.pbuf));
+            enqueue_grow(&bhqueue, closure(xd->h, xennet_rx_buf_finish, xd, &rxb->p.pbuf));
             cons++;
         }
         write_barrier();
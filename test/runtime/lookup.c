@@ -0,0 +1,86 @@
+/* Path lookup benchmark: times stat() of existing and missing paths,
+   as interpreted runtimes do when searching module paths. The lookup
+   cache counters in /sys/kernel/fs/dcache/stats are printed at the end
+   when present. */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NDIRS           8
+#define NFILES          64
+#define ITERATIONS      20000
+
+#define fail_perror(msg, ...) do { printf(msg ": %s (%d)\n", ##__VA_ARGS__, strerror(errno), errno); \
+        exit(EXIT_FAILURE); } while(0)
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void make_tree(void)
+{
+    char path[64];
+    if (mkdir("/lookup", 0755) < 0 && errno != EEXIST)
+        fail_perror("mkdir /lookup");
+    for (int d = 0; d < NDIRS; d++) {
+        snprintf(path, sizeof(path), "/lookup/dir%d", d);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST)
+            fail_perror("mkdir %s", path);
+        for (int f = 0; f < NFILES; f++) {
+            snprintf(path, sizeof(path), "/lookup/dir%d/module%d.py", d, f);
+            int fd = open(path, O_CREAT | O_WRONLY, 0644);
+            if (fd < 0)
+                fail_perror("open %s", path);
+            close(fd);
+        }
+    }
+}
+
+/* stat ITERATIONS paths, expecting them all to exist or all to be missing */
+static void bench(const char *name, const char *fmt, int exist)
+{
+    char path[64];
+    struct stat st;
+    unsigned long long start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        snprintf(path, sizeof(path), fmt, i % NDIRS, (i / NDIRS) % NFILES);
+        int rv = stat(path, &st);
+        if (exist ? rv < 0 : (rv == 0 || errno != ENOENT))
+            fail_perror("stat %s", path);
+    }
+    unsigned long long elapsed = now_ns() - start;
+    printf("%-12s %d lookups, %llu ns per lookup\n", name, ITERATIONS, elapsed / ITERATIONS);
+}
+
+static void print_stats(void)
+{
+    char buf[256];
+    int fd = open("/sys/kernel/fs/dcache/stats", O_RDONLY);
+    if (fd < 0)
+        return;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n > 0) {
+        buf[n] = '\0';
+        printf("%s", buf);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    make_tree();
+    bench("existing", "/lookup/dir%d/module%d.py", 1);
+    bench("missing", "/lookup/dir%d/module%d.so", 0);
+    bench("missing dir", "/lookup/dir%d/pkg%d/__init__.py", 0);
+    print_stats();
+    printf("lookup test passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+/* UDP packets-per-second benchmark: echoes datagrams back to their
+   senders, receiving with recvmmsg() and replying with sendmmsg() in
+   batches, and prints the rate each second. Drive it from the host
+   with any UDP load generator; a datagram starting with "terminate"
+   ends the run.
+
+   usage: udpbench [port] [batch] */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define DEFAULT_PORT    5309
+#define DEFAULT_BATCH   32
+#define MAX_BATCH       1024
+#define BUFLEN          1500
+
+#define fail_perror(msg, ...) do { printf(msg ": %s (%d)\n", ##__VA_ARGS__, strerror(errno), errno); \
+        exit(EXIT_FAILURE); } while(0)
+
+static char bufs[MAX_BATCH][BUFLEN];
+static struct iovec iovs[MAX_BATCH];
+static struct sockaddr_in addrs[MAX_BATCH];
+static struct mmsghdr msgs[MAX_BATCH];
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void reset_msgs(int batch)
+{
+    for (int i = 0; i < batch; i++) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = BUFLEN;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = 0;
+        msgs[i].msg_hdr.msg_controllen = 0;
+        msgs[i].msg_hdr.msg_flags = 0;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int port = argc > 1 ? atoi(argv[1]) : DEFAULT_PORT;
+    int batch = argc > 2 ? atoi(argv[2]) : DEFAULT_BATCH;
+    if (batch < 1 || batch > MAX_BATCH)
+        batch = DEFAULT_BATCH;
+    printf("udpbench: port %d, batch %d\n", port, batch);
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        fail_perror("socket");
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+        fail_perror("bind");
+
+    const char *tstr = "terminate";
+    unsigned long long rx = 0, tx = 0, calls = 0;
+    unsigned long long start = now_ns();
+    while (1) {
+        reset_msgs(batch);
+        int n = recvmmsg(fd, msgs, batch, MSG_WAITFORONE, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fail_perror("recvmmsg");
+        }
+        calls++;
+        rx += n;
+
+        int done = 0;
+        for (int i = 0; i < n; i++) {
+            iovs[i].iov_len = msgs[i].msg_len;
+            if (msgs[i].msg_len >= strlen(tstr) && strncmp(bufs[i], tstr, strlen(tstr)) == 0)
+                done = 1;
+        }
+        for (int sent = 0; sent < n; ) {
+            int rv = sendmmsg(fd, msgs + sent, n - sent, 0);
+            if (rv < 0) {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                fail_perror("sendmmsg");
+            }
+            sent += rv;
+            tx += rv;
+        }
+
+        unsigned long long elapsed = now_ns() - start;
+        if (elapsed >= 1000000000ull || done) {
+            printf("%llu pps received, %llu pps sent, %.1f datagrams per recvmmsg\n",
+                   rx * 1000000000ull / elapsed, tx * 1000000000ull / elapsed,
+                   calls ? (double)rx / calls : 0.0);
+            rx = tx = calls = 0;
+            start = now_ns();
+        }
+        if (done) {
+            printf("udpbench test passed\n");
+            close(fd);
+            return EXIT_SUCCESS;
+        }
+    }
+}
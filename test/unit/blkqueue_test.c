@@ -0,0 +1,278 @@
+#include <runtime.h>
+#include <drivers/blkqueue.h>
+#include <stdlib.h>
+#define EXIT_FAILURE 1
+#define EXIT_SUCCESS 0
+
+#define BLOCK_SIZE      512
+#define MAX_REQS        64
+
+/* A fake driver which records requests and completes them on demand. */
+typedef struct test_req {
+    boolean write;
+    range blocks;
+    int nsegs;
+    struct blkqueue_seg segs[16];
+    status_handler sh;
+} *test_req;
+
+static struct test_req reqs[MAX_REQS];
+static int nreqs;
+static int completed;
+
+closure_function(0, 5, void, test_sg_io,
+                 boolean, write, blkqueue_seg, segs, int, nsegs, range, blocks, status_handler, sh)
+{
+    assert(nreqs < MAX_REQS);
+    assert(nsegs <= 16);
+    test_req r = &reqs[nreqs++];
+    r->write = write;
+    r->blocks = blocks;
+    r->nsegs = nsegs;
+    runtime_memcpy(r->segs, segs, nsegs * sizeof(struct blkqueue_seg));
+    r->sh = sh;
+}
+
+closure_function(0, 1, void, test_done,
+                 status, s)
+{
+    assert(is_ok(s));
+    completed++;
+    closure_finish();
+}
+
+/* A fake driver which completes each request before returning. */
+closure_function(0, 5, void, test_sg_io_inline,
+                 boolean, write, blkqueue_seg, segs, int, nsegs, range, blocks, status_handler, sh)
+{
+    assert(nreqs < MAX_REQS);
+    test_req r = &reqs[nreqs++];
+    r->write = write;
+    r->blocks = blocks;
+    r->nsegs = nsegs;
+    r->sh = 0;
+    apply(sh, STATUS_OK);
+}
+
+/* queues another request from within a completion */
+closure_function(3, 1, void, test_done_resubmit,
+                 heap, h, block_io, r, void *, buf,
+                 status, s)
+{
+    assert(is_ok(s));
+    completed++;
+    apply(bound(r), bound(buf), irange(200, 201), closure(bound(h), test_done));
+    closure_finish();
+}
+
+static blkqueue test_blkqueue(heap h, u64 max_blocks, u64 max_seg_size, int max_segs, int max_inflight)
+{
+    struct blkqueue_limits l;
+    l.block_size = BLOCK_SIZE;
+    l.max_blocks = max_blocks;
+    l.max_seg_size = max_seg_size;
+    l.max_segs = max_segs;
+    l.max_inflight = max_inflight;
+    nreqs = completed = 0;
+    return allocate_blkqueue(h, closure(h, test_sg_io), &l);
+}
+
+/* segments must cover the request, in order, contiguous in the source */
+static boolean check_req(test_req r, void *base, u64 block_base)
+{
+    u64 len = 0;
+    for (int i = 0; i < r->nsegs; i++) {
+        if (r->segs[i].buf != base + (r->blocks.start - block_base) * BLOCK_SIZE + len) {
+            msg_err("req %R seg %d buf %p mismatch\n", r->blocks, i, r->segs[i].buf);
+            return false;
+        }
+        len += r->segs[i].length;
+    }
+    if (len != range_span(r->blocks) * BLOCK_SIZE) {
+        msg_err("req %R segs cover %ld bytes\n", r->blocks, len);
+        return false;
+    }
+    return true;
+}
+
+static boolean merge_test(heap h)
+{
+    u8 *buf = allocate(h, 64 * BLOCK_SIZE);
+    blkqueue bq = test_blkqueue(h, 0, 0, 8, 1);
+    block_io r = blkqueue_reader(bq);
+    block_io w = blkqueue_writer(bq);
+
+    /* first goes straight to the driver, the rest queue and merge */
+    apply(r, buf, irange(0, 4), closure(h, test_done));
+    apply(r, buf + 8 * BLOCK_SIZE, irange(8, 12), closure(h, test_done));
+    apply(r, buf + 12 * BLOCK_SIZE, irange(12, 16), closure(h, test_done));   /* back */
+    apply(r, buf + 4 * BLOCK_SIZE, irange(4, 8), closure(h, test_done));      /* front */
+    apply(w, buf + 16 * BLOCK_SIZE, irange(16, 20), closure(h, test_done));   /* other direction */
+    if (nreqs != 1) {
+        msg_err("%d requests issued at depth 1\n", nreqs);
+        return false;
+    }
+
+    apply(reqs[0].sh, STATUS_OK);
+    if (nreqs != 2 || reqs[1].write || reqs[1].nsegs != 3 ||
+        reqs[1].blocks.start != 4 || reqs[1].blocks.end != 16 || !check_req(&reqs[1], buf, 0)) {
+        msg_err("merged read wrong: %d requests, %R, %d segs\n", nreqs, reqs[1].blocks, reqs[1].nsegs);
+        return false;
+    }
+
+    apply(reqs[1].sh, STATUS_OK);
+    if (nreqs != 3 || !reqs[2].write || reqs[2].nsegs != 1) {
+        msg_err("write not issued after merged read\n");
+        return false;
+    }
+    apply(reqs[2].sh, STATUS_OK);
+    if (completed != 5) {
+        msg_err("%d of 5 completions\n", completed);
+        return false;
+    }
+    deallocate(h, buf, 64 * BLOCK_SIZE);
+    return true;
+}
+
+static boolean split_test(heap h)
+{
+    u8 *buf = allocate(h, 64 * BLOCK_SIZE);
+
+    /* 8 blocks per request, 1024 byte segments: 20 blocks go out as 8, 8, 4 */
+    blkqueue bq = test_blkqueue(h, 8, 2 * BLOCK_SIZE, 8, 16);
+    apply(blkqueue_reader(bq), buf, irange(100, 120), closure(h, test_done));
+    if (nreqs != 3) {
+        msg_err("split into %d requests\n", nreqs);
+        return false;
+    }
+    for (int i = 0; i < nreqs; i++) {
+        if (!check_req(&reqs[i], buf, 100))
+            return false;
+        if (reqs[i].nsegs != (range_span(reqs[i].blocks) + 1) / 2) {
+            msg_err("req %R has %d segs\n", reqs[i].blocks, reqs[i].nsegs);
+            return false;
+        }
+    }
+    apply(reqs[2].sh, STATUS_OK);
+    apply(reqs[0].sh, STATUS_OK);
+    if (completed != 0) {
+        msg_err("completed before all pieces\n");
+        return false;
+    }
+    apply(reqs[1].sh, STATUS_OK);
+    if (completed != 1) {
+        msg_err("split request not completed\n");
+        return false;
+    }
+
+    /* segment limit caps merging */
+    bq = test_blkqueue(h, 0, 0, 2, 1);
+    for (int i = 0; i < 4; i++)
+        apply(blkqueue_reader(bq), buf + i * BLOCK_SIZE, irange(i, i + 1), closure(h, test_done));
+    apply(reqs[0].sh, STATUS_OK);
+    if (nreqs != 2 || reqs[1].nsegs != 2) {
+        msg_err("segment limit not honored\n");
+        return false;
+    }
+    apply(reqs[1].sh, STATUS_OK);
+    if (nreqs != 3 || reqs[2].nsegs != 1)
+        return false;
+    apply(reqs[2].sh, STATUS_OK);
+    deallocate(h, buf, 64 * BLOCK_SIZE);
+    return completed == 4;
+}
+
+static boolean order_test(heap h)
+{
+    u8 *buf = allocate(h, 64 * BLOCK_SIZE);
+
+    /* a write must not merge ahead of a queued read of the same blocks */
+    blkqueue bq = test_blkqueue(h, 0, 0, 8, 1);
+    apply(blkqueue_writer(bq), buf, irange(100, 101), closure(h, test_done));
+    apply(blkqueue_writer(bq), buf, irange(0, 8), closure(h, test_done));
+    apply(blkqueue_reader(bq), buf + 8 * BLOCK_SIZE, irange(8, 16), closure(h, test_done));
+    apply(blkqueue_writer(bq), buf + 8 * BLOCK_SIZE, irange(8, 16), closure(h, test_done));
+    for (int i = 0; i < 4; i++) {
+        if (nreqs != i + 1) {
+            msg_err("%d requests issued, expected %d\n", nreqs, i + 1);
+            return false;
+        }
+        apply(reqs[i].sh, STATUS_OK);
+    }
+    if (reqs[1].blocks.end != 8 || reqs[2].write || !reqs[3].write || reqs[3].blocks.start != 8) {
+        msg_err("overlapping requests reordered: %R then %R\n", reqs[2].blocks, reqs[3].blocks);
+        return false;
+    }
+
+    /* overlapping writes are not at the driver together, others are */
+    bq = test_blkqueue(h, 0, 0, 8, 4);
+    apply(blkqueue_writer(bq), buf, irange(0, 8), closure(h, test_done));
+    apply(blkqueue_writer(bq), buf, irange(4, 12), closure(h, test_done));
+    apply(blkqueue_reader(bq), buf, irange(32, 40), closure(h, test_done));
+    if (nreqs != 1) {
+        msg_err("%d requests issued with an overlap outstanding\n", nreqs);
+        return false;
+    }
+    apply(reqs[0].sh, STATUS_OK);
+    if (nreqs != 3 || reqs[1].blocks.start != 4 || reqs[2].blocks.start != 32) {
+        msg_err("held requests not issued in order\n");
+        return false;
+    }
+    apply(reqs[1].sh, STATUS_OK);
+    apply(reqs[2].sh, STATUS_OK);
+    deallocate(h, buf, 64 * BLOCK_SIZE);
+    return completed == 3;
+}
+
+static boolean inline_test(heap h)
+{
+    u8 *buf = allocate(h, 64 * BLOCK_SIZE);
+    struct blkqueue_limits l;
+    l.block_size = BLOCK_SIZE;
+    l.max_blocks = 8;
+    l.max_seg_size = 2 * BLOCK_SIZE;
+    l.max_segs = 8;
+    l.max_inflight = 1;
+    nreqs = completed = 0;
+    blkqueue bq = allocate_blkqueue(h, closure(h, test_sg_io_inline), &l);
+    block_io r = blkqueue_reader(bq);
+
+    /* each request is done before the driver returns, split or not */
+    apply(r, buf, irange(0, 4), closure(h, test_done));
+    apply(r, buf, irange(0, 20), closure(h, test_done));
+    if (nreqs != 4 || completed != 2) {
+        msg_err("inline: %d requests, %d completions\n", nreqs, completed);
+        return false;
+    }
+
+    /* a request made from an inline completion goes out after it */
+    apply(blkqueue_writer(bq), buf, irange(100, 101),
+          closure(h, test_done_resubmit, h, r, buf));
+    if (nreqs != 6 || completed != 4 || !reqs[4].write || reqs[5].write ||
+        reqs[5].blocks.start != 200) {
+        msg_err("inline resubmit: %d requests, %d completions\n", nreqs, completed);
+        return false;
+    }
+    deallocate(h, buf, 64 * BLOCK_SIZE);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+
+    if (!merge_test(h))
+        exit(EXIT_FAILURE);
+
+    if (!split_test(h))
+        exit(EXIT_FAILURE);
+
+    if (!order_test(h))
+        exit(EXIT_FAILURE);
+
+    if (!inline_test(h))
+        exit(EXIT_FAILURE);
+
+    msg_debug("test passed\n");
+    exit(EXIT_SUCCESS);
+}
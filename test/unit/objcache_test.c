@@ -112,6 +112,84 @@ boolean objcache_test(heap meta, heap parent, int objsize)
     return true;
 }
 
+/* Allocator stress: a random mix of allocations and frees over a
+   range of size classes, holding a live set of STRESS_LIVE objects on
+   average. Reports throughput and fragmentation, the share of pages
+   taken from the parent heap that isn't occupied by live data. */
+#define STRESS_OPS      2000000
+#define STRESS_LIVE     50000
+#define STRESS_MIN_ORDER 4
+#define STRESS_MAX_ORDER 12
+
+boolean mcache_stress(heap meta, heap parent)
+{
+    heap h = allocate_mcache(meta, parent, 5, 16, TEST_PAGESIZE);
+    if (h == INVALID_ADDRESS) {
+	msg_err("failed to allocate mcache\n");
+	return false;
+    }
+    int slots = STRESS_LIVE * 2;
+    u64 *objs = allocate_zero(meta, slots * sizeof(u64));
+    u32 *sizes = allocate_zero(meta, slots * sizeof(u32));
+    u64 live_bytes = 0, peak_parent = 0, peak_live = 0;
+    u64 allocs = 0, frees = 0;
+
+    timestamp start = now(CLOCK_ID_MONOTONIC);
+    for (int op = 0; op < STRESS_OPS; op++) {
+	int i = random_u64() % slots;
+	if (objs[i]) {
+	    /* poison to catch overlapping objects */
+	    if (*(u8 *)pointer_from_u64(objs[i]) != (u8)i) {
+		msg_err("object %lx corrupted\n", objs[i]);
+		return false;
+	    }
+	    deallocate_u64(h, objs[i], sizes[i]);
+	    live_bytes -= sizes[i];
+	    objs[i] = 0;
+	    frees++;
+	} else {
+	    int order = STRESS_MIN_ORDER + random_u64() % (STRESS_MAX_ORDER - STRESS_MIN_ORDER + 1);
+	    u32 size = U64_FROM_BIT(order - 1) + random_u64() % U64_FROM_BIT(order - 1) + 1;
+	    u64 a = allocate_u64(h, size);
+	    if (a == INVALID_PHYSICAL) {
+		msg_err("failed to allocate %d bytes\n", size);
+		return false;
+	    }
+	    *(u8 *)pointer_from_u64(a) = (u8)i;
+	    objs[i] = a;
+	    sizes[i] = size;
+	    live_bytes += size;
+	    allocs++;
+	}
+	if (parent->allocated > peak_parent) {
+	    peak_parent = parent->allocated;
+	    peak_live = live_bytes;
+	}
+    }
+    timestamp elapsed = now(CLOCK_ID_MONOTONIC) - start;
+
+    u64 usec = MAX(usec_from_timestamp(elapsed), 1);
+    rprintf("mcache stress: %ld allocs, %ld frees in %ldus (%ld ops/sec)\n",
+	    allocs, frees, usec, (allocs + frees) * MILLION / usec);
+    rprintf("   live %ld bytes in %ld bytes of pages (%ld percent fragmentation), "
+	    "peak %ld live in %ld\n", live_bytes, parent->allocated,
+	    parent->allocated ? 100 - live_bytes * 100 / parent->allocated : 0,
+	    peak_live, peak_parent);
+
+    for (int i = 0; i < slots; i++) {
+	if (objs[i])
+	    deallocate_u64(h, objs[i], sizes[i]);
+    }
+    if (h->allocated > 0) {
+	msg_err("allocated (%d) should be 0; fail\n", h->allocated);
+	return false;
+    }
+    deallocate(meta, objs, slots * sizeof(u64));
+    deallocate(meta, sizes, slots * sizeof(u32));
+    h->destroy(h);
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     heap h = init_process_runtime();
@@ -125,6 +203,11 @@ int main(int argc, char **argv)
     if (!objcache_test(h, pageheap, 32))
 	exit(EXIT_FAILURE);
 
+    heap stressheap = create_id_heap_backed(h, allocate_mmapheap(h, TEST_PAGESIZE * 64),
+					    TEST_PAGESIZE);
+    if (!mcache_stress(h, stressheap))
+	exit(EXIT_FAILURE);
+
     msg_debug("test passed\n");
     
     exit(EXIT_SUCCESS);
@@ -54,6 +54,11 @@ static test_node allocate_test_node(heap h, range r, int val)
 
 /* XXX do node free */
 
+static inline boolean rmnode_is_red_test(rmnode n)
+{
+    return n && n->red;
+}
+
 boolean basic_test(heap h)
 {
     char * msg = "";
@@ -209,6 +214,211 @@ boolean basic_test(heap h)
     return false;
 }
 
+/* check ordering, overlap and red-black properties; return black height */
+static int validate_subtree(rmnode n, rmnode parent, u64 *lastend, int *count)
+{
+    if (!n)
+        return 1;
+    if (n->parent != parent) {
+        msg_err("node %R: parent mismatch\n", n->r);
+        return -1;
+    }
+    if (n->red && (rmnode_is_red_test(n->left) || rmnode_is_red_test(n->right))) {
+        msg_err("node %R: red node with red child\n", n->r);
+        return -1;
+    }
+    int lh = validate_subtree(n->left, n, lastend, count);
+    if (lh < 0)
+        return -1;
+    if (n->r.start < *lastend) {
+        msg_err("node %R: out of order or overlapping (last end %ld)\n", n->r, *lastend);
+        return -1;
+    }
+    *lastend = n->r.end;
+    (*count)++;
+    int rh = validate_subtree(n->right, n, lastend, count);
+    if (rh < 0)
+        return -1;
+    if (lh != rh) {
+        msg_err("node %R: black height mismatch (%d, %d)\n", n->r, lh, rh);
+        return -1;
+    }
+    return lh + (n->red ? 0 : 1);
+}
+
+static boolean validate_rangemap(rangemap rm, int expected)
+{
+    u64 lastend = 0;
+    int count = 0;
+    if (rmnode_is_red_test(rm->root)) {
+        msg_err("red root\n");
+        return false;
+    }
+    if (validate_subtree(rm->root, 0, &lastend, &count) < 0)
+        return false;
+    if (count != expected) {
+        msg_err("node count %d, expected %d\n", count, expected);
+        return false;
+    }
+    return true;
+}
+
+static void shuffle(u64 *a, int n)
+{
+    for (int i = n - 1; i > 0; i--) {
+        int j = random_u64() % (i + 1);
+        u64 t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+    }
+}
+
+#define RANDOM_TEST_STRIDE  16
+#define RANDOM_TEST_SPAN    10
+
+/* nodes of RANDOM_TEST_SPAN at every RANDOM_TEST_STRIDE, inserted and
+   removed in random order */
+static boolean random_test(heap h, int n)
+{
+    rangemap rm = allocate_rangemap(h);
+    test_node *nodes = allocate(h, n * sizeof(test_node));
+    u64 *order = allocate(h, n * sizeof(u64));
+    for (int i = 0; i < n; i++) {
+        nodes[i] = allocate_test_node(h, irange(i * RANDOM_TEST_STRIDE,
+                                                i * RANDOM_TEST_STRIDE + RANDOM_TEST_SPAN), i);
+        order[i] = i;
+    }
+    shuffle(order, n);
+    for (int i = 0; i < n; i++) {
+        if (!rangemap_insert(rm, &nodes[order[i]]->node)) {
+            msg_err("insert %ld failed\n", order[i]);
+            return false;
+        }
+    }
+    if (!validate_rangemap(rm, n))
+        return false;
+
+    for (int i = 0; i < n; i++) {
+        u64 base = i * RANDOM_TEST_STRIDE;
+        if (rangemap_lookup(rm, base + RANDOM_TEST_SPAN - 1) != &nodes[i]->node ||
+            rangemap_lookup(rm, base + RANDOM_TEST_SPAN) != INVALID_ADDRESS) {
+            msg_err("lookup %d failed\n", i);
+            return false;
+        }
+        rmnode next = rangemap_lookup_at_or_next(rm, base + RANDOM_TEST_SPAN);
+        if (next != (i + 1 < n ? &nodes[i + 1]->node : INVALID_ADDRESS)) {
+            msg_err("lookup_at_or_next %d failed\n", i);
+            return false;
+        }
+        if (rangemap_next_node(rm, &nodes[i]->node) != next ||
+            rangemap_prev_node(rm, &nodes[i]->node) != (i > 0 ? &nodes[i - 1]->node : INVALID_ADDRESS)) {
+            msg_err("next/prev %d failed\n", i);
+            return false;
+        }
+    }
+
+    /* remove every other node in random order */
+    int remain = n;
+    for (int i = 0; i < n; i++) {
+        if (order[i] & 1) {
+            rangemap_remove_node(rm, &nodes[order[i]]->node);
+            remain--;
+        }
+    }
+    if (!validate_rangemap(rm, remain))
+        return false;
+    if (rangemap_lookup(rm, RANDOM_TEST_STRIDE) != INVALID_ADDRESS) {
+        msg_err("lookup of removed node succeeded\n");
+        return false;
+    }
+
+    /* remaining nodes lie wholly within the range and are removed */
+    if (!rangemap_remove_range(rm, irange(0, n * RANDOM_TEST_STRIDE)))
+        return false;
+    if (!validate_rangemap(rm, 0))
+        return false;
+
+    deallocate(h, order, n * sizeof(u64));
+    for (int i = 0; i < n; i++)
+        deallocate(h, nodes[i], sizeof(struct test_node));
+    deallocate(h, nodes, n * sizeof(test_node));
+    deallocate_rangemap(rm);
+    return true;
+}
+
+closure_function(1, 1, void, bench_count_node,
+                 u64 *, count,
+                 rmnode, node)
+{
+    (*bound(count))++;
+}
+
+static u64 bench_nsec_per_op(timestamp start, u64 ops)
+{
+    return nsec_from_timestamp(now(CLOCK_ID_MONOTONIC) - start) / ops;
+}
+
+static boolean range_benchmark(heap h, int n)
+{
+    rangemap rm = allocate_rangemap(h);
+    test_node *nodes = allocate(h, n * sizeof(test_node));
+    u64 *order = allocate(h, n * sizeof(u64));
+    for (int i = 0; i < n; i++) {
+        nodes[i] = allocate_test_node(h, irange(i * RANDOM_TEST_STRIDE,
+                                                i * RANDOM_TEST_STRIDE + RANDOM_TEST_SPAN), i);
+        order[i] = i;
+    }
+    shuffle(order, n);
+
+    timestamp t = now(CLOCK_ID_MONOTONIC);
+    for (int i = 0; i < n; i++)
+        rangemap_insert(rm, &nodes[order[i]]->node);
+    u64 insert_ns = bench_nsec_per_op(t, n);
+
+    t = now(CLOCK_ID_MONOTONIC);
+    for (int i = 0; i < n; i++) {
+        if (rangemap_lookup(rm, order[i] * RANDOM_TEST_STRIDE + 1) == INVALID_ADDRESS) {
+            msg_err("lookup failed\n");
+            return false;
+        }
+    }
+    u64 lookup_ns = bench_nsec_per_op(t, n);
+
+    t = now(CLOCK_ID_MONOTONIC);
+    for (int i = 0; i < n; i++)
+        rangemap_lookup_at_or_next(rm, order[i] * RANDOM_TEST_STRIDE + RANDOM_TEST_SPAN);
+    u64 next_ns = bench_nsec_per_op(t, n);
+
+    u64 count = 0;
+    t = now(CLOCK_ID_MONOTONIC);
+    rangemap_range_lookup(rm, irange(0, infinity), stack_closure(bench_count_node, &count));
+    u64 iterate_ns = bench_nsec_per_op(t, n);
+    if (count != n) {
+        msg_err("range lookup visited %ld nodes, expected %d\n", count, n);
+        return false;
+    }
+
+    t = now(CLOCK_ID_MONOTONIC);
+    for (int i = 0; i < n; i++)
+        rangemap_remove_node(rm, &nodes[order[i]]->node);
+    u64 remove_ns = bench_nsec_per_op(t, n);
+    if (rm->root) {
+        msg_err("rangemap not empty after removal\n");
+        return false;
+    }
+
+    rprintf("rangemap benchmark, %d nodes (ns/op): insert %ld, lookup %ld, "
+            "lookup_at_or_next %ld, iterate %ld, remove %ld\n",
+            n, insert_ns, lookup_ns, next_ns, iterate_ns, remove_ns);
+
+    deallocate(h, order, n * sizeof(u64));
+    for (int i = 0; i < n; i++)
+        deallocate(h, nodes[i], sizeof(struct test_node));
+    deallocate(h, nodes, n * sizeof(test_node));
+    deallocate_rangemap(rm);
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     heap h = init_process_runtime();
@@ -216,10 +426,11 @@ int main(int argc, char **argv)
     if (!basic_test(h))
         goto fail;
 
-    /*
-      if (!random_test(h, 100, 1000))
-      goto fail;
-    */
+    if (!random_test(h, 1000))
+        goto fail;
+
+    if (!range_benchmark(h, 100000))
+        goto fail;
 
     msg_debug("range test passed\n");
     exit(EXIT_SUCCESS);
@@ -0,0 +1,238 @@
+#include <runtime.h>
+#include <stdlib.h>
+#define EXIT_FAILURE 1
+#define EXIT_SUCCESS 0
+
+#define TEST_TIMERS     4096
+#define BENCH_TIMERS    100000
+#define BENCH_ROUNDS    10
+
+/* Timers are driven from a simulated clock, starting well away from
+   zero so that wheel positions aren't aligned with the origin. */
+static timestamp base = (1000000ull << 32) + 12345;
+static timestamp here;
+static timestamp last_here;
+
+typedef struct test_timer {
+    timer t;
+    timestamp expiry;
+    timestamp interval;
+    u64 fired;
+    boolean cancelled;
+    boolean failed;
+} *test_timer;
+
+closure_function(1, 1, void, test_timer_expire,
+                 test_timer, tt,
+                 u64, overruns)
+{
+    test_timer tt = bound(tt);
+    tt->fired += overruns;
+
+    /* must fire at the first check at or after expiry */
+    if (tt->expiry > here || tt->expiry <= last_here) {
+        msg_err("timer expiry %T fired at %T, previous check %T\n", tt->expiry, here, last_here);
+        tt->failed = true;
+    }
+    if (tt->interval)
+        tt->expiry += tt->interval * overruns;
+}
+
+static timestamp random_delay(void)
+{
+    /* exercise every level of the wheel as well as the far heap */
+    switch (random_u64() & 3) {
+    case 0:
+        return random_u64() % milliseconds(100);
+    case 1:
+        return random_u64() % seconds(10);
+    case 2:
+        return random_u64() % seconds(600);
+    default:
+        return random_u64() % seconds(12 * 60 * 60);
+    }
+}
+
+static boolean check_step(timerqueue tq, struct test_timer *tts, int n, timestamp step)
+{
+    last_here = here;
+    here += step;
+    timestamp dt = timerqueue_check(tq, here);
+
+    /* the returned delay must not overshoot the earliest expiry */
+    timestamp next = infinity;
+    for (int i = 0; i < n; i++) {
+        if (tts[i].failed)
+            return false;
+        if (!tts[i].cancelled && (tts[i].interval || !tts[i].fired))
+            next = MIN(next, tts[i].expiry);
+    }
+    if (next != infinity && (next <= here || dt > next - here)) {
+        msg_err("check at %T returned %T, next expiry %T\n", here, dt, next);
+        return false;
+    }
+    if (next == infinity && dt != infinity) {
+        /* early wakeups are allowed, if only for disabled far timers */
+        if (dt == 0) {
+            msg_err("spurious zero delay with no timers pending\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+static boolean wheel_test(heap h)
+{
+    timerqueue tq = allocate_timerqueue(h);
+    struct test_timer *tts = allocate(h, sizeof(struct test_timer) * TEST_TIMERS);
+    here = last_here = base;
+    timerqueue_check(tq, here);
+
+    for (int i = 0; i < TEST_TIMERS; i++) {
+        test_timer tt = &tts[i];
+        tt->expiry = here + random_delay() + 1;
+        tt->interval = (i % 64) == 0 ? milliseconds(1 + random_u64() % 5000) : 0;
+        tt->fired = 0;
+        tt->cancelled = false;
+        tt->failed = false;
+        tt->t = timerqueue_register(tq, CLOCK_ID_MONOTONIC, tt->expiry, tt->interval,
+                                    closure(h, test_timer_expire, tt));
+        if (tt->t == INVALID_ADDRESS) {
+            msg_err("failed to register timer\n");
+            return false;
+        }
+    }
+
+    /* cancel some before they fire */
+    for (int i = 0; i < TEST_TIMERS; i += 3) {
+        remove_timer(tts[i].t, 0);
+        tts[i].cancelled = true;
+    }
+
+    /* advance in steps of varying size, including some long gaps */
+    timestamp end = base + seconds(13 * 60 * 60);
+    while (here < end) {
+        timestamp step;
+        switch (random_u64() & 7) {
+        case 0:
+            step = random_u64() % seconds(3600);
+            break;
+        case 1:
+        case 2:
+            step = random_u64() % seconds(10);
+            break;
+        default:
+            step = random_u64() % milliseconds(50);
+            break;
+        }
+        if (!check_step(tq, tts, TEST_TIMERS, step))
+            return false;
+    }
+
+    for (int i = 0; i < TEST_TIMERS; i++) {
+        test_timer tt = &tts[i];
+        if (tt->cancelled ? tt->fired != 0 : tt->fired == 0) {
+            msg_err("timer %d, cancelled %d, fired %ld\n", i, tt->cancelled, tt->fired);
+            return false;
+        }
+        if (tt->interval && !tt->cancelled)
+            remove_timer(tt->t, 0);
+    }
+    return true;
+}
+
+/* Benchmark: the idle timeout pattern of a busy server, where each of
+   many connections repeatedly cancels and rearms its timeout, against
+   a plain pqueue which, like the old timer heap, can only mark
+   cancelled timers and pop them as they come due. */
+
+typedef struct bench_timer {
+    timestamp expiry;
+    boolean disabled;
+} *bench_timer;
+
+static boolean bench_compare(void *a, void *b)
+{
+    return ((bench_timer)a)->expiry > ((bench_timer)b)->expiry;
+}
+
+closure_function(0, 1, void, bench_expire,
+                 u64, overruns)
+{
+}
+
+static void bench_pqueue(heap h)
+{
+    pqueue q = allocate_pqueue(h, bench_compare);
+    bench_timer *conns = allocate(h, sizeof(bench_timer) * BENCH_TIMERS);
+    timestamp start = now(CLOCK_ID_MONOTONIC);
+    here = base;
+    u64 entries = 0;
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (int i = 0; i < BENCH_TIMERS; i++) {
+            if (r > 0)
+                conns[i]->disabled = true;
+            bench_timer bt = allocate(h, sizeof(struct bench_timer));
+            bt->expiry = here + seconds(60) + (random_u64() & MASK(32));
+            bt->disabled = false;
+            pqueue_insert(q, bt);
+            conns[i] = bt;
+            entries++;
+        }
+        here += milliseconds(10);
+    }
+    timestamp armed = now(CLOCK_ID_MONOTONIC);
+    bench_timer bt;
+    while ((bt = pqueue_pop(q)))
+        deallocate(h, bt, sizeof(struct bench_timer));
+    timestamp end = now(CLOCK_ID_MONOTONIC);
+    rprintf("pqueue: %ld rearms in %ldus (%ld entries held), drain in %ldus\n",
+            (u64)BENCH_TIMERS * BENCH_ROUNDS, usec_from_timestamp(armed - start), entries,
+            usec_from_timestamp(end - armed));
+    deallocate(h, conns, sizeof(bench_timer) * BENCH_TIMERS);
+    deallocate_pqueue(q);
+}
+
+static void bench_wheel(heap h)
+{
+    timerqueue tq = allocate_timerqueue(h);
+    timer *conns = allocate(h, sizeof(timer) * BENCH_TIMERS);
+    timer_handler th = closure(h, bench_expire);
+    timestamp start = now(CLOCK_ID_MONOTONIC);
+    here = base;
+    timerqueue_check(tq, here);
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (int i = 0; i < BENCH_TIMERS; i++) {
+            if (r > 0)
+                remove_timer(conns[i], 0);
+            conns[i] = timerqueue_register(tq, CLOCK_ID_MONOTONIC,
+                                           here + seconds(60) + (random_u64() & MASK(32)),
+                                           0, th);
+        }
+        here += milliseconds(10);
+    }
+    timestamp armed = now(CLOCK_ID_MONOTONIC);
+    while (timerqueue_check(tq, here) != infinity)
+        here += seconds(1);
+    timestamp end = now(CLOCK_ID_MONOTONIC);
+    rprintf("wheel:  %ld rearms in %ldus (%ld entries held), drain in %ldus\n",
+            (u64)BENCH_TIMERS * BENCH_ROUNDS, usec_from_timestamp(armed - start),
+            (u64)BENCH_TIMERS, usec_from_timestamp(end - armed));
+    deallocate(h, conns, sizeof(timer) * BENCH_TIMERS);
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+
+    if (!wheel_test(h))
+        exit(EXIT_FAILURE);
+
+    if (argc > 1 && runtime_strcmp(argv[1], "-b") == 0) {
+        bench_pqueue(h);
+        bench_wheel(h);
+    }
+
+    msg_debug("test passed\n");
+    exit(EXIT_SUCCESS);
+}
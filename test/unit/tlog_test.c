@@ -0,0 +1,173 @@
+#include <runtime.h>
+#include <tfs_internal.h>
+#include <stdlib.h>
+#define EXIT_FAILURE 1
+#define EXIT_SUCCESS 0
+
+#define DISK_SIZE       (8 * MB)
+#define VALUE_SIZE      1000
+#define FLUSH_INTERVAL  100
+
+/* Enough entries to need the head segment and two extensions, and the
+   same again once the log has been reopened. */
+#define NENTRIES        1200
+
+/* A disk in memory whose requests complete inline. Reads fail until
+   it is first written, as mkfs has it for a new image. */
+static u8 *disk;
+static boolean blank;
+
+closure_function(0, 3, void, disk_read,
+                 void *, dest, range, blocks, status_handler, sh)
+{
+    assert(blocks.end <= DISK_SIZE >> SECTOR_OFFSET);
+    if (blank) {
+        apply(sh, timm("result", "blank disk"));
+        return;
+    }
+    runtime_memcpy(dest, disk + (blocks.start << SECTOR_OFFSET), range_span(blocks) << SECTOR_OFFSET);
+    apply(sh, STATUS_OK);
+}
+
+closure_function(0, 3, void, disk_write,
+                 void *, src, range, blocks, status_handler, sh)
+{
+    assert(blocks.end <= DISK_SIZE >> SECTOR_OFFSET);
+    runtime_memcpy(disk + (blocks.start << SECTOR_OFFSET), src, range_span(blocks) << SECTOR_OFFSET);
+    blank = false;
+    apply(sh, STATUS_OK);
+}
+
+static int flushes;
+
+closure_function(0, 1, void, test_flushed,
+                 status, s)
+{
+    assert(is_ok(s));
+    flushes++;
+}
+
+static buffer entry_value(heap h, int i)
+{
+    buffer b = allocate_buffer(h, VALUE_SIZE);
+    for (int j = 0; j < VALUE_SIZE; j++)
+        push_u8(b, (u8)(i + j));
+    return b;
+}
+
+/* Log entries [start, end) as attributes of t, flushing every so
+   often so that appends follow a rewritten END_OF_LOG. */
+static boolean write_entries(heap h, filesystem fs, tuple t, int start, int end)
+{
+    status_handler sh = closure(h, test_flushed);
+    int expected = flushes;
+    for (int i = start; i < end; i++) {
+        buffer v = entry_value(h, i);
+        table_set(t, intern_u64(i), v);
+        filesystem_write_eav(fs, t, intern_u64(i), v, ignore_status);
+        if ((i + 1) % FLUSH_INTERVAL == 0 || i + 1 == end) {
+            if (filesystem_flush(fs, 0, sh))
+                flushes++;
+            expected++;
+        }
+    }
+    if (flushes != expected) {
+        msg_err("%d flushes completed, expected %d\n", flushes, expected);
+        return false;
+    }
+    return true;
+}
+
+static boolean check_entries(heap h, tuple t, int end)
+{
+    if (!t) {
+        msg_err("entries not found\n");
+        return false;
+    }
+    for (int i = 0; i < end; i++) {
+        buffer v = table_find(t, intern_u64(i));
+        if (!v) {
+            msg_err("entry %d missing\n", i);
+            return false;
+        }
+        buffer e = entry_value(h, i);
+        boolean match = buffer_compare(v, e);
+        deallocate_buffer(e);
+        if (!match) {
+            msg_err("entry %d mismatch\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+static int opened;
+
+closure_function(2, 2, void, test_opened,
+                 heap, h, boolean *, result,
+                 filesystem, fs, status, s)
+{
+    heap h = bound(h);
+    boolean *result = bound(result);
+    tuple root = filesystem_getroot(fs);
+    tuple t = table_find(root, sym(entries));
+    u64 offset;
+    *result = false;
+    if (!is_ok(s) && opened > 0) {
+        msg_err("open %d failed: %v\n", opened, s);
+        return;
+    }
+
+    switch (opened++) {
+    case 0:
+        /* new log; its root is the first tuple written */
+        t = allocate_tuple();
+        table_set(root, sym(entries), t);
+        filesystem_write_tuple(fs, root, ignore_status);
+        *result = write_entries(h, fs, t, 0, NENTRIES);
+        break;
+    case 1:
+        /* the chain is read back, claiming the storage of each segment
+           it links to, and appended to at its tail */
+        offset = allocate_u64(fs->storage, INITIAL_LOG_SIZE);
+        if (offset < 3 * INITIAL_LOG_SIZE) {
+            msg_err("log not extended: free storage at 0x%lx\n", offset);
+            return;
+        }
+        deallocate_u64(fs->storage, offset, INITIAL_LOG_SIZE);
+        *result = check_entries(h, t, NENTRIES) &&
+            write_entries(h, fs, t, NENTRIES, 2 * NENTRIES);
+        break;
+    default:
+        *result = check_entries(h, t, 2 * NENTRIES);
+        break;
+    }
+}
+
+boolean chain_test(heap h)
+{
+    disk = allocate_zero(h, DISK_SIZE);
+    assert(disk != INVALID_ADDRESS);
+    blank = true;
+    block_io r = closure(h, disk_read);
+    block_io w = closure(h, disk_write);
+    for (int i = 0; i < 3; i++) {
+        boolean result = false;
+        create_filesystem(h, SECTOR_SIZE, DISK_SIZE, h, r, w, allocate_tuple(),
+                          closure(h, test_opened, h, &result));
+        if (!result)
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+
+    if (!chain_test(h))
+        exit(EXIT_FAILURE);
+
+    msg_debug("test passed\n");
+    exit(EXIT_SUCCESS);
+}
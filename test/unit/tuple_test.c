@@ -152,6 +152,48 @@ fail:
     return failure;
 }
 
+closure_function(1, 2, boolean, skip_symbol,
+                 symbol, skip,
+                 symbol, a, value, v)
+{
+    return a != bound(skip);
+}
+
+boolean encode_decode_filtered_test(heap h)
+{
+    boolean failure = true;
+
+    // encode
+    buffer b3 = allocate_buffer(h, 128);
+    tuple t3 = allocate_tuple();
+    tuple t33 = allocate_tuple();
+    table_set(t33, intern_u64(1), wrap_buffer_cstring(h, "200"));
+    table_set(t3, intern_u64(1), t33);
+    table_set(t3, intern_u64(2), t33);
+    table_set(t3, intern_u64(3), allocate_tuple());
+    table_set(t3, intern_u64(4), wrap_buffer_cstring(h, "400"));
+
+    table tdict1 = allocate_table(h, identity_key, pointer_equal);
+
+    encode_tuple_filtered(b3, tdict1, t3, closure(h, skip_symbol, intern_u64(3)));
+
+    test_assert(buffer_length(b3) > 0);
+
+    // decode
+    table tdict2 = allocate_table(h, identity_key, pointer_equal);
+    tuple t4 = decode_value(h, tdict2, b3);
+
+    test_assert(t4->count == 3);
+    test_assert(table_find(t4, intern_u64(3)) == 0);
+    test_assert(table_find(t4, intern_u64(1)) == table_find(t4, intern_u64(2)));
+    buffer buf = allocate_buffer(h, 128);
+    bprintf(buf, "%t", table_find(t4, intern_u64(1)));
+    test_assert(strncmp(buf->contents, "(1:200)", buf->length) == 0);
+    failure = false;
+fail:
+    return failure;
+}
+
 int main(int argc, char **argv)
 {
     heap h = init_process_runtime();
@@ -162,6 +204,7 @@ int main(int argc, char **argv)
     failure |= encode_decode_test(h);
     failure |= encode_decode_reference_test(h);
     failure |= encode_decode_lengthy_test(h);
+    failure |= encode_decode_filtered_test(h);
 
     if (failure) {
         msg_err("Test failed\n");